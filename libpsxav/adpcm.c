@@ -197,6 +197,11 @@ static void encode_block_xa(
 	psx_audio_xa_settings_t settings,
 	psx_audio_encoder_state_t *state
 ) {
+	// The limit is passed as a number of samples, however each channel of a
+	// stereo sound group only spans half as many sample pairs.
+	if (settings.stereo)
+		audio_samples_limit /= 2;
+
 	if (settings.bits_per_sample == 4) {
 		if (settings.stereo) {
 			data[0]  = encode(&(state->left),  audio_samples,            audio_samples_limit,        2, data + 0x10, 0, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_4BPS);
@@ -267,6 +272,10 @@ static void psx_audio_xa_encode_init_sector(psx_cdrom_sector_mode2_t *buffer, in
 	if (settings.format == PSX_AUDIO_XA_FORMAT_XACD)
 		psx_cdrom_init_sector((psx_cdrom_sector_t *)buffer, lba, PSX_CDROM_SECTOR_TYPE_MODE2_FORM2);
 
+	// Clear any padding left after the last sound group, as well as the coding
+	// field that is filled in below.
+	memset(buffer->subheader, 0, sizeof(buffer->subheader) + sizeof(buffer->data));
+
 	buffer->subheader[0].file = settings.file_number;
 	buffer->subheader[0].channel = settings.channel_number & PSX_CDROM_SECTOR_XA_CHANNEL_MASK;
 	buffer->subheader[0].submode =
@@ -336,6 +345,8 @@ void psx_audio_xa_encode_finalize(psx_audio_xa_settings_t settings, uint8_t *out
 		psx_cdrom_sector_mode2_t *sector = (psx_cdrom_sector_mode2_t*) &output[output_length - PSX_CDROM_SECTOR_SIZE];
 		sector->subheader[0].submode |= PSX_CDROM_SECTOR_XA_SUBMODE_EOF;
 		psx_audio_xa_sync_subheader_copy(sector);
+		// The EDC covers the subheader and must thus be updated.
+		psx_cdrom_calculate_checksums((psx_cdrom_sector_t *)sector, PSX_CDROM_SECTOR_TYPE_MODE2_FORM2);
 	}
 }
 
@@ -399,3 +410,114 @@ int psx_audio_spu_encode_simple(const int16_t *samples, int sample_count, uint8_
 
 	return length;
 }
+
+static void decode(
+	psx_audio_decoder_channel_state_t *state,
+	uint8_t header,
+	const uint8_t *data,
+	int data_shift,
+	int data_pitch,
+	int16_t *samples,
+	int pitch,
+	int filter_count,
+	int shift_range
+) {
+	uint8_t sample_mask = 0xFFFF >> shift_range;
+
+	int shift = header & 0x0F;
+	int filter = header >> 4;
+
+	// Invalid shift and filter values are never generated by the encoder; the
+	// hardware's behavior in such cases is not emulated.
+	if (shift > shift_range) { shift = shift_range; }
+	if (filter >= filter_count) { filter = 0; }
+
+	int k1 = filter_k1[filter];
+	int k2 = filter_k2[filter];
+
+	for (int i = 0; i < PSX_AUDIO_SPU_SAMPLES_PER_BLOCK; i++) {
+		int32_t sample_enc = (data[i * data_pitch] >> data_shift) & sample_mask;
+		int32_t previous_values = (k1*state->prev1 + k2*state->prev2 + (1<<5))>>6;
+
+		int32_t sample_dec = (int16_t) (sample_enc << shift_range);
+		sample_dec >>= shift;
+		sample_dec += previous_values;
+		if (sample_dec > +0x7FFF) { sample_dec = +0x7FFF; }
+		if (sample_dec < -0x8000) { sample_dec = -0x8000; }
+
+		samples[i * pitch] = (int16_t)sample_dec;
+
+		state->prev2 = state->prev1;
+		state->prev1 = sample_dec;
+	}
+}
+
+int psx_audio_xa_decode(
+	psx_audio_xa_settings_t settings,
+	psx_audio_decoder_state_t *state,
+	const uint8_t *data,
+	int16_t *samples
+) {
+	int unit_count = (settings.bits_per_sample == 8) ? 4 : 8;
+	int shift_range = (settings.bits_per_sample == 8) ? SHIFT_RANGE_8BPS : SHIFT_RANGE_4BPS;
+	int sample_count = 0;
+
+	for (int i = 0; i < 18; i++) {
+		const uint8_t *block_data = data + i * 0x80;
+
+		for (int j = 0; j < unit_count; j++) {
+			// Each unit's header is stored twice; the copies at offsets 4-11
+			// cover all units in both 4-bit and 8-bit sound groups.
+			uint8_t header = block_data[4 + j];
+			const uint8_t *unit_data;
+			int data_shift;
+
+			if (settings.bits_per_sample == 8) {
+				unit_data = block_data + 0x10 + j;
+				data_shift = 0;
+			} else {
+				unit_data = block_data + 0x10 + (j >> 1);
+				data_shift = (j & 1) * 4;
+			}
+
+			if (settings.stereo) {
+				int16_t *output = samples + (sample_count + (j >> 1) * PSX_AUDIO_SPU_SAMPLES_PER_BLOCK) * 2 + (j & 1);
+
+				decode((j & 1) ? &(state->right) : &(state->left), header, unit_data, data_shift, 4, output, 2, XA_ADPCM_FILTER_COUNT, shift_range);
+			} else {
+				int16_t *output = samples + sample_count + j * PSX_AUDIO_SPU_SAMPLES_PER_BLOCK;
+
+				decode(&(state->left), header, unit_data, data_shift, 4, output, 1, XA_ADPCM_FILTER_COUNT, shift_range);
+			}
+		}
+
+		sample_count += (settings.stereo ? (unit_count / 2) : unit_count) * PSX_AUDIO_SPU_SAMPLES_PER_BLOCK;
+	}
+
+	return sample_count;
+}
+
+int psx_audio_spu_decode(
+	psx_audio_decoder_channel_state_t *state,
+	const uint8_t *data,
+	int length,
+	int16_t *samples,
+	int pitch
+) {
+	uint8_t prebuf[PSX_AUDIO_SPU_SAMPLES_PER_BLOCK];
+	int sample_count = 0;
+
+	for (int i = 0; (i + PSX_AUDIO_SPU_BLOCK_SIZE) <= length; i += PSX_AUDIO_SPU_BLOCK_SIZE) {
+		const uint8_t *buffer = data + i;
+
+		for (int j = 0; j < PSX_AUDIO_SPU_SAMPLES_PER_BLOCK; j += 2) {
+			prebuf[j] = buffer[2 + (j>>1)] & 0x0F;
+			prebuf[j + 1] = buffer[2 + (j>>1)] >> 4;
+		}
+
+		decode(state, buffer[0], prebuf, 0, 1, samples + sample_count * pitch, pitch, SPU_ADPCM_FILTER_COUNT, SHIFT_RANGE_4BPS);
+		sample_count += PSX_AUDIO_SPU_SAMPLES_PER_BLOCK;
+	}
+
+	return sample_count;
+}
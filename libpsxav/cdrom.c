@@ -85,7 +85,7 @@ void psx_cdrom_calculate_checksums(psx_cdrom_sector_t *sector, psx_cdrom_sector_
 			data[0x811] = (uint8_t)(edc >> 8);
 			data[0x812] = (uint8_t)(edc >> 16);
 			data[0x813] = (uint8_t)(edc >> 24);
-			memset(sector + 0x814, 0, 8);
+			memset(data + 0x814, 0, 8);
 			// TODO: ECC
 			break;
 
@@ -96,6 +96,7 @@ void psx_cdrom_calculate_checksums(psx_cdrom_sector_t *sector, psx_cdrom_sector_
 			data[0x819] = (uint8_t)(edc >> 8);
 			data[0x81A] = (uint8_t)(edc >> 16);
 			data[0x81B] = (uint8_t)(edc >> 24);
+			memset(data + 0x81C, 0, PSX_CDROM_SECTOR_SIZE - 0x81C);
 			// TODO: ECC
 			break;
 
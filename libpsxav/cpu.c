@@ -0,0 +1,97 @@
+/*
+libpsxav: MDEC video + SPU/XA-ADPCM audio library
+
+Copyright (c) 2019, 2020 Adrian "asie" Siekierka
+Copyright (c) 2019 Ben "GreaseMonkey" Russell
+Copyright (c) 2023 spicyjpeg
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libpsxav.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HAVE_X86_DISPATCH
+#endif
+
+static const char *const level_names[PSX_CPU_LEVEL_COUNT] = {
+	"generic",
+	"avx2"
+};
+
+// -1 until the first call to psx_cpu_get_level(). Detection is idempotent, so
+// it does not matter if multiple threads happen to race to perform it.
+static atomic_int current_level = -1;
+
+static psx_cpu_level_t detect_hardware_level(void) {
+#ifdef HAVE_X86_DISPATCH
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2"))
+		return PSX_CPU_LEVEL_AVX2;
+#endif
+
+	return PSX_CPU_LEVEL_GENERIC;
+}
+
+static psx_cpu_level_t detect_level(void) {
+	psx_cpu_level_t level = detect_hardware_level();
+	const char *name = getenv("PSXAV_CPU");
+
+	// The PSXAV_CPU environment variable can be used to force a lower level
+	// (e.g. to benchmark kernels against each other). Unknown names and levels
+	// not supported by the CPU are ignored.
+	if (name == NULL)
+		return level;
+
+	for (int i = 0; i <= (int)level; i++) {
+		if (!strcmp(name, level_names[i]))
+			return (psx_cpu_level_t)i;
+	}
+
+	return level;
+}
+
+psx_cpu_level_t psx_cpu_get_level(void) {
+	int level = atomic_load_explicit(&current_level, memory_order_relaxed);
+
+	if (level < 0) {
+		level = (int)detect_level();
+		atomic_store_explicit(&current_level, level, memory_order_relaxed);
+	}
+
+	return (psx_cpu_level_t)level;
+}
+
+bool psx_cpu_set_level(psx_cpu_level_t level) {
+	if ((int)level < 0 || level > detect_hardware_level())
+		return false;
+
+	atomic_store_explicit(&current_level, (int)level, memory_order_relaxed);
+	return true;
+}
+
+const char *psx_cpu_get_level_name(psx_cpu_level_t level) {
+	if ((int)level < 0 || level >= PSX_CPU_LEVEL_COUNT)
+		return NULL;
+
+	return level_names[level];
+}
@@ -26,6 +26,40 @@ freely, subject to the following restrictions:
 #include <stdbool.h>
 #include <stdint.h>
 
+// Public symbols are exported when building libpsxav itself. On Windows,
+// consumers of the DLL must additionally define PSXAV_USE_SHARED (the
+// pkg-config file does this automatically).
+#if defined(_WIN32) || defined(__CYGWIN__)
+#	if defined(PSXAV_BUILD)
+#		define PSXAV_API __declspec(dllexport)
+#	elif defined(PSXAV_USE_SHARED)
+#		define PSXAV_API __declspec(dllimport)
+#	else
+#		define PSXAV_API
+#	endif
+#elif defined(__GNUC__)
+#	define PSXAV_API __attribute__((visibility("default")))
+#else
+#	define PSXAV_API
+#endif
+
+// cpu.c
+
+// The MDEC DCT and IDCT kernels have multiple implementations, which are
+// selected at runtime based on the features supported by the CPU. All other
+// code (ADPCM, quantization, entropy coding, EDC/ECC) is not dispatched. MDEC
+// encoders and decoders bind their kernel when initialized, so changing the
+// level only affects contexts created afterwards.
+typedef enum {
+	PSX_CPU_LEVEL_GENERIC,
+	PSX_CPU_LEVEL_AVX2,
+	PSX_CPU_LEVEL_COUNT
+} psx_cpu_level_t;
+
+PSXAV_API psx_cpu_level_t psx_cpu_get_level(void);
+PSXAV_API bool psx_cpu_set_level(psx_cpu_level_t level);
+PSXAV_API const char *psx_cpu_get_level_name(psx_cpu_level_t level);
+
 // audio.c
 
 #define PSX_AUDIO_SPU_BLOCK_SIZE        16
@@ -61,6 +95,15 @@ typedef struct {
 	psx_audio_encoder_channel_state_t right;
 } psx_audio_encoder_state_t;
 
+typedef struct {
+	int prev1, prev2;
+} psx_audio_decoder_channel_state_t;
+
+typedef struct {
+	psx_audio_decoder_channel_state_t left;
+	psx_audio_decoder_channel_state_t right;
+} psx_audio_decoder_state_t;
+
 enum {
 	PSX_AUDIO_SPU_LOOP_END    = (1 << 0),
 	PSX_AUDIO_SPU_LOOP_REPEAT = (1 << 0) | (1 << 1),
@@ -70,12 +113,12 @@ enum {
 	PSX_AUDIO_SPU_LOOP_TRAP   = (1 << 0) | (1 << 2)
 };
 
-uint32_t psx_audio_xa_get_buffer_size(psx_audio_xa_settings_t settings, int sample_count);
-uint32_t psx_audio_spu_get_buffer_size(int sample_count);
-uint32_t psx_audio_xa_get_buffer_size_per_sector(psx_audio_xa_settings_t settings);
-uint32_t psx_audio_xa_get_samples_per_sector(psx_audio_xa_settings_t settings);
-uint32_t psx_audio_xa_get_sector_interleave(psx_audio_xa_settings_t settings);
-int psx_audio_xa_encode(
+PSXAV_API uint32_t psx_audio_xa_get_buffer_size(psx_audio_xa_settings_t settings, int sample_count);
+PSXAV_API uint32_t psx_audio_spu_get_buffer_size(int sample_count);
+PSXAV_API uint32_t psx_audio_xa_get_buffer_size_per_sector(psx_audio_xa_settings_t settings);
+PSXAV_API uint32_t psx_audio_xa_get_samples_per_sector(psx_audio_xa_settings_t settings);
+PSXAV_API uint32_t psx_audio_xa_get_sector_interleave(psx_audio_xa_settings_t settings);
+PSXAV_API int psx_audio_xa_encode(
 	psx_audio_xa_settings_t settings,
 	psx_audio_encoder_state_t *state,
 	const int16_t *samples,
@@ -83,22 +126,40 @@ int psx_audio_xa_encode(
 	int lba,
 	uint8_t *output
 );
-int psx_audio_xa_encode_simple(
+PSXAV_API int psx_audio_xa_encode_simple(
 	psx_audio_xa_settings_t settings,
 	const int16_t *samples,
 	int sample_count,
 	int lba,
 	uint8_t *output
 );
-int psx_audio_spu_encode(
+PSXAV_API int psx_audio_spu_encode(
 	psx_audio_encoder_channel_state_t *state,
 	const int16_t *samples,
 	int sample_count,
 	int pitch,
 	uint8_t *output
 );
-int psx_audio_spu_encode_simple(const int16_t *samples, int sample_count, uint8_t *output, int loop_start);
-void psx_audio_xa_encode_finalize(psx_audio_xa_settings_t settings, uint8_t *output, int output_length);
+PSXAV_API int psx_audio_spu_encode_simple(const int16_t *samples, int sample_count, uint8_t *output, int loop_start);
+PSXAV_API void psx_audio_xa_encode_finalize(psx_audio_xa_settings_t settings, uint8_t *output, int output_length);
+
+// Decoding is the exact inverse of the encoders' internal model of the
+// hardware decoder. psx_audio_xa_decode() takes the data area of a single
+// sector (18 sound groups) and returns the number of samples per channel
+// decoded; stereo samples are interleaved.
+PSXAV_API int psx_audio_xa_decode(
+	psx_audio_xa_settings_t settings,
+	psx_audio_decoder_state_t *state,
+	const uint8_t *data,
+	int16_t *samples
+);
+PSXAV_API int psx_audio_spu_decode(
+	psx_audio_decoder_channel_state_t *state,
+	const uint8_t *data,
+	int length,
+	int16_t *samples,
+	int pitch
+);
 
 // cdrom.c
 
@@ -171,6 +232,140 @@ typedef enum {
 	PSX_CDROM_SECTOR_TYPE_MODE2_FORM2
 } psx_cdrom_sector_type_t;
 
-void psx_cdrom_init_xa_subheader(psx_cdrom_sector_xa_subheader_t *subheader, psx_cdrom_sector_type_t type);
-void psx_cdrom_init_sector(psx_cdrom_sector_t *sector, int lba, psx_cdrom_sector_type_t type);
-void psx_cdrom_calculate_checksums(psx_cdrom_sector_t *sector, psx_cdrom_sector_type_t type);
+PSXAV_API void psx_cdrom_init_xa_subheader(psx_cdrom_sector_xa_subheader_t *subheader, psx_cdrom_sector_type_t type);
+PSXAV_API void psx_cdrom_init_sector(psx_cdrom_sector_t *sector, int lba, psx_cdrom_sector_type_t type);
+PSXAV_API void psx_cdrom_calculate_checksums(psx_cdrom_sector_t *sector, psx_cdrom_sector_type_t type);
+
+// stream.c
+
+#define PSX_AUDIO_XA_MAX_SAMPLES_PER_SECTOR 4032 // 224 * 18, 4-bit mono
+#define PSX_AUDIO_XA_STREAM_SECTORS         4
+#define PSX_AUDIO_SPU_STREAM_BLOCKS         32
+
+// Streaming encoders accept any number of samples at a time, buffering them
+// until a whole sector or block can be encoded, and keep encoded data in a
+// small ring buffer until it is pulled by the caller. Pushing stops once the
+// ring buffer is full, so callers should alternate between pushing samples
+// and pulling data, then call the finalize function once all samples have
+// been pushed and pull any data left. Streams are opaque and placed in a
+// caller-provided workspace, like MDEC encoders.
+typedef struct psx_audio_xa_stream psx_audio_xa_stream_t;
+typedef struct psx_audio_spu_stream psx_audio_spu_stream_t;
+
+PSXAV_API int psx_audio_xa_stream_get_workspace_size(void);
+PSXAV_API int psx_audio_spu_stream_get_workspace_size(void);
+PSXAV_API psx_audio_xa_stream_t *psx_audio_xa_stream_init(psx_audio_xa_settings_t settings, int lba, void *workspace);
+PSXAV_API int psx_audio_xa_stream_push(psx_audio_xa_stream_t *stream, const int16_t *samples, int sample_count);
+PSXAV_API void psx_audio_xa_stream_finalize(psx_audio_xa_stream_t *stream);
+PSXAV_API int psx_audio_xa_stream_pull(psx_audio_xa_stream_t *stream, uint8_t *output);
+PSXAV_API psx_audio_spu_stream_t *psx_audio_spu_stream_init(int loop_start, bool loop, void *workspace);
+PSXAV_API int psx_audio_spu_stream_push(psx_audio_spu_stream_t *stream, const int16_t *samples, int sample_count);
+PSXAV_API void psx_audio_spu_stream_finalize(psx_audio_spu_stream_t *stream);
+PSXAV_API int psx_audio_spu_stream_pull(psx_audio_spu_stream_t *stream, uint8_t *output);
+
+// mdec.c
+
+typedef enum {
+	PSX_MDEC_BS_V2,
+	PSX_MDEC_BS_V3,
+	PSX_MDEC_BS_V3DC
+} psx_mdec_bs_version_t;
+
+typedef struct {
+	psx_mdec_bs_version_t version;
+	int width; // must be a multiple of 16
+	int height; // must be a multiple of 16
+} psx_mdec_settings_t;
+
+typedef struct {
+	int quant_scale;
+	int quant_attempts; // number of quantization scales tried
+	int bytes_used; // including the 8-byte frame header
+	int blocks_used; // size of decoded MDEC data in 32-bit words
+	int uncomp_hwords_used;
+} psx_mdec_frame_stats_t;
+
+// Frames are normally passed to encoders packed in NV21 format (a Y plane
+// followed by an interleaved Cr/Cb plane, both as wide as the frame). Frames
+// decoded by other libraries may instead be passed as a set of 4:2:0 planes
+// with arbitrary strides, optionally along with lookup tables to apply to each
+// luma and chroma sample (e.g. to expand limited range frames to full range),
+// which are gathered into macroblocks directly without converting the frame.
+// Planes of any other size than the encoder's resolution are resampled by a
+// scaler while being gathered.
+typedef enum {
+	PSX_MDEC_PLANES_NV21, // Y, interleaved Cr/Cb
+	PSX_MDEC_PLANES_NV12, // Y, interleaved Cb/Cr
+	PSX_MDEC_PLANES_YUV420P // Y, Cb, Cr
+} psx_mdec_planes_layout_t;
+
+typedef struct {
+	psx_mdec_planes_layout_t layout;
+	int width; // of the luma plane, chroma planes are half as large (rounded up)
+	int height;
+	const uint8_t *planes[3];
+	int strides[3];
+	const uint8_t *luma_lut; // NULL if samples are used as-is
+	const uint8_t *chroma_lut; // NULL if samples are used as-is
+} psx_mdec_frame_planes_t;
+
+// Scalers resample frames passed as planes to a fixed output resolution, one
+// 16-line strip at a time, using a separable bilinear filter (widened when
+// downscaling so that all source samples are averaged). The frame's lookup
+// tables are applied to the scaled samples. When passed to
+// psx_mdec_transform_frame_planes(), each strip is transformed into macroblocks
+// as soon as it has been scaled, so the scaled frame is never stored in full.
+// Scalers are placed in a caller-provided workspace like encoders, but also
+// hold scratch buffers and must not be used from multiple threads at a time.
+typedef struct psx_mdec_scaler psx_mdec_scaler_t;
+
+PSXAV_API int psx_mdec_get_scaler_workspace_size(psx_mdec_settings_t settings, int src_width, int src_height);
+PSXAV_API psx_mdec_scaler_t *psx_mdec_init_scaler(psx_mdec_settings_t settings, int src_width, int src_height, void *workspace);
+// Scales a frame into a packed NV21 frame, producing exactly the same samples
+// the encoder would gather when given the scaler.
+PSXAV_API void psx_mdec_scale_frame_planes(psx_mdec_scaler_t *scaler, const psx_mdec_frame_planes_t *frame, uint8_t *output);
+
+// Encoders are opaque and, along with all buffers they use, carved out of a
+// caller-provided workspace (which must be aligned as returned by malloc()).
+// The encoder is valid until the workspace is freed. Separate encoders do not
+// share any state and can be used from different threads concurrently.
+typedef struct psx_mdec_encoder psx_mdec_encoder_t;
+
+PSXAV_API int psx_mdec_get_workspace_size(psx_mdec_settings_t settings);
+PSXAV_API int psx_mdec_get_frame_size(psx_mdec_settings_t settings);
+PSXAV_API psx_mdec_encoder_t *psx_mdec_init_encoder(psx_mdec_settings_t settings, void *workspace);
+PSXAV_API void psx_mdec_transform_frame(psx_mdec_encoder_t *encoder, const uint8_t *frame);
+// The scaler is only used if the planes' size differs from the encoder's
+// resolution, and may be NULL otherwise.
+PSXAV_API void psx_mdec_transform_frame_planes(
+	psx_mdec_encoder_t *encoder,
+	psx_mdec_scaler_t *scaler,
+	const psx_mdec_frame_planes_t *frame
+);
+PSXAV_API int psx_mdec_encode_blocks(
+	psx_mdec_encoder_t *encoder,
+	int quant_scale,
+	uint8_t *output,
+	int max_size,
+	psx_mdec_frame_stats_t *stats
+);
+PSXAV_API int psx_mdec_encode_frame(
+	psx_mdec_encoder_t *encoder,
+	const uint8_t *frame,
+	uint8_t *output,
+	int max_size,
+	psx_mdec_frame_stats_t *stats
+);
+
+// Decoders are opaque and placed in a caller-provided workspace in the same
+// way as encoders. Frames are decoded into the same NV21 layout taken by the
+// encoder, using an integer IDCT and the same dequantization rules as the MDEC.
+typedef struct psx_mdec_decoder psx_mdec_decoder_t;
+
+PSXAV_API int psx_mdec_get_decoder_workspace_size(void);
+PSXAV_API psx_mdec_decoder_t *psx_mdec_init_decoder(psx_mdec_settings_t settings, void *workspace);
+PSXAV_API bool psx_mdec_decode_frame(psx_mdec_decoder_t *decoder, const uint8_t *input, int length, uint8_t *frame);
+// Parses a frame without decoding it, returning false if it does not contain
+// exactly as many macroblocks as the decoder's resolution requires.
+PSXAV_API bool psx_mdec_check_frame(psx_mdec_decoder_t *decoder, const uint8_t *input, int length);
+PSXAV_API void psx_mdec_convert_frame_rgb(psx_mdec_settings_t settings, const uint8_t *frame, uint8_t *output);
@@ -0,0 +1,1869 @@
+/*
+libpsxav: MDEC video + SPU/XA-ADPCM audio library
+
+Copyright (c) 2019, 2020 Adrian "asie" Siekierka
+Copyright (c) 2019 Ben "GreaseMonkey" Russell
+Copyright (c) 2023 spicyjpeg
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "libpsxav.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HAVE_X86_DISPATCH
+#include <immintrin.h>
+#endif
+
+#define AC_PAIR(zeroes, value) \
+	(((zeroes) << 10) | ((+(value)) & 0x3FF)), \
+	(((zeroes) << 10) | ((-(value)) & 0x3FF))
+
+static const struct {
+	int c_bits;
+	uint32_t c_value;
+	uint16_t u_hword_pos;
+	uint16_t u_hword_neg;
+} ac_huffman_tree[] = {
+	// Fuck this Huffman tree in particular --GM
+	{ 2, 0x3,    AC_PAIR( 0,  1)},
+	{ 3, 0x3,    AC_PAIR( 1,  1)},
+	{ 4, 0x4,    AC_PAIR( 0,  2)},
+	{ 4, 0x5,    AC_PAIR( 2,  1)},
+	{ 5, 0x05,   AC_PAIR( 0,  3)},
+	{ 5, 0x06,   AC_PAIR( 4,  1)},
+	{ 5, 0x07,   AC_PAIR( 3,  1)},
+	{ 6, 0x04,   AC_PAIR( 7,  1)},
+	{ 6, 0x05,   AC_PAIR( 6,  1)},
+	{ 6, 0x06,   AC_PAIR( 1,  2)},
+	{ 6, 0x07,   AC_PAIR( 5,  1)},
+	{ 7, 0x04,   AC_PAIR( 2,  2)},
+	{ 7, 0x05,   AC_PAIR( 9,  1)},
+	{ 7, 0x06,   AC_PAIR( 0,  4)},
+	{ 7, 0x07,   AC_PAIR( 8,  1)},
+	{ 8, 0x20,   AC_PAIR(13,  1)},
+	{ 8, 0x21,   AC_PAIR( 0,  6)},
+	{ 8, 0x22,   AC_PAIR(12,  1)},
+	{ 8, 0x23,   AC_PAIR(11,  1)},
+	{ 8, 0x24,   AC_PAIR( 3,  2)},
+	{ 8, 0x25,   AC_PAIR( 1,  3)},
+	{ 8, 0x26,   AC_PAIR( 0,  5)},
+	{ 8, 0x27,   AC_PAIR(10,  1)},
+	{10, 0x008,  AC_PAIR(16,  1)},
+	{10, 0x009,  AC_PAIR( 5,  2)},
+	{10, 0x00A,  AC_PAIR( 0,  7)},
+	{10, 0x00B,  AC_PAIR( 2,  3)},
+	{10, 0x00C,  AC_PAIR( 1,  4)},
+	{10, 0x00D,  AC_PAIR(15,  1)},
+	{10, 0x00E,  AC_PAIR(14,  1)},
+	{10, 0x00F,  AC_PAIR( 4,  2)},
+	{12, 0x010,  AC_PAIR( 0, 11)},
+	{12, 0x011,  AC_PAIR( 8,  2)},
+	{12, 0x012,  AC_PAIR( 4,  3)},
+	{12, 0x013,  AC_PAIR( 0, 10)},
+	{12, 0x014,  AC_PAIR( 2,  4)},
+	{12, 0x015,  AC_PAIR( 7,  2)},
+	{12, 0x016,  AC_PAIR(21,  1)},
+	{12, 0x017,  AC_PAIR(20,  1)},
+	{12, 0x018,  AC_PAIR( 0,  9)},
+	{12, 0x019,  AC_PAIR(19,  1)},
+	{12, 0x01A,  AC_PAIR(18,  1)},
+	{12, 0x01B,  AC_PAIR( 1,  5)},
+	{12, 0x01C,  AC_PAIR( 3,  3)},
+	{12, 0x01D,  AC_PAIR( 0,  8)},
+	{12, 0x01E,  AC_PAIR( 6,  2)},
+	{12, 0x01F,  AC_PAIR(17,  1)},
+	{13, 0x0010, AC_PAIR(10,  2)},
+	{13, 0x0011, AC_PAIR( 9,  2)},
+	{13, 0x0012, AC_PAIR( 5,  3)},
+	{13, 0x0013, AC_PAIR( 3,  4)},
+	{13, 0x0014, AC_PAIR( 2,  5)},
+	{13, 0x0015, AC_PAIR( 1,  7)},
+	{13, 0x0016, AC_PAIR( 1,  6)},
+	{13, 0x0017, AC_PAIR( 0, 15)},
+	{13, 0x0018, AC_PAIR( 0, 14)},
+	{13, 0x0019, AC_PAIR( 0, 13)},
+	{13, 0x001A, AC_PAIR( 0, 12)},
+	{13, 0x001B, AC_PAIR(26,  1)},
+	{13, 0x001C, AC_PAIR(25,  1)},
+	{13, 0x001D, AC_PAIR(24,  1)},
+	{13, 0x001E, AC_PAIR(23,  1)},
+	{13, 0x001F, AC_PAIR(22,  1)},
+	{14, 0x0010, AC_PAIR( 0, 31)},
+	{14, 0x0011, AC_PAIR( 0, 30)},
+	{14, 0x0012, AC_PAIR( 0, 29)},
+	{14, 0x0013, AC_PAIR( 0, 28)},
+	{14, 0x0014, AC_PAIR( 0, 27)},
+	{14, 0x0015, AC_PAIR( 0, 26)},
+	{14, 0x0016, AC_PAIR( 0, 25)},
+	{14, 0x0017, AC_PAIR( 0, 24)},
+	{14, 0x0018, AC_PAIR( 0, 23)},
+	{14, 0x0019, AC_PAIR( 0, 22)},
+	{14, 0x001A, AC_PAIR( 0, 21)},
+	{14, 0x001B, AC_PAIR( 0, 20)},
+	{14, 0x001C, AC_PAIR( 0, 19)},
+	{14, 0x001D, AC_PAIR( 0, 18)},
+	{14, 0x001E, AC_PAIR( 0, 17)},
+	{14, 0x001F, AC_PAIR( 0, 16)},
+	{15, 0x0010, AC_PAIR( 0, 40)},
+	{15, 0x0011, AC_PAIR( 0, 39)},
+	{15, 0x0012, AC_PAIR( 0, 38)},
+	{15, 0x0013, AC_PAIR( 0, 37)},
+	{15, 0x0014, AC_PAIR( 0, 36)},
+	{15, 0x0015, AC_PAIR( 0, 35)},
+	{15, 0x0016, AC_PAIR( 0, 34)},
+	{15, 0x0017, AC_PAIR( 0, 33)},
+	{15, 0x0018, AC_PAIR( 0, 32)},
+	{15, 0x0019, AC_PAIR( 1, 14)},
+	{15, 0x001A, AC_PAIR( 1, 13)},
+	{15, 0x001B, AC_PAIR( 1, 12)},
+	{15, 0x001C, AC_PAIR( 1, 11)},
+	{15, 0x001D, AC_PAIR( 1, 10)},
+	{15, 0x001E, AC_PAIR( 1,  9)},
+	{15, 0x001F, AC_PAIR( 1,  8)},
+	{16, 0x0010, AC_PAIR( 1, 18)},
+	{16, 0x0011, AC_PAIR( 1, 17)},
+	{16, 0x0012, AC_PAIR( 1, 16)},
+	{16, 0x0013, AC_PAIR( 1, 15)},
+	{16, 0x0014, AC_PAIR( 6,  3)},
+	{16, 0x0015, AC_PAIR(16,  2)},
+	{16, 0x0016, AC_PAIR(15,  2)},
+	{16, 0x0017, AC_PAIR(14,  2)},
+	{16, 0x0018, AC_PAIR(13,  2)},
+	{16, 0x0019, AC_PAIR(12,  2)},
+	{16, 0x001A, AC_PAIR(11,  2)},
+	{16, 0x001B, AC_PAIR(31,  1)},
+	{16, 0x001C, AC_PAIR(30,  1)},
+	{16, 0x001D, AC_PAIR(29,  1)},
+	{16, 0x001E, AC_PAIR(28,  1)},
+	{16, 0x001F, AC_PAIR(27,  1)}
+};
+
+static const struct {
+	int c_bits;
+	uint32_t c_value;
+	int dc_bits;
+} dc_c_huffman_tree[] = {
+	{2, 0x1,  0},
+	{2, 0x2,  1},
+	{3, 0x6,  2},
+	{4, 0xE,  3},
+	{5, 0x1E, 4},
+	{6, 0x3E, 5},
+	{7, 0x7E, 6},
+	{8, 0xFE, 7}
+};
+
+static const struct {
+	int c_bits;
+	uint32_t c_value;
+	int dc_bits;
+} dc_y_huffman_tree[] = {
+	{2, 0x0,  0},
+	{2, 0x1,  1},
+	{3, 0x5,  2},
+	{3, 0x6,  3},
+	{4, 0xE,  4},
+	{5, 0x1E, 5},
+	{6, 0x3E, 6},
+	{7, 0x7E, 7}
+};
+
+static const uint8_t quant_dec[8*8] = {
+	 2, 16, 19, 22, 26, 27, 29, 34,
+	16, 16, 22, 24, 27, 29, 34, 37,
+	19, 22, 26, 27, 29, 34, 34, 38,
+	22, 22, 26, 27, 29, 34, 37, 40,
+	22, 26, 27, 29, 32, 35, 40, 48,
+	26, 27, 29, 32, 35, 40, 48, 58,
+	26, 27, 29, 34, 38, 46, 56, 69,
+	27, 29, 35, 38, 46, 56, 69, 83
+};
+
+static const uint8_t dct_zagzig_table[8*8] = {
+	 0,  1,  8, 16,  9,  2,  3, 10,
+	17, 24, 32, 25, 18, 11,  4,  5,
+	12, 19, 26, 33, 40, 48, 41, 34,
+	27, 20, 13,  6,  7, 14, 21, 28,
+	35, 42, 49, 56, 57, 50, 43, 36,
+	29, 22, 15, 23, 30, 37, 44, 51,
+	58, 59, 52, 45, 38, 31, 39, 46,
+	53, 60, 61, 54, 47, 55, 62, 63
+};
+
+enum {
+	INDEX_CR,
+	INDEX_CB,
+	INDEX_Y
+};
+
+#define HUFFMAN_CODE(bits, value) (((bits) << 24) | (value))
+
+#define AC_HUFFMAN_MAP_SIZE (0x10000 * sizeof(uint32_t))
+#define DC_HUFFMAN_MAP_SIZE (0x200 * 3 * sizeof(uint32_t))
+
+struct psx_mdec_encoder {
+	psx_mdec_settings_t settings;
+
+	uint32_t *ac_huffman_map;
+	uint32_t *dc_huffman_map;
+	int16_t *dct_block_lists[6];
+	void (*transform_macroblock)(int16_t *const *blocks, const uint8_t *y_plane, const uint8_t *c_plane, int pitch);
+
+	uint8_t *output;
+	int max_size;
+	int bytes_used;
+	int uncomp_hwords_used;
+	int block_type;
+	int16_t last_dc_values[3];
+	uint16_t bits_value;
+	int bits_left;
+};
+
+// The encoder itself is placed at the beginning of the workspace, padded to
+// keep the buffers following it aligned.
+#define ENCODER_SIZE ((sizeof(psx_mdec_encoder_t) + 63) & ~63)
+
+static void init_huffman_maps(psx_mdec_encoder_t *encoder) {
+	for(int i = 0; i <= 0xFFFF; i++)
+		encoder->ac_huffman_map[i] = HUFFMAN_CODE(6 + 16, (0x1 << 16) | i);
+
+	encoder->dc_huffman_map[(INDEX_CR << 9) | 0] = HUFFMAN_CODE(2, 0x0);
+	encoder->dc_huffman_map[(INDEX_CB << 9) | 0] = HUFFMAN_CODE(2, 0x0);
+	encoder->dc_huffman_map[(INDEX_Y  << 9) | 0] = HUFFMAN_CODE(3, 0x4);
+
+	int ac_tree_item_count = sizeof(ac_huffman_tree) / sizeof(ac_huffman_tree[0]);
+	int dc_c_tree_item_count = sizeof(dc_c_huffman_tree) / sizeof(dc_c_huffman_tree[0]);
+	int dc_y_tree_item_count = sizeof(dc_y_huffman_tree) / sizeof(dc_y_huffman_tree[0]);
+
+	for (int i = 0; i < ac_tree_item_count; i++) {
+		int bits = ac_huffman_tree[i].c_bits + 1;
+		uint32_t base_value = ac_huffman_tree[i].c_value;
+
+		encoder->ac_huffman_map[ac_huffman_tree[i].u_hword_pos] = HUFFMAN_CODE(bits, (base_value << 1) | 0);
+		encoder->ac_huffman_map[ac_huffman_tree[i].u_hword_neg] = HUFFMAN_CODE(bits, (base_value << 1) | 1);
+	}
+	for (int i = 0; i < dc_c_tree_item_count; i++) {
+		int dc_bits = dc_c_huffman_tree[i].dc_bits;
+		int bits = dc_c_huffman_tree[i].c_bits + 1 + dc_bits;
+		uint32_t base_value = dc_c_huffman_tree[i].c_value;
+
+		int pos_offset = 1 << dc_bits;
+		int neg_offset = pos_offset * 2 - 1;
+
+		for (int j = 0; j < (1 << dc_bits); j++) {
+			int pos = (j + pos_offset) & 0x1FF;
+			int neg = (j - neg_offset) & 0x1FF;
+
+			encoder->dc_huffman_map[(INDEX_CR << 9) | pos] = HUFFMAN_CODE(bits, (base_value << (dc_bits + 1)) | (1 << dc_bits) | j);
+			encoder->dc_huffman_map[(INDEX_CR << 9) | neg] = HUFFMAN_CODE(bits, (base_value << (dc_bits + 1)) | (0 << dc_bits) | j);
+			encoder->dc_huffman_map[(INDEX_CB << 9) | pos] = HUFFMAN_CODE(bits, (base_value << (dc_bits + 1)) | (1 << dc_bits) | j);
+			encoder->dc_huffman_map[(INDEX_CB << 9) | neg] = HUFFMAN_CODE(bits, (base_value << (dc_bits + 1)) | (0 << dc_bits) | j);
+		}
+	}
+	for (int i = 0; i < dc_y_tree_item_count; i++) {
+		int dc_bits = dc_y_huffman_tree[i].dc_bits;
+		int bits = dc_y_huffman_tree[i].c_bits + 1 + dc_bits;
+		uint32_t base_value = dc_y_huffman_tree[i].c_value;
+
+		int pos_offset = 1 << dc_bits;
+		int neg_offset = pos_offset * 2 - 1;
+
+		for (int j = 0; j < (1 << dc_bits); j++) {
+			int pos = (j + pos_offset) & 0x1FF;
+			int neg = (j - neg_offset) & 0x1FF;
+
+			encoder->dc_huffman_map[(INDEX_Y << 9) | pos] = HUFFMAN_CODE(bits, (base_value << (dc_bits + 1)) | (1 << dc_bits) | j);
+			encoder->dc_huffman_map[(INDEX_Y << 9) | neg] = HUFFMAN_CODE(bits, (base_value << (dc_bits + 1)) | (0 << dc_bits) | j);
+		}
+	}
+}
+
+static bool flush_bits(psx_mdec_encoder_t *encoder) {
+	if(encoder->bits_left < 16) {
+		if ((encoder->bytes_used + 2) > encoder->max_size)
+			return false;
+
+		encoder->output[encoder->bytes_used++] = (uint8_t)encoder->bits_value;
+		encoder->output[encoder->bytes_used++] = (uint8_t)(encoder->bits_value>>8);
+	}
+
+	encoder->bits_left = 16;
+	encoder->bits_value = 0;
+	return true;
+}
+
+static bool encode_bits(psx_mdec_encoder_t *encoder, int bits, uint32_t val) {
+	assert(val < (1<<bits));
+
+	// FIXME: for some reason the main logic breaks when bits > 16
+	// and I have no idea why, so I have to split this up --GM
+	if (bits > 16) {
+		if (!encode_bits(encoder, bits-16, val>>16))
+			return false;
+
+		bits = 16;
+		val &= 0xFFFF;
+	}
+
+	if (encoder->bits_left == 0) {
+		if (!flush_bits(encoder))
+			return false;
+	}
+
+	while (bits > encoder->bits_left) {
+		// Bits need truncating
+		uint32_t outval = val;
+		outval >>= bits - encoder->bits_left;
+		assert(outval < (1<<16));
+		assert((encoder->bits_value & outval) == 0);
+		encoder->bits_value |= (uint16_t)outval;
+		bits -= encoder->bits_left;
+		uint32_t mask = (1<<bits)-1;
+		val &= mask;
+		assert(mask >= 1);
+		assert(val < (1<<bits));
+		if (!flush_bits(encoder))
+			return false;
+	}
+
+	if (bits >= 1) {
+		assert(bits <= 16);
+		// Bits may need shifting into place
+		uint32_t outval = val;
+		outval <<= encoder->bits_left - bits;
+		assert(outval < (1<<16));
+		assert((encoder->bits_value & outval) == 0);
+		encoder->bits_value |= (uint16_t)outval;
+		encoder->bits_left -= bits;
+	}
+
+	return true;
+}
+
+// Integer forward DCT based on the "islow" algorithm from the IJG JPEG library,
+// with extra intermediate precision. The output is scaled up by a factor of 8.
+#define FDCT_CONST_BITS 13
+#define FDCT_PASS1_BITS 4
+#define FDCT_DESCALE(x, n) (((x) + (1 << ((n) - 1))) >> (n))
+
+enum {
+	FIX_0_298631336 = 2446,
+	FIX_0_390180644 = 3196,
+	FIX_0_541196100 = 4433,
+	FIX_0_765366865 = 6270,
+	FIX_0_899976223 = 7373,
+	FIX_1_175875602 = 9633,
+	FIX_1_501321110 = 12299,
+	FIX_1_847759065 = 15137,
+	FIX_1_961570560 = 16069,
+	FIX_2_053119869 = 16819,
+	FIX_2_562915447 = 20995,
+	FIX_3_072711026 = 25172
+};
+
+static void transform_dct_pass(int16_t *block, int stride, int step, int shift) {
+	for (int i = 0; i < 8; i++, block += step) {
+		int16_t *data = block;
+
+		int tmp0 = data[0*stride] + data[7*stride];
+		int tmp7 = data[0*stride] - data[7*stride];
+		int tmp1 = data[1*stride] + data[6*stride];
+		int tmp6 = data[1*stride] - data[6*stride];
+		int tmp2 = data[2*stride] + data[5*stride];
+		int tmp5 = data[2*stride] - data[5*stride];
+		int tmp3 = data[3*stride] + data[4*stride];
+		int tmp4 = data[3*stride] - data[4*stride];
+
+		// Even part
+		int tmp10 = tmp0 + tmp3;
+		int tmp13 = tmp0 - tmp3;
+		int tmp11 = tmp1 + tmp2;
+		int tmp12 = tmp1 - tmp2;
+
+		data[0*stride] = (int16_t)FDCT_DESCALE((tmp10 + tmp11) * (1 << FDCT_CONST_BITS), shift);
+		data[4*stride] = (int16_t)FDCT_DESCALE((tmp10 - tmp11) * (1 << FDCT_CONST_BITS), shift);
+
+		int z1 = (tmp12 + tmp13) * FIX_0_541196100;
+		data[2*stride] = (int16_t)FDCT_DESCALE(z1 + tmp13 * FIX_0_765366865, shift);
+		data[6*stride] = (int16_t)FDCT_DESCALE(z1 - tmp12 * FIX_1_847759065, shift);
+
+		// Odd part
+		z1 = tmp4 + tmp7;
+		int z2 = tmp5 + tmp6;
+		int z3 = tmp4 + tmp6;
+		int z4 = tmp5 + tmp7;
+		int z5 = (z3 + z4) * FIX_1_175875602;
+
+		tmp4 *= FIX_0_298631336;
+		tmp5 *= FIX_2_053119869;
+		tmp6 *= FIX_3_072711026;
+		tmp7 *= FIX_1_501321110;
+		z1 *= -FIX_0_899976223;
+		z2 *= -FIX_2_562915447;
+		z3 = z3 * -FIX_1_961570560 + z5;
+		z4 = z4 * -FIX_0_390180644 + z5;
+
+		data[7*stride] = (int16_t)FDCT_DESCALE(tmp4 + z1 + z3, shift);
+		data[5*stride] = (int16_t)FDCT_DESCALE(tmp5 + z2 + z4, shift);
+		data[3*stride] = (int16_t)FDCT_DESCALE(tmp6 + z2 + z3, shift);
+		data[1*stride] = (int16_t)FDCT_DESCALE(tmp7 + z1 + z4, shift);
+	}
+}
+
+static void transform_dct_block(int16_t *block) {
+	// Rows are processed first, leaving the results scaled up by
+	// 2^FDCT_PASS1_BITS for extra precision, then columns.
+	transform_dct_pass(block, 1, 8, FDCT_CONST_BITS - FDCT_PASS1_BITS);
+	transform_dct_pass(block, 8, 1, FDCT_CONST_BITS + FDCT_PASS1_BITS);
+}
+
+// Gathers a 16x16 macroblock from the Y plane and the interleaved Cr/Cb plane
+// of an NV21 frame, level shifts it and transforms all 6 blocks while the
+// pixels are still in cache.
+static void transform_macroblock(int16_t *const *blocks, const uint8_t *y_plane, const uint8_t *c_plane, int pitch) {
+	// Order: Cr Cb [Y1|Y2]
+	//              [Y3|Y4]
+	for (int y = 0; y < 8; y++) {
+		const uint8_t *c_row = c_plane + pitch*y;
+		const uint8_t *y_row0 = y_plane + pitch*y;
+		const uint8_t *y_row1 = y_plane + pitch*(y + 8);
+
+		for (int x = 0; x < 8; x++) {
+			int k = y*8 + x;
+
+			blocks[0][k] = (int16_t)c_row[2*x + 0] - 128;
+			blocks[1][k] = (int16_t)c_row[2*x + 1] - 128;
+			blocks[2][k] = (int16_t)y_row0[x + 0] - 128;
+			blocks[3][k] = (int16_t)y_row0[x + 8] - 128;
+			blocks[4][k] = (int16_t)y_row1[x + 0] - 128;
+			blocks[5][k] = (int16_t)y_row1[x + 8] - 128;
+		}
+	}
+
+	for (int i = 0; i < 6; i++)
+		transform_dct_block(blocks[i]);
+}
+
+#ifdef HAVE_X86_DISPATCH
+// AVX2 version of transform_dct_block(), producing bit-identical results. Each
+// pass processes all 8 rows or columns at once as 32-bit lanes; the block is
+// transposed before and after the row pass. Intermediate values are truncated
+// to 16 bits like in the scalar version.
+#define AVX2_FUNC __attribute__((target("avx2")))
+
+static inline AVX2_FUNC __m256i avx2_descale(__m256i x, int shift) {
+	x = _mm256_add_epi32(x, _mm256_set1_epi32(1 << (shift - 1)));
+	x = _mm256_sra_epi32(x, _mm_cvtsi32_si128(shift));
+
+	// Emulate the int16_t cast.
+	return _mm256_srai_epi32(_mm256_slli_epi32(x, 16), 16);
+}
+
+static inline AVX2_FUNC __m256i avx2_mul(__m256i x, int value) {
+	return _mm256_mullo_epi32(x, _mm256_set1_epi32(value));
+}
+
+static inline AVX2_FUNC void avx2_transpose(__m256i *rows) {
+	__m256i t[8], u[8];
+
+	for (int i = 0; i < 8; i += 2) {
+		t[i + 0] = _mm256_unpacklo_epi32(rows[i], rows[i + 1]);
+		t[i + 1] = _mm256_unpackhi_epi32(rows[i], rows[i + 1]);
+	}
+	for (int i = 0; i < 8; i += 4) {
+		u[i + 0] = _mm256_unpacklo_epi64(t[i + 0], t[i + 2]);
+		u[i + 1] = _mm256_unpackhi_epi64(t[i + 0], t[i + 2]);
+		u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+		u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+	}
+	for (int i = 0; i < 4; i++) {
+		rows[i + 0] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x20);
+		rows[i + 4] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x31);
+	}
+}
+
+static inline AVX2_FUNC void transform_dct_pass_avx2(__m256i *data, int shift) {
+	__m256i tmp0 = _mm256_add_epi32(data[0], data[7]);
+	__m256i tmp7 = _mm256_sub_epi32(data[0], data[7]);
+	__m256i tmp1 = _mm256_add_epi32(data[1], data[6]);
+	__m256i tmp6 = _mm256_sub_epi32(data[1], data[6]);
+	__m256i tmp2 = _mm256_add_epi32(data[2], data[5]);
+	__m256i tmp5 = _mm256_sub_epi32(data[2], data[5]);
+	__m256i tmp3 = _mm256_add_epi32(data[3], data[4]);
+	__m256i tmp4 = _mm256_sub_epi32(data[3], data[4]);
+
+	// Even part
+	__m256i tmp10 = _mm256_add_epi32(tmp0, tmp3);
+	__m256i tmp13 = _mm256_sub_epi32(tmp0, tmp3);
+	__m256i tmp11 = _mm256_add_epi32(tmp1, tmp2);
+	__m256i tmp12 = _mm256_sub_epi32(tmp1, tmp2);
+
+	data[0] = avx2_descale(_mm256_slli_epi32(_mm256_add_epi32(tmp10, tmp11), FDCT_CONST_BITS), shift);
+	data[4] = avx2_descale(_mm256_slli_epi32(_mm256_sub_epi32(tmp10, tmp11), FDCT_CONST_BITS), shift);
+
+	__m256i z1 = avx2_mul(_mm256_add_epi32(tmp12, tmp13), FIX_0_541196100);
+	data[2] = avx2_descale(_mm256_add_epi32(z1, avx2_mul(tmp13, FIX_0_765366865)), shift);
+	data[6] = avx2_descale(_mm256_sub_epi32(z1, avx2_mul(tmp12, FIX_1_847759065)), shift);
+
+	// Odd part
+	z1 = _mm256_add_epi32(tmp4, tmp7);
+	__m256i z2 = _mm256_add_epi32(tmp5, tmp6);
+	__m256i z3 = _mm256_add_epi32(tmp4, tmp6);
+	__m256i z4 = _mm256_add_epi32(tmp5, tmp7);
+	__m256i z5 = avx2_mul(_mm256_add_epi32(z3, z4), FIX_1_175875602);
+
+	tmp4 = avx2_mul(tmp4, FIX_0_298631336);
+	tmp5 = avx2_mul(tmp5, FIX_2_053119869);
+	tmp6 = avx2_mul(tmp6, FIX_3_072711026);
+	tmp7 = avx2_mul(tmp7, FIX_1_501321110);
+	z1 = avx2_mul(z1, -FIX_0_899976223);
+	z2 = avx2_mul(z2, -FIX_2_562915447);
+	z3 = _mm256_add_epi32(avx2_mul(z3, -FIX_1_961570560), z5);
+	z4 = _mm256_add_epi32(avx2_mul(z4, -FIX_0_390180644), z5);
+
+	data[7] = avx2_descale(_mm256_add_epi32(_mm256_add_epi32(tmp4, z1), z3), shift);
+	data[5] = avx2_descale(_mm256_add_epi32(_mm256_add_epi32(tmp5, z2), z4), shift);
+	data[3] = avx2_descale(_mm256_add_epi32(_mm256_add_epi32(tmp6, z2), z3), shift);
+	data[1] = avx2_descale(_mm256_add_epi32(_mm256_add_epi32(tmp7, z1), z4), shift);
+}
+
+// Transforms a block already loaded into registers (one row per vector) and
+// stores the coefficients.
+static inline AVX2_FUNC void transform_dct_block_avx2(__m256i *data, int16_t *block) {
+	avx2_transpose(data);
+	transform_dct_pass_avx2(data, FDCT_CONST_BITS - FDCT_PASS1_BITS);
+	avx2_transpose(data);
+	transform_dct_pass_avx2(data, FDCT_CONST_BITS + FDCT_PASS1_BITS);
+
+	for (int i = 0; i < 8; i++) {
+		__m128i row = _mm_packs_epi32(
+			_mm256_castsi256_si128(data[i]),
+			_mm256_extracti128_si256(data[i], 1)
+		);
+
+		_mm_storeu_si128((__m128i *)&block[i * 8], row);
+	}
+}
+
+// AVX2 version of transform_macroblock(). Rows are loaded straight from the
+// frame into 32-bit lanes and level shifted in registers, so the gathered
+// pixels never have to be written out and read back before the DCT.
+static AVX2_FUNC void transform_macroblock_avx2(int16_t *const *blocks, const uint8_t *y_plane, const uint8_t *c_plane, int pitch) {
+	const __m128i deinterleave = _mm_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14, 1, 3, 5, 7, 9, 11, 13, 15);
+	const __m256i bias = _mm256_set1_epi32(128);
+	__m256i data[2][8];
+
+	for (int y = 0; y < 8; y++) {
+		__m128i c_row = _mm_loadu_si128((const __m128i *)(c_plane + pitch*y));
+		c_row = _mm_shuffle_epi8(c_row, deinterleave);
+
+		data[0][y] = _mm256_sub_epi32(_mm256_cvtepu8_epi32(c_row), bias);
+		data[1][y] = _mm256_sub_epi32(_mm256_cvtepu8_epi32(_mm_srli_si128(c_row, 8)), bias);
+	}
+
+	transform_dct_block_avx2(data[0], blocks[0]);
+	transform_dct_block_avx2(data[1], blocks[1]);
+
+	for (int i = 0; i < 2; i++) {
+		const uint8_t *y_rows = y_plane + pitch*8*i;
+
+		for (int y = 0; y < 8; y++) {
+			__m128i y_row = _mm_loadu_si128((const __m128i *)(y_rows + pitch*y));
+
+			data[0][y] = _mm256_sub_epi32(_mm256_cvtepu8_epi32(y_row), bias);
+			data[1][y] = _mm256_sub_epi32(_mm256_cvtepu8_epi32(_mm_srli_si128(y_row, 8)), bias);
+		}
+
+		transform_dct_block_avx2(data[0], blocks[2 + i*2]);
+		transform_dct_block_avx2(data[1], blocks[3 + i*2]);
+	}
+}
+#endif
+
+// https://stackoverflow.com/a/60011209
+#define DIVIDE_ROUNDED(n, d) (((n) >= 0) ? (((n) + (d)/2) / (d)) : (((n) - (d)/2) / (d)))
+
+static int clamp_coeff(int coeff) {
+	if (coeff < -0x200)
+		return -0x200;
+	if (coeff > +0x1FE)
+		return +0x1FE; // 0x1FF = v2 end of frame
+
+	return coeff;
+}
+
+static bool encode_dct_block(
+	psx_mdec_encoder_t *encoder,
+	const int16_t *block,
+	const int16_t *quant_table
+) {
+	int dc = clamp_coeff(DIVIDE_ROUNDED(block[0], quant_table[0]));
+
+	if (encoder->settings.version == PSX_MDEC_BS_V2) {
+		if (!encode_bits(encoder, 10, dc & 0x3FF))
+			return false;
+	} else {
+		int index = encoder->block_type;
+
+		if (index > INDEX_Y)
+			index = INDEX_Y;
+
+		int delta = DIVIDE_ROUNDED(dc - encoder->last_dc_values[index], 4);
+		encoder->last_dc_values[index] += delta * 4;
+
+		// Some versions of Sony's BS v3 decoder compute each DC coefficient as
+		// ((last + delta * 4) & 0x3FF) instead of just (last + delta * 4). The
+		// encoder can leverage this behavior to represent large coefficient
+		// differences as smaller deltas that cause the decoder to overflow and
+		// wrap around (e.g. -1 to encode -512 -> 511 as opposed to +1023). This
+		// saves some space as larger DC values take up more bits.
+		if (encoder->settings.version == PSX_MDEC_BS_V3DC) {
+			if (delta < -0x80)
+				delta += 0x100;
+			else if (delta > +0x80)
+				delta -= 0x100;
+		}
+
+		uint32_t outword = encoder->dc_huffman_map[(index << 9) | (delta & 0x1FF)];
+
+		if (!encode_bits(encoder, outword >> 24, outword & 0xFFFFFF))
+			return false;
+	}
+
+	for (int i = 1, zeroes = 0; i < 64; i++) {
+		int ri = dct_zagzig_table[i];
+		int ac = clamp_coeff(DIVIDE_ROUNDED(block[ri], quant_table[ri]));
+
+		if (ac == 0) {
+			zeroes++;
+		} else {
+			uint32_t outword = encoder->ac_huffman_map[(zeroes << 10) | (ac & 0x3FF)];
+
+			if (!encode_bits(encoder, outword >> 24, outword & 0xFFFFFF))
+				return false;
+
+			zeroes = 0;
+			encoder->uncomp_hwords_used++;
+		}
+	}
+
+	// Store end of block
+	if (!encode_bits(encoder, 2, 0x2))
+		return false;
+
+	encoder->block_type++;
+	encoder->block_type %= 6;
+	encoder->uncomp_hwords_used += 2;
+	return true;
+}
+
+int psx_mdec_get_workspace_size(psx_mdec_settings_t settings) {
+	int dct_block_count_x = (settings.width + 15) / 16;
+	int dct_block_count_y = (settings.height + 15) / 16;
+	int dct_block_size = dct_block_count_x * dct_block_count_y * sizeof(int16_t) * 8*8;
+
+	return ENCODER_SIZE + AC_HUFFMAN_MAP_SIZE + DC_HUFFMAN_MAP_SIZE + dct_block_size * 6;
+}
+
+int psx_mdec_get_frame_size(psx_mdec_settings_t settings) {
+	return settings.width * settings.height * 3 / 2;
+}
+
+psx_mdec_encoder_t *psx_mdec_init_encoder(psx_mdec_settings_t settings, void *workspace) {
+	// TODO: non-16x16-aligned videos
+	if (
+		settings.width <= 0 ||
+		settings.height <= 0 ||
+		(settings.width % 16) ||
+		(settings.height % 16)
+	)
+		return NULL;
+
+	int dct_block_count_x = settings.width / 16;
+	int dct_block_count_y = settings.height / 16;
+	int dct_block_count = dct_block_count_x * dct_block_count_y * 8*8;
+	psx_mdec_encoder_t *encoder = (psx_mdec_encoder_t *)workspace;
+	uint8_t *ptr = (uint8_t *)workspace + ENCODER_SIZE;
+
+	encoder->settings = settings;
+	encoder->ac_huffman_map = (uint32_t *)ptr;
+	ptr += AC_HUFFMAN_MAP_SIZE;
+	encoder->dc_huffman_map = (uint32_t *)ptr;
+	ptr += DC_HUFFMAN_MAP_SIZE;
+
+	for (int i = 0; i < 6; i++)
+		encoder->dct_block_lists[i] = (int16_t *)ptr + dct_block_count * i;
+
+	encoder->transform_macroblock = &transform_macroblock;
+
+#ifdef HAVE_X86_DISPATCH
+	if (psx_cpu_get_level() >= PSX_CPU_LEVEL_AVX2)
+		encoder->transform_macroblock = &transform_macroblock_avx2;
+#endif
+
+	encoder->output = NULL;
+	encoder->max_size = 0;
+	encoder->bytes_used = 0;
+	encoder->uncomp_hwords_used = 0;
+
+	init_huffman_maps(encoder);
+	return encoder;
+}
+
+void psx_mdec_transform_frame(psx_mdec_encoder_t *encoder, const uint8_t *frame) {
+	int pitch = encoder->settings.width;
+	const uint8_t *y_plane = frame;
+	const uint8_t *c_plane = y_plane + (encoder->settings.width * encoder->settings.height);
+
+	int dct_block_count_x = encoder->settings.width / 16;
+	int dct_block_count_y = encoder->settings.height / 16;
+
+	// Rearrange the Y/C planes into macroblocks one 16-pixel strip at a time,
+	// from left to right, so that each strip is only read once and the blocks
+	// are written out sequentially.
+	for (int fy = 0; fy < dct_block_count_y; fy++) {
+		const uint8_t *y_rows = y_plane + pitch*16*fy;
+		const uint8_t *c_rows = c_plane + pitch*8*fy;
+
+		for (int fx = 0; fx < dct_block_count_x; fx++) {
+			int block_offs = 64 * (fy*dct_block_count_x + fx);
+			int16_t *blocks[6] = {
+				encoder->dct_block_lists[0] + block_offs,
+				encoder->dct_block_lists[1] + block_offs,
+				encoder->dct_block_lists[2] + block_offs,
+				encoder->dct_block_lists[3] + block_offs,
+				encoder->dct_block_lists[4] + block_offs,
+				encoder->dct_block_lists[5] + block_offs
+			};
+
+			encoder->transform_macroblock(blocks, y_rows + 16*fx, c_rows + 16*fx, pitch);
+		}
+	}
+}
+
+// Scalers use a separable filter with a fixed number of taps per output sample
+// in each direction, stored as the index of the first source sample and a set
+// of 2.14 fixed-point weights summing to one.
+typedef struct {
+	int taps;
+	int *starts;
+	int16_t *weights;
+} scaler_filter_t;
+
+enum {
+	FILTER_LUMA_X,
+	FILTER_LUMA_Y,
+	FILTER_CHROMA_X,
+	FILTER_CHROMA_Y,
+	NUM_FILTERS
+};
+
+struct psx_mdec_scaler {
+	psx_mdec_settings_t settings;
+	int src_width;
+	int src_height;
+
+	scaler_filter_t filters[NUM_FILTERS];
+	int32_t *luma_row; // vertically filtered source rows
+	int32_t *chroma_row; // interleaved as in the source, or split into Cb and Cr halves
+	uint8_t *strip; // one 16-line NV21 strip at the output resolution
+};
+
+#define SCALER_SIZE ((sizeof(psx_mdec_scaler_t) + 63) & ~63)
+
+// Weights follow a triangle (i.e. bilinear interpolation) which is widened to
+// cover all source samples that fall under each output sample when
+// downscaling, so that they are averaged rather than skipped.
+static int get_filter_taps(int src_size, int dst_size) {
+	int64_t step = ((int64_t)src_size << 16) / dst_size;
+	int64_t radius = (step > 0x10000) ? step : 0x10000;
+	int taps = (int)((radius * 2 + 0xFFFF) >> 16);
+
+	return (taps < src_size) ? taps : src_size;
+}
+
+static void init_filter(scaler_filter_t *filter, int src_size, int dst_size) {
+	int64_t step = ((int64_t)src_size << 16) / dst_size;
+	int64_t radius = (step > 0x10000) ? step : 0x10000;
+
+	memset(filter->weights, 0, sizeof(int16_t) * filter->taps * dst_size);
+
+	for (int i = 0; i < dst_size; i++) {
+		// Both the position of the output sample's center in the source and
+		// the weights are in 16.16 fixed-point format.
+		int64_t center = step * i + step / 2 - 0x8000;
+		int first = (int)((center - radius) >> 16) + 1;
+		int last = (int)((center + radius - 1) >> 16);
+
+		int start = first;
+		if (start > (src_size - filter->taps))
+			start = src_size - filter->taps;
+		if (start < 0)
+			start = 0;
+
+		int64_t sum = 0;
+		for (int j = first; j <= last; j++) {
+			int64_t distance = (int64_t)j * 0x10000 - center;
+			sum += radius - ((distance < 0) ? -distance : distance);
+		}
+
+		// Samples outside of the frame are replaced with the closest edge
+		// sample. The weights are rounded cumulatively so that they always
+		// add up to exactly one.
+		int16_t *weights = filter->weights + filter->taps * i;
+		int64_t partial_sum = 0;
+		int rounded_sum = 0;
+
+		for (int j = first; j <= last; j++) {
+			int64_t distance = (int64_t)j * 0x10000 - center;
+			int index = (j < 0) ? 0 : ((j >= src_size) ? (src_size - 1) : j);
+
+			partial_sum += radius - ((distance < 0) ? -distance : distance);
+			int rounded = (int)((partial_sum * 0x4000 + sum / 2) / sum);
+
+			weights[index - start] += rounded - rounded_sum;
+			rounded_sum = rounded;
+		}
+
+		filter->starts[i] = start;
+	}
+}
+
+// All buffers are laid out in the same order by psx_mdec_get_scaler_workspace_size()
+// and psx_mdec_init_scaler().
+static int layout_scaler(psx_mdec_scaler_t *scaler, psx_mdec_settings_t settings, int src_width, int src_height, uint8_t *ptr) {
+	int src_sizes[NUM_FILTERS] = {
+		src_width, src_height, (src_width + 1) / 2, (src_height + 1) / 2
+	};
+	int dst_sizes[NUM_FILTERS] = {
+		settings.width, settings.height, settings.width / 2, settings.height / 2
+	};
+	int size = SCALER_SIZE;
+
+	for (int i = 0; i < NUM_FILTERS; i++) {
+		int taps = get_filter_taps(src_sizes[i], dst_sizes[i]);
+		int starts_size = (sizeof(int) * dst_sizes[i] + 63) & ~63;
+		int weights_size = (sizeof(int16_t) * taps * dst_sizes[i] + 63) & ~63;
+
+		if (scaler != NULL) {
+			scaler->filters[i].taps = taps;
+			scaler->filters[i].starts = (int *)(ptr + size);
+			scaler->filters[i].weights = (int16_t *)(ptr + size + starts_size);
+		}
+
+		size += starts_size + weights_size;
+	}
+
+	int luma_row_size = (sizeof(int32_t) * src_sizes[FILTER_LUMA_X] + 63) & ~63;
+	int chroma_row_size = (sizeof(int32_t) * src_sizes[FILTER_CHROMA_X] * 2 + 63) & ~63;
+
+	if (scaler != NULL) {
+		scaler->luma_row = (int32_t *)(ptr + size);
+		scaler->chroma_row = (int32_t *)(ptr + size + luma_row_size);
+		scaler->strip = ptr + size + luma_row_size + chroma_row_size;
+	}
+
+	return size + luma_row_size + chroma_row_size + settings.width * 24;
+}
+
+static bool check_scaler_settings(psx_mdec_settings_t settings, int src_width, int src_height) {
+	return (
+		settings.width > 0 &&
+		settings.height > 0 &&
+		!(settings.width % 16) &&
+		!(settings.height % 16) &&
+		src_width > 0 &&
+		src_height > 0
+	);
+}
+
+int psx_mdec_get_scaler_workspace_size(psx_mdec_settings_t settings, int src_width, int src_height) {
+	if (!check_scaler_settings(settings, src_width, src_height))
+		return 0;
+
+	return layout_scaler(NULL, settings, src_width, src_height, NULL);
+}
+
+psx_mdec_scaler_t *psx_mdec_init_scaler(psx_mdec_settings_t settings, int src_width, int src_height, void *workspace) {
+	if (!check_scaler_settings(settings, src_width, src_height))
+		return NULL;
+
+	psx_mdec_scaler_t *scaler = (psx_mdec_scaler_t *)workspace;
+
+	scaler->settings = settings;
+	scaler->src_width = src_width;
+	scaler->src_height = src_height;
+	layout_scaler(scaler, settings, src_width, src_height, (uint8_t *)workspace);
+
+	init_filter(&(scaler->filters[FILTER_LUMA_X]), src_width, settings.width);
+	init_filter(&(scaler->filters[FILTER_LUMA_Y]), src_height, settings.height);
+	init_filter(&(scaler->filters[FILTER_CHROMA_X]), (src_width + 1) / 2, settings.width / 2);
+	init_filter(&(scaler->filters[FILTER_CHROMA_Y]), (src_height + 1) / 2, settings.height / 2);
+	return scaler;
+}
+
+// Filters the source rows covered by the given output row into a row of 8.8
+// fixed-point samples.
+static void filter_rows(
+	const scaler_filter_t *filter,
+	int index,
+	const uint8_t *plane,
+	int stride,
+	int count,
+	int32_t *row
+) {
+	const int16_t *weights = filter->weights + filter->taps * index;
+	const uint8_t *src = plane + (ptrdiff_t)stride * filter->starts[index];
+
+	for (int x = 0; x < count; x++)
+		row[x] = 1 << 5;
+
+	for (int i = 0; i < filter->taps; i++, src += stride) {
+		int32_t weight = weights[i];
+
+		if (!weight)
+			continue;
+
+		for (int x = 0; x < count; x++)
+			row[x] += weight * src[x];
+	}
+
+	for (int x = 0; x < count; x++)
+		row[x] >>= 6;
+}
+
+// Filters a row produced by filter_rows() horizontally (reading every step-th
+// sample, so that interleaved chroma rows can be filtered in place), then
+// rounds it back to 8 bits and applies the lookup table if any.
+static void filter_columns(
+	const scaler_filter_t *filter,
+	const int32_t *row,
+	int step,
+	int count,
+	const uint8_t *lut,
+	uint8_t *output,
+	int output_step
+) {
+	for (int x = 0; x < count; x++) {
+		const int16_t *weights = filter->weights + filter->taps * x;
+		const int32_t *src = row + filter->starts[x] * step;
+		int32_t sum = 1 << 21;
+
+		for (int i = 0; i < filter->taps; i++)
+			sum += weights[i] * src[i * step];
+
+		uint8_t value = (uint8_t)(sum >> 22);
+		output[x * output_step] = (lut != NULL) ? lut[value] : value;
+	}
+}
+
+// Scales the given 16-line strip of the frame into the NV21 planes starting at
+// y_rows and c_rows.
+static void scale_strip(
+	psx_mdec_scaler_t *scaler,
+	const psx_mdec_frame_planes_t *frame,
+	int strip,
+	uint8_t *y_rows,
+	uint8_t *c_rows,
+	int pitch
+) {
+	const scaler_filter_t *filters = scaler->filters;
+	int width = scaler->settings.width;
+	int chroma_width = (scaler->src_width + 1) / 2;
+
+	for (int y = 0; y < 16; y++) {
+		filter_rows(
+			&filters[FILTER_LUMA_Y],
+			16*strip + y,
+			frame->planes[0],
+			frame->strides[0],
+			scaler->src_width,
+			scaler->luma_row
+		);
+		filter_columns(&filters[FILTER_LUMA_X], scaler->luma_row, 1, width, frame->luma_lut, y_rows + pitch*y, 1);
+	}
+
+	// Interleaved chroma rows are filtered vertically as-is, while separate
+	// planes are filtered into two halves of the row.
+	const int32_t *cr_row, *cb_row;
+	int step;
+
+	if (frame->layout == PSX_MDEC_PLANES_YUV420P) {
+		cb_row = scaler->chroma_row;
+		cr_row = scaler->chroma_row + chroma_width;
+		step = 1;
+	} else {
+		cr_row = scaler->chroma_row + ((frame->layout == PSX_MDEC_PLANES_NV21) ? 0 : 1);
+		cb_row = scaler->chroma_row + ((frame->layout == PSX_MDEC_PLANES_NV21) ? 1 : 0);
+		step = 2;
+	}
+
+	for (int y = 0; y < 8; y++) {
+		int index = 8*strip + y;
+		uint8_t *dst = c_rows + pitch*y;
+
+		if (frame->layout == PSX_MDEC_PLANES_YUV420P) {
+			filter_rows(&filters[FILTER_CHROMA_Y], index, frame->planes[1], frame->strides[1], chroma_width, scaler->chroma_row);
+			filter_rows(&filters[FILTER_CHROMA_Y], index, frame->planes[2], frame->strides[2], chroma_width, scaler->chroma_row + chroma_width);
+		} else {
+			filter_rows(&filters[FILTER_CHROMA_Y], index, frame->planes[1], frame->strides[1], chroma_width * 2, scaler->chroma_row);
+		}
+
+		filter_columns(&filters[FILTER_CHROMA_X], cr_row, step, width / 2, frame->chroma_lut, dst, 2);
+		filter_columns(&filters[FILTER_CHROMA_X], cb_row, step, width / 2, frame->chroma_lut, dst + 1, 2);
+	}
+}
+
+// Gathers a 16x16 macroblock from a frame passed as separate planes into a
+// packed NV21 macroblock (which fits in a few cache lines), applying the
+// frame's lookup tables if any, then transforms it as usual.
+static void transform_macroblock_planes(
+	psx_mdec_encoder_t *encoder,
+	int16_t *const *blocks,
+	const psx_mdec_frame_planes_t *frame,
+	int px,
+	int py
+) {
+	uint8_t y_block[16*16];
+	uint8_t c_block[16*8];
+
+	for (int y = 0; y < 16; y++) {
+		const uint8_t *src = frame->planes[0] + (ptrdiff_t)frame->strides[0]*(py + y) + px;
+		uint8_t *dst = y_block + 16*y;
+
+		if (frame->luma_lut != NULL) {
+			for (int x = 0; x < 16; x++)
+				dst[x] = frame->luma_lut[src[x]];
+		} else {
+			memcpy(dst, src, 16);
+		}
+	}
+
+	for (int y = 0; y < 8; y++) {
+		const uint8_t *src_cr, *src_cb;
+		int step;
+		uint8_t *dst = c_block + 16*y;
+
+		if (frame->layout == PSX_MDEC_PLANES_NV21) {
+			src_cr = frame->planes[1] + (ptrdiff_t)frame->strides[1]*(py/2 + y) + px;
+			src_cb = src_cr + 1;
+			step = 2;
+		} else if (frame->layout == PSX_MDEC_PLANES_NV12) {
+			src_cb = frame->planes[1] + (ptrdiff_t)frame->strides[1]*(py/2 + y) + px;
+			src_cr = src_cb + 1;
+			step = 2;
+		} else {
+			src_cb = frame->planes[1] + (ptrdiff_t)frame->strides[1]*(py/2 + y) + px/2;
+			src_cr = frame->planes[2] + (ptrdiff_t)frame->strides[2]*(py/2 + y) + px/2;
+			step = 1;
+		}
+
+		for (int x = 0; x < 8; x++) {
+			uint8_t cr = src_cr[x*step];
+			uint8_t cb = src_cb[x*step];
+
+			if (frame->chroma_lut != NULL) {
+				cr = frame->chroma_lut[cr];
+				cb = frame->chroma_lut[cb];
+			}
+
+			dst[2*x + 0] = cr;
+			dst[2*x + 1] = cb;
+		}
+	}
+
+	encoder->transform_macroblock(blocks, y_block, c_block, 16);
+}
+
+void psx_mdec_scale_frame_planes(psx_mdec_scaler_t *scaler, const psx_mdec_frame_planes_t *frame, uint8_t *output) {
+	assert(frame->width == scaler->src_width && frame->height == scaler->src_height);
+
+	int pitch = scaler->settings.width;
+	uint8_t *y_plane = output;
+	uint8_t *c_plane = y_plane + (scaler->settings.width * scaler->settings.height);
+
+	for (int fy = 0; fy < (scaler->settings.height / 16); fy++)
+		scale_strip(scaler, frame, fy, y_plane + pitch*16*fy, c_plane + pitch*8*fy, pitch);
+}
+
+// Scales the frame one 16-line strip at a time into the scaler's strip buffer
+// (which stays in cache), then transforms all macroblocks in the strip before
+// moving onto the next one.
+static void transform_frame_scaled(
+	psx_mdec_encoder_t *encoder,
+	psx_mdec_scaler_t *scaler,
+	const psx_mdec_frame_planes_t *frame
+) {
+	assert(frame->width == scaler->src_width && frame->height == scaler->src_height);
+	assert(
+		scaler->settings.width == encoder->settings.width &&
+		scaler->settings.height == encoder->settings.height
+	);
+
+	int pitch = encoder->settings.width;
+	uint8_t *y_rows = scaler->strip;
+	uint8_t *c_rows = y_rows + pitch*16;
+
+	int dct_block_count_x = encoder->settings.width / 16;
+	int dct_block_count_y = encoder->settings.height / 16;
+
+	for (int fy = 0; fy < dct_block_count_y; fy++) {
+		scale_strip(scaler, frame, fy, y_rows, c_rows, pitch);
+
+		for (int fx = 0; fx < dct_block_count_x; fx++) {
+			int block_offs = 64 * (fy*dct_block_count_x + fx);
+			int16_t *blocks[6] = {
+				encoder->dct_block_lists[0] + block_offs,
+				encoder->dct_block_lists[1] + block_offs,
+				encoder->dct_block_lists[2] + block_offs,
+				encoder->dct_block_lists[3] + block_offs,
+				encoder->dct_block_lists[4] + block_offs,
+				encoder->dct_block_lists[5] + block_offs
+			};
+
+			encoder->transform_macroblock(blocks, y_rows + 16*fx, c_rows + 16*fx, pitch);
+		}
+	}
+}
+
+void psx_mdec_transform_frame_planes(
+	psx_mdec_encoder_t *encoder,
+	psx_mdec_scaler_t *scaler,
+	const psx_mdec_frame_planes_t *frame
+) {
+	if (frame->width != encoder->settings.width || frame->height != encoder->settings.height) {
+		assert(scaler != NULL);
+		transform_frame_scaled(encoder, scaler, frame);
+		return;
+	}
+
+	int dct_block_count_x = encoder->settings.width / 16;
+	int dct_block_count_y = encoder->settings.height / 16;
+
+	// NV21 frames whose planes share the same stride can be read in place.
+	bool in_place = (
+		frame->layout == PSX_MDEC_PLANES_NV21 &&
+		frame->strides[0] == frame->strides[1] &&
+		frame->luma_lut == NULL &&
+		frame->chroma_lut == NULL
+	);
+
+	for (int fy = 0; fy < dct_block_count_y; fy++) {
+		for (int fx = 0; fx < dct_block_count_x; fx++) {
+			int block_offs = 64 * (fy*dct_block_count_x + fx);
+			int16_t *blocks[6] = {
+				encoder->dct_block_lists[0] + block_offs,
+				encoder->dct_block_lists[1] + block_offs,
+				encoder->dct_block_lists[2] + block_offs,
+				encoder->dct_block_lists[3] + block_offs,
+				encoder->dct_block_lists[4] + block_offs,
+				encoder->dct_block_lists[5] + block_offs
+			};
+
+			if (in_place)
+				encoder->transform_macroblock(
+					blocks,
+					frame->planes[0] + (ptrdiff_t)frame->strides[0]*16*fy + 16*fx,
+					frame->planes[1] + (ptrdiff_t)frame->strides[1]*8*fy + 16*fx,
+					frame->strides[0]
+				);
+			else
+				transform_macroblock_planes(encoder, blocks, frame, 16*fx, 16*fy);
+		}
+	}
+}
+
+int psx_mdec_encode_blocks(
+	psx_mdec_encoder_t *encoder,
+	int quant_scale,
+	uint8_t *output,
+	int max_size,
+	psx_mdec_frame_stats_t *stats
+) {
+	assert(quant_scale >= 1 && quant_scale < 64);
+
+	int dct_block_count_x = encoder->settings.width / 16;
+	int dct_block_count_y = encoder->settings.height / 16;
+	int16_t quant_table[8*8];
+
+	// The DC coefficient's quantization scale is always 8.
+	quant_table[0] = quant_dec[0] * 8;
+
+	for (int i = 1; i < 64; i++)
+		quant_table[i] = quant_dec[i] * quant_scale;
+
+	if (max_size < 8)
+		return -1;
+
+	memset(output, 0, max_size);
+
+	encoder->output = output;
+	encoder->max_size = max_size;
+	encoder->block_type = 0;
+	encoder->last_dc_values[INDEX_CR] = 0;
+	encoder->last_dc_values[INDEX_CB] = 0;
+	encoder->last_dc_values[INDEX_Y] = 0;
+
+	encoder->bits_value = 0;
+	encoder->bits_left = 16;
+	encoder->uncomp_hwords_used = 0;
+	encoder->bytes_used = 8;
+
+	bool ok = true;
+	for (int fx = 0; ok && (fx < dct_block_count_x); fx++) {
+		for (int fy = 0; ok && (fy < dct_block_count_y); fy++) {
+			int block_offs = 64 * (fy*dct_block_count_x + fx);
+
+			for(int i = 0; ok && (i < 6); i++)
+				ok = encode_dct_block(encoder, encoder->dct_block_lists[i] + block_offs, quant_table);
+		}
+	}
+
+	uint32_t end_of_block = (encoder->settings.version == PSX_MDEC_BS_V2) ? 0x1FF : 0x3FF;
+
+	if (ok)
+		ok = encode_bits(encoder, 10, end_of_block);
+	if (ok)
+		ok = flush_bits(encoder);
+
+	encoder->output = NULL;
+
+	if (!ok)
+		return -1;
+
+	encoder->uncomp_hwords_used += 2;
+
+	// MDEC DMA is usually configured to transfer data in 32-word chunks.
+	int uncomp_hwords_used = (encoder->uncomp_hwords_used+0x3F)&~0x3F;
+
+	// This is not the number of 32-byte blocks required for uncompressed data
+	// as jPSXdec docs say, but rather the number of 32-*bit* words required.
+	// The first 4 bytes of the frame header are in fact the MDEC command to
+	// start decoding, which contains the data length in words in the lower 16
+	// bits.
+	int blocks_used = (uncomp_hwords_used+1)>>1;
+
+	// We need a multiple of 4
+	int bytes_used = (encoder->bytes_used+0x3)&~0x3;
+
+	// MDEC command (size of decompressed MDEC data)
+	output[0x000] = (uint8_t)blocks_used;
+	output[0x001] = (uint8_t)(blocks_used>>8);
+	output[0x002] = (uint8_t)0x00;
+	output[0x003] = (uint8_t)0x38;
+
+	// Quantization scale
+	output[0x004] = (uint8_t)quant_scale;
+	output[0x005] = (uint8_t)(quant_scale>>8);
+
+	// BS version
+	if (encoder->settings.version == PSX_MDEC_BS_V2)
+		output[0x006] = 0x02;
+	else
+		output[0x006] = 0x03;
+
+	output[0x007] = 0x00;
+
+	if (stats != NULL) {
+		stats->quant_scale = quant_scale;
+		stats->quant_attempts = 1;
+		stats->bytes_used = bytes_used;
+		stats->blocks_used = blocks_used;
+		stats->uncomp_hwords_used = uncomp_hwords_used;
+	}
+
+	return bytes_used;
+}
+
+int psx_mdec_encode_frame(
+	psx_mdec_encoder_t *encoder,
+	const uint8_t *frame,
+	uint8_t *output,
+	int max_size,
+	psx_mdec_frame_stats_t *stats
+) {
+	psx_mdec_transform_frame(encoder, frame);
+
+	// Attempt encoding the frame at the maximum quality. If the result is too
+	// large, increase the quantization scale and try again.
+	// TODO: if a frame encoded at scale N is too large but the same frame
+	// encoded at scale N+1 leaves a significant amount of free space, attempt
+	// compressing at scale N but optimizing coefficients away until it fits
+	// (like the old algorithm did)
+	for (int quant_scale = 1; quant_scale < 64; quant_scale++) {
+		int bytes_used = psx_mdec_encode_blocks(encoder, quant_scale, output, max_size, stats);
+
+		if (bytes_used < 0)
+			continue;
+		if (stats != NULL)
+			stats->quant_attempts = quant_scale;
+
+		return bytes_used;
+	}
+
+	return -1;
+}
+
+// Decoding uses two-level lookup tables for the AC Huffman codes. The first
+// level is indexed by the next 11 bits of the bitstream, which is enough to
+// match all codes apart from the longest ones, all starting with 7 zeroes; the
+// second level is indexed by the 10 bits following the zeroes.
+#define AC_LOOKUP_BITS      11
+#define AC_LONG_LOOKUP_BITS 10
+#define AC_MAX_CODE_BITS    (7 + AC_LONG_LOOKUP_BITS)
+#define DC_LOOKUP_BITS      8
+
+enum {
+	AC_LOOKUP_EOB    = 1 << 24,
+	AC_LOOKUP_ESCAPE = 1 << 25,
+	AC_LOOKUP_LONG   = 1 << 26
+};
+
+#define AC_LOOKUP_ENTRY(bits, hword) (((bits) << 16) | (hword))
+#define DC_LOOKUP_ENTRY(bits, value_bits) ((bits) | ((value_bits) << 4))
+
+struct psx_mdec_decoder {
+	psx_mdec_settings_t settings;
+	uint32_t ac_lookup[1 << AC_LOOKUP_BITS];
+	uint32_t ac_long_lookup[1 << AC_LONG_LOOKUP_BITS];
+	uint8_t dc_lookup[2][1 << DC_LOOKUP_BITS];
+	void (*inverse_dct_block)(int16_t *block);
+
+	const uint8_t *input;
+	int input_length;
+	int input_offset;
+	uint32_t bits_value;
+	int bits_left;
+	int block_type;
+	int16_t last_dc_values[3];
+};
+
+static void init_ac_lookup_tables(psx_mdec_decoder_t *decoder) {
+	memset(decoder->ac_lookup, 0, sizeof(decoder->ac_lookup));
+	memset(decoder->ac_long_lookup, 0, sizeof(decoder->ac_long_lookup));
+
+	for (int i = 0; i < (1 << AC_LOOKUP_BITS); i++) {
+		if ((i >> (AC_LOOKUP_BITS - 2)) == 0x2)
+			decoder->ac_lookup[i] = AC_LOOKUP_EOB | AC_LOOKUP_ENTRY(2, 0);
+		else if ((i >> (AC_LOOKUP_BITS - 6)) == 0x1)
+			decoder->ac_lookup[i] = AC_LOOKUP_ESCAPE | AC_LOOKUP_ENTRY(6, 0);
+		else if ((i >> (AC_LOOKUP_BITS - 7)) == 0x0)
+			decoder->ac_lookup[i] = AC_LOOKUP_LONG;
+	}
+
+	int ac_tree_item_count = sizeof(ac_huffman_tree) / sizeof(ac_huffman_tree[0]);
+
+	for (int i = 0; i < ac_tree_item_count; i++) {
+		int bits = ac_huffman_tree[i].c_bits + 1;
+		uint32_t base_value = ac_huffman_tree[i].c_value << 1;
+
+		for (int sign = 0; sign < 2; sign++) {
+			uint16_t hword = sign ? ac_huffman_tree[i].u_hword_neg : ac_huffman_tree[i].u_hword_pos;
+			uint32_t entry = AC_LOOKUP_ENTRY(bits, hword);
+
+			if (bits <= AC_LOOKUP_BITS) {
+				int first = (base_value | sign) << (AC_LOOKUP_BITS - bits);
+
+				for (int j = 0; j < (1 << (AC_LOOKUP_BITS - bits)); j++)
+					decoder->ac_lookup[first + j] = entry;
+			} else {
+				int first = ((base_value | sign) << (AC_MAX_CODE_BITS - bits)) & ((1 << AC_LONG_LOOKUP_BITS) - 1);
+
+				for (int j = 0; j < (1 << (AC_MAX_CODE_BITS - bits)); j++)
+					decoder->ac_long_lookup[first + j] = entry;
+			}
+		}
+	}
+}
+
+static void init_dc_lookup_tables(psx_mdec_decoder_t *decoder) {
+	memset(decoder->dc_lookup, 0, sizeof(decoder->dc_lookup));
+
+	// Zero deltas are encoded with no additional value bits.
+	for (int i = 0; i < (1 << (DC_LOOKUP_BITS - 2)); i++)
+		decoder->dc_lookup[0][i] = DC_LOOKUP_ENTRY(2, 0);
+	for (int i = 0; i < (1 << (DC_LOOKUP_BITS - 3)); i++)
+		decoder->dc_lookup[1][(0x4 << (DC_LOOKUP_BITS - 3)) | i] = DC_LOOKUP_ENTRY(3, 0);
+
+	int dc_c_tree_item_count = sizeof(dc_c_huffman_tree) / sizeof(dc_c_huffman_tree[0]);
+	int dc_y_tree_item_count = sizeof(dc_y_huffman_tree) / sizeof(dc_y_huffman_tree[0]);
+
+	for (int i = 0; i < dc_c_tree_item_count; i++) {
+		int bits = dc_c_huffman_tree[i].c_bits;
+		int first = dc_c_huffman_tree[i].c_value << (DC_LOOKUP_BITS - bits);
+
+		for (int j = 0; j < (1 << (DC_LOOKUP_BITS - bits)); j++)
+			decoder->dc_lookup[0][first + j] = DC_LOOKUP_ENTRY(bits, dc_c_huffman_tree[i].dc_bits + 1);
+	}
+	for (int i = 0; i < dc_y_tree_item_count; i++) {
+		int bits = dc_y_huffman_tree[i].c_bits;
+		int first = dc_y_huffman_tree[i].c_value << (DC_LOOKUP_BITS - bits);
+
+		for (int j = 0; j < (1 << (DC_LOOKUP_BITS - bits)); j++)
+			decoder->dc_lookup[1][first + j] = DC_LOOKUP_ENTRY(bits, dc_y_huffman_tree[i].dc_bits + 1);
+	}
+}
+
+static void refill_bits(psx_mdec_decoder_t *decoder) {
+	while (decoder->bits_left <= 16) {
+		uint32_t hword = 0;
+
+		// Reading past the end of the frame yields zeroes; the caller checks
+		// whether any of them were actually consumed.
+		if ((decoder->input_offset + 2) <= decoder->input_length) {
+			hword = decoder->input[decoder->input_offset];
+			hword |= decoder->input[decoder->input_offset + 1] << 8;
+		}
+
+		decoder->bits_value = (decoder->bits_value << 16) | hword;
+		decoder->bits_left += 16;
+		decoder->input_offset += 2;
+	}
+}
+
+static inline uint32_t peek_bits(psx_mdec_decoder_t *decoder, int bits) {
+	if (decoder->bits_left <= 16)
+		refill_bits(decoder);
+
+	return (decoder->bits_value >> (decoder->bits_left - bits)) & ((1 << bits) - 1);
+}
+
+static inline uint32_t read_bits(psx_mdec_decoder_t *decoder, int bits) {
+	uint32_t value = peek_bits(decoder, bits);
+
+	decoder->bits_left -= bits;
+	return value;
+}
+
+static inline int sign_extend_coeff(uint32_t value) {
+	return (int)((value & 0x3FF) ^ 0x200) - 0x200;
+}
+
+// Dequantized coefficients are clamped to 11 bits like the MDEC does.
+static inline int16_t clamp_dequant(int value) {
+	if (value < -0x400)
+		return -0x400;
+	if (value > +0x3FF)
+		return +0x3FF;
+
+	return (int16_t)value;
+}
+
+static bool decode_dct_block(psx_mdec_decoder_t *decoder, int quant_scale, int16_t *block) {
+	memset(block, 0, sizeof(int16_t) * 8*8);
+
+	int dc;
+
+	if (decoder->settings.version == PSX_MDEC_BS_V2) {
+		dc = sign_extend_coeff(read_bits(decoder, 10));
+	} else {
+		int index = decoder->block_type;
+
+		if (index > INDEX_Y)
+			index = INDEX_Y;
+
+		uint8_t entry = decoder->dc_lookup[index == INDEX_Y][peek_bits(decoder, DC_LOOKUP_BITS)];
+		int value_bits = entry >> 4;
+
+		if (!entry)
+			return false;
+
+		decoder->bits_left -= entry & 0xF;
+		int delta = 0;
+
+		if (value_bits) {
+			delta = read_bits(decoder, value_bits);
+
+			// The MSB of the value is cleared for negative deltas.
+			if (!(delta >> (value_bits - 1)))
+				delta -= (1 << value_bits) - 1;
+		}
+
+		dc = decoder->last_dc_values[index] + delta * 4;
+
+		// See encode_dct_block() for details on DC wrapping.
+		if (decoder->settings.version == PSX_MDEC_BS_V3DC)
+			dc = sign_extend_coeff(dc);
+
+		decoder->last_dc_values[index] = dc;
+	}
+
+	// The DC coefficient's quantization scale is always 8, which cancels out
+	// with the division by 8 applied to AC coefficients.
+	block[0] = clamp_dequant(dc * quant_dec[0]);
+
+	for (int i = 1;;) {
+		uint32_t code = peek_bits(decoder, AC_MAX_CODE_BITS);
+		uint32_t entry = decoder->ac_lookup[code >> (AC_MAX_CODE_BITS - AC_LOOKUP_BITS)];
+
+		if (entry & AC_LOOKUP_LONG)
+			entry = decoder->ac_long_lookup[code & ((1 << AC_LONG_LOOKUP_BITS) - 1)];
+		if (!entry)
+			return false;
+
+		decoder->bits_left -= (entry >> 16) & 0xFF;
+
+		if (entry & AC_LOOKUP_EOB)
+			break;
+
+		// Escape codes are followed by a raw 16-bit value.
+		uint32_t hword = (entry & AC_LOOKUP_ESCAPE) ? read_bits(decoder, 16) : (entry & 0xFFFF);
+		i += hword >> 10;
+
+		if (i > 63)
+			return false;
+
+		int ri = dct_zagzig_table[i++];
+		int ac = sign_extend_coeff(hword) * quant_dec[ri] * quant_scale;
+
+		block[ri] = clamp_dequant(DIVIDE_ROUNDED(ac, 8));
+	}
+
+	decoder->block_type++;
+	decoder->block_type %= 6;
+
+	return ((decoder->input_offset - decoder->input_length) * 8) <= decoder->bits_left;
+}
+
+// Integer inverse DCT based on the "islow" algorithm from the IJG JPEG library.
+// The output is level shifted but not clamped.
+#define IDCT_CONST_BITS 13
+#define IDCT_PASS1_BITS 2
+
+static void inverse_dct_pass(int *data, int stride, int step, int shift) {
+	for (int i = 0; i < 8; i++, data += step) {
+		// Even part
+		int z2 = data[2*stride];
+		int z3 = data[6*stride];
+
+		int z1 = (z2 + z3) * FIX_0_541196100;
+		int tmp2 = z1 - z3 * FIX_1_847759065;
+		int tmp3 = z1 + z2 * FIX_0_765366865;
+
+		z2 = data[0*stride];
+		z3 = data[4*stride];
+
+		int tmp0 = (z2 + z3) * (1 << IDCT_CONST_BITS);
+		int tmp1 = (z2 - z3) * (1 << IDCT_CONST_BITS);
+
+		int tmp10 = tmp0 + tmp3;
+		int tmp13 = tmp0 - tmp3;
+		int tmp11 = tmp1 + tmp2;
+		int tmp12 = tmp1 - tmp2;
+
+		// Odd part
+		tmp0 = data[7*stride];
+		tmp1 = data[5*stride];
+		tmp2 = data[3*stride];
+		tmp3 = data[1*stride];
+
+		z1 = tmp0 + tmp3;
+		z2 = tmp1 + tmp2;
+		z3 = tmp0 + tmp2;
+		int z4 = tmp1 + tmp3;
+		int z5 = (z3 + z4) * FIX_1_175875602;
+
+		tmp0 *= FIX_0_298631336;
+		tmp1 *= FIX_2_053119869;
+		tmp2 *= FIX_3_072711026;
+		tmp3 *= FIX_1_501321110;
+		z1 *= -FIX_0_899976223;
+		z2 *= -FIX_2_562915447;
+		z3 = z3 * -FIX_1_961570560 + z5;
+		z4 = z4 * -FIX_0_390180644 + z5;
+
+		tmp0 += z1 + z3;
+		tmp1 += z2 + z4;
+		tmp2 += z2 + z3;
+		tmp3 += z1 + z4;
+
+		data[0*stride] = FDCT_DESCALE(tmp10 + tmp3, shift);
+		data[7*stride] = FDCT_DESCALE(tmp10 - tmp3, shift);
+		data[1*stride] = FDCT_DESCALE(tmp11 + tmp2, shift);
+		data[6*stride] = FDCT_DESCALE(tmp11 - tmp2, shift);
+		data[2*stride] = FDCT_DESCALE(tmp12 + tmp1, shift);
+		data[5*stride] = FDCT_DESCALE(tmp12 - tmp1, shift);
+		data[3*stride] = FDCT_DESCALE(tmp13 + tmp0, shift);
+		data[4*stride] = FDCT_DESCALE(tmp13 - tmp0, shift);
+	}
+}
+
+static void inverse_dct_block(int16_t *block) {
+	int data[8*8];
+
+	for (int i = 0; i < 64; i++)
+		data[i] = block[i];
+
+	// Columns are processed first, leaving the results scaled up by
+	// 2^IDCT_PASS1_BITS for extra precision, then rows.
+	inverse_dct_pass(data, 8, 1, IDCT_CONST_BITS - IDCT_PASS1_BITS);
+	inverse_dct_pass(data, 1, 8, IDCT_CONST_BITS + IDCT_PASS1_BITS + 3);
+
+	for (int i = 0; i < 64; i++)
+		block[i] = (int16_t)data[i];
+}
+
+#ifdef HAVE_X86_DISPATCH
+static inline AVX2_FUNC __m256i avx2_idct_descale(__m256i x, int shift) {
+	x = _mm256_add_epi32(x, _mm256_set1_epi32(1 << (shift - 1)));
+
+	return _mm256_sra_epi32(x, _mm_cvtsi32_si128(shift));
+}
+
+static inline AVX2_FUNC void inverse_dct_pass_avx2(__m256i *data, int shift) {
+	// Even part
+	__m256i z1 = avx2_mul(_mm256_add_epi32(data[2], data[6]), FIX_0_541196100);
+	__m256i tmp2 = _mm256_sub_epi32(z1, avx2_mul(data[6], FIX_1_847759065));
+	__m256i tmp3 = _mm256_add_epi32(z1, avx2_mul(data[2], FIX_0_765366865));
+
+	__m256i tmp0 = _mm256_slli_epi32(_mm256_add_epi32(data[0], data[4]), IDCT_CONST_BITS);
+	__m256i tmp1 = _mm256_slli_epi32(_mm256_sub_epi32(data[0], data[4]), IDCT_CONST_BITS);
+
+	__m256i tmp10 = _mm256_add_epi32(tmp0, tmp3);
+	__m256i tmp13 = _mm256_sub_epi32(tmp0, tmp3);
+	__m256i tmp11 = _mm256_add_epi32(tmp1, tmp2);
+	__m256i tmp12 = _mm256_sub_epi32(tmp1, tmp2);
+
+	// Odd part
+	tmp0 = data[7];
+	tmp1 = data[5];
+	tmp2 = data[3];
+	tmp3 = data[1];
+
+	z1 = _mm256_add_epi32(tmp0, tmp3);
+	__m256i z2 = _mm256_add_epi32(tmp1, tmp2);
+	__m256i z3 = _mm256_add_epi32(tmp0, tmp2);
+	__m256i z4 = _mm256_add_epi32(tmp1, tmp3);
+	__m256i z5 = avx2_mul(_mm256_add_epi32(z3, z4), FIX_1_175875602);
+
+	tmp0 = avx2_mul(tmp0, FIX_0_298631336);
+	tmp1 = avx2_mul(tmp1, FIX_2_053119869);
+	tmp2 = avx2_mul(tmp2, FIX_3_072711026);
+	tmp3 = avx2_mul(tmp3, FIX_1_501321110);
+	z1 = avx2_mul(z1, -FIX_0_899976223);
+	z2 = avx2_mul(z2, -FIX_2_562915447);
+	z3 = _mm256_add_epi32(avx2_mul(z3, -FIX_1_961570560), z5);
+	z4 = _mm256_add_epi32(avx2_mul(z4, -FIX_0_390180644), z5);
+
+	tmp0 = _mm256_add_epi32(tmp0, _mm256_add_epi32(z1, z3));
+	tmp1 = _mm256_add_epi32(tmp1, _mm256_add_epi32(z2, z4));
+	tmp2 = _mm256_add_epi32(tmp2, _mm256_add_epi32(z2, z3));
+	tmp3 = _mm256_add_epi32(tmp3, _mm256_add_epi32(z1, z4));
+
+	data[0] = avx2_idct_descale(_mm256_add_epi32(tmp10, tmp3), shift);
+	data[7] = avx2_idct_descale(_mm256_sub_epi32(tmp10, tmp3), shift);
+	data[1] = avx2_idct_descale(_mm256_add_epi32(tmp11, tmp2), shift);
+	data[6] = avx2_idct_descale(_mm256_sub_epi32(tmp11, tmp2), shift);
+	data[2] = avx2_idct_descale(_mm256_add_epi32(tmp12, tmp1), shift);
+	data[5] = avx2_idct_descale(_mm256_sub_epi32(tmp12, tmp1), shift);
+	data[3] = avx2_idct_descale(_mm256_add_epi32(tmp13, tmp0), shift);
+	data[4] = avx2_idct_descale(_mm256_sub_epi32(tmp13, tmp0), shift);
+}
+
+// AVX2 version of inverse_dct_block(), producing bit-identical results. The
+// column pass operates on rows directly, while the row pass is sandwiched
+// between two transpositions.
+static AVX2_FUNC void inverse_dct_block_avx2(int16_t *block) {
+	__m256i data[8];
+
+	for (int i = 0; i < 8; i++)
+		data[i] = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)&block[i * 8]));
+
+	inverse_dct_pass_avx2(data, IDCT_CONST_BITS - IDCT_PASS1_BITS);
+	avx2_transpose(data);
+	inverse_dct_pass_avx2(data, IDCT_CONST_BITS + IDCT_PASS1_BITS + 3);
+	avx2_transpose(data);
+
+	for (int i = 0; i < 8; i++) {
+		// Emulate the int16_t cast.
+		__m256i row = _mm256_srai_epi32(_mm256_slli_epi32(data[i], 16), 16);
+
+		_mm_storeu_si128((__m128i *)&block[i * 8], _mm_packs_epi32(
+			_mm256_castsi256_si128(row),
+			_mm256_extracti128_si256(row, 1)
+		));
+	}
+}
+#endif
+
+static void store_block(const int16_t *block, uint8_t *output, int pitch, int step) {
+	for (int y = 0; y < 8; y++) {
+		for (int x = 0; x < 8; x++) {
+			int value = block[y*8 + x] + 128;
+
+			if (value < 0)
+				value = 0;
+			if (value > 255)
+				value = 255;
+
+			output[y*pitch + x*step] = (uint8_t)value;
+		}
+	}
+}
+
+// Returns a pointer to the top left pixel of the given block of a macroblock.
+// Blocks are in the order they are stored in the bitstream:
+//   Cr Cb [Y1|Y2]
+//         [Y3|Y4]
+static uint8_t *get_block_output(psx_mdec_settings_t settings, uint8_t *frame, int fx, int fy, int index) {
+	int pitch = settings.width;
+	uint8_t *y_plane = frame;
+	uint8_t *c_plane = y_plane + (settings.width * settings.height);
+
+	switch (index) {
+		case 0:
+			return c_plane + pitch*(fy*8) + 2*(fx*8) + 0;
+		case 1:
+			return c_plane + pitch*(fy*8) + 2*(fx*8) + 1;
+		default:
+			index -= 2;
+			return y_plane + pitch*(fy*16 + (index / 2)*8) + (fx*16 + (index % 2)*8);
+	}
+}
+
+int psx_mdec_get_decoder_workspace_size(void) {
+	return sizeof(psx_mdec_decoder_t);
+}
+
+psx_mdec_decoder_t *psx_mdec_init_decoder(psx_mdec_settings_t settings, void *workspace) {
+	if (
+		settings.width <= 0 ||
+		settings.height <= 0 ||
+		(settings.width % 16) ||
+		(settings.height % 16)
+	)
+		return NULL;
+
+	psx_mdec_decoder_t *decoder = (psx_mdec_decoder_t *)workspace;
+	decoder->settings = settings;
+	decoder->inverse_dct_block = &inverse_dct_block;
+
+#ifdef HAVE_X86_DISPATCH
+	if (psx_cpu_get_level() >= PSX_CPU_LEVEL_AVX2)
+		decoder->inverse_dct_block = &inverse_dct_block_avx2;
+#endif
+
+	decoder->input = NULL;
+	decoder->input_length = 0;
+	decoder->input_offset = 0;
+
+	init_ac_lookup_tables(decoder);
+	init_dc_lookup_tables(decoder);
+	return decoder;
+}
+
+// Decodes all macroblocks of a frame, or only parses them if no output frame
+// is given. In the latter case the bitstream must also be terminated by an
+// end-of-frame code right after the last macroblock, which is what allows
+// frames encoded at a different resolution to be detected.
+static bool decode_frame_blocks(psx_mdec_decoder_t *decoder, const uint8_t *input, int length, uint8_t *frame) {
+	if (length < 8)
+		return false;
+
+	int quant_scale = input[0x004] | (input[0x005] << 8);
+	int version = input[0x006];
+
+	if (quant_scale < 1 || quant_scale >= 64)
+		return false;
+	if (version != ((decoder->settings.version == PSX_MDEC_BS_V2) ? 0x02 : 0x03))
+		return false;
+
+	int dct_block_count_x = decoder->settings.width / 16;
+	int dct_block_count_y = decoder->settings.height / 16;
+
+	decoder->input = input;
+	decoder->input_length = length;
+	decoder->input_offset = 8;
+	decoder->bits_value = 0;
+	decoder->bits_left = 0;
+	decoder->block_type = 0;
+	decoder->last_dc_values[INDEX_CR] = 0;
+	decoder->last_dc_values[INDEX_CB] = 0;
+	decoder->last_dc_values[INDEX_Y] = 0;
+
+	bool ok = true;
+	for (int fx = 0; ok && (fx < dct_block_count_x); fx++) {
+		for (int fy = 0; ok && (fy < dct_block_count_y); fy++) {
+			int16_t block[8*8];
+
+			for (int i = 0; ok && (i < 6); i++) {
+				ok = decode_dct_block(decoder, quant_scale, block);
+
+				if (ok && frame != NULL) {
+					decoder->inverse_dct_block(block);
+					store_block(block, get_block_output(decoder->settings, frame, fx, fy, i), decoder->settings.width, (i < 2) ? 2 : 1);
+				}
+			}
+		}
+	}
+
+	if (ok && frame == NULL) {
+		uint32_t end_of_block = (decoder->settings.version == PSX_MDEC_BS_V2) ? 0x1FF : 0x3FF;
+
+		ok = (read_bits(decoder, 10) == end_of_block) &&
+			(((decoder->input_offset - decoder->input_length) * 8) <= decoder->bits_left);
+	}
+
+	decoder->input = NULL;
+	return ok;
+}
+
+bool psx_mdec_decode_frame(psx_mdec_decoder_t *decoder, const uint8_t *input, int length, uint8_t *frame) {
+	return decode_frame_blocks(decoder, input, length, frame);
+}
+
+bool psx_mdec_check_frame(psx_mdec_decoder_t *decoder, const uint8_t *input, int length) {
+	return decode_frame_blocks(decoder, input, length, NULL);
+}
+
+static inline uint8_t clamp_rgb(int value) {
+	if (value < 0)
+		return 0;
+	if (value > 255)
+		return 255;
+
+	return (uint8_t)value;
+}
+
+void psx_mdec_convert_frame_rgb(psx_mdec_settings_t settings, const uint8_t *frame, uint8_t *output) {
+	int pitch = settings.width;
+	const uint8_t *y_plane = frame;
+	const uint8_t *c_plane = y_plane + (settings.width * settings.height);
+
+	// The MDEC uses the same full-range BT.601 coefficients as JFIF, with
+	// nearest neighbor chroma upsampling. Coefficients are in 16.16 format.
+	for (int y = 0; y < settings.height; y++) {
+		const uint8_t *y_row = y_plane + pitch * y;
+		const uint8_t *c_row = c_plane + pitch * (y / 2);
+
+		for (int x = 0; x < settings.width; x++, output += 3) {
+			int luma = y_row[x] << 16;
+			int cr = c_row[(x & ~1) + 0] - 128;
+			int cb = c_row[(x & ~1) + 1] - 128;
+
+			output[0] = clamp_rgb((luma + 91881 * cr + 0x8000) >> 16);
+			output[1] = clamp_rgb((luma - 22554 * cb - 46802 * cr + 0x8000) >> 16);
+			output[2] = clamp_rgb((luma + 116130 * cb + 0x8000) >> 16);
+		}
+	}
+}
@@ -0,0 +1,306 @@
+/*
+libpsxav: MDEC video + SPU/XA-ADPCM audio library
+
+Copyright (c) 2019, 2020 Adrian "asie" Siekierka
+Copyright (c) 2019 Ben "GreaseMonkey" Russell
+Copyright (c) 2023 spicyjpeg
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "libpsxav.h"
+
+// The most recently encoded sector or block is always held back until either
+// more samples are pushed or the stream is finalized, as its flags may still
+// have to be updated to mark the end of the stream. A few slots are also kept
+// free while pushing, so that finalizing never requires pulling data first.
+#define XA_STREAM_FINALIZE_SLOTS  1
+#define SPU_STREAM_FINALIZE_SLOTS 2
+
+struct psx_audio_xa_stream {
+	psx_audio_xa_settings_t settings;
+	psx_audio_encoder_state_t state;
+	int lba;
+	bool finalized;
+
+	int16_t samples[PSX_AUDIO_XA_MAX_SAMPLES_PER_SECTOR];
+	int sample_count; // per channel
+	uint8_t sectors[PSX_AUDIO_XA_STREAM_SECTORS][PSX_CDROM_SECTOR_SIZE];
+	int sector_offset;
+	int sector_count;
+};
+
+struct psx_audio_spu_stream {
+	psx_audio_encoder_channel_state_t state;
+	int loop_start; // in samples, -1 = none
+	bool loop;
+	bool finalized;
+
+	int16_t samples[PSX_AUDIO_SPU_SAMPLES_PER_BLOCK];
+	int sample_count;
+	uint8_t blocks[PSX_AUDIO_SPU_STREAM_BLOCKS][PSX_AUDIO_SPU_BLOCK_SIZE];
+	int block_offset;
+	int block_count;
+	int block_index;
+};
+
+// XA-ADPCM streams
+
+static int get_xa_channel_count(const psx_audio_xa_stream_t *stream) {
+	return stream->settings.stereo ? 2 : 1;
+}
+
+static uint8_t *get_xa_stream_slot(psx_audio_xa_stream_t *stream, int index) {
+	return stream->sectors[(stream->sector_offset + index) % PSX_AUDIO_XA_STREAM_SECTORS];
+}
+
+static void encode_xa_stream_sector(psx_audio_xa_stream_t *stream, const int16_t *samples, int sample_count) {
+	uint8_t *sector = get_xa_stream_slot(stream, stream->sector_count);
+
+	psx_audio_xa_encode(stream->settings, &(stream->state), samples, sample_count, stream->lba, sector);
+	stream->sector_count++;
+	stream->lba++;
+}
+
+// Encodes the sector currently being buffered once it is complete, if there is
+// room for it.
+static void flush_xa_stream(psx_audio_xa_stream_t *stream, int reserved_slots) {
+	int samples_per_sector = psx_audio_xa_get_samples_per_sector(stream->settings);
+
+	if (stream->sample_count < samples_per_sector)
+		return;
+	if (stream->sector_count >= (PSX_AUDIO_XA_STREAM_SECTORS - reserved_slots))
+		return;
+
+	encode_xa_stream_sector(stream, stream->samples, stream->sample_count);
+	stream->sample_count = 0;
+}
+
+int psx_audio_xa_stream_get_workspace_size(void) {
+	return sizeof(psx_audio_xa_stream_t);
+}
+
+psx_audio_xa_stream_t *psx_audio_xa_stream_init(psx_audio_xa_settings_t settings, int lba, void *workspace) {
+	psx_audio_xa_stream_t *stream = (psx_audio_xa_stream_t *)workspace;
+
+	memset(stream, 0, sizeof(psx_audio_xa_stream_t));
+	stream->settings = settings;
+	stream->lba = lba;
+	return stream;
+}
+
+int psx_audio_xa_stream_push(psx_audio_xa_stream_t *stream, const int16_t *samples, int sample_count) {
+	assert(!stream->finalized);
+
+	int channels = get_xa_channel_count(stream);
+	int samples_per_sector = psx_audio_xa_get_samples_per_sector(stream->settings);
+	int max_sectors = PSX_AUDIO_XA_STREAM_SECTORS - XA_STREAM_FINALIZE_SLOTS;
+	int pushed = 0;
+
+	flush_xa_stream(stream, XA_STREAM_FINALIZE_SLOTS);
+
+	while (pushed < sample_count && stream->sample_count < samples_per_sector) {
+		int remaining = sample_count - pushed;
+
+		// Whole sectors are encoded straight from the caller's buffer whenever
+		// no partial sector is being buffered.
+		if (stream->sample_count == 0 && remaining >= samples_per_sector) {
+			if (stream->sector_count >= max_sectors)
+				break;
+
+			encode_xa_stream_sector(stream, samples + pushed * channels, samples_per_sector);
+			pushed += samples_per_sector;
+			continue;
+		}
+
+		int length = samples_per_sector - stream->sample_count;
+
+		if (length > remaining)
+			length = remaining;
+
+		memcpy(
+			stream->samples + stream->sample_count * channels,
+			samples + pushed * channels,
+			length * channels * sizeof(int16_t)
+		);
+		stream->sample_count += length;
+		pushed += length;
+
+		flush_xa_stream(stream, XA_STREAM_FINALIZE_SLOTS);
+	}
+
+	return pushed;
+}
+
+void psx_audio_xa_stream_finalize(psx_audio_xa_stream_t *stream) {
+	if (stream->finalized)
+		return;
+
+	flush_xa_stream(stream, 0);
+
+	// Any leftover samples are padded with silence to fill the last sector.
+	if (stream->sample_count) {
+		encode_xa_stream_sector(stream, stream->samples, stream->sample_count);
+		stream->sample_count = 0;
+	}
+	if (stream->sector_count) {
+		psx_audio_xa_encode_finalize(
+			stream->settings,
+			get_xa_stream_slot(stream, stream->sector_count - 1),
+			psx_audio_xa_get_buffer_size_per_sector(stream->settings)
+		);
+	}
+
+	stream->finalized = true;
+}
+
+int psx_audio_xa_stream_pull(psx_audio_xa_stream_t *stream, uint8_t *output) {
+	if (stream->sector_count < (stream->finalized ? 1 : 2))
+		return 0;
+
+	int length = psx_audio_xa_get_buffer_size_per_sector(stream->settings);
+
+	memcpy(output, get_xa_stream_slot(stream, 0), length);
+	stream->sector_offset = (stream->sector_offset + 1) % PSX_AUDIO_XA_STREAM_SECTORS;
+	stream->sector_count--;
+
+	if (!stream->finalized)
+		flush_xa_stream(stream, XA_STREAM_FINALIZE_SLOTS);
+
+	return length;
+}
+
+// SPU-ADPCM streams
+
+static uint8_t *get_spu_stream_slot(psx_audio_spu_stream_t *stream, int index) {
+	return stream->blocks[(stream->block_offset + index) % PSX_AUDIO_SPU_STREAM_BLOCKS];
+}
+
+static void encode_spu_stream_block(psx_audio_spu_stream_t *stream, const int16_t *samples, int sample_count) {
+	uint8_t *block = get_spu_stream_slot(stream, stream->block_count);
+
+	psx_audio_spu_encode(&(stream->state), samples, sample_count, 1, block);
+
+	if (stream->loop_start >= 0 && stream->block_index == (stream->loop_start / PSX_AUDIO_SPU_SAMPLES_PER_BLOCK))
+		block[1] |= PSX_AUDIO_SPU_LOOP_START;
+
+	stream->block_count++;
+	stream->block_index++;
+}
+
+static void flush_spu_stream(psx_audio_spu_stream_t *stream, int reserved_slots) {
+	if (stream->sample_count < PSX_AUDIO_SPU_SAMPLES_PER_BLOCK)
+		return;
+	if (stream->block_count >= (PSX_AUDIO_SPU_STREAM_BLOCKS - reserved_slots))
+		return;
+
+	encode_spu_stream_block(stream, stream->samples, stream->sample_count);
+	stream->sample_count = 0;
+}
+
+int psx_audio_spu_stream_get_workspace_size(void) {
+	return sizeof(psx_audio_spu_stream_t);
+}
+
+psx_audio_spu_stream_t *psx_audio_spu_stream_init(int loop_start, bool loop, void *workspace) {
+	psx_audio_spu_stream_t *stream = (psx_audio_spu_stream_t *)workspace;
+
+	memset(stream, 0, sizeof(psx_audio_spu_stream_t));
+	stream->loop_start = loop_start;
+	stream->loop = loop;
+	return stream;
+}
+
+int psx_audio_spu_stream_push(psx_audio_spu_stream_t *stream, const int16_t *samples, int sample_count) {
+	assert(!stream->finalized);
+
+	int max_blocks = PSX_AUDIO_SPU_STREAM_BLOCKS - SPU_STREAM_FINALIZE_SLOTS;
+	int pushed = 0;
+
+	flush_spu_stream(stream, SPU_STREAM_FINALIZE_SLOTS);
+
+	while (pushed < sample_count && stream->sample_count < PSX_AUDIO_SPU_SAMPLES_PER_BLOCK) {
+		int remaining = sample_count - pushed;
+
+		if (stream->sample_count == 0 && remaining >= PSX_AUDIO_SPU_SAMPLES_PER_BLOCK) {
+			if (stream->block_count >= max_blocks)
+				break;
+
+			encode_spu_stream_block(stream, samples + pushed, PSX_AUDIO_SPU_SAMPLES_PER_BLOCK);
+			pushed += PSX_AUDIO_SPU_SAMPLES_PER_BLOCK;
+			continue;
+		}
+
+		int length = PSX_AUDIO_SPU_SAMPLES_PER_BLOCK - stream->sample_count;
+
+		if (length > remaining)
+			length = remaining;
+
+		memcpy(stream->samples + stream->sample_count, samples + pushed, length * sizeof(int16_t));
+		stream->sample_count += length;
+		pushed += length;
+
+		flush_spu_stream(stream, SPU_STREAM_FINALIZE_SLOTS);
+	}
+
+	return pushed;
+}
+
+void psx_audio_spu_stream_finalize(psx_audio_spu_stream_t *stream) {
+	if (stream->finalized)
+		return;
+
+	flush_spu_stream(stream, 0);
+
+	if (stream->sample_count) {
+		encode_spu_stream_block(stream, stream->samples, stream->sample_count);
+		stream->sample_count = 0;
+	}
+
+	if (stream->loop) {
+		// Make the last block jump back to the loop start point.
+		if (stream->block_count)
+			get_spu_stream_slot(stream, stream->block_count - 1)[1] |= PSX_AUDIO_SPU_LOOP_REPEAT;
+	} else {
+		// Insert trailing looping block
+		uint8_t *block = get_spu_stream_slot(stream, stream->block_count);
+
+		memset(block, 0, PSX_AUDIO_SPU_BLOCK_SIZE);
+		block[1] = PSX_AUDIO_SPU_LOOP_TRAP;
+		stream->block_count++;
+	}
+
+	stream->finalized = true;
+}
+
+int psx_audio_spu_stream_pull(psx_audio_spu_stream_t *stream, uint8_t *output) {
+	if (stream->block_count < (stream->finalized ? 1 : 2))
+		return 0;
+
+	memcpy(output, get_spu_stream_slot(stream, 0), PSX_AUDIO_SPU_BLOCK_SIZE);
+	stream->block_offset = (stream->block_offset + 1) % PSX_AUDIO_SPU_STREAM_BLOCKS;
+	stream->block_count--;
+
+	if (!stream->finalized)
+		flush_spu_stream(stream, SPU_STREAM_FINALIZE_SLOTS);
+
+	return PSX_AUDIO_SPU_BLOCK_SIZE;
+}
@@ -28,6 +28,7 @@ freely, subject to the following restrictions:
 #include <string.h>
 #include "args.h"
 #include "config.h"
+#include "libpsxav.h"
 
 #define INVALID_PARAM -1
 
@@ -125,11 +126,21 @@ static const char *const general_options_help =
 	"                        vagi:   [A.] .vag SPU-ADPCM interleaved\n"
 	"                        str:    [AV] .str video + XA-ADPCM, 2336-byte sectors\n"
 	"                        strcd:  [AV] .str video + XA-ADPCM, 2352-byte sectors\n"
-	//"                        strspu: [AV] .str video + SPU-ADPCM, 2048-byte sectors\n"
+	"                        strspu: [AV] .str video + SPU-ADPCM, 2048-byte sectors\n"
 	"                        strv:   [.V] .str video, 2048-byte sectors\n"
 	"                        sbs:    [.V] .sbs video\n"
 	"    -R key=value,...  Pass custom options to libswresample (see FFmpeg docs)\n"
 	"    -S key=value,...  Pass custom options to libswscale (see FFmpeg docs)\n"
+	"    -m                Convert input file (a previously encoded .xa, .str or .sbs file) to output format's sector size, or\n"
+	"                      between .str and .sbs, re-encoding only frames that do not fit\n"
+	"    -d                Decode input file (a previously encoded file in the given format) to .y4m video and/or .wav audio for\n"
+	"                      preview; audio is saved next to the output file, or discarded if video is written to stdout (-)\n"
+	"    -j threads        Encode video frames and convert sectors using up to specified number of threads\n"
+	"                      (default is number of CPU cores, split evenly between outputs)\n"
+	"    -B megabytes      Limit memory used to buffer decoded frames not yet consumed by all outputs (default 0 = unlimited)\n"
+	"    -o file           Save encoding statistics (time spent in each stage) as JSON to specified file (- for stdout)\n"
+	"    -O seconds        Also save statistics periodically while encoding, as JSON Lines (default 0 = disabled)\n"
+	"    -p file           Save a timeline of all threads' activity to specified file (in Chrome trace event format, shared by all outputs)\n"
 	"\n";
 
 static const char *const format_names[NUM_FORMATS] = {
@@ -177,6 +188,12 @@ static void init_default_args(args_t *args) {
 	args->str_cd_speed = 2;
 	args->str_video_id = 0x8001;
 	args->str_audio_id = 0x0001;
+	args->str_range_start = 0;
+	args->str_range_end = -1;
+	args->str_checkpoint_interval = 0;
+	args->str_mux_pattern = NULL;
+	args->str_mux_num = 1;
+	args->str_mux_den = 1;
 
 	if (args->format == FORMAT_SPU || args->format == FORMAT_VAG)
 		args->alignment = 64; // Default SPU DMA chunk size
@@ -230,6 +247,41 @@ static int parse_general_option(args_t *args, char option, const char *param) {
 			args->swscale_options = param;
 			return 2;
 
+		case 'm':
+			args->flags |= FLAG_TRANSMUX;
+			return 1;
+
+		case 'd':
+			args->flags |= FLAG_PREVIEW;
+			return 1;
+
+		case 'j':
+			return parse_int(&(args->thread_count), "thread count", param, 1, 64);
+
+		case 'B':
+			return parse_int(&(args->decoder_buffer_size), "decoder buffer size", param, 0, 4095);
+
+		case 'o':
+			if (param == NULL) {
+				fprintf(stderr, "Missing statistics file path after option\n");
+				return INVALID_PARAM;
+			}
+
+			args->stats_file = param;
+			return 2;
+
+		case 'O':
+			return parse_int(&(args->stats_interval), "statistics interval", param, 0, -1);
+
+		case 'p':
+			if (param == NULL) {
+				fprintf(stderr, "Missing trace file path after option\n");
+				return INVALID_PARAM;
+			}
+
+			args->trace_file = param;
+			return 2;
+
 		default:
 			return 0;
 	}
@@ -369,7 +421,7 @@ static int parse_spui_option(args_t *args, char option, const char *param) {
 
 static const char *const bs_options_help =
 	"Video options:\n"
-	"    [-v v2|v3|v3dc] [-s WxH] [-I]\n"
+	"    [-v v2|v3|v3dc] [-s WxH] [-I] [-E] [-H file [-P file]] [-M file] [-G file]\n"
 	"\n"
 	"    -v codec          Use specified video codec\n"
 	"                        v2:   MDEC BS v2 (default)\n"
@@ -377,6 +429,11 @@ static const char *const bs_options_help =
 	"                        v3dc: MDEC BS v3, expect decoder to wrap DC coefficients\n"
 	"    -s WxH            Rescale input file to fit within specified size (16x16-640x512 in 16-pixel increments, default 320x240)\n"
 	"    -I                Force stretching to given size without preserving aspect ratio\n"
+	"    -E                Scale 4:2:0 input using a bilinear filter in the same pass as encoding, rather than through libswscale\n"
+	"    -H file           Save hashes of all input frames to specified file, compare against any hashes already present in it\n"
+	"    -P file           Copy unchanged frames (according to -H) from specified previously encoded file rather than re-encoding them\n"
+	"    -M file           Remux frames from specified previously encoded file, only re-encoding frames that exceed the new size budget\n"
+	"    -G file           Save statistics for each encoded frame (quantization scale, size, encoding time) as CSV to specified file (- for stdout)\n"
 	"\n";
 
 const char *const bs_codec_names[NUM_BS_CODECS] = {
@@ -425,6 +482,45 @@ static int parse_bs_option(args_t *args, char option, const char *param) {
 			args->flags |= FLAG_BS_IGNORE_ASPECT;
 			return 1;
 
+		case 'E':
+			args->flags |= FLAG_BS_FUSED_SCALE;
+			return 1;
+
+		case 'H':
+			if (param == NULL) {
+				fprintf(stderr, "Missing hash list path after option\n");
+				return INVALID_PARAM;
+			}
+
+			args->video_hash_file = param;
+			return 2;
+
+		case 'P':
+		case 'M':
+			if (param == NULL) {
+				fprintf(stderr, "Missing previously encoded file path after option\n");
+				return INVALID_PARAM;
+			}
+			if (args->video_reuse_file != NULL) {
+				fprintf(stderr, "Only one previously encoded file can be specified\n");
+				return INVALID_PARAM;
+			}
+
+			if (option == 'M')
+				args->flags |= FLAG_BS_REMUX;
+
+			args->video_reuse_file = param;
+			return 2;
+
+		case 'G':
+			if (param == NULL) {
+				fprintf(stderr, "Missing frame statistics file path after option\n");
+				return INVALID_PARAM;
+			}
+
+			args->video_log_file = param;
+			return 2;
+
 		default:
 			return 0;
 	}
@@ -432,13 +528,19 @@ static int parse_bs_option(args_t *args, char option, const char *param) {
 
 static const char *const str_options_help =
 	".str container options:\n"
-	"    [-r num[/den]] [-x 1|2] [-T id] [-A id] [-X]\n"
+	"    [-r num[/den]] [-x 1|2] [-T id] [-A id] [-X] [-U pattern] [-z start-[end] | -J] [-K secs] [-Y]\n"
 	"\n"
 	"    -r num[/den]      Set video frame rate to specified integer or fraction (default 15)\n"
 	"    -x 1|2            Set CD-ROM speed the file is meant to played at (default 2)\n"
 	"    -T id             Tag video sectors with specified .str type ID (default 0x8001)\n"
 	"    -A id             Tag SPU-ADPCM sectors with specified .str type ID (default 0x0001)\n"
 	"    -X                Place audio sectors after corresponding video sectors rather than ahead of them\n"
+	"    -U pattern        Mux this and all following outputs with the same path into a single file, interleaving their\n"
+	"                      sectors according to specified comma-separated list of output indices (e.g. 0,1,0,2)\n"
+	"    -z start-[end]    Only output sectors in specified LBA range (end excluded), save boundary state to <out>.state\n"
+	"    -J                Stitch together parts previously encoded with -z (pass all parts in order, then output file)\n"
+	"    -K secs           Flush output file and save encoder state to <out>.state every given number of seconds\n"
+	"    -Y                Resume interrupted encoding from last state saved to <out>.state (all other options must match)\n"
 	"\n";
 
 static int parse_str_option(args_t *args, char option, const char *param) {
@@ -485,6 +587,55 @@ static int parse_str_option(args_t *args, char option, const char *param) {
 			args->flags |= FLAG_STR_TRAILING_AUDIO;
 			return 1;
 
+		case 'U':
+			if (param == NULL) {
+				fprintf(stderr, "Missing interleaving pattern after option\n");
+				return INVALID_PARAM;
+			}
+
+			args->str_mux_pattern = param;
+			return 2;
+
+		case 'z':
+			if (param == NULL) {
+				fprintf(stderr, "Missing sector range after option\n");
+				return INVALID_PARAM;
+			}
+
+			args->str_range_start = strtol(param, &next, 10);
+
+			if (!next || *next != '-') {
+				fprintf(stderr, "Invalid sector range (must be specified as <start>-[end])\n");
+				return INVALID_PARAM;
+			}
+
+			if (next[1])
+				args->str_range_end = strtol(next + 1, NULL, 10);
+			else
+				args->str_range_end = -1;
+
+			if (
+				args->str_range_start < 0 ||
+				(args->str_range_end >= 0 && args->str_range_end <= args->str_range_start)
+			) {
+				fprintf(stderr, "Invalid sector range: %s\n", param);
+				return INVALID_PARAM;
+			}
+
+			args->flags |= FLAG_STR_RANGE;
+			return 2;
+
+		case 'J':
+			args->flags |= FLAG_STR_STITCH;
+			return 1;
+
+		case 'K':
+			return parse_int(&(args->str_checkpoint_interval), "checkpoint interval", param, 1, -1);
+
+		case 'Y':
+			args->flags |= FLAG_STR_RESUME;
+			return 1;
+
 		default:
 			return 0;
 	}
@@ -513,9 +664,15 @@ static const char *const general_usage =
 	"    psxavenc -t spu|vag   [spu-options]                             <in> <out.vag>\n"
 	"    psxavenc -t spui|vagi [spui-options]                            <in> <out.vag>\n"
 	"    psxavenc -t str|strcd [xa-options]   [bs-options] [str-options] <in> <out.str>\n"
-	//"    psxavenc -t strspu    [spui-options] [bs-options] [str-options] <in> <out.str>\n"
+	"    psxavenc -t str|strcd|strv -J                                   <part.str...> <out.str>\n"
+	"    psxavenc -t xa|xacd|str|strcd|strv|sbs -d [options]             <in> <out.y4m|out.wav|->\n"
+	"    psxavenc -t strspu    [spui-options] [bs-options] [str-options] <in> <out.str>\n"
 	"    psxavenc -t strv                     [bs-options] [str-options] <in> <out.str>\n"
 	"    psxavenc -t sbs                      [bs-options] [sbs-options] <in> <out.sbs>\n"
+	"\n"
+	"Multiple output files can be generated from the same input file in a single\n"
+	"pass by appending further output specifications after the first one:\n"
+	"    psxavenc -t <format> [options] <in> <out> [-t <format> [options] [<in>] <out>...]\n"
 	"\n";
 
 static const struct {
@@ -680,13 +837,25 @@ static void print_help(format_t format) {
 		printf("%s", format_info[format].container_options_help);
 }
 
-bool parse_args(args_t *args, const char *const *options, int count) {
+int parse_args(args_t *args, const char *const *options, int count, const char *input_file) {
 	int arg_index = 0;
 
+	// Additional outputs are encoded from the same input file as the first
+	// one by default and may take only an output file path.
+	args->input_files = malloc((count + 1) * sizeof(const char *));
+
+	if (input_file != NULL)
+		args->input_files[args->input_file_count++] = input_file;
+
 	while (arg_index < count) {
 		const char *option = options[arg_index];
 
 		if (option[0] == '-' && option[2] == 0 && !(args->flags & FLAG_IGNORE_OPTIONS)) {
+			// A -t option following the output file path starts the
+			// specification of another output.
+			if (option[1] == 't' && args->input_file_count >= 2)
+				break;
+
 			const char *param;
 			if ((arg_index + 1) < count)
 				param = options[arg_index + 1];
@@ -695,30 +864,38 @@ bool parse_args(args_t *args, const char *const *options, int count) {
 
 			int parsed = parse_option(args, option[1], param);
 			if (parsed <= 0)
-				return false;
+				return 0;
 
 			arg_index += parsed;
 			continue;
 		}
 
-		if (args->input_file == NULL) {
-			args->input_file = option;
-		} else if (args->output_file == NULL) {
-			args->output_file = option;
-		} else {
-			fprintf(stderr, "There should be no arguments after the output file path\n");
-			return false;
-		}
+		args->input_files[args->input_file_count++] = option;
 		arg_index++;
 	}
 
+	// If an additional output specifies its own input file, it overrides the
+	// inherited one.
+	if (input_file != NULL && args->input_file_count == 3) {
+		args->input_file_count--;
+		memmove(args->input_files, args->input_files + 1, args->input_file_count * sizeof(const char *));
+	}
+
+	// The last path is always the output file.
+	if (args->input_file_count >= 2) {
+		args->input_file_count--;
+		args->input_file = args->input_files[0];
+		args->output_file = args->input_files[args->input_file_count];
+	}
+
 	if (args->flags & FLAG_PRINT_HELP) {
 		print_help(args->format);
-		return false;
+		return 0;
 	}
 	if (args->flags & FLAG_PRINT_VERSION) {
 		printf("psxavenc " VERSION "\n");
-		return false;
+		printf("DCT/IDCT kernels: %s\n", psx_cpu_get_level_name(psx_cpu_get_level()));
+		return 0;
 	}
 	if (args->format == FORMAT_INVALID || args->input_file == NULL || args->output_file == NULL) {
 		fprintf(
@@ -730,8 +907,91 @@ bool parse_args(args_t *args, const char *const *options, int count) {
 			"    psxavenc -h\n",
 			general_usage
 		);
-		return false;
+		return 0;
+	}
+	if (args->input_file_count > 1 && !(args->flags & FLAG_STR_STITCH)) {
+		fprintf(stderr, "There should be no arguments after the output file path\n");
+		return 0;
+	}
+	if (args->flags & (FLAG_STR_RANGE | FLAG_STR_RESUME)) {
+		if (args->flags & FLAG_STR_STITCH) {
+			fprintf(stderr, "Sector ranges cannot be encoded and stitched at the same time\n");
+			return 0;
+		}
+		if (args->video_hash_file != NULL) {
+			fprintf(stderr, "A hash list cannot be generated when encoding a sector range or resuming\n");
+			return 0;
+		}
+	}
+	if (args->format == FORMAT_STRSPU && args->audio_channels > MAX_STR_AUDIO_CHANNELS) {
+		fprintf(stderr, "The strspu format supports at most %d audio channels\n", MAX_STR_AUDIO_CHANNELS);
+		return 0;
+	}
+	if (args->str_checkpoint_interval > 0 && (args->flags & (FLAG_STR_STITCH | FLAG_TRANSMUX | FLAG_PREVIEW))) {
+		fprintf(stderr, "Checkpoints can only be saved when encoding a .str file\n");
+		return 0;
+	}
+	if (args->str_mux_pattern != NULL) {
+		if (
+			(args->flags & (FLAG_STR_RANGE | FLAG_STR_STITCH | FLAG_STR_RESUME | FLAG_TRANSMUX | FLAG_PREVIEW)) ||
+			args->str_checkpoint_interval > 0
+		) {
+			fprintf(stderr, "Multiple streams cannot be muxed when encoding a sector range, stitching or resuming\n");
+			return 0;
+		}
+	}
+	if (args->flags & FLAG_TRANSMUX) {
+		if (
+			args->format != FORMAT_XA &&
+			args->format != FORMAT_XACD &&
+			args->format != FORMAT_STR &&
+			args->format != FORMAT_STRCD &&
+			args->format != FORMAT_STRV &&
+			args->format != FORMAT_SBS
+		) {
+			fprintf(stderr, "Only .xa, .str and .sbs files can be converted without re-encoding\n");
+			return 0;
+		}
+		if (
+			(args->flags & (FLAG_STR_RANGE | FLAG_STR_STITCH | FLAG_STR_RESUME)) ||
+			args->video_hash_file != NULL ||
+			args->video_reuse_file != NULL
+		) {
+			fprintf(stderr, "Encoding options cannot be used when converting a file without re-encoding\n");
+			return 0;
+		}
+	}
+	if (args->flags & FLAG_PREVIEW) {
+		if (
+			args->format != FORMAT_XA &&
+			args->format != FORMAT_XACD &&
+			args->format != FORMAT_STR &&
+			args->format != FORMAT_STRCD &&
+			args->format != FORMAT_STRV &&
+			args->format != FORMAT_SBS
+		) {
+			fprintf(stderr, "Only .xa, .str and .sbs files can be decoded for preview\n");
+			return 0;
+		}
+		if (
+			(args->flags & (FLAG_STR_RANGE | FLAG_STR_STITCH | FLAG_STR_RESUME | FLAG_TRANSMUX)) ||
+			args->video_hash_file != NULL ||
+			args->video_reuse_file != NULL
+		) {
+			fprintf(stderr, "Encoding options cannot be used when decoding a file for preview\n");
+			return 0;
+		}
+	}
+	if (args->video_reuse_file != NULL) {
+		if (args->video_hash_file == NULL && !(args->flags & FLAG_BS_REMUX)) {
+			fprintf(stderr, "A hash list must be specified using -H in order to reuse frames\n");
+			return 0;
+		}
+		if (strcmp(args->video_reuse_file, args->output_file) == 0) {
+			fprintf(stderr, "The previously encoded file must be renamed or copied before overwriting it\n");
+			return 0;
+		}
 	}
 
-	return true;
+	return arg_index;
 }
@@ -29,6 +29,8 @@ freely, subject to the following restrictions:
 #define NUM_FORMATS   11
 #define NUM_BS_CODECS 3
 
+#define MAX_STR_AUDIO_CHANNELS 24 // One per SPU voice
+
 enum {
 	FLAG_IGNORE_OPTIONS       = 1 << 0,
 	FLAG_QUIET                = 1 << 1,
@@ -39,7 +41,14 @@ enum {
 	FLAG_SPU_ENABLE_LOOP      = 1 << 6,
 	FLAG_SPU_NO_LEADING_DUMMY = 1 << 7,
 	FLAG_BS_IGNORE_ASPECT     = 1 << 8,
-	FLAG_STR_TRAILING_AUDIO   = 1 << 9
+	FLAG_STR_TRAILING_AUDIO   = 1 << 9,
+	FLAG_STR_RANGE            = 1 << 10,
+	FLAG_STR_STITCH           = 1 << 11,
+	FLAG_STR_RESUME           = 1 << 12,
+	FLAG_BS_REMUX             = 1 << 13,
+	FLAG_TRANSMUX             = 1 << 14,
+	FLAG_PREVIEW              = 1 << 15,
+	FLAG_BS_FUSED_SCALE       = 1 << 16
 };
 
 typedef enum {
@@ -70,8 +79,15 @@ typedef struct {
 	format_t format;
 	const char *input_file;
 	const char *output_file;
+	const char **input_files; // all input files (parts to stitch with -J)
+	int input_file_count;
 	const char *swresample_options;
 	const char *swscale_options;
+	int thread_count; // 0 = automatic
+	int decoder_buffer_size; // in megabytes, 0 = unlimited
+	const char *stats_file;
+	int stats_interval; // in seconds
+	const char *trace_file;
 
 	int audio_frequency; // 18900 or 37800 Hz
 	int audio_channels;
@@ -84,13 +100,22 @@ typedef struct {
 	bs_codec_t video_codec;
 	int video_width;
 	int video_height;
+	const char *video_hash_file;
+	const char *video_reuse_file;
+	const char *video_log_file;
 
 	int str_fps_num;
 	int str_fps_den;
 	int str_cd_speed; // 1 or 2
 	int str_video_id;
 	int str_audio_id;
+	int str_range_start;
+	int str_range_end;
+	int str_checkpoint_interval; // in seconds
+	const char *str_mux_pattern;
+	int str_mux_num; // share of sectors given to this stream when muxing
+	int str_mux_den;
 	int alignment;
 } args_t;
 
-bool parse_args(args_t *args, const char *const *options, int count);
+int parse_args(args_t *args, const char *const *options, int count, const char *input_file);
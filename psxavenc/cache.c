@@ -0,0 +1,386 @@
+/*
+psxavenc: MDEC video + SPU/XA-ADPCM audio encoder frontend
+
+Copyright (c) 2019, 2020 Adrian "asie" Siekierka
+Copyright (c) 2019 Ben "GreaseMonkey" Russell
+Copyright (c) 2023, 2025 spicyjpeg
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "args.h"
+#include "cache.h"
+#include "demux.h"
+
+#define HASH_LIST_HEADER_SIZE 0x10
+
+// The hash list file consists of a 16-byte header followed by a 64-bit hash
+// for each frame, all in little endian format:
+//   0x00-0x03: magic ("PSFH")
+//   0x04-0x05: video width
+//   0x06-0x07: video height
+//   0x08:      BS codec (0 = v2, 1 = v3, 2 = v3dc)
+//   0x0C-0x0F: number of hashes
+static const char hash_list_magic[4] = { 'P', 'S', 'F', 'H' };
+
+// 64-bit FNV-1a hash
+static uint64_t hash_frame(const uint8_t *data, int length) {
+	uint64_t hash = 0xCBF29CE484222325;
+
+	for (int i = 0; i < length; i++) {
+		hash ^= data[i];
+		hash *= 0x00000100000001B3;
+	}
+
+	return hash;
+}
+
+static void load_hash_list(frame_cache_t *cache) {
+	FILE *file = fopen(cache->hash_file, "rb");
+
+	// A missing hash list is not an error, as it will be created once the
+	// encoding process is complete.
+	if (file == NULL)
+		return;
+
+	uint8_t header[HASH_LIST_HEADER_SIZE];
+
+	if (
+		fread(header, HASH_LIST_HEADER_SIZE, 1, file) != 1 ||
+		memcmp(header, hash_list_magic, sizeof(hash_list_magic)) != 0
+	) {
+		fprintf(stderr, "Warning: ignoring invalid hash list: %s\n", cache->hash_file);
+		fclose(file);
+		return;
+	}
+
+	int video_width = header[0x04] | (header[0x05] << 8);
+	int video_height = header[0x06] | (header[0x07] << 8);
+	int hash_count = header[0x0C] | (header[0x0D] << 8) | (header[0x0E] << 16) | (header[0x0F] << 24);
+
+	if (
+		video_width != cache->video_width ||
+		video_height != cache->video_height ||
+		header[0x08] != (uint8_t)cache->video_codec
+	) {
+		fprintf(stderr, "Warning: ignoring hash list generated with different video settings\n");
+		fclose(file);
+		return;
+	}
+
+	cache->old_hashes = malloc(hash_count * sizeof(uint64_t));
+	cache->old_hash_count = 0;
+
+	for (; cache->old_hash_count < hash_count; cache->old_hash_count++) {
+		uint8_t entry[8];
+
+		if (fread(entry, sizeof(entry), 1, file) != 1)
+			break;
+
+		uint64_t hash = 0;
+
+		for (int i = 7; i >= 0; i--)
+			hash = (hash << 8) | entry[i];
+
+		cache->old_hashes[cache->old_hash_count] = hash;
+	}
+
+	fclose(file);
+}
+
+static bool save_hash_list(frame_cache_t *cache) {
+	FILE *file = fopen(cache->hash_file, "wb");
+
+	if (file == NULL)
+		return false;
+
+	uint8_t header[HASH_LIST_HEADER_SIZE];
+	memset(header, 0, HASH_LIST_HEADER_SIZE);
+	memcpy(header, hash_list_magic, sizeof(hash_list_magic));
+
+	header[0x04] = (uint8_t)cache->video_width;
+	header[0x05] = (uint8_t)(cache->video_width >> 8);
+	header[0x06] = (uint8_t)cache->video_height;
+	header[0x07] = (uint8_t)(cache->video_height >> 8);
+	header[0x08] = (uint8_t)cache->video_codec;
+	header[0x0C] = (uint8_t)cache->hash_count;
+	header[0x0D] = (uint8_t)(cache->hash_count >> 8);
+	header[0x0E] = (uint8_t)(cache->hash_count >> 16);
+	header[0x0F] = (uint8_t)(cache->hash_count >> 24);
+
+	fwrite(header, HASH_LIST_HEADER_SIZE, 1, file);
+
+	for (int i = 0; i < cache->hash_count; i++) {
+		uint8_t entry[8];
+		uint64_t hash = cache->hashes[i];
+
+		for (int j = 0; j < 8; j++, hash >>= 8)
+			entry[j] = (uint8_t)hash;
+
+		fwrite(entry, sizeof(entry), 1, file);
+	}
+
+	return fclose(file) == 0;
+}
+
+static int get_last_source_frame(const frame_cache_t *cache) {
+	int last_frame = 0;
+
+	for (int i = 0; i < cache->source.frame_count; i++) {
+		if (get_demux_frame(&(cache->source), i) != NULL)
+			last_frame = i;
+	}
+
+	return last_frame;
+}
+
+// Frames are matched by their index when remuxing, so the previously encoded
+// file must have the same frame rate. This can only be verified if it has an
+// audio track to measure the frame rate against.
+static bool check_source_frame_rate(const frame_cache_t *cache, const args_t *args) {
+	int frame_count;
+	double duration;
+
+	if (!measure_demux_frame_rate(&(cache->source), &frame_count, &duration))
+		return true;
+
+	double expected = duration * args->str_fps_num / args->str_fps_den;
+
+	if (fabs(frame_count - expected) <= (1.0 + expected * 0.01))
+		return true;
+
+	fprintf(
+		stderr,
+		"Previously encoded file has different frame rate (%.2f fps, expected %.2f)\n",
+		frame_count / duration,
+		(double)args->str_fps_num / args->str_fps_den
+	);
+	return false;
+}
+
+bool open_frame_cache(frame_cache_t *cache, const args_t *args) {
+	cache->hash_file = args->video_hash_file;
+	cache->video_codec = args->video_codec;
+	cache->video_width = args->video_width;
+	cache->video_height = args->video_height;
+	cache->old_hashes = NULL;
+	cache->old_hash_count = 0;
+	cache->hashes = NULL;
+	cache->hash_count = 0;
+	cache->hash_capacity = 0;
+	cache->has_source = false;
+	cache->remux = (args->flags & FLAG_BS_REMUX) != 0;
+	cache->frames_reused = 0;
+
+	if (args->video_reuse_file != NULL) {
+		bool ok;
+
+		// When remuxing, frames can also be taken from an .sbs file to
+		// generate a .str file and vice versa.
+		if (cache->remux)
+			ok = open_demux_any(&(cache->source), args->video_reuse_file, args->str_video_id, args->alignment);
+		else if (args->format == FORMAT_SBS)
+			ok = open_demux_sbs(&(cache->source), args->video_reuse_file, args->alignment);
+		else
+			ok = open_demux_str(&(cache->source), args->video_reuse_file, args->str_video_id);
+
+		if (!ok) {
+			fprintf(stderr, "Failed to open previously encoded file: %s\n", args->video_reuse_file);
+			return false;
+		}
+
+		// .sbs files do not store the video resolution, so this can only be
+		// checked when remuxing a .str file.
+		if (
+			cache->source.video_width != 0 &&
+			(cache->source.video_width != cache->video_width || cache->source.video_height != cache->video_height)
+		) {
+			fprintf(
+				stderr,
+				"Previously encoded file has different resolution (%dx%d)\n",
+				cache->source.video_width,
+				cache->source.video_height
+			);
+			close_demux(&(cache->source));
+			return false;
+		}
+		if (
+			cache->source.video_width == 0 &&
+			!check_demux_resolution(&(cache->source), cache->video_width, cache->video_height)
+		) {
+			fprintf(
+				stderr,
+				"Previously encoded .sbs file does not match the resolution passed to -s (%dx%d)\n",
+				cache->video_width,
+				cache->video_height
+			);
+			close_demux(&(cache->source));
+			return false;
+		}
+		if (cache->remux && !check_source_frame_rate(cache, args)) {
+			close_demux(&(cache->source));
+			return false;
+		}
+
+		cache->has_source = true;
+	}
+
+	if (cache->hash_file != NULL)
+		load_hash_list(cache);
+
+	return true;
+}
+
+// Sets up a cache that copies frames from an already opened file, which the
+// cache takes ownership of, when converting it to another format.
+void init_frame_cache_source(frame_cache_t *cache, const demux_t *source, bs_codec_t video_codec, int video_width, int video_height) {
+	cache->hash_file = NULL;
+	cache->video_codec = video_codec;
+	cache->video_width = video_width;
+	cache->video_height = video_height;
+	cache->old_hashes = NULL;
+	cache->old_hash_count = 0;
+	cache->hashes = NULL;
+	cache->hash_count = 0;
+	cache->hash_capacity = 0;
+	cache->has_source = true;
+	cache->remux = true;
+	cache->source = *source;
+	cache->frames_reused = 0;
+}
+
+static int copy_cached_frame(frame_cache_t *cache, int frame_index, int frame_max_size, uint8_t *output) {
+	const demux_frame_t *frame = get_demux_frame(&(cache->source), frame_index);
+
+	if (frame == NULL || frame->bytes_used > frame_max_size)
+		return 0;
+
+	memset(output, 0, frame_max_size);
+	int bytes_used = read_demux_frame(&(cache->source), frame_index, output, frame_max_size);
+
+	if (bytes_used <= 8)
+		return 0;
+
+	// Make sure the frame was encoded with the same BS version.
+	if (output[0x006] != ((cache->video_codec == BS_CODEC_V2) ? 0x02 : 0x03))
+		return 0;
+
+	cache->frames_reused++;
+	return bytes_used;
+}
+
+// Looks up the given frame in the previously encoded file and copies its
+// bitstream to the output buffer if the frame is unchanged, i.e. if the hash of
+// the input frame matches the one saved from the previous run and the frame
+// was given the same size budget. As the encoder is deterministic, this results
+// in the exact same data as re-encoding the frame. When remuxing, any frame
+// that fits within the new size budget is copied regardless of its hash and
+// original budget. Returns the length of the copied bitstream or 0 if the frame
+// shall be encoded.
+int fetch_cached_frame(
+	frame_cache_t *cache,
+	int frame_index,
+	int frame_max_size,
+	const uint8_t *video_frame,
+	uint8_t *output
+) {
+	int slot = frame_index - 1;
+
+	if (slot < 0)
+		return 0;
+
+	// Frames only need to be hashed if a hash list is going to be saved.
+	if (cache->hash_file == NULL)
+		return cache->remux ? copy_cached_frame(cache, frame_index, frame_max_size, output) : 0;
+
+	uint64_t hash = hash_frame(video_frame, cache->video_width * cache->video_height * 3 / 2);
+
+	if (slot >= cache->hash_capacity) {
+		int new_capacity = slot + 256;
+
+		cache->hashes = realloc(cache->hashes, new_capacity * sizeof(uint64_t));
+		memset(cache->hashes + cache->hash_capacity, 0, (new_capacity - cache->hash_capacity) * sizeof(uint64_t));
+		cache->hash_capacity = new_capacity;
+	}
+	if (slot >= cache->hash_count)
+		cache->hash_count = slot + 1;
+
+	cache->hashes[slot] = hash;
+
+	if (cache->remux)
+		return copy_cached_frame(cache, frame_index, frame_max_size, output);
+	if (!cache->has_source || slot >= cache->old_hash_count || cache->old_hashes[slot] != hash)
+		return 0;
+
+	const demux_frame_t *frame = get_demux_frame(&(cache->source), frame_index);
+
+	if (frame == NULL || frame->max_size != frame_max_size)
+		return 0;
+
+	return copy_cached_frame(cache, frame_index, frame_max_size, output);
+}
+
+// Checks that the input file yielded as many frames as the previously encoded
+// file being remuxed contains, once all of them have been decoded. .str files
+// may be up to a second of video shorter than their input, as frames still
+// queued once the end of the input file is reached are not encoded.
+bool check_frame_cache_length(const frame_cache_t *cache, const args_t *args, int frame_count) {
+	if (!cache->remux || !cache->has_source)
+		return true;
+
+	int source_frame_count = get_last_source_frame(cache);
+	int tolerance = (args->str_fps_num + args->str_fps_den - 1) / args->str_fps_den;
+
+	if (source_frame_count <= frame_count && (frame_count - source_frame_count) <= tolerance)
+		return true;
+
+	fprintf(
+		stderr,
+		"\nPreviously encoded file has %d frames, but the input file has %d\n",
+		source_frame_count,
+		frame_count
+	);
+	return false;
+}
+
+bool close_frame_cache(frame_cache_t *cache) {
+	bool ok = true;
+
+	if (cache->hash_file != NULL)
+		ok = save_hash_list(cache);
+
+	if (cache->has_source) {
+		close_demux(&(cache->source));
+		cache->has_source = false;
+	}
+	if (cache->old_hashes != NULL) {
+		free(cache->old_hashes);
+		cache->old_hashes = NULL;
+	}
+	if (cache->hashes != NULL) {
+		free(cache->hashes);
+		cache->hashes = NULL;
+	}
+
+	return ok;
+}
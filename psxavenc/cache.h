@@ -0,0 +1,61 @@
+/*
+psxavenc: MDEC video + SPU/XA-ADPCM audio encoder frontend
+
+Copyright (c) 2019, 2020 Adrian "asie" Siekierka
+Copyright (c) 2019 Ben "GreaseMonkey" Russell
+Copyright (c) 2023, 2025 spicyjpeg
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "args.h"
+#include "demux.h"
+
+typedef struct {
+	const char *hash_file;
+	bs_codec_t video_codec;
+	int video_width;
+	int video_height;
+
+	uint64_t *old_hashes;
+	int old_hash_count;
+	uint64_t *hashes;
+	int hash_count;
+	int hash_capacity;
+
+	bool has_source;
+	bool remux;
+	demux_t source;
+
+	int frames_reused;
+} frame_cache_t;
+
+bool open_frame_cache(frame_cache_t *cache, const args_t *args);
+void init_frame_cache_source(frame_cache_t *cache, const demux_t *source, bs_codec_t video_codec, int video_width, int video_height);
+int fetch_cached_frame(
+	frame_cache_t *cache,
+	int frame_index,
+	int frame_max_size,
+	const uint8_t *video_frame,
+	uint8_t *output
+);
+bool check_frame_cache_length(const frame_cache_t *cache, const args_t *args, int frame_count);
+bool close_frame_cache(frame_cache_t *cache);
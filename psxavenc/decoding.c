@@ -23,13 +23,18 @@ freely, subject to the following restrictions:
 */
 
 #include <assert.h>
+#include <limits.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <libavutil/opt.h>
 #include <libavcodec/avcodec.h>
 #include <libavcodec/avdct.h>
@@ -38,6 +43,8 @@ freely, subject to the following restrictions:
 #include <libswscale/swscale.h>
 #include "args.h"
 #include "decoding.h"
+#include "stats.h"
+#include "trace.h"
 
 enum {
 	LOOP_TYPE_FORWARD,
@@ -128,10 +135,12 @@ static bool decode_frame(AVCodecContext *codec, AVFrame *frame, int *frame_size,
 	return false;
 }
 
-bool open_av_data(decoder_t *decoder, const args_t *args, int flags) {
+static void init_av_data(decoder_t *decoder, const args_t *args) {
 	decoder->audio_samples = NULL;
 	decoder->audio_sample_count = 0;
 	decoder->video_frames = NULL;
+	decoder->video_planes = NULL;
+	decoder->video_scaler = NULL;
 	decoder->video_frame_count = 0;
 
 	decoder->video_width = args->video_width;
@@ -154,6 +163,40 @@ bool open_av_data(decoder_t *decoder, const args_t *args, int flags) {
 	av->video_codec_context = NULL;
 	av->resampler = NULL;
 	av->scaler = NULL;
+	av->audio_direct = false;
+	av->video_direct = false;
+	av->video_zero_copy = false;
+	av->video_full_range = true;
+	av->video_direct_width = 0;
+	av->video_direct_height = 0;
+	av->video_scaler_workspace = NULL;
+	av->source = NULL;
+	av->source_view = -1;
+	av->input_drained = false;
+	av->stats = NULL;
+	av->audio_sample_capacity = 0;
+	av->video_frame_capacity = 0;
+	av->video_frame_refs = NULL;
+}
+
+bool open_av_source(decoder_source_t *source, const args_t *args, int flags, int view_count) {
+	decoder_t *decoder = &(source->decoder);
+	decoder_state_t *av = &(decoder->state);
+
+	init_av_data(decoder, args);
+
+	source->queue_offset = 0;
+	source->queue_length = 0;
+	source->queue_size = 0;
+	source->max_queue_size = 0;
+	source->view_positions = malloc(view_count * sizeof(int));
+	source->view_count = view_count;
+
+	for (int i = 0; i < view_count; i++)
+		source->view_positions[i] = 0;
+
+	pthread_mutex_init(&(source->mutex), NULL);
+	pthread_cond_init(&(source->cond), NULL);
 
 	if (args->flags & FLAG_QUIET)
 		av_log_set_level(AV_LOG_QUIET);
@@ -175,11 +218,6 @@ bool open_av_data(decoder_t *decoder, const args_t *args, int flags) {
 				av->audio_stream_index = i;
 			}
 		}
-
-		if ((flags & DECODER_AUDIO_REQUIRED) && av->audio_stream_index == -1) {
-			fprintf(stderr, "Input file has no audio data\n");
-			return false;
-		}
 	}
 
 	if (flags & DECODER_USE_VIDEO) {
@@ -192,11 +230,6 @@ bool open_av_data(decoder_t *decoder, const args_t *args, int flags) {
 				av->video_stream_index = i;
 			}
 		}
-
-		if ((flags & DECODER_VIDEO_REQUIRED) && av->video_stream_index == -1) {
-			fprintf(stderr, "Input file has no video data\n");
-			return false;
-		}
 	}
 
 	av->audio_stream = (av->audio_stream_index != -1 ? av->format->streams[av->audio_stream_index] : NULL);
@@ -212,7 +245,140 @@ bool open_av_data(decoder_t *decoder, const args_t *args, int flags) {
 			return false;
 		if (avcodec_open2(av->audio_codec_context, codec, NULL) < 0)
 			return false;
+	}
+
+	if (av->video_stream != NULL) {
+		const AVCodec *codec = avcodec_find_decoder(av->video_stream->codecpar->codec_id);
+		av->video_codec_context = avcodec_alloc_context3(codec);
+
+		if (av->video_codec_context == NULL)
+			return false;
+		if (avcodec_parameters_to_context(av->video_codec_context, av->video_stream->codecpar) < 0)
+			return false;
+		if (avcodec_open2(av->video_codec_context, codec, NULL) < 0)
+			return false;
+	}
 
+	av->frame = av_frame_alloc();
+
+	if (av->frame == NULL)
+		return false;
+
+	return true;
+}
+
+// 4:2:0 frames that already match the output resolution do not need to be
+// scaled, only converted to NV21 and (for limited range frames) expanded to
+// full range, which can be done in a single pass without going through
+// libswscale. If requested, other 4:2:0 frames are scaled by libpsxav's scaler
+// instead of libswscale. This is disabled if any custom libswscale options are
+// given.
+static bool init_av_direct_video(decoder_t *decoder, const args_t *args) {
+	decoder_state_t *av = &(decoder->state);
+	enum AVPixelFormat pix_fmt = av->video_codec_context->pix_fmt;
+	bool scaled = (
+		av->video_codec_context->width != decoder->video_width ||
+		av->video_codec_context->height != decoder->video_height
+	);
+
+	av->video_direct = (
+		(
+			pix_fmt == AV_PIX_FMT_YUV420P ||
+			pix_fmt == AV_PIX_FMT_YUVJ420P ||
+			pix_fmt == AV_PIX_FMT_NV12 ||
+			pix_fmt == AV_PIX_FMT_NV21
+		) &&
+		(!scaled || (args->flags & FLAG_BS_FUSED_SCALE)) &&
+		args->swscale_options == NULL
+	);
+	av->video_direct_width = av->video_codec_context->width;
+	av->video_direct_height = av->video_codec_context->height;
+	av->video_full_range = (
+		pix_fmt == AV_PIX_FMT_YUVJ420P ||
+		av->video_codec_context->color_range == AVCOL_RANGE_JPEG
+	);
+
+	// With a single output and no frame pool (see init_frame_pool() in
+	// filefmt.c), such frames are not even converted (nor scaled). The
+	// decoded frames are kept referenced until they are retired instead, and
+	// the encoder gathers macroblocks straight from their planes. Hash lists
+	// are computed over converted frames, so they also require frames to be
+	// converted.
+	av->video_zero_copy = (
+		av->video_direct &&
+		av->source != NULL &&
+		av->source->view_count == 1 &&
+		args->video_hash_file == NULL &&
+		(args->thread_count <= 1 || args->video_reuse_file != NULL)
+	);
+
+	for (int i = 0; i < 256; i++) {
+		double luma = round((double)(i - 16) * 255.0 / 219.0);
+		double chroma = round((double)(i - 128) * 255.0 / 224.0) + 128.0;
+
+		av->video_luma_lut[i] = (uint8_t)fmin(fmax(luma, 0.0), 255.0);
+		av->video_chroma_lut[i] = (uint8_t)fmin(fmax(chroma, 0.0), 255.0);
+	}
+
+	if (!av->video_direct || !scaled)
+		return true;
+
+	psx_mdec_settings_t settings;
+	settings.version = PSX_MDEC_BS_V2;
+	settings.width = decoder->video_width;
+	settings.height = decoder->video_height;
+
+	av->video_scaler_workspace = tracked_malloc(
+		MEMORY_DECODER_BUFFERS,
+		psx_mdec_get_scaler_workspace_size(settings, av->video_direct_width, av->video_direct_height)
+	);
+
+	if (av->video_scaler_workspace == NULL)
+		return false;
+
+	decoder->video_scaler = psx_mdec_init_scaler(
+		settings,
+		av->video_direct_width,
+		av->video_direct_height,
+		av->video_scaler_workspace
+	);
+	return decoder->video_scaler != NULL;
+}
+
+bool open_av_view(decoder_t *decoder, decoder_source_t *source, int view_index, const args_t *args, int flags) {
+	decoder_state_t *av = &(decoder->state);
+	decoder_state_t *source_av = &(source->decoder.state);
+
+	init_av_data(decoder, args);
+
+	// The view shares the demuxer and decoders with the source (and thus all
+	// other views), but has its own resampler and scaler as each output may
+	// use a different sample rate and resolution.
+	av->source = source;
+	av->source_view = view_index;
+	av->format = source_av->format;
+
+	if (flags & DECODER_USE_AUDIO) {
+		av->audio_stream_index = source_av->audio_stream_index;
+		av->audio_stream = source_av->audio_stream;
+		av->audio_codec_context = source_av->audio_codec_context;
+	}
+	if (flags & DECODER_USE_VIDEO) {
+		av->video_stream_index = source_av->video_stream_index;
+		av->video_stream = source_av->video_stream;
+		av->video_codec_context = source_av->video_codec_context;
+	}
+
+	if ((flags & DECODER_AUDIO_REQUIRED) && av->audio_stream == NULL) {
+		fprintf(stderr, "Input file has no audio data\n");
+		return false;
+	}
+	if ((flags & DECODER_VIDEO_REQUIRED) && av->video_stream == NULL) {
+		fprintf(stderr, "Input file has no video data\n");
+		return false;
+	}
+
+	if (av->audio_stream != NULL) {
 		AVChannelLayout layout;
 		layout.nb_channels = args->audio_channels;
 
@@ -253,19 +419,30 @@ bool open_av_data(decoder_t *decoder, const args_t *args, int flags) {
 		}
 		if (swr_init(av->resampler) < 0)
 			return false;
+
+		// Samples that only need to be interleaved and/or converted to 16-bit
+		// are appended to the buffer directly rather than going through
+		// libswresample. This is disabled if any custom libswresample options
+		// are given, or if the input's channels are not laid out exactly as
+		// the output's (e.g. a 2-channel file holding anything but FL/FR must
+		// still be downmixed).
+		enum AVSampleFormat sample_fmt = av->audio_codec_context->sample_fmt;
+
+		av->audio_direct = (
+			(
+				sample_fmt == AV_SAMPLE_FMT_S16 ||
+				sample_fmt == AV_SAMPLE_FMT_S16P ||
+				sample_fmt == AV_SAMPLE_FMT_FLT ||
+				sample_fmt == AV_SAMPLE_FMT_FLTP
+			) &&
+			av->audio_codec_context->sample_rate == args->audio_frequency &&
+			args->audio_channels <= 2 &&
+			av_channel_layout_compare(&av->audio_codec_context->ch_layout, &layout) == 0 &&
+			args->swresample_options == NULL
+		);
 	}
 
 	if (av->video_stream != NULL) {
-		const AVCodec *codec = avcodec_find_decoder(av->video_stream->codecpar->codec_id);
-		av->video_codec_context = avcodec_alloc_context3(codec);
-
-		if (av->video_codec_context == NULL)
-			return false;
-		if (avcodec_parameters_to_context(av->video_codec_context, av->video_stream->codecpar) < 0)
-			return false;
-		if (avcodec_open2(av->video_codec_context, codec, NULL) < 0)
-			return false;
-
 		if (
 			(decoder->video_width > av->video_codec_context->width || decoder->video_height > av->video_codec_context->height) &&
 			!(args->flags & FLAG_QUIET)
@@ -315,6 +492,8 @@ bool open_av_data(decoder_t *decoder, const args_t *args, int flags) {
 		}
 
 		av->video_frame_dst_size = 3 * decoder->video_width * decoder->video_height / 2;
+		if (!init_av_direct_video(decoder, args))
+			return false;
 	}
 
 	av->frame = av_frame_alloc();
@@ -367,48 +546,333 @@ int get_av_loop_point(decoder_t *decoder, const args_t *args) {
 	return -1;
 }
 
-static void poll_av_packet_audio(decoder_t *decoder, AVPacket *packet) {
+// Grows a buffer holding decoded data to fit at least the given number of
+// items. The capacity is doubled as needed rather than matched exactly, so that
+// the buffer does not have to be reallocated every time a frame is decoded.
+static void *reserve_av_buffer(void *buffer, int *capacity, int needed, size_t item_size) {
+	if (needed <= *capacity)
+		return buffer;
+
+	int new_capacity = *capacity * 2;
+
+	if (new_capacity < needed)
+		new_capacity = needed;
+
+	*capacity = new_capacity;
+	return tracked_realloc(MEMORY_DECODER_BUFFERS, buffer, new_capacity * item_size);
+}
+
+static void reserve_audio_samples(decoder_t *decoder, int needed_samples) {
 	decoder_state_t *av = &(decoder->state);
 
-	int frame_size;
+	decoder->audio_samples = reserve_av_buffer(
+		decoder->audio_samples,
+		&(av->audio_sample_capacity),
+		decoder->audio_sample_count + needed_samples * av->sample_count_mul,
+		sizeof(int16_t)
+	);
+}
+
+// Same conversion libswresample performs, rounding to the nearest integer and
+// clipping. SSE2 is part of the x86-64 baseline, so the helpers below use it
+// unconditionally where available and fall back to scalar code for the last
+// few samples and on other architectures.
+static inline int16_t convert_float_sample(float sample) {
+	float value = fminf(fmaxf(sample * 32768.0f, -32768.0f), 32767.0f);
+
+	return (int16_t)(int32_t)nearbyintf(value);
+}
+
+#ifdef __SSE2__
+// Converts 8 samples at once. Values are clamped before rounding, as
+// _mm_cvtps_epi32() returns INT_MIN for values out of range; NaNs are turned
+// into -32768 by _mm_max_ps() like in the scalar version.
+static inline __m128i convert_float_samples_sse2(const float *src) {
+	const __m128 scale = _mm_set1_ps(32768.0f);
+	const __m128 min_value = _mm_set1_ps(-32768.0f);
+	const __m128 max_value = _mm_set1_ps(32767.0f);
+
+	__m128 lo = _mm_mul_ps(_mm_loadu_ps(src + 0), scale);
+	__m128 hi = _mm_mul_ps(_mm_loadu_ps(src + 4), scale);
+	lo = _mm_min_ps(_mm_max_ps(lo, min_value), max_value);
+	hi = _mm_min_ps(_mm_max_ps(hi, min_value), max_value);
+
+	return _mm_packs_epi32(_mm_cvtps_epi32(lo), _mm_cvtps_epi32(hi));
+}
+#endif
+
+static void convert_float_samples(int16_t *restrict dst, const float *restrict src, int count) {
+	int i = 0;
 
-	if (!decode_frame(av->audio_codec_context, av->frame, &frame_size, packet))
+#ifdef __SSE2__
+	for (; i <= (count - 8); i += 8)
+		_mm_storeu_si128((__m128i *)&dst[i], convert_float_samples_sse2(&src[i]));
+#endif
+
+	for (; i < count; i++)
+		dst[i] = convert_float_sample(src[i]);
+}
+
+static void interleave_float_samples(int16_t *restrict dst, const float *restrict left, const float *restrict right, int count) {
+	int i = 0;
+
+#ifdef __SSE2__
+	for (; i <= (count - 8); i += 8) {
+		__m128i l = convert_float_samples_sse2(&left[i]);
+		__m128i r = convert_float_samples_sse2(&right[i]);
+
+		_mm_storeu_si128((__m128i *)&dst[i * 2 + 0], _mm_unpacklo_epi16(l, r));
+		_mm_storeu_si128((__m128i *)&dst[i * 2 + 8], _mm_unpackhi_epi16(l, r));
+	}
+#endif
+
+	for (; i < count; i++) {
+		dst[i * 2 + 0] = convert_float_sample(left[i]);
+		dst[i * 2 + 1] = convert_float_sample(right[i]);
+	}
+}
+
+static void interleave_s16_samples(int16_t *restrict dst, const int16_t *restrict left, const int16_t *restrict right, int count) {
+	int i = 0;
+
+#ifdef __SSE2__
+	for (; i <= (count - 8); i += 8) {
+		__m128i l = _mm_loadu_si128((const __m128i *)&left[i]);
+		__m128i r = _mm_loadu_si128((const __m128i *)&right[i]);
+
+		_mm_storeu_si128((__m128i *)&dst[i * 2 + 0], _mm_unpacklo_epi16(l, r));
+		_mm_storeu_si128((__m128i *)&dst[i * 2 + 8], _mm_unpackhi_epi16(l, r));
+	}
+#endif
+
+	for (; i < count; i++) {
+		dst[i * 2 + 0] = left[i];
+		dst[i * 2 + 1] = right[i];
+	}
+}
+
+static void copy_av_frame_audio(decoder_t *decoder, const AVFrame *frame) {
+	decoder_state_t *av = &(decoder->state);
+
+	int channels = av->sample_count_mul;
+	int count = frame->nb_samples;
+
+	reserve_audio_samples(decoder, count);
+	int16_t *dst = decoder->audio_samples + decoder->audio_sample_count;
+
+	switch (frame->format) {
+		case AV_SAMPLE_FMT_S16:
+			memcpy(dst, frame->data[0], count * channels * sizeof(int16_t));
+			break;
+
+		case AV_SAMPLE_FMT_FLT:
+			convert_float_samples(dst, (const float *)frame->data[0], count * channels);
+			break;
+
+		case AV_SAMPLE_FMT_S16P:
+			if (channels == 1)
+				memcpy(dst, frame->data[0], count * sizeof(int16_t));
+			else
+				interleave_s16_samples(dst, (const int16_t *)frame->data[0], (const int16_t *)frame->data[1], count);
+			break;
+
+		case AV_SAMPLE_FMT_FLTP:
+			if (channels == 1)
+				convert_float_samples(dst, (const float *)frame->data[0], count);
+			else
+				interleave_float_samples(dst, (const float *)frame->data[0], (const float *)frame->data[1], count);
+			break;
+
+		default:
+			assert(false);
+	}
+
+	decoder->audio_sample_count += count * channels;
+}
+
+static void convert_av_frame_audio(decoder_t *decoder, AVFrame *frame) {
+	decoder_state_t *av = &(decoder->state);
+
+	// The frame's own format is checked as well, as it may differ from the
+	// one the decoder was opened with.
+	if (av->audio_direct && frame->format == av->audio_codec_context->sample_fmt) {
+		if (frame->nb_samples > 0)
+			copy_av_frame_audio(decoder, frame);
 		return;
+	}
 
-	int frame_sample_count = swr_get_out_samples(av->resampler, av->frame->nb_samples);
+	int frame_sample_count = swr_get_out_samples(av->resampler, frame->nb_samples);
 
-	if (frame_sample_count == 0)
+	if (frame_sample_count <= 0)
 		return;
 
-	size_t buffer_size = sizeof(int16_t) * av->sample_count_mul * frame_sample_count;
-	uint8_t *buffer = malloc(buffer_size);
-	memset(buffer, 0, buffer_size);
+	// Samples are converted in place at the end of the buffer.
+	reserve_audio_samples(decoder, frame_sample_count);
+	uint8_t *buffer = (uint8_t *)(decoder->audio_samples + decoder->audio_sample_count);
 
 	frame_sample_count = swr_convert(
 		av->resampler,
 		&buffer,
 		frame_sample_count,
-		(const uint8_t**)av->frame->data,
-		av->frame->nb_samples
+		(const uint8_t**)frame->data,
+		frame->nb_samples
 	);
 
-	decoder->audio_samples = realloc(
-		decoder->audio_samples,
-		(decoder->audio_sample_count + ((frame_sample_count + 4032) * av->sample_count_mul)) * sizeof(int16_t)
+	if (frame_sample_count > 0)
+		decoder->audio_sample_count += frame_sample_count * av->sample_count_mul;
+}
+
+static void copy_av_frame_video(decoder_t *decoder, const AVFrame *frame, uint8_t *dst_frame) {
+	decoder_state_t *av = &(decoder->state);
+
+	int width = decoder->video_width;
+	int height = decoder->video_height;
+	uint8_t *y_plane = dst_frame;
+	uint8_t *c_plane = dst_frame + width * height;
+
+	for (int y = 0; y < height; y++) {
+		const uint8_t *src = frame->data[0] + (ptrdiff_t)y * frame->linesize[0];
+		uint8_t *dst = y_plane + y * width;
+
+		if (av->video_full_range) {
+			memcpy(dst, src, width);
+		} else {
+			for (int x = 0; x < width; x++)
+				dst[x] = av->video_luma_lut[src[x]];
+		}
+	}
+
+	// NV21 stores Cr before Cb, NV12 the other way around.
+	for (int y = 0; y < (height / 2); y++) {
+		const uint8_t *src_cr, *src_cb;
+		int src_step;
+		uint8_t *dst = c_plane + y * width;
+
+		if (frame->format == AV_PIX_FMT_NV21) {
+			src_cr = frame->data[1] + (ptrdiff_t)y * frame->linesize[1];
+			src_cb = src_cr + 1;
+			src_step = 2;
+		} else if (frame->format == AV_PIX_FMT_NV12) {
+			src_cb = frame->data[1] + (ptrdiff_t)y * frame->linesize[1];
+			src_cr = src_cb + 1;
+			src_step = 2;
+		} else {
+			src_cb = frame->data[1] + (ptrdiff_t)y * frame->linesize[1];
+			src_cr = frame->data[2] + (ptrdiff_t)y * frame->linesize[2];
+			src_step = 1;
+		}
+
+		if (av->video_full_range && frame->format == AV_PIX_FMT_NV21) {
+			memcpy(dst, src_cr, width);
+		} else if (av->video_full_range) {
+			for (int x = 0; x < (width / 2); x++) {
+				dst[x * 2 + 0] = src_cr[x * src_step];
+				dst[x * 2 + 1] = src_cb[x * src_step];
+			}
+		} else {
+			for (int x = 0; x < (width / 2); x++) {
+				dst[x * 2 + 0] = av->video_chroma_lut[src_cr[x * src_step]];
+				dst[x * 2 + 1] = av->video_chroma_lut[src_cb[x * src_step]];
+			}
+		}
+	}
+}
+
+static void reserve_video_frame_refs(decoder_t *decoder, int needed_frames) {
+	decoder_state_t *av = &(decoder->state);
+	int capacity = av->video_frame_capacity;
+
+	// Both arrays always have the same capacity.
+	av->video_frame_refs = reserve_av_buffer(av->video_frame_refs, &capacity, needed_frames, sizeof(AVFrame *));
+	decoder->video_planes = reserve_av_buffer(
+		decoder->video_planes,
+		&(av->video_frame_capacity),
+		needed_frames,
+		sizeof(psx_mdec_frame_planes_t)
 	);
-	memmove(
-		&(decoder->audio_samples[decoder->audio_sample_count]),
-		buffer,
-		sizeof(int16_t) * frame_sample_count * av->sample_count_mul
+}
+
+static void init_av_frame_planes(decoder_t *decoder, const AVFrame *frame, psx_mdec_frame_planes_t *planes, bool full_range) {
+	decoder_state_t *av = &(decoder->state);
+
+	if (frame->format == AV_PIX_FMT_NV21)
+		planes->layout = PSX_MDEC_PLANES_NV21;
+	else if (frame->format == AV_PIX_FMT_NV12)
+		planes->layout = PSX_MDEC_PLANES_NV12;
+	else
+		planes->layout = PSX_MDEC_PLANES_YUV420P;
+
+	planes->width = frame->width;
+	planes->height = frame->height;
+
+	for (int i = 0; i < 3; i++) {
+		planes->planes[i] = frame->data[i];
+		planes->strides[i] = frame->linesize[i];
+	}
+
+	if (full_range) {
+		planes->luma_lut = NULL;
+		planes->chroma_lut = NULL;
+	} else {
+		planes->luma_lut = av->video_luma_lut;
+		planes->chroma_lut = av->video_chroma_lut;
+	}
+}
+
+// Returns true if the frame can bypass libswscale. The frame's own format and
+// size are checked, as they may differ from the ones the decoder was opened
+// with.
+static bool is_av_frame_direct(const decoder_t *decoder, const AVFrame *frame) {
+	const decoder_state_t *av = &(decoder->state);
+
+	return (
+		av->video_direct &&
+		frame->format == av->video_codec_context->pix_fmt &&
+		frame->width == av->video_direct_width &&
+		frame->height == av->video_direct_height
 	);
-	decoder->audio_sample_count += frame_sample_count * av->sample_count_mul;
-	free(buffer);
 }
 
-static void poll_av_packet_video(decoder_t *decoder, AVPacket *packet) {
+// Appends a reference to the given frame to the queue. Frames that do not match
+// the format and size the decoder was opened with (which should be rare) are
+// converted by libswscale into a newly allocated NV21 frame instead.
+static void reference_av_frame_video(decoder_t *decoder, const AVFrame *frame) {
+	decoder_state_t *av = &(decoder->state);
+	AVFrame *ref;
+	bool converted = !is_av_frame_direct(decoder, frame);
+
+	if (converted) {
+		ref = av_frame_alloc();
+		ref->format = AV_PIX_FMT_NV21;
+		ref->width = decoder->video_width;
+		ref->height = decoder->video_height;
+		av_frame_get_buffer(ref, 0);
+
+		sws_scale(
+			av->scaler,
+			(const uint8_t *const *) frame->data,
+			frame->linesize,
+			0,
+			frame->height,
+			ref->data,
+			ref->linesize
+		);
+	} else {
+		ref = av_frame_clone(frame);
+	}
+
+	init_av_frame_planes(
+		decoder,
+		ref,
+		&(decoder->video_planes[decoder->video_frame_count]),
+		converted || av->video_full_range
+	);
+	av->video_frame_refs[decoder->video_frame_count] = ref;
+}
+
+static void convert_av_frame_video(decoder_t *decoder, AVFrame *frame) {
 	decoder_state_t *av = &(decoder->state);
 
-	int frame_size;
 	double pts_step = (double)decoder->video_fps_den / (double)decoder->video_fps_num;
 
 	int plane_size = decoder->video_width * decoder->video_height;
@@ -416,14 +880,12 @@ static void poll_av_packet_video(decoder_t *decoder, AVPacket *packet) {
 		decoder->video_width, decoder->video_width
 	};
 
-	if (!decode_frame(av->video_codec_context, av->frame, &frame_size, packet))
-		return;
-	if (!av->frame->width || !av->frame->height || !av->frame->data[0])
+	if (!frame->width || !frame->height || !frame->data[0])
 		return;
 
 	// Some files seem to have timestamps starting from a negative value
 	// (but otherwise valid) for whatever reason.
-	double pts = (double)av->frame->pts * (double)av->video_stream->time_base.num / (double)av->video_stream->time_base.den;
+	double pts = (double)frame->pts * (double)av->video_stream->time_base.num / (double)av->video_stream->time_base.den;
 
 #if 0
 	if (pts < 0.0)
@@ -445,9 +907,28 @@ static void poll_av_packet_video(decoder_t *decoder, AVPacket *packet) {
 	if (dupe_frames < 0)
 		dupe_frames = 0;
 
-	decoder->video_frames = realloc(
+	if (av->video_zero_copy) {
+		reserve_video_frame_refs(decoder, decoder->video_frame_count + dupe_frames + 1);
+
+		for (; dupe_frames; dupe_frames--) {
+			int i = decoder->video_frame_count;
+
+			av->video_frame_refs[i] = av_frame_clone(av->video_frame_refs[i - 1]);
+			decoder->video_planes[i] = decoder->video_planes[i - 1];
+			decoder->video_frame_count += 1;
+			av->video_next_pts += pts_step;
+		}
+
+		reference_av_frame_video(decoder, frame);
+		decoder->video_frame_count += 1;
+		return;
+	}
+
+	decoder->video_frames = reserve_av_buffer(
 		decoder->video_frames,
-		(decoder->video_frame_count + dupe_frames + 1) * av->video_frame_dst_size
+		&(av->video_frame_capacity),
+		decoder->video_frame_count + dupe_frames + 1,
+		av->video_frame_dst_size
 	);
 
 	for (; dupe_frames; dupe_frames--) {
@@ -461,15 +942,30 @@ static void poll_av_packet_video(decoder_t *decoder, AVPacket *packet) {
 	}
 
 	uint8_t *dst_frame = decoder->video_frames + av->video_frame_dst_size * decoder->video_frame_count;
+
+	if (is_av_frame_direct(decoder, frame)) {
+		if (decoder->video_scaler != NULL) {
+			psx_mdec_frame_planes_t planes;
+
+			init_av_frame_planes(decoder, frame, &planes, av->video_full_range);
+			psx_mdec_scale_frame_planes(decoder->video_scaler, &planes, dst_frame);
+		} else {
+			copy_av_frame_video(decoder, frame, dst_frame);
+		}
+
+		decoder->video_frame_count += 1;
+		return;
+	}
+
 	uint8_t *dst_pointers[2] = {
 		dst_frame, dst_frame + plane_size
 	};
 	sws_scale(
 		av->scaler,
-		(const uint8_t *const *) av->frame->data,
-		av->frame->linesize,
+		(const uint8_t *const *) frame->data,
+		frame->linesize,
 		0,
-		av->frame->height,
+		frame->height,
 		dst_pointers,
 		dst_strides
 	);
@@ -477,34 +973,150 @@ static void poll_av_packet_video(decoder_t *decoder, AVPacket *packet) {
 	decoder->video_frame_count += 1;
 }
 
+// Returns the amount of memory referenced by a decoded frame. Frames may share
+// buffers with the decoder's internal pools, so this is only an estimate.
+static size_t get_av_frame_size(const AVFrame *frame) {
+	size_t size = 0;
+
+	for (int i = 0; i < AV_NUM_DATA_POINTERS && frame->buf[i] != NULL; i++)
+		size += frame->buf[i]->size;
+	for (int i = 0; i < frame->nb_extended_buf; i++)
+		size += frame->extended_buf[i]->size;
+
+	return size;
+}
+
+// Must be called with the source's mutex locked. The time spent demuxing and
+// decoding is accounted to the statistics of the view that requested it.
+static void decode_av_source_packet(decoder_source_t *source, encode_stats_t *stats) {
+	decoder_t *decoder = &(source->decoder);
+	decoder_state_t *av = &(decoder->state);
+
+	AVPacket packet;
+	uint64_t t = begin_stage(stats);
+
+	if (av_read_frame(av->format, &packet) < 0) {
+		decoder->end_of_input = true;
+		return;
+	}
+
+	end_stage(stats, STAGE_DEMUX, t);
+
+	AVCodecContext *codec = NULL;
+	bool is_video = false;
+
+	if (packet.stream_index == av->audio_stream_index) {
+		codec = av->audio_codec_context;
+	} else if (packet.stream_index == av->video_stream_index) {
+		codec = av->video_codec_context;
+		is_video = true;
+	}
+
+	int frame_size;
+	t = begin_stage(stats);
+
+	if (codec != NULL && decode_frame(codec, av->frame, &frame_size, &packet)) {
+		decoded_frame_t *entry = &(source->queue[source->queue_length++]);
+
+		// Packets that did not produce any frame are still queued (as an
+		// empty entry), as they may flush samples buffered by the resampler.
+		entry->is_video = is_video;
+		entry->frame = av->frame->buf[0] ? av_frame_clone(av->frame) : NULL;
+		entry->size = (entry->frame != NULL) ? get_av_frame_size(entry->frame) : 0;
+		av_frame_unref(av->frame);
+
+		source->queue_size += entry->size;
+		track_memory(MEMORY_DECODER_QUEUE, (int64_t)entry->size);
+	}
+	if (codec != NULL)
+		end_stage(stats, STAGE_DECODE, t);
+
+	av_packet_unref(&packet);
+}
+
+// Must be called with the source's mutex locked.
+static void trim_av_source(decoder_source_t *source) {
+	int min_position = source->queue_offset + source->queue_length;
+
+	for (int i = 0; i < source->view_count; i++) {
+		if (source->view_positions[i] < min_position)
+			min_position = source->view_positions[i];
+	}
+
+	int trimmed = min_position - source->queue_offset;
+
+	if (trimmed <= 0)
+		return;
+
+	for (int i = 0; i < trimmed; i++) {
+		source->queue_size -= source->queue[i].size;
+		track_memory(MEMORY_DECODER_QUEUE, -(int64_t)source->queue[i].size);
+		av_frame_free(&(source->queue[i].frame));
+	}
+
+	source->queue_offset += trimmed;
+	source->queue_length -= trimmed;
+	memmove(source->queue, source->queue + trimmed, source->queue_length * sizeof(decoded_frame_t));
+
+	pthread_cond_broadcast(&(source->cond));
+}
+
 bool poll_av_data(decoder_t *decoder) {
 	decoder_state_t *av = &(decoder->state);
+	decoder_source_t *source = av->source;
 
-	if (decoder->end_of_input)
+	if (av->input_drained)
 		return false;
 
-	AVPacket packet;
+	pthread_mutex_lock(&(source->mutex));
+	int *position = &(source->view_positions[av->source_view]);
 
-	if (av_read_frame(av->format, &packet) >= 0) {
-		if (packet.stream_index == av->audio_stream_index)
-			poll_av_packet_audio(decoder, &packet);
-		else if (packet.stream_index == av->video_stream_index)
-			poll_av_packet_video(decoder, &packet);
+	// Whichever view runs out of decoded data first is responsible for
+	// decoding more. Views that get too far ahead of the others wait for them
+	// to catch up, in order to bound the number of frames kept in memory.
+	while (*position >= (source->queue_offset + source->queue_length)) {
+		if (source->decoder.end_of_input)
+			break;
 
-		av_packet_unref(&packet);
-		return true;
-	} else {
-		// out is always padded out with 4032 "0" samples, this makes calculations elsewhere easier
-		if (av->audio_stream)
-			memset(
-				decoder->audio_samples + decoder->audio_sample_count,
-				0,
-				4032 * av->sample_count_mul * sizeof(int16_t)
-			);
+		if (
+			source->queue_length >= DECODER_QUEUE_SIZE ||
+			(source->max_queue_size && source->queue_size >= source->max_queue_size)
+		) {
+			uint64_t t = begin_trace_span();
+			pthread_cond_wait(&(source->cond), &(source->mutex));
+			end_trace_span("wait_decoder", "wait", t, NULL, 0);
+		} else
+			decode_av_source_packet(source, av->stats);
+	}
 
-		decoder->end_of_input = true;
+	if (*position >= (source->queue_offset + source->queue_length)) {
+		pthread_mutex_unlock(&(source->mutex));
+
+		av->input_drained = true;
 		return false;
 	}
+
+	decoded_frame_t entry = source->queue[*position - source->queue_offset];
+	AVFrame *frame = (entry.frame != NULL) ? av_frame_clone(entry.frame) : NULL;
+
+	(*position)++;
+	trim_av_source(source);
+	pthread_mutex_unlock(&(source->mutex));
+
+	// Empty entries are handled by passing the view's own (always empty)
+	// frame to the conversion functions.
+	uint64_t t = begin_stage(av->stats);
+
+	if (entry.is_video && av->video_stream != NULL) {
+		convert_av_frame_video(decoder, (frame != NULL) ? frame : av->frame);
+		end_stage(av->stats, STAGE_SCALE, t);
+	} else if (!entry.is_video && av->audio_stream != NULL) {
+		convert_av_frame_audio(decoder, (frame != NULL) ? frame : av->frame);
+		end_stage(av->stats, STAGE_RESAMPLE, t);
+	}
+
+	av_frame_free(&frame);
+	return true;
 }
 
 bool ensure_av_data(decoder_t *decoder, int needed_audio_samples, int needed_video_frames) {
@@ -521,6 +1133,11 @@ bool ensure_av_data(decoder_t *decoder, int needed_audio_samples, int needed_vid
 #endif
 		//fprintf(stderr, "ensure %d -> %d, %d -> %d\n", decoder->audio_sample_count, needed_audio_samples, decoder->video_frame_count, needed_video_frames);
 		if (!poll_av_data(decoder)) {
+			// The end of the input file is only reported once more data than
+			// what is left is requested, regardless of how far ahead
+			// prefetch_av_data() may have decoded.
+			decoder->end_of_input = true;
+
 			// Keep returning true even if the end of the input file has been
 			// reached, if the buffer is not yet completely empty.
 			return
@@ -533,6 +1150,15 @@ bool ensure_av_data(decoder_t *decoder, int needed_audio_samples, int needed_vid
 	return true;
 }
 
+// Decodes further ahead than ensure_av_data() would (e.g. to keep worker
+// threads busy) without affecting when the end of the input is reported.
+void prefetch_av_data(decoder_t *decoder, int needed_video_frames) {
+	while (decoder->video_frame_count < needed_video_frames) {
+		if (!poll_av_data(decoder))
+			break;
+	}
+}
+
 void retire_av_data(decoder_t *decoder, int retired_audio_samples, int retired_video_frames) {
 	//fprintf(stderr, "retire %d -> %d, %d -> %d\n", decoder->audio_sample_count, retired_audio_samples, decoder->video_frame_count, retired_video_frames);
 	assert(retired_audio_samples <= decoder->audio_sample_count);
@@ -547,12 +1173,31 @@ void retire_av_data(decoder_t *decoder, int retired_audio_samples, int retired_v
 			decoder->audio_samples + retired_audio_samples,
 			(decoder->audio_sample_count - retired_audio_samples) * sample_size
 		);
-	if (decoder->video_frame_count > retired_video_frames)
+	if (decoder->state.video_zero_copy) {
+		AVFrame **refs = decoder->state.video_frame_refs;
+
+		for (int i = 0; i < retired_video_frames; i++)
+			av_frame_free(&refs[i]);
+
+		if (decoder->video_frame_count > retired_video_frames) {
+			memmove(
+				refs,
+				refs + retired_video_frames,
+				(decoder->video_frame_count - retired_video_frames) * sizeof(AVFrame *)
+			);
+			memmove(
+				decoder->video_planes,
+				decoder->video_planes + retired_video_frames,
+				(decoder->video_frame_count - retired_video_frames) * sizeof(psx_mdec_frame_planes_t)
+			);
+		}
+	} else if (decoder->video_frame_count > retired_video_frames) {
 		memmove(
 			decoder->video_frames,
 			decoder->video_frames + retired_video_frames * frame_size,
 			(decoder->video_frame_count - retired_video_frames) * frame_size
 		);
+	}
 
 	decoder->audio_sample_count -= retired_audio_samples;
 	decoder->video_frame_count -= retired_video_frames;
@@ -560,22 +1205,58 @@ void retire_av_data(decoder_t *decoder, int retired_audio_samples, int retired_v
 
 void close_av_data(decoder_t *decoder) {
 	decoder_state_t *av = &(decoder->state);
+	decoder_source_t *source = av->source;
+
+	// Detach the view from the source, so that other views no longer wait
+	// for it.
+	if (source != NULL) {
+		pthread_mutex_lock(&(source->mutex));
+		source->view_positions[av->source_view] = INT_MAX;
+		trim_av_source(source);
+		pthread_mutex_unlock(&(source->mutex));
+	}
 
 	av_frame_free(&(av->frame));
 	swr_free(&(av->resampler));
+	sws_freeContext(av->scaler);
+	av->scaler = NULL;
+	tracked_free(av->video_scaler_workspace);
+	av->video_scaler_workspace = NULL;
+	decoder->video_scaler = NULL;
+
+	for (int i = 0; av->video_frame_refs != NULL && i < decoder->video_frame_count; i++)
+		av_frame_free(&(av->video_frame_refs[i]));
+
+	tracked_free(decoder->audio_samples);
+	tracked_free(decoder->video_frames);
+	tracked_free(decoder->video_planes);
+	tracked_free(av->video_frame_refs);
+	decoder->audio_samples = NULL;
+	decoder->video_frames = NULL;
+	decoder->video_planes = NULL;
+	av->video_frame_refs = NULL;
+	av->audio_sample_capacity = 0;
+	av->video_frame_capacity = 0;
+}
+
+void close_av_source(decoder_source_t *source) {
+	decoder_state_t *av = &(source->decoder.state);
+
+	for (int i = 0; i < source->queue_length; i++) {
+		track_memory(MEMORY_DECODER_QUEUE, -(int64_t)source->queue[i].size);
+		av_frame_free(&(source->queue[i].frame));
+	}
+
+	av_frame_free(&(av->frame));
 #if LIBAVCODEC_VERSION_MAJOR < 61
 	// Deprecated, kept for compatibility with older FFmpeg versions.
 	avcodec_close(av->audio_codec_context);
 #endif
 	avcodec_free_context(&(av->audio_codec_context));
+	avcodec_free_context(&(av->video_codec_context));
 	avformat_free_context(av->format);
 
-	if(decoder->audio_samples != NULL) {
-		free(decoder->audio_samples);
-		decoder->audio_samples = NULL;
-	}
-	if(decoder->video_frames != NULL) {
-		free(decoder->video_frames);
-		decoder->video_frames = NULL;
-	}
+	free(source->view_positions);
+	pthread_mutex_destroy(&(source->mutex));
+	pthread_cond_destroy(&(source->cond));
 }
@@ -24,6 +24,7 @@ freely, subject to the following restrictions:
 
 #pragma once
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <libavutil/opt.h>
@@ -32,7 +33,13 @@ freely, subject to the following restrictions:
 #include <libavformat/avformat.h>
 #include <libswresample/swresample.h>
 #include <libswscale/swscale.h>
+#include <libpsxav.h>
 #include "args.h"
+#include "stats.h"
+
+#define DECODER_QUEUE_SIZE 32
+
+typedef struct decoder_source_t decoder_source_t;
 
 typedef struct {
 	int video_frame_dst_size;
@@ -46,6 +53,23 @@ typedef struct {
 	struct SwrContext* resampler;
 	struct SwsContext* scaler;
 	AVFrame* frame;
+	bool audio_direct; // frames can bypass libswresample if they match the output rate and layout
+	bool video_direct; // frames can bypass libswscale if they match the input format and size
+	bool video_zero_copy; // frames are referenced rather than converted
+	bool video_full_range;
+	uint8_t video_luma_lut[256]; // used to convert limited range frames
+	uint8_t video_chroma_lut[256];
+	int video_direct_width; // size frames must have to bypass libswscale
+	int video_direct_height;
+	void *video_scaler_workspace;
+	decoder_source_t *source;
+	int source_view;
+	bool input_drained;
+	encode_stats_t *stats; // NULL if not collecting statistics
+
+	int audio_sample_capacity;
+	int video_frame_capacity;
+	AVFrame **video_frame_refs; // one per queued frame if frames are referenced
 
 	int sample_count_mul;
 
@@ -56,6 +80,8 @@ typedef struct {
 	int16_t *audio_samples;
 	int audio_sample_count;
 	uint8_t *video_frames;
+	psx_mdec_frame_planes_t *video_planes; // used instead of video_frames if not NULL
+	psx_mdec_scaler_t *video_scaler; // NULL if frames bypassing libswscale are not scaled
 	int video_frame_count;
 
 	int video_width;
@@ -67,6 +93,29 @@ typedef struct {
 	decoder_state_t state;
 } decoder_t;
 
+typedef struct {
+	AVFrame *frame; // NULL if the packet did not produce any frame
+	size_t size;
+	bool is_video;
+} decoded_frame_t;
+
+// A source demuxes and decodes the input file once, then hands the decoded
+// frames over to any number of views (one per output file). Frames are kept in
+// the queue until all views have converted them.
+struct decoder_source_t {
+	decoder_t decoder;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+
+	decoded_frame_t queue[DECODER_QUEUE_SIZE];
+	int queue_offset;
+	int queue_length;
+	size_t queue_size; // in bytes
+	size_t max_queue_size; // in bytes, 0 = only limited by DECODER_QUEUE_SIZE
+	int *view_positions;
+	int view_count;
+};
+
 enum {
 	DECODER_USE_AUDIO      = 1 << 0,
 	DECODER_USE_VIDEO      = 1 << 1,
@@ -74,9 +123,12 @@ enum {
 	DECODER_VIDEO_REQUIRED = 1 << 3
 };
 
-bool open_av_data(decoder_t *decoder, const args_t *args, int flags);
+bool open_av_source(decoder_source_t *source, const args_t *args, int flags, int view_count);
+bool open_av_view(decoder_t *decoder, decoder_source_t *source, int view_index, const args_t *args, int flags);
 int get_av_loop_point(decoder_t *decoder, const args_t *args);
 bool poll_av_data(decoder_t *decoder);
 bool ensure_av_data(decoder_t *decoder, int needed_audio_samples, int needed_video_frames);
+void prefetch_av_data(decoder_t *decoder, int needed_video_frames);
 void retire_av_data(decoder_t *decoder, int retired_audio_samples, int retired_video_frames);
 void close_av_data(decoder_t *decoder);
+void close_av_source(decoder_source_t *source);
@@ -0,0 +1,448 @@
+/*
+psxavenc: MDEC video + SPU/XA-ADPCM audio encoder frontend
+
+Copyright (c) 2019, 2020 Adrian "asie" Siekierka
+Copyright (c) 2019 Ben "GreaseMonkey" Russell
+Copyright (c) 2023, 2025 spicyjpeg
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libpsxav.h>
+#include "demux.h"
+
+static const uint8_t sector_sync[12] = {
+	0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00
+};
+
+static long get_file_size(FILE *file) {
+	if (fseek(file, 0, SEEK_END) != 0)
+		return -1;
+
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	return size;
+}
+
+// There is no header that identifies the sector size of a .str or .xa file,
+// however 2352-byte sectors always start with a sync sequence and 2336-byte
+// sectors always start with two identical copies of the CD-XA subheader.
+// Returns 0 if the sector size could not be determined.
+int detect_sector_size(const uint8_t *header, long file_size) {
+	if (memcmp(header, sector_sync, sizeof(sector_sync)) == 0)
+		return PSX_CDROM_SECTOR_SIZE;
+	if (memcmp(header, header + 4, 4) == 0 && (file_size % 2336) == 0)
+		return 2336;
+	if ((file_size % 2048) == 0)
+		return 2048;
+
+	return 0;
+}
+
+static bool detect_demux_sector_size(demux_t *demux, long file_size) {
+	uint8_t header[16];
+
+	if (fread(header, sizeof(header), 1, demux->file) != 1)
+		return false;
+
+	fseek(demux->file, 0, SEEK_SET);
+	demux->sector_size = detect_sector_size(header, file_size);
+
+	if (demux->sector_size == PSX_CDROM_SECTOR_SIZE)
+		demux->payload_offset = 0x018;
+	else if (demux->sector_size == 2336)
+		demux->payload_offset = 0x008;
+	else if (demux->sector_size == 2048)
+		demux->payload_offset = 0x000;
+	else
+		return false;
+
+	return true;
+}
+
+static demux_frame_t *alloc_demux_frame(demux_t *demux, int frame_index, int chunk_count) {
+	if (frame_index >= demux->frame_count) {
+		int new_count = frame_index + 256;
+
+		demux->frames = realloc(demux->frames, new_count * sizeof(demux_frame_t));
+		memset(demux->frames + demux->frame_count, 0, (new_count - demux->frame_count) * sizeof(demux_frame_t));
+		demux->frame_count = new_count;
+	}
+
+	demux_frame_t *frame = &(demux->frames[frame_index]);
+
+	if (frame->chunk_offsets == NULL) {
+		frame->max_size = chunk_count * STR_CHUNK_DATA_SIZE;
+		frame->chunk_count = chunk_count;
+		frame->chunk_offsets = malloc(chunk_count * sizeof(long));
+
+		for (int i = 0; i < chunk_count; i++)
+			frame->chunk_offsets[i] = -1;
+	}
+
+	return frame;
+}
+
+static void init_demux(demux_t *demux) {
+	demux->frames = NULL;
+	demux->frame_count = 0;
+	demux->video_width = 0;
+	demux->video_height = 0;
+	demux->audio_offsets = NULL;
+	demux->audio_sector_count = 0;
+	demux->audio_file = 0;
+	demux->audio_channel = 0;
+	demux->audio_frequency = 0;
+	demux->audio_channels = 0;
+	demux->audio_bit_depth = 0;
+}
+
+// XA-ADPCM sectors are assumed to belong to the .str file's audio track if
+// they have the same file and channel number as the first one, as .str files
+// normally contain at most one track.
+static void add_demux_audio_sector(demux_t *demux, const uint8_t *subheader, long sector_offset, int *capacity) {
+	if (demux->audio_sector_count == 0) {
+		uint8_t coding = subheader[3];
+
+		demux->audio_file = subheader[0];
+		demux->audio_channel = subheader[1];
+		demux->audio_channels = ((coding & PSX_CDROM_SECTOR_XA_CODING_CHANNEL_MASK) == PSX_CDROM_SECTOR_XA_CODING_STEREO) ? 2 : 1;
+		demux->audio_frequency = ((coding & PSX_CDROM_SECTOR_XA_CODING_FREQ_MASK) == PSX_CDROM_SECTOR_XA_CODING_FREQ_SINGLE) ? PSX_AUDIO_XA_FREQ_SINGLE : PSX_AUDIO_XA_FREQ_DOUBLE;
+		demux->audio_bit_depth = ((coding & PSX_CDROM_SECTOR_XA_CODING_BITS_MASK) == PSX_CDROM_SECTOR_XA_CODING_BITS_8) ? 8 : 4;
+	} else if (subheader[0] != demux->audio_file || subheader[1] != demux->audio_channel) {
+		return;
+	}
+
+	if (demux->audio_sector_count >= *capacity) {
+		*capacity += 1024;
+		demux->audio_offsets = realloc(demux->audio_offsets, *capacity * sizeof(long));
+	}
+
+	demux->audio_offsets[demux->audio_sector_count++] = sector_offset;
+}
+
+bool open_demux_str(demux_t *demux, const char *path, uint16_t str_video_id) {
+	init_demux(demux);
+	demux->file = fopen(path, "rb");
+
+	if (demux->file == NULL)
+		return false;
+
+	long file_size = get_file_size(demux->file);
+
+	if (file_size <= 0 || !detect_demux_sector_size(demux, file_size)) {
+		fprintf(stderr, "Failed to detect sector size of %s\n", path);
+		close_demux(demux);
+		return false;
+	}
+
+	uint8_t sector[PSX_CDROM_SECTOR_SIZE];
+	long sector_offset = 0;
+	int audio_capacity = 0;
+
+	for (; fread(sector, demux->sector_size, 1, demux->file) == 1; sector_offset += demux->sector_size) {
+		// XA-ADPCM sectors have no .str chunk header.
+		if (demux->payload_offset > 0) {
+			const uint8_t *subheader = sector + demux->payload_offset - 8;
+
+			if (subheader[2] & PSX_CDROM_SECTOR_XA_SUBMODE_AUDIO) {
+				add_demux_audio_sector(demux, subheader, sector_offset, &audio_capacity);
+				continue;
+			}
+		}
+
+		const uint8_t *header = sector + demux->payload_offset;
+		uint16_t chunk_type = header[0x002] | (header[0x003] << 8);
+
+		if (header[0x000] != 0x60 || header[0x001] != 0x01 || chunk_type != str_video_id)
+			continue;
+
+		int chunk_index = header[0x004] | (header[0x005] << 8);
+		int chunk_count = header[0x006] | (header[0x007] << 8);
+		int frame_index = header[0x008] | (header[0x009] << 8) | (header[0x00A] << 16);
+		int bytes_used = header[0x00C] | (header[0x00D] << 8) | (header[0x00E] << 16);
+
+		if (chunk_count == 0 || chunk_index >= chunk_count || bytes_used > chunk_count * STR_CHUNK_DATA_SIZE)
+			continue;
+
+		demux_frame_t *frame = alloc_demux_frame(demux, frame_index, chunk_count);
+
+		if (frame->chunk_count != chunk_count)
+			continue;
+
+		frame->bytes_used = bytes_used;
+		frame->chunk_offsets[chunk_index] = sector_offset + demux->payload_offset + STR_CHUNK_HEADER_SIZE;
+
+		demux->video_width = header[0x010] | (header[0x011] << 8);
+		demux->video_height = header[0x012] | (header[0x013] << 8);
+	}
+
+	return true;
+}
+
+bool is_bs_frame_header(const uint8_t *header) {
+	// Check for a valid MDEC command and BS version in the frame header.
+	return header[0x002] == 0x00 && header[0x003] == 0x38 && (header[0x006] == 0x02 || header[0x006] == 0x03);
+}
+
+// .sbs files do not store the length of each frame, but as the BS bitstream
+// always ends with an all-ones end-of-frame code and the rest of each slot is
+// zero-filled it can be recovered by stripping trailing zeroes.
+static int get_bs_frame_length(const uint8_t *frame, int size) {
+	while (size > 8 && frame[size - 1] == 0)
+		size--;
+
+	return (size + 3) & ~3;
+}
+
+bool open_demux_sbs(demux_t *demux, const char *path, int slot_size) {
+	init_demux(demux);
+	demux->sector_size = slot_size;
+	demux->payload_offset = 0;
+	demux->file = fopen(path, "rb");
+
+	if (demux->file == NULL)
+		return false;
+
+	uint8_t *slot = malloc(slot_size);
+	long slot_offset = 0;
+
+	for (int i = 1; fread(slot, slot_size, 1, demux->file) == 1; i++, slot_offset += slot_size) {
+		if (!is_bs_frame_header(slot))
+			continue;
+
+		demux_frame_t *frame = alloc_demux_frame(demux, i, 1);
+
+		frame->max_size = slot_size;
+		frame->bytes_used = get_bs_frame_length(slot, slot_size);
+		frame->chunk_offsets[0] = slot_offset;
+	}
+
+	free(slot);
+	return true;
+}
+
+// The slot size of an .sbs file is not stored anywhere either, so it is
+// assumed to be the smallest power of two (or the given size, which is tried
+// first) for which all slots in the file begin with a BS frame header.
+static bool check_sbs_slot_size(FILE *file, long file_size, int slot_size) {
+	if (slot_size < 8 || (file_size % slot_size) != 0)
+		return false;
+
+	uint8_t header[8];
+
+	for (long offset = 0; offset < file_size; offset += slot_size) {
+		if (fseek(file, offset, SEEK_SET) != 0 || fread(header, sizeof(header), 1, file) != 1)
+			return false;
+		if (!is_bs_frame_header(header))
+			return false;
+	}
+
+	return true;
+}
+
+bool open_demux_any(demux_t *demux, const char *path, uint16_t str_video_id, int sbs_slot_size) {
+	FILE *file = fopen(path, "rb");
+
+	if (file == NULL)
+		return false;
+
+	uint8_t header[8];
+	long file_size = get_file_size(file);
+
+	if (file_size < (long)sizeof(header) || fread(header, sizeof(header), 1, file) != 1) {
+		fclose(file);
+		return false;
+	}
+
+	// .str files never begin with a BS frame header, as they start with
+	// either a sync sequence, a CD-XA subheader or a .str chunk header.
+	if (!is_bs_frame_header(header)) {
+		fclose(file);
+		return open_demux_str(demux, path, str_video_id);
+	}
+
+	int slot_size = 0;
+
+	if (check_sbs_slot_size(file, file_size, sbs_slot_size)) {
+		slot_size = sbs_slot_size;
+	} else {
+		for (int size = 2048; size <= 0x100000; size <<= 1) {
+			if (check_sbs_slot_size(file, file_size, size)) {
+				slot_size = size;
+				break;
+			}
+		}
+	}
+
+	fclose(file);
+
+	if (slot_size == 0) {
+		fprintf(stderr, "Failed to detect slot size of %s\n", path);
+		return false;
+	}
+
+	return open_demux_sbs(demux, path, slot_size);
+}
+
+const demux_frame_t *get_demux_frame(const demux_t *demux, int frame_index) {
+	if (frame_index < 0 || frame_index >= demux->frame_count)
+		return NULL;
+
+	const demux_frame_t *frame = &(demux->frames[frame_index]);
+
+	if (frame->chunk_offsets == NULL)
+		return NULL;
+
+	// Ignore frames that are missing one or more chunks.
+	for (int i = 0; i < frame->chunk_count; i++) {
+		if (frame->chunk_offsets[i] < 0)
+			return NULL;
+	}
+
+	return frame;
+}
+
+int read_demux_frame(demux_t *demux, int frame_index, uint8_t *output, int max_size) {
+	const demux_frame_t *frame = get_demux_frame(demux, frame_index);
+
+	if (frame == NULL || frame->bytes_used > max_size)
+		return -1;
+
+	int chunk_size = (frame->chunk_count > 1) ? STR_CHUNK_DATA_SIZE : frame->max_size;
+	int offset = 0;
+
+	for (int i = 0; i < frame->chunk_count && offset < frame->bytes_used; i++) {
+		int length = frame->bytes_used - offset;
+
+		if (length > chunk_size)
+			length = chunk_size;
+
+		if (fseek(demux->file, frame->chunk_offsets[i], SEEK_SET) != 0)
+			return -1;
+		if (fread(output + offset, length, 1, demux->file) != 1)
+			return -1;
+
+		offset += length;
+	}
+
+	return frame->bytes_used;
+}
+
+// .sbs files do not store the video resolution, so it can only be validated by
+// parsing the first frame and making sure the bitstream ends right after the
+// last macroblock of a frame of the given resolution.
+bool check_demux_resolution(demux_t *demux, int width, int height) {
+	for (int i = 0; i < demux->frame_count; i++) {
+		const demux_frame_t *frame = get_demux_frame(demux, i);
+
+		if (frame == NULL)
+			continue;
+
+		uint8_t *data = malloc(frame->bytes_used);
+		void *workspace = malloc(psx_mdec_get_decoder_workspace_size());
+		bool ok = false;
+
+		if (data != NULL && workspace != NULL) {
+			int length = read_demux_frame(demux, i, data, frame->bytes_used);
+			psx_mdec_settings_t settings;
+
+			settings.version = (data[0x006] == 0x02) ? PSX_MDEC_BS_V2 : PSX_MDEC_BS_V3;
+			settings.width = width;
+			settings.height = height;
+
+			psx_mdec_decoder_t *decoder = psx_mdec_init_decoder(settings, workspace);
+			ok = (length > 0) && (decoder != NULL) && psx_mdec_check_frame(decoder, data, length);
+		}
+
+		free(data);
+		free(workspace);
+		return ok;
+	}
+
+	return true;
+}
+
+// Reads the CD-XA subheader and data of the given sector of the audio track
+// (2336 bytes, as in a .str file with 2336-byte sectors).
+bool read_demux_audio_sector(demux_t *demux, int index, uint8_t *output) {
+	if (index < 0 || index >= demux->audio_sector_count)
+		return false;
+
+	long offset = demux->audio_offsets[index] + demux->payload_offset - 8;
+
+	if (fseek(demux->file, offset, SEEK_SET) != 0)
+		return false;
+
+	return fread(output, 2336, 1, demux->file) == 1;
+}
+
+// As .str files do not store their frame rate, it is measured by counting the
+// frames that start between the first and last sector of the audio track, whose
+// playback duration is known. Returns false if the file has no audio track.
+bool measure_demux_frame_rate(const demux_t *demux, int *frame_count, double *duration) {
+	if (demux->audio_sector_count < 2)
+		return false;
+
+	long first_offset = demux->audio_offsets[0];
+	long last_offset = demux->audio_offsets[demux->audio_sector_count - 1];
+	*frame_count = 0;
+
+	for (int i = 0; i < demux->frame_count; i++) {
+		const demux_frame_t *frame = get_demux_frame(demux, i);
+
+		if (frame != NULL && frame->chunk_offsets[0] >= first_offset && frame->chunk_offsets[0] < last_offset)
+			(*frame_count)++;
+	}
+
+	psx_audio_xa_settings_t settings;
+	settings.stereo = (demux->audio_channels == 2);
+	settings.frequency = demux->audio_frequency;
+	settings.bits_per_sample = demux->audio_bit_depth;
+
+	int samples_per_sector = psx_audio_xa_get_samples_per_sector(settings);
+	*duration = (double)(demux->audio_sector_count - 1) * samples_per_sector / demux->audio_frequency;
+	return true;
+}
+
+void close_demux(demux_t *demux) {
+	for (int i = 0; i < demux->frame_count; i++) {
+		if (demux->frames[i].chunk_offsets != NULL)
+			free(demux->frames[i].chunk_offsets);
+	}
+
+	if (demux->frames != NULL) {
+		free(demux->frames);
+		demux->frames = NULL;
+	}
+	if (demux->audio_offsets != NULL) {
+		free(demux->audio_offsets);
+		demux->audio_offsets = NULL;
+	}
+	if (demux->file != NULL) {
+		fclose(demux->file);
+		demux->file = NULL;
+	}
+
+	demux->frame_count = 0;
+	demux->audio_sector_count = 0;
+}
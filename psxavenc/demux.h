@@ -0,0 +1,75 @@
+/*
+psxavenc: MDEC video + SPU/XA-ADPCM audio encoder frontend
+
+Copyright (c) 2019, 2020 Adrian "asie" Siekierka
+Copyright (c) 2019 Ben "GreaseMonkey" Russell
+Copyright (c) 2023, 2025 spicyjpeg
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define STR_CHUNK_HEADER_SIZE 0x20
+#define STR_CHUNK_DATA_SIZE   2016
+
+typedef struct {
+	int max_size;
+	int bytes_used;
+	int chunk_count;
+	long *chunk_offsets;
+} demux_frame_t;
+
+typedef struct {
+	FILE *file;
+	int sector_size;
+	int payload_offset;
+	int video_width;
+	int video_height;
+
+	// Frames are indexed by the frame number stored in their .str chunk
+	// headers, which starts from 1. For .sbs files the frame number is simply
+	// the index of the frame's slot plus one.
+	demux_frame_t *frames;
+	int frame_count;
+
+	// Offsets of the sectors making up the XA-ADPCM track of a .str file, if
+	// any, and the track's format as stored in the first sector's subheader.
+	long *audio_offsets;
+	int audio_sector_count;
+	int audio_file;
+	int audio_channel;
+	int audio_frequency;
+	int audio_channels;
+	int audio_bit_depth;
+} demux_t;
+
+int detect_sector_size(const uint8_t *header, long file_size);
+bool is_bs_frame_header(const uint8_t *header);
+bool open_demux_str(demux_t *demux, const char *path, uint16_t str_video_id);
+bool open_demux_sbs(demux_t *demux, const char *path, int slot_size);
+bool open_demux_any(demux_t *demux, const char *path, uint16_t str_video_id, int sbs_slot_size);
+const demux_frame_t *get_demux_frame(const demux_t *demux, int frame_index);
+int read_demux_frame(demux_t *demux, int frame_index, uint8_t *output, int max_size);
+bool check_demux_resolution(demux_t *demux, int width, int height);
+bool read_demux_audio_sector(demux_t *demux, int index, uint8_t *output);
+bool measure_demux_frame_rate(const demux_t *demux, int *frame_count, double *duration);
+void close_demux(demux_t *demux);
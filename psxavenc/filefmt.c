@@ -23,34 +23,38 @@ freely, subject to the following restrictions:
 */
 
 #include <assert.h>
+#include <limits.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <libpsxav.h>
 #include "args.h"
+#include "cache.h"
 #include "decoding.h"
+#include "filefmt.h"
 #include "mdec.h"
+#include "range.h"
+#include "stats.h"
+#include "trace.h"
 
-static time_t start_time = 0;
-static time_t last_progress_update = 0;
+static void write_output(encode_stats_t *stats, const void *data, size_t length, FILE *output) {
+	uint64_t t = begin_stage(stats);
+	fwrite(data, length, 1, output);
+	end_stage(stats, STAGE_WRITE, t);
 
-static time_t get_elapsed_time(void) {
-	time_t t;
-
-	if (start_time > 0) {
-		t = time(NULL) - start_time;
-	} else {
-		t = 0;
-		start_time = time(NULL);
-	}
+	if (stats != NULL)
+		stats->bytes_written += length;
+}
 
-	if (t <= last_progress_update)
-		return 0;
+static double get_avg_quant_scale(const mdec_encoder_t *encoder) {
+	if (encoder->state.frame_index <= 0)
+		return 0.0;
 
-	last_progress_update = t;
-	return t;
+	return (double)encoder->state.quant_scale_sum / (double)encoder->state.frame_index;
 }
 
 static psx_audio_xa_settings_t args_to_libpsxav_xa_audio(const args_t *args) {
@@ -70,7 +74,152 @@ static psx_audio_xa_settings_t args_to_libpsxav_xa_audio(const args_t *args) {
 	return settings;
 };
 
-static void init_sector_buffer_video(const args_t *args, uint8_t *sector, int lba) {
+static int64_t get_gcd(int64_t a, int64_t b) {
+	while (b) {
+		int64_t t = a % b;
+		a = b;
+		b = t;
+	}
+
+	return a;
+}
+
+// Calculates the average number of sectors in each group of interleaved audio
+// and video sectors (as a fraction), as well as how many of them hold audio
+// data. When multiple streams are muxed together, each stream only gets
+// str_mux_num out of every str_mux_den sectors read from the disc and its
+// interleave is scaled down accordingly.
+static bool get_str_interleave(const args_t *args, bool has_audio, int64_t *interleave_num, int64_t *interleave_den, int *audio_sectors_per_block) {
+	int speed_num = args->str_cd_speed * args->str_mux_num;
+	int speed_den = args->str_mux_den;
+
+	if (!has_audio) {
+		*interleave_num = 1;
+		*interleave_den = 1;
+		*audio_sectors_per_block = 0;
+		return true;
+	}
+
+	if (args->format == FORMAT_STRSPU) {
+		int samples_per_chunk = args->audio_interleave / PSX_AUDIO_SPU_BLOCK_SIZE * PSX_AUDIO_SPU_SAMPLES_PER_BLOCK;
+		int chunk_size = args->audio_interleave * args->audio_channels + args->alignment - 1;
+		chunk_size -= chunk_size % args->alignment;
+
+		// Each chunk is placed at the first sector read after the previous
+		// one has finished playing, so that audio never underruns, but the
+		// fractional part is carried over to the next block rather than
+		// discarded in order to prevent audio from drifting.
+		*interleave_num = (int64_t)75 * speed_num * samples_per_chunk;
+		*interleave_den = (int64_t)args->audio_frequency * speed_den;
+		*audio_sectors_per_block = (chunk_size + 2015) / 2016;
+	} else {
+		psx_audio_xa_settings_t xa_settings = args_to_libpsxav_xa_audio(args);
+		int xa_interleave = psx_audio_xa_get_sector_interleave(xa_settings) * speed_num;
+
+		// XA-ADPCM sectors must be evenly spaced on the disc.
+		if (xa_interleave % speed_den) {
+			fprintf(stderr, "XA-ADPCM sectors cannot be evenly spaced using the specified interleaving pattern\n");
+			return false;
+		}
+
+		*interleave_num = xa_interleave / speed_den;
+		*interleave_den = 1;
+		*audio_sectors_per_block = 1;
+	}
+
+	int64_t gcd = get_gcd(*interleave_num, *interleave_den);
+	*interleave_num /= gcd;
+	*interleave_den /= gcd;
+
+	// Even the shortest block must have room for at least one video sector.
+	if ((*interleave_num / *interleave_den) <= *audio_sectors_per_block) {
+		fprintf(stderr, "Audio data rate too high for the specified CD-ROM speed and interleaving pattern\n");
+		return false;
+	}
+
+	return true;
+}
+
+bool init_str_layout(str_layout_t *layout, const args_t *args, bool has_audio) {
+	int64_t interleave_num, interleave_den;
+
+	if (!get_str_interleave(args, has_audio, &interleave_num, &interleave_den, &(layout->audio_sectors_per_block)))
+		return false;
+
+	// A/N audio, (N-A)/N video, or 0/1 audio, 1/1 video if there is no audio
+	layout->interleave = (int)((interleave_num + interleave_den - 1) / interleave_den);
+	layout->video_sectors_per_block = layout->interleave - layout->audio_sectors_per_block;
+	layout->audio_end = -1;
+	layout->trailing_audio = (args->flags & FLAG_STR_TRAILING_AUDIO) != 0;
+
+	// e.g. 15fps = (150*7/8/15) = 8.75 blocks per frame
+	int64_t base = (int64_t)(75 * args->str_cd_speed * args->str_mux_num) * (interleave_num - layout->audio_sectors_per_block * interleave_den) * args->str_fps_den;
+	int64_t den = interleave_num * args->str_fps_num * args->str_mux_den;
+	int64_t gcd = get_gcd(base, den);
+	base /= gcd;
+	den /= gcd;
+
+	// The fractional part of each frame's size is accumulated in an int, so
+	// both terms must leave enough headroom.
+	if (interleave_num > INT_MAX || base > (INT_MAX / 2) || den > (INT_MAX / 2)) {
+		fprintf(stderr, "Frame rate and audio settings cannot be represented exactly (try a simpler frame rate or sample rate)\n");
+		return false;
+	}
+
+	layout->interleave_num = (int)interleave_num;
+	layout->interleave_den = (int)interleave_den;
+	layout->frame_block_base_overflow = (int)base;
+	layout->frame_block_overflow_den = (int)den;
+	return true;
+}
+
+// Returns the index of the given sector within its block of audio sectors, or
+// -1 if it is a video sector.
+int get_str_audio_chunk_index(const str_layout_t *layout, int lba) {
+	if (layout->audio_end >= 0 && lba >= layout->audio_end)
+		return -1;
+
+	int64_t num = layout->interleave_num;
+	int64_t den = layout->interleave_den;
+
+	// Find the last block starting at or before this sector.
+	int64_t block = ((int64_t)(lba + 1) * den - 1) / num;
+	int block_start = (int)((block * num) / den);
+	int block_length = (int)(((block + 1) * num) / den) - block_start;
+
+	int audio_chunk_index = lba - block_start;
+
+	if (layout->trailing_audio)
+		audio_chunk_index -= block_length - layout->audio_sectors_per_block;
+	if (audio_chunk_index < 0 || audio_chunk_index >= layout->audio_sectors_per_block)
+		return -1;
+
+	return audio_chunk_index;
+}
+
+// Returns an upper bound for the number of sectors (including audio sectors) a
+// single frame can span, used to skip encoding frames outside of a range.
+int get_str_max_frame_span(const str_layout_t *layout, double frame_size) {
+	int min_video_sectors = layout->video_sectors_per_block;
+
+	if (layout->interleave_num % layout->interleave_den)
+		min_video_sectors--;
+
+	return ((int)ceil(frame_size) / min_video_sectors + 2) * layout->interleave;
+}
+
+// Returns the number of bytes reserved for the given frame (starting from 1).
+// This matches the sizes encode_sector_str() assigns to frames as it goes, as
+// the fractional part of each frame's size is carried over to the next one.
+int get_str_frame_max_size(const str_layout_t *layout, int frame_index) {
+	int64_t base = layout->frame_block_base_overflow;
+	int64_t den = layout->frame_block_overflow_den;
+
+	int sectors = (int)((base * frame_index) / den - (base * (frame_index - 1)) / den);
+	return sectors * 2016;
+}
+
+void init_sector_buffer_video(const args_t *args, uint8_t *sector, int lba) {
 	psx_cdrom_sector_xa_subheader_t *subheader = NULL;
 
 	if (args->format == FORMAT_STRCD) {
@@ -90,6 +239,142 @@ static void init_sector_buffer_video(const args_t *args, uint8_t *sector, int lb
 	}
 }
 
+static void get_str_boundary(
+	str_boundary_t *boundary,
+	const mdec_encoder_t *encoder,
+	const psx_audio_encoder_channel_state_t *audio_state,
+	int audio_channels,
+	int lba,
+	int audio_end
+) {
+	boundary->lba = lba;
+	boundary->frame_index = encoder->state.frame_index;
+	boundary->frame_data_offset = encoder->state.frame_data_offset;
+	boundary->frame_max_size = encoder->state.frame_max_size;
+	boundary->frame_block_overflow_num = encoder->state.frame_block_overflow_num;
+	boundary->audio_end = audio_end;
+
+	memset(boundary->audio_state, 0, sizeof(boundary->audio_state));
+
+	if (audio_state != NULL)
+		memcpy(boundary->audio_state, audio_state, sizeof(psx_audio_encoder_channel_state_t) * audio_channels);
+
+	// The mean square error is only used for statistics and does not affect
+	// the encoded data.
+	for (int ch = 0; ch < audio_channels; ch++)
+		boundary->audio_state[ch].mse = 0;
+}
+
+// The XA-ADPCM encoder keeps the state of both channels in a single structure.
+static void get_xa_channel_states(psx_audio_encoder_channel_state_t *channels, const psx_audio_encoder_state_t *state) {
+	channels[0] = state->left;
+	channels[1] = state->right;
+}
+
+static void init_str_range(
+	const args_t *args,
+	str_range_t *range,
+	const mdec_encoder_t *encoder,
+	int sector_size,
+	int interleave
+) {
+	range->format = args->format;
+	range->sector_size = sector_size;
+	range->frame_block_base_overflow = encoder->state.frame_block_base_overflow;
+	range->frame_block_overflow_den = encoder->state.frame_block_overflow_den;
+	range->interleave = interleave;
+	range->audio_channels = args->audio_channels;
+	range->end_of_input = false;
+	range->start.lba = -1;
+	range->last_checkpoint = time(NULL);
+}
+
+static bool resume_str_boundaries(str_range_t *range, const str_range_t *resume) {
+	if (
+		range->sector_size != resume->sector_size ||
+		range->frame_block_base_overflow != resume->frame_block_base_overflow ||
+		range->frame_block_overflow_den != resume->frame_block_overflow_den ||
+		range->interleave != resume->interleave ||
+		range->audio_channels != resume->audio_channels
+	) {
+		fprintf(stderr, "Output file was encoded with different settings, cannot resume\n");
+		return false;
+	}
+
+	range->start = resume->start;
+	return true;
+}
+
+static bool update_str_boundaries(
+	const args_t *args,
+	str_range_t *range,
+	const str_range_t *resume,
+	const mdec_encoder_t *encoder,
+	const psx_audio_encoder_channel_state_t *audio_state,
+	int lba,
+	int audio_end,
+	FILE *output
+) {
+	str_boundary_t boundary;
+	get_str_boundary(&boundary, encoder, audio_state, args->audio_channels, lba, audio_end);
+
+	int output_start;
+
+	if (resume != NULL) {
+		// Encoding is deterministic, so the state of the encoder once it
+		// reaches the last checkpoint must match the saved one exactly.
+		if (lba == resume->end.lba && !compare_str_boundaries(&boundary, &(resume->end))) {
+			fprintf(stderr, "Encoder state does not match saved state at LBA %d, cannot resume\n", lba);
+			return false;
+		}
+
+		output_start = resume->end.lba;
+	} else {
+		if (lba == args->str_range_start)
+			range->start = boundary;
+
+		output_start = args->str_range_start;
+	}
+
+	if (args->str_checkpoint_interval <= 0 || lba <= output_start)
+		return true;
+
+	time_t t = time(NULL);
+
+	if ((t - range->last_checkpoint) < args->str_checkpoint_interval)
+		return true;
+
+	range->last_checkpoint = t;
+	range->end = boundary;
+	range->end_of_input = false;
+
+	// The output file must be flushed to disk before the state file is
+	// updated, so that the latter never refers to data that was not saved.
+	if (!sync_file(output) || !save_str_range(range, args->output_file))
+		fprintf(stderr, "\nFailed to save checkpoint: %s.state\n", args->output_file);
+
+	return true;
+}
+
+static bool save_str_boundaries(const args_t *args, str_range_t *range, bool end_of_input, FILE *output) {
+	if (!(args->flags & (FLAG_STR_RANGE | FLAG_STR_RESUME)) && args->str_checkpoint_interval <= 0)
+		return true;
+
+	// If the range starts past the end of the input file, no data will have
+	// been output and the range is empty.
+	if (range->start.lba < 0)
+		range->start = range->end;
+
+	range->end_of_input = end_of_input;
+
+	if (!sync_file(output) || !save_str_range(range, args->output_file)) {
+		fprintf(stderr, "\nFailed to save state file: %s.state\n", args->output_file);
+		return false;
+	}
+
+	return true;
+}
+
 #define VAG_HEADER_SIZE 0x30
 
 static void write_vag_header(const args_t *args, int size_per_channel, uint8_t *header) {
@@ -164,55 +449,66 @@ static void write_vag_header(const args_t *args, int size_per_channel, uint8_t *
 // The functions below are some peak spaghetti code I would rewrite if that
 // didn't also require scrapping the rest of the codebase. -- spicyjpeg
 
-void encode_file_xa(const args_t *args, decoder_t *decoder, FILE *output) {
+bool encode_file_xa(const args_t *args, decoder_t *decoder, encode_stats_t *stats, FILE *output) {
 	psx_audio_xa_settings_t xa_settings = args_to_libpsxav_xa_audio(args);
 
 	int audio_samples_per_sector = psx_audio_xa_get_samples_per_sector(xa_settings);
 
-	psx_audio_encoder_state_t audio_state;
-	memset(&audio_state, 0, sizeof(psx_audio_encoder_state_t));
+	void *stream_workspace = tracked_malloc(MEMORY_AUDIO_BUFFERS, psx_audio_xa_stream_get_workspace_size());
+	psx_audio_xa_stream_t *stream = psx_audio_xa_stream_init(xa_settings, 0, stream_workspace);
 
 	int sector_count = 0;
+	bool has_data;
 
-	for (; ensure_av_data(decoder, audio_samples_per_sector * args->audio_channels, 0); sector_count++) {
-		int samples_length = decoder->audio_sample_count / args->audio_channels;
+	do {
+		has_data = ensure_av_data(decoder, audio_samples_per_sector * args->audio_channels, 0);
 
-		if (samples_length > audio_samples_per_sector)
-			samples_length = audio_samples_per_sector;
+		// Samples are pushed as they are decoded, and the stream takes care of
+		// splitting them up into sectors and flagging the last one.
+		uint64_t t = begin_stage(stats);
 
-		uint8_t sector[PSX_CDROM_SECTOR_SIZE];
-		int length = psx_audio_xa_encode(
-			xa_settings,
-			&audio_state,
-			decoder->audio_samples,
-			samples_length,
-			sector_count,
-			sector
-		);
+		if (has_data) {
+			int pushed = psx_audio_xa_stream_push(stream, decoder->audio_samples, decoder->audio_sample_count / args->audio_channels);
+			retire_av_data(decoder, pushed * args->audio_channels, 0);
+		} else {
+			psx_audio_xa_stream_finalize(stream);
+		}
 
-		if (decoder->end_of_input)
-			psx_audio_xa_encode_finalize(xa_settings, sector, length);
+		end_stage(stats, STAGE_AUDIO, t);
 
-		retire_av_data(decoder, samples_length * args->audio_channels, 0);
-		fwrite(sector, length, 1, output);
+		for (;; sector_count++) {
+			uint64_t sector_start = begin_trace_span();
+			uint8_t sector[PSX_CDROM_SECTOR_SIZE];
 
-		time_t t = get_elapsed_time();
+			t = begin_stage(stats);
+			int length = psx_audio_xa_stream_pull(stream, sector);
+			end_stage(stats, STAGE_AUDIO, t);
 
-		if (!(args->flags & FLAG_HIDE_PROGRESS) && t) {
-			fprintf(
-				stderr,
-				"\rLBA: %6d | Encoding speed: %5.2fx",
-				sector_count,
-				(double)(sector_count * audio_samples_per_sector) / (double)(args->audio_frequency * t)
-			);
+			if (!length)
+				break;
+
+			write_output(stats, sector, length, output);
+			end_trace_span("sector", "sector", sector_start, "lba", sector_count);
+
+			double position = (double)((sector_count + 1) * audio_samples_per_sector) / (double)args->audio_frequency;
+
+			if (update_encode_stats(stats, 0, position) && !(args->flags & FLAG_HIDE_PROGRESS)) {
+				fprintf(
+					stderr,
+					"\rLBA: %6d | Encoding speed: %5.2fx",
+					sector_count,
+					position / stats->elapsed
+				);
+			}
 		}
-	}
-}
+	} while (has_data);
+
+	tracked_free(stream_workspace);
 
-void encode_file_spu(const args_t *args, decoder_t *decoder, FILE *output) {
-	psx_audio_encoder_channel_state_t audio_state;
-	memset(&audio_state, 0, sizeof(psx_audio_encoder_channel_state_t));
+	return true;
+}
 
+bool encode_file_spu(const args_t *args, decoder_t *decoder, encode_stats_t *stats, FILE *output) {
 	// The header must be written after the data as we don't yet know the
 	// number of audio samples.
 	if (args->format == FORMAT_VAG)
@@ -225,57 +521,60 @@ void encode_file_spu(const args_t *args, decoder_t *decoder, FILE *output) {
 		// Insert leading silent block
 		memset(block, 0, PSX_AUDIO_SPU_BLOCK_SIZE);
 
-		fwrite(block, PSX_AUDIO_SPU_BLOCK_SIZE, 1, output);
+		write_output(stats, block, PSX_AUDIO_SPU_BLOCK_SIZE, output);
 		block_count++;
 	}
 
-	int loop_start_block = -1;
+	int loop_start = -1;
 
 	if (args->audio_loop_point >= 0)
-		loop_start_block = block_count + (args->audio_loop_point * args->audio_frequency) / (PSX_AUDIO_SPU_SAMPLES_PER_BLOCK * 1000);
+		loop_start = (args->audio_loop_point * args->audio_frequency) / 1000;
 
-	for (; ensure_av_data(decoder, PSX_AUDIO_SPU_SAMPLES_PER_BLOCK, 0); block_count++) {
-		int samples_length = decoder->audio_sample_count;
+	// The stream also takes care of flagging the last block as looping, or
+	// appending a silent looping block if looping is disabled.
+	void *stream_workspace = tracked_malloc(MEMORY_AUDIO_BUFFERS, psx_audio_spu_stream_get_workspace_size());
+	psx_audio_spu_stream_t *stream = psx_audio_spu_stream_init(loop_start, (args->flags & FLAG_SPU_ENABLE_LOOP) != 0, stream_workspace);
 
-		if (samples_length > PSX_AUDIO_SPU_SAMPLES_PER_BLOCK)
-			samples_length = PSX_AUDIO_SPU_SAMPLES_PER_BLOCK;
+	bool has_data;
 
-		int length = psx_audio_spu_encode(
-			&audio_state,
-			decoder->audio_samples,
-			samples_length,
-			1,
-			block
-		);
+	do {
+		has_data = ensure_av_data(decoder, PSX_AUDIO_SPU_SAMPLES_PER_BLOCK, 0);
 
-		if (block_count == loop_start_block)
-			block[1] |= PSX_AUDIO_SPU_LOOP_START;
-		if ((args->flags & FLAG_SPU_ENABLE_LOOP) && decoder->end_of_input)
-			block[1] |= PSX_AUDIO_SPU_LOOP_REPEAT;
+		uint64_t t = begin_stage(stats);
 
-		retire_av_data(decoder, samples_length, 0);
-		fwrite(block, length, 1, output);
+		if (has_data) {
+			int pushed = psx_audio_spu_stream_push(stream, decoder->audio_samples, decoder->audio_sample_count);
+			retire_av_data(decoder, pushed, 0);
+		} else {
+			psx_audio_spu_stream_finalize(stream);
+		}
 
-		time_t t = get_elapsed_time();
+		end_stage(stats, STAGE_AUDIO, t);
 
-		if (!(args->flags & FLAG_HIDE_PROGRESS) && t) {
-			fprintf(
-				stderr,
-				"\rBlock: %6d | Encoding speed: %5.2fx",
-				block_count,
-				(double)(block_count * PSX_AUDIO_SPU_SAMPLES_PER_BLOCK) / (double)(args->audio_frequency * t)
-			);
-		}
-	}
+		for (;; block_count++) {
+			t = begin_stage(stats);
+			int length = psx_audio_spu_stream_pull(stream, block);
+			end_stage(stats, STAGE_AUDIO, t);
 
-	if (!(args->flags & FLAG_SPU_ENABLE_LOOP)) {
-		// Insert trailing looping block
-		memset(block, 0, PSX_AUDIO_SPU_BLOCK_SIZE);
-		block[1] = PSX_AUDIO_SPU_LOOP_TRAP;
+			if (!length)
+				break;
 
-		fwrite(block, PSX_AUDIO_SPU_BLOCK_SIZE, 1, output);
-		block_count++;
-	}
+			write_output(stats, block, length, output);
+
+			double position = (double)((block_count + 1) * PSX_AUDIO_SPU_SAMPLES_PER_BLOCK) / (double)args->audio_frequency;
+
+			if (update_encode_stats(stats, 0, position) && !(args->flags & FLAG_HIDE_PROGRESS)) {
+				fprintf(
+					stderr,
+					"\rBlock: %6d | Encoding speed: %5.2fx",
+					block_count,
+					position / stats->elapsed
+				);
+			}
+		}
+	} while (has_data);
+
+	tracked_free(stream_workspace);
 
 	int overflow = (block_count * PSX_AUDIO_SPU_BLOCK_SIZE) % args->alignment;
 
@@ -288,11 +587,62 @@ void encode_file_spu(const args_t *args, decoder_t *decoder, FILE *output) {
 		write_vag_header(args, block_count * PSX_AUDIO_SPU_BLOCK_SIZE, header);
 
 		fseek(output, 0, SEEK_SET);
-		fwrite(header, VAG_HEADER_SIZE, 1, output);
+		write_output(stats, header, VAG_HEADER_SIZE, output);
+	}
+
+	return true;
+}
+
+typedef struct {
+	const args_t *args;
+	psx_audio_encoder_channel_state_t *state;
+	const int16_t *samples;
+	int sample_count;
+	bool end_of_input;
+	uint8_t *output;
+	encode_stats_t *stats;
+	int trace_track;
+} spu_channel_job_t;
+
+// Encodes one channel's worth of data for an interleaved SPU-ADPCM chunk. This
+// may run on a worker thread, as channels are encoded independently.
+static void *encode_spu_channel(void *arg) {
+	const spu_channel_job_t *job = (const spu_channel_job_t *)arg;
+	const args_t *args = job->args;
+
+	uint64_t t = begin_stage(job->stats);
+	int length = psx_audio_spu_encode(
+		job->state,
+		job->samples,
+		job->sample_count,
+		args->audio_channels,
+		job->output
+	);
+
+	if (length > 0) {
+		uint8_t *last_block = job->output + length - PSX_AUDIO_SPU_BLOCK_SIZE;
+
+		// The loop point is ignored in strspu files, whose audio is meant to be
+		// stopped by the stream driver along with the video.
+		if (
+			(args->flags & FLAG_SPU_ENABLE_LOOP) ||
+			(job->end_of_input && args->audio_loop_point >= 0 && args->format != FORMAT_STRSPU)
+		) {
+			last_block[1] = PSX_AUDIO_SPU_LOOP_REPEAT;
+		} else if (job->end_of_input) {
+			// HACK: the trailing block should in theory be appended to the
+			// existing data, but it's easier to just zerofill and repurpose
+			// the last encoded block.
+			memset(last_block, 0, PSX_AUDIO_SPU_BLOCK_SIZE);
+			last_block[1] = PSX_AUDIO_SPU_LOOP_TRAP;
+		}
 	}
+
+	end_stage(job->stats, STAGE_AUDIO, t);
+	return NULL;
 }
 
-void encode_file_spui(const args_t *args, decoder_t *decoder, FILE *output) {
+bool encode_file_spui(const args_t *args, decoder_t *decoder, encode_stats_t *stats, FILE *output) {
 	int audio_samples_per_chunk = args->audio_interleave / PSX_AUDIO_SPU_BLOCK_SIZE * PSX_AUDIO_SPU_SAMPLES_PER_BLOCK;
 
 	// NOTE: since the interleaved .vag format is not standardized, some tools
@@ -310,10 +660,10 @@ void encode_file_spui(const args_t *args, decoder_t *decoder, FILE *output) {
 		fprintf(stderr, "Warning: ignoring loop point as there is no header to store it in\n");
 
 	int audio_state_size = sizeof(psx_audio_encoder_channel_state_t) * args->audio_channels;
-	psx_audio_encoder_channel_state_t *audio_state = malloc(audio_state_size);
+	psx_audio_encoder_channel_state_t *audio_state = tracked_malloc(MEMORY_AUDIO_BUFFERS, audio_state_size);
 	memset(audio_state, 0, audio_state_size);
 
-	uint8_t *chunk = malloc(chunk_size);
+	uint8_t *chunk = tracked_malloc(MEMORY_AUDIO_BUFFERS, chunk_size);
 	int chunk_count = 0;
 
 	for (; ensure_av_data(decoder, audio_samples_per_chunk * args->audio_channels, 0); chunk_count++) {
@@ -332,50 +682,37 @@ void encode_file_spui(const args_t *args, decoder_t *decoder, FILE *output) {
 		}
 
 		for (int ch = 0; ch < args->audio_channels; ch++, chunk_ptr += args->audio_interleave) {
-			int length = psx_audio_spu_encode(
-				audio_state + ch,
-				decoder->audio_samples + ch,
-				samples_length,
-				args->audio_channels,
-				chunk_ptr
-			);
-
-			if (length > 0) {
-				uint8_t *last_block = chunk_ptr + length - PSX_AUDIO_SPU_BLOCK_SIZE;
-
-				if (
-					(args->flags & FLAG_SPU_ENABLE_LOOP) ||
-					(decoder->end_of_input && args->audio_loop_point >= 0)
-				) {
-					last_block[1] = PSX_AUDIO_SPU_LOOP_REPEAT;
-				} else if (decoder->end_of_input) {
-					// HACK: the trailing block should in theory be appended to
-					// the existing data, but it's easier to just zerofill and
-					// repurpose the last encoded block.
-					memset(last_block, 0, PSX_AUDIO_SPU_BLOCK_SIZE);
-					last_block[1] = PSX_AUDIO_SPU_LOOP_TRAP;
-				}
-			}
+			spu_channel_job_t job = {
+				.args = args,
+				.state = audio_state + ch,
+				.samples = decoder->audio_samples + ch,
+				.sample_count = samples_length,
+				.end_of_input = decoder->end_of_input,
+				.output = chunk_ptr,
+				.stats = stats
+			};
+
+			encode_spu_channel(&job);
 		}
 
 		retire_av_data(decoder, samples_length * args->audio_channels, 0);
-		fwrite(chunk, chunk_size, 1, output);
+		write_output(stats, chunk, chunk_size, output);
 
-		time_t t = get_elapsed_time();
+		double position = (double)((chunk_count + 1) * audio_samples_per_chunk) / (double)args->audio_frequency;
 
-		if (!(args->flags & FLAG_HIDE_PROGRESS) && t) {
+		if (update_encode_stats(stats, 0, position) && !(args->flags & FLAG_HIDE_PROGRESS)) {
 			fprintf(
 				stderr,
 				"\rChunk: %6d | Encoding speed: %5.2fx",
 				chunk_count,
-				(double)(chunk_count * audio_samples_per_chunk) / (double)(args->audio_frequency * t)
+				position / stats->elapsed
 			);
 		}
 
 	}
 
-	free(audio_state);
-	free(chunk);
+	tracked_free(audio_state);
+	tracked_free(chunk);
 
 	if (args->format == FORMAT_VAGI) {
 		uint8_t *header = malloc(header_size);
@@ -383,85 +720,227 @@ void encode_file_spui(const args_t *args, decoder_t *decoder, FILE *output) {
 		write_vag_header(args, chunk_count * args->audio_interleave, header);
 
 		fseek(output, 0, SEEK_SET);
-		fwrite(header, header_size, 1, output);
+		write_output(stats, header, header_size, output);
 		free(header);
 	}
+
+	return true;
+}
+
+// Frames are encoded ahead of the sectors they are going to be placed in by a
+// pool of worker threads if more than one thread is available. Frames reused
+// from a previously encoded file are instead fetched in order by the encoder
+// itself, as reusing them would not save any time otherwise.
+static void init_frame_pool(
+	mdec_frame_pool_t *pool,
+	const args_t *args,
+	mdec_encoder_t *encoder,
+	const frame_cache_t *cache,
+	int max_frame_size
+) {
+	if (args->thread_count <= 1 || cache->has_source || cache->remux)
+		return;
+
+	if (!init_mdec_frame_pool(pool, encoder, args->thread_count, max_frame_size)) {
+		destroy_mdec_frame_pool(pool);
+		return;
+	}
+
+	encoder->frame_pool = pool;
+}
+
+// Submits as many upcoming frames as there are idle workers. If no layout is
+// given, all frames are assumed to have the same maximum size.
+static void submit_pooled_frames(
+	mdec_encoder_t *encoder,
+	decoder_t *decoder,
+	const str_layout_t *layout,
+	int frame_max_size
+) {
+	mdec_frame_pool_t *pool = encoder->frame_pool;
+
+	if (pool == NULL || encoder->skip_encoding)
+		return;
+
+	prefetch_av_data(decoder, pool->job_count);
+
+	for (;;) {
+		int offset = get_pooled_frame_offset(encoder);
+
+		if (offset < 0 || offset >= decoder->video_frame_count)
+			break;
+		if (layout != NULL)
+			frame_max_size = get_str_frame_max_size(layout, pool->next_frame_index);
+
+		submit_pooled_frame(encoder, frame_max_size, decoder->video_frames + offset * pool->frame_size);
+	}
+}
+
+static void destroy_frame_pool(mdec_encoder_t *encoder) {
+	if (encoder->frame_pool != NULL)
+		destroy_mdec_frame_pool(encoder->frame_pool);
+
+	encoder->frame_pool = NULL;
+}
+
+// When remuxing a .str file whose audio track is in the same format as the one
+// being encoded, its XA-ADPCM sectors are copied rather than re-encoded.
+static demux_t *get_xa_audio_source(const args_t *args, frame_cache_t *cache) {
+	if (!cache->remux || !cache->has_source || cache->source.audio_sector_count == 0)
+		return NULL;
+
+	demux_t *source = &(cache->source);
+
+	if (
+		source->audio_frequency != args->audio_frequency ||
+		source->audio_channels != args->audio_channels ||
+		source->audio_bit_depth != args->audio_bit_depth
+	)
+		return NULL;
+
+	return source;
 }
 
-void encode_file_str(const args_t *args, decoder_t *decoder, FILE *output) {
+// Copies a sector of the remuxed file's audio track into a full 2352-byte
+// buffer, updating the file and channel number in its subheader and
+// regenerating its header and EDC.
+static bool copy_xa_sector(const args_t *args, demux_t *source, int index, int lba, uint8_t *buffer) {
+	psx_cdrom_sector_t *sector = (psx_cdrom_sector_t *)buffer;
+	psx_cdrom_sector_xa_subheader_t subheader[2];
+
+	if (!read_demux_audio_sector(source, index, buffer + PSX_CDROM_SECTOR_SIZE - 2336))
+		return false;
+
+	memcpy(subheader, sector->mode2.subheader, sizeof(subheader));
+	subheader[0].file = args->audio_xa_file;
+	subheader[0].channel = args->audio_xa_channel & PSX_CDROM_SECTOR_XA_CHANNEL_MASK;
+	subheader[1] = subheader[0];
+
+	psx_cdrom_init_sector(sector, lba, PSX_CDROM_SECTOR_TYPE_MODE2_FORM2);
+	memcpy(sector->mode2.subheader, subheader, sizeof(subheader));
+	psx_cdrom_calculate_checksums(sector, PSX_CDROM_SECTOR_TYPE_MODE2_FORM2);
+	return true;
+}
+
+bool encode_file_str(
+	const args_t *args,
+	decoder_t *decoder,
+	frame_cache_t *cache,
+	const str_range_t *resume,
+	encode_stats_t *stats,
+	FILE *output
+) {
 	psx_audio_xa_settings_t xa_settings = args_to_libpsxav_xa_audio(args);
 	int sector_size = psx_audio_xa_get_buffer_size_per_sector(xa_settings);
 
-	int interleave;
+	// The layout has already been validated by the caller.
+	str_layout_t layout;
+	init_str_layout(&layout, args, decoder->state.audio_stream != NULL);
+
 	int audio_samples_per_sector;
-	int video_sectors_per_block;
 
 	if (decoder->state.audio_stream != NULL) {
-		// 1/N audio, (N-1)/N video
-		interleave = psx_audio_xa_get_sector_interleave(xa_settings) * args->str_cd_speed;
 		audio_samples_per_sector = psx_audio_xa_get_samples_per_sector(xa_settings);
-		video_sectors_per_block = interleave - 1;
 
 		if (!(args->flags & FLAG_QUIET))
 			fprintf(
 				stderr,
 				"Interleave: %d/%d audio, %d/%d video\n",
-				interleave - video_sectors_per_block,
-				interleave,
-				video_sectors_per_block,
-				interleave
+				layout.audio_sectors_per_block,
+				layout.interleave,
+				layout.video_sectors_per_block,
+				layout.interleave
 			);
 	} else {
-		// 0/1 audio, 1/1 video
-		interleave = 1;
 		audio_samples_per_sector = 0;
-		video_sectors_per_block = 1;
 	}
 
 	psx_audio_encoder_state_t audio_state;
 	memset(&audio_state, 0, sizeof(psx_audio_encoder_state_t));
 
+	demux_t *audio_source = get_xa_audio_source(args, cache);
+	int audio_sectors_copied = 0;
+
 	mdec_encoder_t encoder;
 	init_mdec_encoder(&encoder, args->video_codec, args->video_width, args->video_height);
+	encoder.frame_cache = cache;
+	encoder.stats = stats;
 
-	// e.g. 15fps = (150*7/8/15) = 8.75 blocks per frame
-	encoder.state.frame_block_base_overflow = (75 * args->str_cd_speed) * video_sectors_per_block * args->str_fps_den;
-	encoder.state.frame_block_overflow_den = interleave * args->str_fps_num;
+	encoder.state.frame_block_base_overflow = layout.frame_block_base_overflow;
+	encoder.state.frame_block_overflow_den = layout.frame_block_overflow_den;
 	double frame_size = (double)encoder.state.frame_block_base_overflow / (double)encoder.state.frame_block_overflow_den;
 
 	if (!(args->flags & FLAG_QUIET))
 		fprintf(stderr, "Frame size: %.2f sectors\n", frame_size);
 
-	encoder.state.frame_output = malloc(2016 * (int)ceil(frame_size));
+	encoder.state.frame_output = tracked_malloc(MEMORY_FRAME_BUFFERS, 2016 * (int)ceil(frame_size));
 	encoder.state.frame_index = 0;
 	encoder.state.frame_data_offset = 0;
 	encoder.state.frame_max_size = 0;
 	encoder.state.frame_block_overflow_num = 0;
 	encoder.state.quant_scale_sum = 0;
 
+	mdec_frame_pool_t frame_pool;
+	init_frame_pool(&frame_pool, args, &encoder, cache, 2016 * (int)ceil(frame_size));
+
 	// FIXME: this needs an extra frame to prevent A/V desync
-	int frames_needed = (int)ceil((double)video_sectors_per_block / frame_size);
+	int frames_needed = (int)ceil((double)layout.video_sectors_per_block / frame_size);
 
 	if (frames_needed < 2)
 		frames_needed = 2;
 
+	str_range_t range;
+	init_str_range(args, &range, &encoder, sector_size, layout.interleave);
+
+	int output_start = args->str_range_start;
+	bool aborted = false;
+
+	if (resume != NULL) {
+		output_start = resume->end.lba;
+		aborted = !resume_str_boundaries(&range, resume);
+	}
+
+	int max_frame_span = get_str_max_frame_span(&layout, frame_size);
+
 	int sector_count = 0;
 
 	for (; !decoder->end_of_input || encoder.state.frame_data_offset < encoder.state.frame_max_size; sector_count++) {
-		ensure_av_data(decoder, audio_samples_per_sector * args->audio_channels, frames_needed);
-
-		uint8_t sector[PSX_CDROM_SECTOR_SIZE];
-		bool is_video_sector;
+		if (aborted || (args->str_range_end >= 0 && sector_count >= args->str_range_end))
+			break;
+		psx_audio_encoder_channel_state_t channel_states[2];
+		get_xa_channel_states(channel_states, &audio_state);
+
+		if (!update_str_boundaries(args, &range, resume, &encoder, channel_states, sector_count, layout.audio_end, output)) {
+			aborted = true;
+			break;
+		}
 
-		if (audio_samples_per_sector == 0)
-			is_video_sector = true;
-		else if (args->flags & FLAG_STR_TRAILING_AUDIO)
-			is_video_sector = (sector_count % interleave) < video_sectors_per_block;
-		else
-			is_video_sector = (sector_count % interleave) > 0;
+		uint64_t sector_start = begin_trace_span();
+		encoder.skip_encoding = (sector_count + max_frame_span) <= output_start;
+		ensure_av_data(decoder, audio_samples_per_sector * args->audio_channels, frames_needed);
+		submit_pooled_frames(&encoder, decoder, &layout, 0);
+
+		// 2336-byte sectors are assembled at the end of a full 2352-byte
+		// buffer, so that the EDC can be placed at the right offset.
+		uint8_t buffer[PSX_CDROM_SECTOR_SIZE];
+		uint8_t *sector = buffer + PSX_CDROM_SECTOR_SIZE - sector_size;
+
+		// psx_audio_xa_encode() does not initialize the sector if there are no
+		// samples left, so once the audio track has run out its slots are
+		// given to video instead.
+		if (get_str_audio_chunk_index(&layout, sector_count) >= 0) {
+			if (audio_source != NULL) {
+				if (audio_sectors_copied >= audio_source->audio_sector_count)
+					layout.audio_end = sector_count;
+			} else if (decoder->audio_sample_count < args->audio_channels) {
+				layout.audio_end = sector_count;
+			}
+		}
 
-		if (is_video_sector) {
+		if (get_str_audio_chunk_index(&layout, sector_count) < 0) {
 			init_sector_buffer_video(args, sector, sector_count);
+			encoder.video_planes = decoder->video_planes;
+			encoder.video_scaler = decoder->video_scaler;
 
 			int frames_used = encode_sector_str(
 				&encoder,
@@ -471,7 +950,10 @@ void encode_file_str(const args_t *args, decoder_t *decoder, FILE *output) {
 				sector
 			);
 
-			psx_cdrom_calculate_checksums((psx_cdrom_sector_t *)sector, PSX_CDROM_SECTOR_TYPE_MODE2_FORM1);
+			uint64_t t = begin_stage(stats);
+			psx_cdrom_calculate_checksums((psx_cdrom_sector_t *)buffer, PSX_CDROM_SECTOR_TYPE_MODE2_FORM1);
+			end_stage(stats, STAGE_CHECKSUM, t);
+
 			retire_av_data(decoder, 0, frames_used);
 		} else {
 			int samples_length = decoder->audio_sample_count / args->audio_channels;
@@ -479,111 +961,378 @@ void encode_file_str(const args_t *args, decoder_t *decoder, FILE *output) {
 			if (samples_length > audio_samples_per_sector)
 				samples_length = audio_samples_per_sector;
 
-			// FIXME: this is an extremely hacky way to handle audio tracks
-			// shorter than the video track
-			if (!samples_length)
-				video_sectors_per_block++;
+			uint64_t t = begin_stage(stats);
 
-			int length = psx_audio_xa_encode(
-				xa_settings,
-				&audio_state,
-				decoder->audio_samples,
-				samples_length,
-				sector_count,
-				sector
-			);
-
-			if (decoder->end_of_input)
-				psx_audio_xa_encode_finalize(xa_settings, sector, length);
+			if (audio_source != NULL) {
+				if (!copy_xa_sector(args, audio_source, audio_sectors_copied++, sector_count, buffer)) {
+					fprintf(stderr, "\nFailed to read audio sector from previously encoded file\n");
+					aborted = true;
+					break;
+				}
+			} else {
+				int length = psx_audio_xa_encode(
+					xa_settings,
+					&audio_state,
+					decoder->audio_samples,
+					samples_length,
+					sector_count,
+					sector
+				);
+
+				if (decoder->end_of_input)
+					psx_audio_xa_encode_finalize(xa_settings, sector, length);
+			}
 
+			end_stage(stats, STAGE_AUDIO, t);
 			retire_av_data(decoder, samples_length * args->audio_channels, 0);
 		}
 
-		fwrite(sector, sector_size, 1, output);
+		if (sector_count >= output_start)
+			write_output(stats, sector, sector_size, output);
+
+		end_trace_span("sector", "sector", sector_start, "lba", sector_count);
 
-		time_t t = get_elapsed_time();
+		double position = (double)(encoder.state.frame_index * args->str_fps_den) / (double)args->str_fps_num;
 
-		if (!(args->flags & FLAG_HIDE_PROGRESS) && t) {
+		if (update_encode_stats(stats, encoder.state.frame_index, position) && !(args->flags & FLAG_HIDE_PROGRESS)) {
 			fprintf(
 				stderr,
 				"\rFrame: %4d | LBA: %6d | Avg. q. scale: %5.2f | Encoding speed: %5.2fx",
 				encoder.state.frame_index,
 				sector_count,
-				(double)encoder.state.quant_scale_sum / (double)encoder.state.frame_index,
-				(double)(encoder.state.frame_index * args->str_fps_den) / (double)(t * args->str_fps_num)
+				get_avg_quant_scale(&encoder),
+				position / stats->elapsed
 			);
 		}
 	}
 
-	free(encoder.state.frame_output);
+	if (!aborted) {
+		psx_audio_encoder_channel_state_t channel_states[2];
+		get_xa_channel_states(channel_states, &audio_state);
+
+		get_str_boundary(&(range.end), &encoder, channel_states, args->audio_channels, sector_count, layout.audio_end);
+		if (!save_str_boundaries(
+			args,
+			&range,
+			decoder->end_of_input && encoder.state.frame_data_offset >= encoder.state.frame_max_size,
+			output
+		))
+			aborted = true;
+	}
+
+	destroy_frame_pool(&encoder);
+	tracked_free(encoder.state.frame_output);
 	destroy_mdec_encoder(&encoder);
+	return !aborted;
 }
 
-void encode_file_strspu(const args_t *args, decoder_t *decoder, FILE *output) {
-	int interleave;
-	int audio_samples_per_sector;
-	int video_sectors_per_block;
+// Audio in strspu files is stored as a series of interleaved SPU-ADPCM chunks
+// (laid out like in spui files), each split across one or more .str chunks.
+// Chunks are encoded ahead of time on worker threads, one per channel, so that
+// audio encoding overlaps with the encoding of the video sectors preceding the
+// chunk's audio sectors.
+typedef struct {
+	psx_audio_encoder_channel_state_t *state;
+	spu_channel_job_t *jobs;
+	pthread_t *threads;
+	bool *started;
+	int16_t *samples;
+	uint8_t *chunk;
+	int chunk_size;
+	int samples_per_chunk;
+	int chunk_index;
+	bool has_data;
+	encode_stats_t *stats;
+
+	// State of all channels prior to encoding the current chunk, saved as part
+	// of .str range boundaries.
+	psx_audio_encoder_channel_state_t *boundary_state;
+} spu_chunk_encoder_t;
+
+static void init_spu_chunk_encoder(
+	spu_chunk_encoder_t *encoder,
+	const args_t *args,
+	encode_stats_t *stats,
+	int chunk_size,
+	int samples_per_chunk
+) {
+	int channels = args->audio_channels;
+
+	encoder->state = tracked_calloc(MEMORY_AUDIO_BUFFERS, channels, sizeof(psx_audio_encoder_channel_state_t));
+	encoder->boundary_state = tracked_calloc(MEMORY_AUDIO_BUFFERS, channels, sizeof(psx_audio_encoder_channel_state_t));
+	encoder->jobs = calloc(channels, sizeof(spu_channel_job_t));
+	encoder->threads = calloc(channels, sizeof(pthread_t));
+	encoder->started = calloc(channels, sizeof(bool));
+	encoder->samples = tracked_malloc(MEMORY_AUDIO_BUFFERS, samples_per_chunk * channels * sizeof(int16_t));
+	encoder->chunk = tracked_malloc(MEMORY_AUDIO_BUFFERS, chunk_size);
+	encoder->chunk_size = chunk_size;
+	encoder->samples_per_chunk = samples_per_chunk;
+	encoder->chunk_index = 0;
+	encoder->has_data = false;
+	encoder->stats = stats;
+
+	for (int ch = 0; ch < channels; ch++)
+		encoder->jobs[ch].trace_track = create_trace_track("%s: audio channel %d", args->output_file, ch);
+}
 
-	if (decoder->state.audio_stream != NULL) {
-		assert(false); // TODO: implement
+static void *run_spu_channel_job(void *arg) {
+	const spu_channel_job_t *job = (const spu_channel_job_t *)arg;
+
+	set_trace_track(job->trace_track);
+	return encode_spu_channel(arg);
+}
+
+static void finish_spu_chunk(spu_chunk_encoder_t *encoder, const args_t *args) {
+	for (int ch = 0; ch < args->audio_channels; ch++) {
+		if (encoder->started[ch]) {
+			pthread_join(encoder->threads[ch], NULL);
+			encoder->started[ch] = false;
+		}
+	}
+}
+
+static void start_spu_chunk(spu_chunk_encoder_t *encoder, const args_t *args, decoder_t *decoder) {
+	int channels = args->audio_channels;
+
+	finish_spu_chunk(encoder, args);
+	memcpy(encoder->boundary_state, encoder->state, channels * sizeof(psx_audio_encoder_channel_state_t));
+
+	ensure_av_data(decoder, encoder->samples_per_chunk * channels, 0);
+
+	int samples_length = decoder->audio_sample_count / channels;
+
+	if (samples_length > encoder->samples_per_chunk)
+		samples_length = encoder->samples_per_chunk;
+
+	memset(encoder->chunk, 0, encoder->chunk_size);
+	uint8_t *chunk_ptr = encoder->chunk;
+
+	// Insert leading silent block
+	if (encoder->chunk_index == 0 && !(args->flags & FLAG_SPU_NO_LEADING_DUMMY)) {
+		chunk_ptr += PSX_AUDIO_SPU_BLOCK_SIZE;
+		samples_length -= PSX_AUDIO_SPU_SAMPLES_PER_BLOCK;
+	}
+
+	encoder->chunk_index++;
+	encoder->has_data = (samples_length > 0);
+
+	// Once the audio track is over, empty chunks are output in order to keep
+	// the interleaving pattern intact.
+	if (!encoder->has_data)
+		return;
+
+	bool end_of_input = decoder->end_of_input && (decoder->audio_sample_count / channels) <= samples_length;
+
+	memcpy(encoder->samples, decoder->audio_samples, samples_length * channels * sizeof(int16_t));
+	retire_av_data(decoder, samples_length * channels, 0);
+
+	for (int ch = 0; ch < channels; ch++, chunk_ptr += args->audio_interleave) {
+		spu_channel_job_t *job = &(encoder->jobs[ch]);
+
+		job->args = args;
+		job->state = &(encoder->state[ch]);
+		job->samples = encoder->samples + ch;
+		job->sample_count = samples_length;
+		job->end_of_input = end_of_input;
+		job->output = chunk_ptr;
+		job->stats = encoder->stats;
+
+		encoder->started[ch] = (pthread_create(&(encoder->threads[ch]), NULL, &run_spu_channel_job, job) == 0);
+
+		if (!encoder->started[ch])
+			encode_spu_channel(job);
+	}
+}
+
+static void encode_sector_spu_chunk(
+	const args_t *args,
+	const spu_chunk_encoder_t *encoder,
+	int chunk_index,
+	int chunk_count,
+	uint8_t *output
+) {
+	uint8_t *header = output;
+	memset(output, 0, 2048);
+
+	// STR version
+	header[0x000] = 0x60;
+	header[0x001] = 0x01;
+
+	// Chunk type
+	header[0x002] = (uint8_t)args->str_audio_id;
+	header[0x003] = (uint8_t)(args->str_audio_id >> 8);
+
+	// Muxed chunk index/count
+	header[0x004] = (uint8_t)chunk_index;
+	header[0x005] = (uint8_t)(chunk_index >> 8);
+	header[0x006] = (uint8_t)chunk_count;
+	header[0x007] = (uint8_t)(chunk_count >> 8);
+
+	// Audio chunk index
+	header[0x008] = (uint8_t)encoder->chunk_index;
+	header[0x009] = (uint8_t)(encoder->chunk_index >> 8);
+	header[0x00A] = (uint8_t)(encoder->chunk_index >> 16);
+	header[0x00B] = (uint8_t)(encoder->chunk_index >> 24);
+
+	// Demuxed bytes used (zero for empty chunks past the end of the audio)
+	int bytes_used = encoder->has_data ? encoder->chunk_size : 0;
+	header[0x00C] = (uint8_t)bytes_used;
+	header[0x00D] = (uint8_t)(bytes_used >> 8);
+	header[0x00E] = (uint8_t)(bytes_used >> 16);
+	header[0x00F] = (uint8_t)(bytes_used >> 24);
+
+	// Sample rate
+	header[0x010] = (uint8_t)args->audio_frequency;
+	header[0x011] = (uint8_t)(args->audio_frequency >> 8);
+	header[0x012] = (uint8_t)(args->audio_frequency >> 16);
+	header[0x013] = (uint8_t)(args->audio_frequency >> 24);
+
+	// Channel count
+	header[0x014] = (uint8_t)args->audio_channels;
+	header[0x015] = (uint8_t)(args->audio_channels >> 8);
+
+	// Channel interleave size
+	header[0x018] = (uint8_t)args->audio_interleave;
+	header[0x019] = (uint8_t)(args->audio_interleave >> 8);
+	header[0x01A] = (uint8_t)(args->audio_interleave >> 16);
+	header[0x01B] = (uint8_t)(args->audio_interleave >> 24);
+
+	int offset = chunk_index * 2016;
+	int length = encoder->chunk_size - offset;
+
+	if (length > 2016)
+		length = 2016;
+	if (length > 0 && encoder->has_data)
+		memcpy(output + 0x020, encoder->chunk + offset, length);
+}
+
+static void destroy_spu_chunk_encoder(spu_chunk_encoder_t *encoder, const args_t *args) {
+	finish_spu_chunk(encoder, args);
+
+	tracked_free(encoder->state);
+	tracked_free(encoder->boundary_state);
+	free(encoder->jobs);
+	free(encoder->threads);
+	free(encoder->started);
+	tracked_free(encoder->samples);
+	tracked_free(encoder->chunk);
+}
+
+bool encode_file_strspu(
+	const args_t *args,
+	decoder_t *decoder,
+	frame_cache_t *cache,
+	const str_range_t *resume,
+	encode_stats_t *stats,
+	FILE *output
+) {
+	spu_chunk_encoder_t audio_encoder;
+	bool has_audio = (decoder->state.audio_stream != NULL);
+
+	// The layout has already been validated by the caller. A is the number of
+	// sectors needed to hold an audio chunk and N the number of sectors read
+	// in the time it takes to play it back.
+	str_layout_t layout;
+	init_str_layout(&layout, args, has_audio);
+
+	if (has_audio) {
+		int samples_per_chunk = args->audio_interleave / PSX_AUDIO_SPU_BLOCK_SIZE * PSX_AUDIO_SPU_SAMPLES_PER_BLOCK;
+		int chunk_size = args->audio_interleave * args->audio_channels + args->alignment - 1;
+		chunk_size -= chunk_size % args->alignment;
+
+		init_spu_chunk_encoder(&audio_encoder, args, stats, chunk_size, samples_per_chunk);
+
+		if (args->audio_loop_point >= 0 && !(args->flags & FLAG_QUIET))
+			fprintf(stderr, "Warning: ignoring loop point as there is no header to store it in\n");
+		if (!(args->flags & FLAG_QUIET)) {
+			double interleave = (double)layout.interleave_num / (double)layout.interleave_den;
 
-		if (!(args->flags & FLAG_QUIET))
 			fprintf(
 				stderr,
-				"Interleave: %d/%d audio, %d/%d video\n",
-				interleave - video_sectors_per_block,
+				"Interleave: %d/%.2f audio, %.2f/%.2f video\n",
+				layout.audio_sectors_per_block,
 				interleave,
-				video_sectors_per_block,
+				interleave - layout.audio_sectors_per_block,
 				interleave
 			);
-	} else {
-		// 0/1 audio, 1/1 video
-		interleave = 1;
-		audio_samples_per_sector = 0;
-		video_sectors_per_block = 1;
+		}
 	}
 
 	mdec_encoder_t encoder;
 	init_mdec_encoder(&encoder, args->video_codec, args->video_width, args->video_height);
+	encoder.frame_cache = cache;
+	encoder.stats = stats;
 
-	// e.g. 15fps = (150*7/8/15) = 8.75 blocks per frame
-	encoder.state.frame_block_base_overflow = (75 * args->str_cd_speed) * video_sectors_per_block * args->str_fps_den;
-	encoder.state.frame_block_overflow_den = interleave * args->str_fps_num;
+	encoder.state.frame_block_base_overflow = layout.frame_block_base_overflow;
+	encoder.state.frame_block_overflow_den = layout.frame_block_overflow_den;
 	double frame_size = (double)encoder.state.frame_block_base_overflow / (double)encoder.state.frame_block_overflow_den;
 
 	if (!(args->flags & FLAG_QUIET))
 		fprintf(stderr, "Frame size: %.2f sectors\n", frame_size);
 
-	encoder.state.frame_output = malloc(2016 * (int)ceil(frame_size));
+	encoder.state.frame_output = tracked_malloc(MEMORY_FRAME_BUFFERS, 2016 * (int)ceil(frame_size));
 	encoder.state.frame_index = 0;
 	encoder.state.frame_data_offset = 0;
 	encoder.state.frame_max_size = 0;
 	encoder.state.frame_block_overflow_num = 0;
 	encoder.state.quant_scale_sum = 0;
 
+	mdec_frame_pool_t frame_pool;
+	init_frame_pool(&frame_pool, args, &encoder, cache, 2016 * (int)ceil(frame_size));
+
 	// FIXME: this needs an extra frame to prevent A/V desync
-	int frames_needed = (int)ceil((double)video_sectors_per_block / frame_size);
+	int frames_needed = (int)ceil((double)layout.video_sectors_per_block / frame_size);
 
 	if (frames_needed < 2)
 		frames_needed = 2;
 
+	str_range_t range;
+	init_str_range(args, &range, &encoder, 2048, layout.interleave);
+
+	int output_start = args->str_range_start;
+	bool aborted = false;
+
+	if (resume != NULL) {
+		output_start = resume->end.lba;
+		aborted = !resume_str_boundaries(&range, resume);
+	}
+
+	int max_frame_span = get_str_max_frame_span(&layout, frame_size);
+
 	int sector_count = 0;
 
+	if (has_audio)
+		start_spu_chunk(&audio_encoder, args, decoder);
+
 	for (; !decoder->end_of_input || encoder.state.frame_data_offset < encoder.state.frame_max_size; sector_count++) {
-		ensure_av_data(decoder, audio_samples_per_sector * args->audio_channels, frames_needed);
+		if (aborted || (args->str_range_end >= 0 && sector_count >= args->str_range_end))
+			break;
+		if (!update_str_boundaries(
+			args,
+			&range,
+			resume,
+			&encoder,
+			has_audio ? audio_encoder.boundary_state : NULL,
+			sector_count,
+			layout.audio_end,
+			output
+		)) {
+			aborted = true;
+			break;
+		}
 
-		uint8_t sector[2048];
-		bool is_video_sector;
+		uint64_t sector_start = begin_trace_span();
+		encoder.skip_encoding = (sector_count + max_frame_span) <= output_start;
+		ensure_av_data(decoder, 0, frames_needed);
+		submit_pooled_frames(&encoder, decoder, &layout, 0);
 
-		if (audio_samples_per_sector == 0)
-			is_video_sector = true;
-		else if (args->flags & FLAG_STR_TRAILING_AUDIO)
-			is_video_sector = (sector_count % interleave) < video_sectors_per_block;
-		else
-			is_video_sector = (sector_count % interleave) > 0;
+		uint8_t sector[2048];
+		int audio_chunk_index = get_str_audio_chunk_index(&layout, sector_count);
 
-		if (is_video_sector) {
+		if (audio_chunk_index < 0) {
 			init_sector_buffer_video(args, sector, sector_count);
+			encoder.video_planes = decoder->video_planes;
+			encoder.video_scaler = decoder->video_scaler;
 
 			int frames_used = encode_sector_str(
 				&encoder,
@@ -595,69 +1344,104 @@ void encode_file_strspu(const args_t *args, decoder_t *decoder, FILE *output) {
 
 			retire_av_data(decoder, 0, frames_used);
 		} else {
-			int samples_length = decoder->audio_sample_count / args->audio_channels;
+			if (audio_chunk_index == 0)
+				finish_spu_chunk(&audio_encoder, args);
 
-			if (samples_length > audio_samples_per_sector)
-				samples_length = audio_samples_per_sector;
-
-			// FIXME: this is an extremely hacky way to handle audio tracks
-			// shorter than the video track
-			if (!samples_length)
-				video_sectors_per_block++;
+			encode_sector_spu_chunk(args, &audio_encoder, audio_chunk_index, layout.audio_sectors_per_block, sector);
 
-			assert(false); // TODO: implement
-
-			retire_av_data(decoder, samples_length * args->audio_channels, 0);
+			// Start encoding the next chunk in the background as soon as the
+			// current one has been fully written.
+			if (audio_chunk_index == (layout.audio_sectors_per_block - 1))
+				start_spu_chunk(&audio_encoder, args, decoder);
 		}
 
-		fwrite(sector, 2048, 1, output);
+		if (sector_count >= output_start)
+			write_output(stats, sector, 2048, output);
 
-		time_t t = get_elapsed_time();
+		end_trace_span("sector", "sector", sector_start, "lba", sector_count);
 
-		if (!(args->flags & FLAG_HIDE_PROGRESS) && t) {
+		double position = (double)(encoder.state.frame_index * args->str_fps_den) / (double)args->str_fps_num;
+
+		if (update_encode_stats(stats, encoder.state.frame_index, position) && !(args->flags & FLAG_HIDE_PROGRESS)) {
 			fprintf(
 				stderr,
 				"\rFrame: %4d | LBA: %6d | Avg. q. scale: %5.2f | Encoding speed: %5.2fx",
 				encoder.state.frame_index,
 				sector_count,
-				(double)encoder.state.quant_scale_sum / (double)encoder.state.frame_index,
-				(double)(encoder.state.frame_index * args->str_fps_den) / (double)(t * args->str_fps_num)
+				get_avg_quant_scale(&encoder),
+				position / stats->elapsed
 			);
 		}
 	}
 
-	free(encoder.state.frame_output);
+	if (!aborted) {
+		get_str_boundary(
+			&(range.end),
+			&encoder,
+			has_audio ? audio_encoder.boundary_state : NULL,
+			args->audio_channels,
+			sector_count,
+			layout.audio_end
+		);
+		if (!save_str_boundaries(
+			args,
+			&range,
+			decoder->end_of_input && encoder.state.frame_data_offset >= encoder.state.frame_max_size,
+			output
+		))
+			aborted = true;
+	}
+
+	if (has_audio)
+		destroy_spu_chunk_encoder(&audio_encoder, args);
+
+	destroy_frame_pool(&encoder);
+	tracked_free(encoder.state.frame_output);
 	destroy_mdec_encoder(&encoder);
+	return !aborted;
 }
 
-void encode_file_sbs(const args_t *args, decoder_t *decoder, FILE *output) {
+bool encode_file_sbs(const args_t *args, decoder_t *decoder, frame_cache_t *cache, encode_stats_t *stats, FILE *output) {
 	mdec_encoder_t encoder;
 	init_mdec_encoder(&encoder, args->video_codec, args->video_width, args->video_height);
+	encoder.frame_cache = cache;
+	encoder.stats = stats;
 
-	encoder.state.frame_output = malloc(args->alignment);
+	encoder.state.frame_output = tracked_malloc(MEMORY_FRAME_BUFFERS, args->alignment);
+	encoder.state.frame_index = 0;
 	encoder.state.frame_data_offset = 0;
 	encoder.state.frame_max_size = args->alignment;
 	encoder.state.quant_scale_sum = 0;
 
-	for (int j = 0; ensure_av_data(decoder, 0, 1); j++) {
+	mdec_frame_pool_t frame_pool;
+	init_frame_pool(&frame_pool, args, &encoder, cache, args->alignment);
+
+	while (ensure_av_data(decoder, 0, 1)) {
+		submit_pooled_frames(&encoder, decoder, NULL, args->alignment);
+
+		encoder.state.frame_index++;
+		encoder.video_planes = decoder->video_planes;
+		encoder.video_scaler = decoder->video_scaler;
 		encode_frame_bs(&encoder, decoder->video_frames);
 
 		retire_av_data(decoder, 0, 1);
-		fwrite(encoder.state.frame_output, args->alignment, 1, output);
+		write_output(stats, encoder.state.frame_output, args->alignment, output);
 
-		time_t t = get_elapsed_time();
+		double position = (double)(encoder.state.frame_index * args->str_fps_den) / (double)args->str_fps_num;
 
-		if (!(args->flags & FLAG_HIDE_PROGRESS) && t) {
+		if (update_encode_stats(stats, encoder.state.frame_index, position) && !(args->flags & FLAG_HIDE_PROGRESS)) {
 			fprintf(
 				stderr,
 				"\rFrame: %4d | Avg. q. scale: %5.2f | Encoding speed: %5.2fx",
-				j,
-				(double)encoder.state.quant_scale_sum / (double)j,
-				(double)(j * args->str_fps_den) / (double)(t * args->str_fps_num)
+				encoder.state.frame_index,
+				get_avg_quant_scale(&encoder),
+				position / stats->elapsed
 			);
 		}
 	}
 
-	free(encoder.state.frame_output);
+	destroy_frame_pool(&encoder);
+	tracked_free(encoder.state.frame_output);
 	destroy_mdec_encoder(&encoder);
+	return true;
 }
@@ -24,13 +24,58 @@ freely, subject to the following restrictions:
 
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include "args.h"
+#include "cache.h"
 #include "decoding.h"
+#include "range.h"
+#include "stats.h"
 
-void encode_file_xa(const args_t *args, decoder_t *decoder, FILE *output);
-void encode_file_spu(const args_t *args, decoder_t *decoder, FILE *output);
-void encode_file_spui(const args_t *args, decoder_t *decoder, FILE *output);
-void encode_file_str(const args_t *args, decoder_t *decoder, FILE *output);
-void encode_file_strspu(const args_t *args, decoder_t *decoder, FILE *output);
-void encode_file_sbs(const args_t *args, decoder_t *decoder, FILE *output);
+// The layout of a .str file's sectors only depends on the encoding settings,
+// thus the position of each audio sector and the space reserved for each frame
+// can be determined ahead of encoding.
+// Blocks of audio and video sectors are normally all the same size. SPU-ADPCM
+// chunks may however take a fractional number of sectors to play back, in which
+// case block k starts at sector floor(k * interleave_num / interleave_den) and
+// blocks alternate between two lengths, so that chunks are read at the exact
+// rate they are played at.
+// If an XA audio track runs out before the video track, all sectors from the
+// first audio sector that would be left empty onwards are given to video.
+typedef struct {
+	int interleave; // length of the longest block
+	int interleave_num, interleave_den;
+	int audio_sectors_per_block;
+	int video_sectors_per_block; // in the longest block
+	int frame_block_base_overflow;
+	int frame_block_overflow_den;
+	int audio_end; // first sector after the end of the audio track, -1 if not yet reached
+	bool trailing_audio;
+} str_layout_t;
+
+bool init_str_layout(str_layout_t *layout, const args_t *args, bool has_audio);
+int get_str_audio_chunk_index(const str_layout_t *layout, int lba);
+int get_str_frame_max_size(const str_layout_t *layout, int frame_index);
+int get_str_max_frame_span(const str_layout_t *layout, double frame_size);
+void init_sector_buffer_video(const args_t *args, uint8_t *sector, int lba);
+bool encode_file_xa(const args_t *args, decoder_t *decoder, encode_stats_t *stats, FILE *output);
+bool encode_file_spu(const args_t *args, decoder_t *decoder, encode_stats_t *stats, FILE *output);
+bool encode_file_spui(const args_t *args, decoder_t *decoder, encode_stats_t *stats, FILE *output);
+bool encode_file_str(
+	const args_t *args,
+	decoder_t *decoder,
+	frame_cache_t *cache,
+	const str_range_t *resume,
+	encode_stats_t *stats,
+	FILE *output
+);
+bool encode_file_strspu(
+	const args_t *args,
+	decoder_t *decoder,
+	frame_cache_t *cache,
+	const str_range_t *resume,
+	encode_stats_t *stats,
+	FILE *output
+);
+bool encode_file_sbs(const args_t *args, decoder_t *decoder, frame_cache_t *cache, encode_stats_t *stats, FILE *output);
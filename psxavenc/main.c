@@ -22,11 +22,27 @@ freely, subject to the following restrictions:
 3. This notice may not be removed or altered from any source distribution.
 */
 
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
 #include "args.h"
+#include "cache.h"
 #include "decoding.h"
 #include "filefmt.h"
+#include "mux.h"
+#include "preview.h"
+#include "range.h"
+#include "stats.h"
+#include "trace.h"
+#include "transmux.h"
 
 static const char *const bs_codec_names[NUM_BS_CODECS] = {
 	"BS v2",
@@ -48,165 +64,714 @@ static const uint8_t decoder_flags[NUM_FORMATS] = {
 	DECODER_USE_VIDEO | DECODER_VIDEO_REQUIRED // sbs
 };
 
-int main(int argc, const char **argv) {
+#define MAX_OUTPUTS 16
+
+typedef struct {
 	args_t args;
 	decoder_t decoder;
+	frame_cache_t cache;
+	str_range_t resume;
+	encode_stats_t stats;
 	FILE *output;
+	int trace_track;
+	int source_index;
+	int view_index;
+	int mux_group; // -1 if not muxed with other outputs
+	bool encode_ok;
+} output_t;
+
+// Outputs sharing the same path as one that specifies an interleaving pattern
+// are encoded into temporary files, which are then muxed into the final file
+// once all outputs have been encoded.
+typedef struct {
+	mux_pattern_t pattern;
+	int outputs[MAX_MUX_STREAMS];
+	int stream_count;
+} mux_group_t;
+
+static int get_cpu_count(void) {
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	int count = (int)info.dwNumberOfProcessors;
+#else
+	int count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+	return (count > 1) ? count : 1;
+}
 
-	args.flags = 0;
+static void init_args(args_t *args) {
+	args->flags = 0;
+
+	args->format = FORMAT_INVALID;
+	args->input_file = NULL;
+	args->output_file = NULL;
+	args->input_files = NULL;
+	args->input_file_count = 0;
+	args->swresample_options = NULL;
+	args->swscale_options = NULL;
+	args->thread_count = 0;
+	args->decoder_buffer_size = 0;
+	args->stats_file = NULL;
+	args->stats_interval = 0;
+	args->trace_file = NULL;
+	args->video_hash_file = NULL;
+	args->video_reuse_file = NULL;
+	args->video_log_file = NULL;
+}
 
-	args.format = FORMAT_INVALID;
-	args.input_file = NULL;
-	args.output_file = NULL;
-	args.swresample_options = NULL;
-	args.swscale_options = NULL;
+static bool open_output(output_t *output) {
+	args_t *args = &(output->args);
+
+	if (!open_frame_cache(&(output->cache), args))
+		return false;
+
+	if (output->mux_group >= 0) {
+		output->output = tmpfile();
+
+		if (output->output == NULL)
+			fprintf(stderr, "Failed to create temporary file for output: %s\n", args->output_file);
+	} else if (args->flags & FLAG_STR_RESUME) {
+		output->output = resume_str_range(&(output->resume), args);
+
+		if (output->output != NULL && output->resume.end_of_input) {
+			if (!(args->flags & FLAG_QUIET))
+				fprintf(stderr, "Output file is already complete, nothing to resume: %s\n", args->output_file);
+
+			fclose(output->output);
+			output->output = NULL;
+			return true;
+		}
+		if (output->output != NULL && !(args->flags & FLAG_QUIET))
+			fprintf(
+				stderr,
+				"Resuming from LBA %d (frame %d, %.2f s)\n",
+				output->resume.end.lba,
+				output->resume.end.frame_index,
+				(double)(output->resume.end.frame_index * args->str_fps_den) / (double)args->str_fps_num
+			);
+	} else {
+		output->output = fopen(args->output_file, "wb");
+
+		if (output->output == NULL)
+			fprintf(stderr, "Failed to open output file: %s\n", args->output_file);
+	}
 
-	if (!parse_args(&args, argv + 1, argc - 1))
-		return 1;
-	if (!open_av_data(&decoder, &args, decoder_flags[args.format])) {
-		fprintf(stderr, "Failed to open input file: %s\n", args.input_file);
-		return 1;
+	if (output->output == NULL) {
+		close_frame_cache(&(output->cache));
+		return false;
 	}
 
-	output = fopen(args.output_file, "wb");
+	return true;
+}
 
-	if (output == NULL) {
-		fprintf(stderr, "Failed to open output file: %s\n", args.output_file);
-		close_av_data(&decoder);
-		return 1;
-	}
+static void print_output_info(output_t *output) {
+	args_t *args = &(output->args);
+	decoder_t *decoder = &(output->decoder);
 
-	switch (args.format) {
+	switch (args->format) {
 		case FORMAT_XA:
 		case FORMAT_XACD:
-			if (!(args.flags & FLAG_QUIET))
+			if (!(args->flags & FLAG_QUIET))
 				fprintf(
 					stderr,
 					"Audio format: XA-ADPCM, %d Hz %d-bit %s, F=%d C=%d\n",
-					args.audio_frequency,
-					args.audio_bit_depth,
-					(args.audio_channels == 2) ? "stereo" : "mono",
-					args.audio_xa_file,
-					args.audio_xa_channel
+					args->audio_frequency,
+					args->audio_bit_depth,
+					(args->audio_channels == 2) ? "stereo" : "mono",
+					args->audio_xa_file,
+					args->audio_xa_channel
 				);
-
-			encode_file_xa(&args, &decoder, output);
 			break;
 
 		case FORMAT_SPU:
 		case FORMAT_VAG:
-			if (!(args.flags & FLAG_OVERRIDE_LOOP_POINT)) {
-				args.audio_loop_point = get_av_loop_point(&decoder, &args);
+			if (!(args->flags & FLAG_OVERRIDE_LOOP_POINT)) {
+				args->audio_loop_point = get_av_loop_point(decoder, args);
 
-				if (args.audio_loop_point >= 0)
-					args.flags |= FLAG_SPU_ENABLE_LOOP;
+				if (args->audio_loop_point >= 0)
+					args->flags |= FLAG_SPU_ENABLE_LOOP;
 			}
 
-			if (!(args.flags & FLAG_QUIET))
+			if (!(args->flags & FLAG_QUIET))
 				fprintf(
 					stderr,
 					"Audio format: SPU-ADPCM, %d Hz mono\n",
-					args.audio_frequency
+					args->audio_frequency
 				);
-
-			encode_file_spu(&args, &decoder, output);
 			break;
 
 		case FORMAT_SPUI:
 		case FORMAT_VAGI:
-			if (!(args.flags & FLAG_OVERRIDE_LOOP_POINT))
-				args.audio_loop_point = get_av_loop_point(&decoder, &args);
+			if (!(args->flags & FLAG_OVERRIDE_LOOP_POINT))
+				args->audio_loop_point = get_av_loop_point(decoder, args);
 
-			if (!(args.flags & FLAG_QUIET))
+			if (!(args->flags & FLAG_QUIET))
 				fprintf(
 					stderr,
 					"Audio format: SPU-ADPCM, %d Hz %d channels, interleave=%d\n",
-					args.audio_frequency,
-					args.audio_channels,
-					args.audio_interleave
+					args->audio_frequency,
+					args->audio_channels,
+					args->audio_interleave
 				);
-
-			encode_file_spui(&args, &decoder, output);
 			break;
 
 		case FORMAT_STR:
 		case FORMAT_STRCD:
-			if (!(args.flags & FLAG_QUIET)) {
-				if (decoder.state.audio_stream != NULL)
+			if (!(args->flags & FLAG_QUIET)) {
+				if (decoder->state.audio_stream != NULL)
 					fprintf(
 						stderr,
 						"Audio format: XA-ADPCM, %d Hz %d-bit %s, F=%d C=%d\n",
-						args.audio_frequency,
-						args.audio_bit_depth,
-						(args.audio_channels == 2) ? "stereo" : "mono",
-						args.audio_xa_file,
-						args.audio_xa_channel
+						args->audio_frequency,
+						args->audio_bit_depth,
+						(args->audio_channels == 2) ? "stereo" : "mono",
+						args->audio_xa_file,
+						args->audio_xa_channel
 					);
 
 				fprintf(
 					stderr,
 					"Video format: %s, %dx%d, %.2f fps\n",
-					bs_codec_names[args.video_codec],
-					args.video_width,
-					args.video_height,
-					(double)args.str_fps_num / (double)args.str_fps_den
+					bs_codec_names[args->video_codec],
+					args->video_width,
+					args->video_height,
+					(double)args->str_fps_num / (double)args->str_fps_den
 				);
 			}
-
-			encode_file_str(&args, &decoder, output);
 			break;
 
 		case FORMAT_STRSPU:
-			// TODO: implement and remove this check
-			fprintf(stderr, "This format is not currently supported\n");
-			break;
-
 		case FORMAT_STRV:
-			if (!(args.flags & FLAG_QUIET)) {
-				if (decoder.state.audio_stream != NULL)
+			if (!(args->flags & FLAG_QUIET)) {
+				if (decoder->state.audio_stream != NULL)
 					fprintf(
 						stderr,
 						"Audio format: SPU-ADPCM, %d Hz %d channels, interleave=%d\n",
-						args.audio_frequency,
-						args.audio_channels,
-						args.audio_interleave
+						args->audio_frequency,
+						args->audio_channels,
+						args->audio_interleave
 					);
 
 				fprintf(
 					stderr,
 					"Video format: %s, %dx%d, %.2f fps\n",
-					bs_codec_names[args.video_codec],
-					args.video_width,
-					args.video_height,
-					(double)args.str_fps_num / (double)args.str_fps_den
+					bs_codec_names[args->video_codec],
+					args->video_width,
+					args->video_height,
+					(double)args->str_fps_num / (double)args->str_fps_den
 				);
 			}
-
-			encode_file_strspu(&args, &decoder, output);
 			break;
 
 		case FORMAT_SBS:
-			if (!(args.flags & FLAG_QUIET))
+			if (!(args->flags & FLAG_QUIET))
 				fprintf(
 					stderr,
 					"Video format: %s, %dx%d, %.2f fps\n",
-					bs_codec_names[args.video_codec],
-					args.video_width,
-					args.video_height,
-					(double)args.str_fps_num / (double)args.str_fps_den
+					bs_codec_names[args->video_codec],
+					args->video_width,
+					args->video_height,
+					(double)args->str_fps_num / (double)args->str_fps_den
 				);
+			break;
+
+		default:
+			;
+	}
+}
+
+// JSON reports from multiple outputs can share standard output, as each line is
+// written while holding the stream's lock. Any other shared file, including a
+// frame log written to standard output alongside anything else, would end up
+// with rows that cannot be told apart.
+static bool is_same_stats_file(const char *path, bool is_log, const char *other_path, bool other_is_log) {
+	if (path == NULL || other_path == NULL || strcmp(path, other_path))
+		return false;
+
+	return is_log || other_is_log || strcmp(path, "-");
+}
+
+static bool is_str_format(format_t format) {
+	return
+		format == FORMAT_STR ||
+		format == FORMAT_STRCD ||
+		format == FORMAT_STRSPU ||
+		format == FORMAT_STRV;
+}
+
+static bool init_mux_groups(output_t *outputs, int output_count, mux_group_t *groups, int *group_count) {
+	*group_count = 0;
+
+	for (int i = 0; i < output_count; i++)
+		outputs[i].mux_group = -1;
+
+	for (int i = 0; i < output_count; i++) {
+		args_t *args = &(outputs[i].args);
+
+		if (args->str_mux_pattern == NULL)
+			continue;
+		if (outputs[i].mux_group >= 0) {
+			fprintf(stderr, "Only the first output muxed into a file may specify an interleaving pattern\n");
+			return false;
+		}
+		if (!is_str_format(args->format)) {
+			fprintf(stderr, "Only .str files can be muxed together\n");
+			return false;
+		}
+
+		mux_group_t *group = &groups[*group_count];
+
+		if (!parse_mux_pattern(&(group->pattern), args->str_mux_pattern))
+			return false;
+
+		group->stream_count = 0;
+
+		for (int j = i; j < output_count; j++) {
+			args_t *stream_args = &(outputs[j].args);
 
-			encode_file_sbs(&args, &decoder, output);
+			if (strcmp(stream_args->output_file, args->output_file))
+				continue;
+
+			if (
+				stream_args->format != args->format ||
+				stream_args->str_cd_speed != args->str_cd_speed
+			) {
+				fprintf(stderr, "All outputs muxed into %s must use the same format and CD-ROM speed\n", args->output_file);
+				return false;
+			}
+			if (
+				(stream_args->flags & FLAG_STR_RESUME) ||
+				stream_args->str_checkpoint_interval > 0 ||
+				stream_args->video_hash_file != NULL
+			) {
+				fprintf(stderr, "Outputs muxed into %s cannot be resumed or generate a hash list\n", args->output_file);
+				return false;
+			}
+			if (group->stream_count >= group->pattern.stream_count) {
+				fprintf(stderr, "More outputs muxed into %s than streams in interleaving pattern\n", args->output_file);
+				return false;
+			}
+
+			int stream = group->stream_count++;
+
+			// Each stream only gets a fraction of the sectors read from the
+			// disc, as if it were played back at a lower speed.
+			stream_args->str_mux_num = group->pattern.stream_slots[stream];
+			stream_args->str_mux_den = group->pattern.length;
+
+			group->outputs[stream] = j;
+			outputs[j].mux_group = *group_count;
+		}
+
+		if (group->stream_count < group->pattern.stream_count) {
+			fprintf(stderr, "Fewer outputs muxed into %s than streams in interleaving pattern\n", args->output_file);
+			return false;
+		}
+
+		(*group_count)++;
+	}
+
+	return true;
+}
+
+static bool mux_outputs(output_t *outputs, const mux_group_t *group) {
+	const args_t *args = &(outputs[group->outputs[0]].args);
+	FILE *streams[MAX_MUX_STREAMS];
+
+	for (int i = 0; i < group->stream_count; i++)
+		streams[i] = outputs[group->outputs[i]].output;
+
+	FILE *output = fopen(args->output_file, "wb");
+
+	if (output == NULL) {
+		fprintf(stderr, "Failed to open output file: %s\n", args->output_file);
+		return false;
+	}
+
+	bool ok = mux_str_streams(&(group->pattern), args, streams, output);
+
+	if (fclose(output) != 0) {
+		fprintf(stderr, "Failed to write output file: %s\n", args->output_file);
+		ok = false;
+	}
+	if (ok && !(args->flags & FLAG_QUIET))
+		fprintf(stderr, "Muxed %d streams into %s\n", group->stream_count, args->output_file);
+
+	return ok;
+}
+
+static void *encode_output(void *arg) {
+	output_t *output = (output_t *)arg;
+	args_t *args = &(output->args);
+	decoder_t *decoder = &(output->decoder);
+	const str_range_t *resume = (args->flags & FLAG_STR_RESUME) ? &(output->resume) : NULL;
+	encode_stats_t *stats = &(output->stats);
+
+	decoder->state.stats = stats;
+	output->encode_ok = false;
+	set_trace_track(output->trace_track);
+	start_encode_stats(stats);
+
+	switch (args->format) {
+		case FORMAT_XA:
+		case FORMAT_XACD:
+			output->encode_ok = encode_file_xa(args, decoder, stats, output->output);
+			break;
+
+		case FORMAT_SPU:
+		case FORMAT_VAG:
+			output->encode_ok = encode_file_spu(args, decoder, stats, output->output);
+			break;
+
+		case FORMAT_SPUI:
+		case FORMAT_VAGI:
+			output->encode_ok = encode_file_spui(args, decoder, stats, output->output);
+			break;
+
+		case FORMAT_STR:
+		case FORMAT_STRCD:
+			output->encode_ok = encode_file_str(args, decoder, &(output->cache), resume, stats, output->output);
+			break;
+
+		case FORMAT_STRSPU:
+		case FORMAT_STRV:
+			output->encode_ok = encode_file_strspu(args, decoder, &(output->cache), resume, stats, output->output);
+			break;
+
+		case FORMAT_SBS:
+			output->encode_ok = encode_file_sbs(args, decoder, &(output->cache), stats, output->output);
 			break;
 
 		default:
 			;
 	}
 
-	if (!(args.flags & FLAG_HIDE_PROGRESS))
-		fprintf(stderr, "\nDone.\n");
+	// The length of a remuxed file can only be checked once the whole input
+	// file has been decoded.
+	if (output->encode_ok && decoder->end_of_input)
+		output->encode_ok = check_frame_cache_length(&(output->cache), args, stats->frames + decoder->video_frame_count);
+
+	// The view must be closed as soon as possible, as other outputs may be
+	// waiting for it to consume decoded data.
+	close_av_data(decoder);
+	finish_encode_stats(stats);
+	return NULL;
+}
+
+int main(int argc, const char **argv) {
+	output_t outputs[MAX_OUTPUTS];
+	decoder_source_t sources[MAX_OUTPUTS];
+	int source_flags[MAX_OUTPUTS];
+	int source_views[MAX_OUTPUTS];
+	mux_group_t groups[MAX_OUTPUTS];
+	int output_count = 0;
+	int source_count = 0;
+	int group_count = 0;
+	int ret = 1;
+
+	for (int arg_offset = 1; output_count == 0 || arg_offset < argc; output_count++) {
+		if (output_count >= MAX_OUTPUTS) {
+			fprintf(stderr, "Too many output files (up to %d can be generated at once)\n", MAX_OUTPUTS);
+			goto cleanup_args;
+		}
+
+		args_t *args = &(outputs[output_count].args);
+		init_args(args);
+
+		int parsed = parse_args(
+			args,
+			argv + arg_offset,
+			argc - arg_offset,
+			output_count ? outputs[0].args.input_file : NULL
+		);
+
+		if (!parsed) {
+			output_count++;
+			goto cleanup_args;
+		}
+
+		arg_offset += parsed;
+
+		if ((args->flags & (FLAG_STR_STITCH | FLAG_TRANSMUX | FLAG_PREVIEW)) && output_count > 0) {
+			fprintf(stderr, "Stitching, converting and previewing cannot be combined with other outputs\n");
+			output_count++;
+			goto cleanup_args;
+		}
+	}
+
+	// Unless specified, the available CPU cores are split evenly between
+	// outputs.
+	int cpu_count = get_cpu_count();
+
+	for (int i = 0; i < output_count; i++) {
+		if (outputs[i].args.thread_count > 0)
+			continue;
+
+		int thread_count = cpu_count / output_count;
+		outputs[i].args.thread_count = (thread_count > 1) ? thread_count : 1;
+	}
+
+	// Stitching, converting and previewing do not involve any FFmpeg decoding
+	// or encoding.
+	if (outputs[0].args.flags & (FLAG_STR_STITCH | FLAG_TRANSMUX | FLAG_PREVIEW)) {
+		if (output_count > 1)
+			fprintf(stderr, "Stitching, converting and previewing cannot be combined with other outputs\n");
+		else if (outputs[0].args.flags & FLAG_STR_STITCH)
+			ret = stitch_str_ranges(&(outputs[0].args)) ? 0 : 1;
+		else if (outputs[0].args.flags & FLAG_PREVIEW)
+			ret = preview_file(&(outputs[0].args)) ? 0 : 1;
+		else
+			ret = transmux_file(&(outputs[0].args)) ? 0 : 1;
+
+		goto cleanup_args;
+	}
+
+	if (!init_mux_groups(outputs, output_count, groups, &group_count))
+		goto cleanup_args;
+
+	const char *trace_file = NULL;
+
+	for (int i = 0; i < output_count; i++) {
+		const args_t *args = &(outputs[i].args);
+
+		// A single trace is saved for all outputs.
+		if (args->trace_file != NULL) {
+			if (trace_file != NULL && strcmp(trace_file, args->trace_file)) {
+				fprintf(stderr, "Only one trace file can be saved\n");
+				goto cleanup_args;
+			}
+
+			trace_file = args->trace_file;
+		}
+
+		if (is_same_stats_file(args->stats_file, false, args->video_log_file, true)) {
+			fprintf(stderr, "Statistics and frame log cannot be saved to the same file\n");
+			goto cleanup_args;
+		}
+
+		for (int j = 0; j < i; j++) {
+			const args_t *other_args = &(outputs[j].args);
+
+			if (
+				is_same_stats_file(other_args->stats_file, false, args->stats_file, false) ||
+				is_same_stats_file(other_args->video_log_file, true, args->video_log_file, true) ||
+				is_same_stats_file(other_args->stats_file, false, args->video_log_file, true) ||
+				is_same_stats_file(other_args->video_log_file, true, args->stats_file, false)
+			) {
+				fprintf(stderr, "Multiple outputs cannot save statistics to the same file\n");
+				goto cleanup_args;
+			}
+		}
+	}
+
+	// Outputs encoded from the same input file share a single source, so that
+	// each input file is only decoded once.
+	for (int i = 0; i < output_count; i++) {
+		args_t *args = &(outputs[i].args);
+		int j = source_count;
+
+		for (int k = 0; k < i; k++) {
+			if (!strcmp(outputs[k].args.input_file, args->input_file)) {
+				j = outputs[k].source_index;
+				break;
+			}
+		}
+		if (j == source_count) {
+			source_flags[j] = 0;
+			source_views[j] = 0;
+			source_count++;
+		}
+
+		outputs[i].source_index = j;
+		outputs[i].view_index = source_views[j]++;
+		source_flags[j] |= decoder_flags[args->format] & (DECODER_USE_AUDIO | DECODER_USE_VIDEO);
+	}
+
+	// Progress from multiple outputs encoded in parallel cannot be displayed
+	// on a single line.
+	if (output_count > 1) {
+		for (int i = 0; i < output_count; i++)
+			outputs[i].args.flags |= FLAG_HIDE_PROGRESS;
+	}
+
+	if (trace_file != NULL && !open_trace(trace_file))
+		goto cleanup_args;
+
+	int opened_sources = 0;
+	int opened_count = 0;
+	bool encoded = false;
+
+	for (; opened_sources < source_count; opened_sources++) {
+		const args_t *args = NULL;
+
+		for (int i = 0; args == NULL; i++) {
+			if (outputs[i].source_index == opened_sources)
+				args = &(outputs[i].args);
+		}
+
+		if (!open_av_source(&sources[opened_sources], args, source_flags[opened_sources], source_views[opened_sources])) {
+			fprintf(stderr, "Failed to open input file: %s\n", args->input_file);
+			close_av_source(&sources[opened_sources]);
+			goto cleanup_outputs;
+		}
+	}
+
+	for (; opened_count < output_count; opened_count++) {
+		output_t *output = &(outputs[opened_count]);
+		args_t *args = &(output->args);
+
+		if (output_count > 1 && !(args->flags & FLAG_QUIET))
+			fprintf(stderr, "Output: %s\n", args->output_file);
+
+		// If multiple outputs sharing the same source specify a buffer size
+		// limit, the smallest one is used.
+		decoder_source_t *source = &sources[output->source_index];
+		size_t buffer_size = (size_t)args->decoder_buffer_size << 20;
+
+		if (buffer_size && (!source->max_queue_size || buffer_size < source->max_queue_size))
+			source->max_queue_size = buffer_size;
+
+		if (!open_av_view(
+			&(output->decoder),
+			&sources[output->source_index],
+			output->view_index,
+			args,
+			decoder_flags[args->format]
+		)) {
+			fprintf(stderr, "Failed to open input file: %s\n", args->input_file);
+			close_av_data(&(output->decoder));
+			goto cleanup_outputs;
+		}
+
+		// The view may have reduced the video size to preserve the input
+		// file's aspect ratio, which the encoder must then use as well.
+		args->video_width = output->decoder.video_width;
+		args->video_height = output->decoder.video_height;
+
+		if (is_str_format(args->format)) {
+			str_layout_t layout;
+
+			if (!init_str_layout(&layout, args, output->decoder.state.audio_stream != NULL)) {
+				close_av_data(&(output->decoder));
+				goto cleanup_outputs;
+			}
+		}
+		if (!open_encode_stats(&(output->stats), args)) {
+			close_av_data(&(output->decoder));
+			goto cleanup_outputs;
+		}
+		if (!open_output(output)) {
+			close_encode_stats(&(output->stats));
+			close_av_data(&(output->decoder));
+			goto cleanup_outputs;
+		}
+
+		print_output_info(output);
+
+		if (output_count > 1)
+			output->trace_track = create_trace_track("output %d: %s", opened_count, args->output_file);
+		else
+			output->trace_track = -1;
+	}
+
+	bool encode_ok = true;
+
+	if (output_count > 1) {
+		pthread_t threads[MAX_OUTPUTS];
+		bool started[MAX_OUTPUTS];
+
+		// If a thread cannot be created, the output's view is closed so that
+		// other outputs sharing the same source do not wait for it.
+		for (int i = 0; i < output_count; i++) {
+			started[i] = false;
+
+			if (outputs[i].output != NULL)
+				started[i] = (pthread_create(&threads[i], NULL, &encode_output, &outputs[i]) == 0);
+
+			if (outputs[i].output != NULL && !started[i]) {
+				fprintf(stderr, "Failed to start encoding thread for %s\n", outputs[i].args.output_file);
+				encode_ok = false;
+			}
+			if (!started[i])
+				close_av_data(&(outputs[i].decoder));
+		}
+		for (int i = 0; i < output_count; i++) {
+			if (!started[i])
+				continue;
+
+			pthread_join(threads[i], NULL);
+
+			if (!outputs[i].encode_ok)
+				encode_ok = false;
+		}
+
+		if (encode_ok && !(outputs[0].args.flags & FLAG_QUIET))
+			fprintf(stderr, "Done.\n");
+	} else {
+		if (outputs[0].output != NULL) {
+			encode_output(&outputs[0]);
+			encode_ok = outputs[0].encode_ok;
+		} else {
+			close_av_data(&(outputs[0].decoder));
+		}
+
+		if (encode_ok && !(outputs[0].args.flags & FLAG_HIDE_PROGRESS))
+			fprintf(stderr, "\nDone.\n");
+	}
+
+	encoded = true;
+	ret = encode_ok ? 0 : 1;
+
+	for (int i = 0; i < group_count; i++) {
+		if (!mux_outputs(outputs, &groups[i]))
+			ret = 1;
+	}
+
+	for (int i = 0; i < output_count; i++) {
+		args_t *args = &(outputs[i].args);
+
+		if (!(args->flags & FLAG_QUIET) && args->video_reuse_file != NULL) {
+			fprintf(
+				stderr,
+				(args->flags & FLAG_BS_REMUX) ? "Remuxed %d frames from %s\n" : "Reused %d unchanged frames from %s\n",
+				outputs[i].cache.frames_reused,
+				args->video_reuse_file
+			);
+		}
+	}
+
+cleanup_outputs:
+	// Views that failed to open have already been closed, while views that
+	// were used for encoding are closed by encode_output().
+	for (int i = 0; i < opened_count; i++) {
+		if (!encoded)
+			close_av_data(&(outputs[i].decoder));
+		if (outputs[i].output != NULL)
+			fclose(outputs[i].output);
+
+		if (!close_frame_cache(&(outputs[i].cache))) {
+			fprintf(stderr, "Failed to save hash list: %s\n", outputs[i].args.video_hash_file);
+			ret = 1;
+		}
+		if (!close_encode_stats(&(outputs[i].stats))) {
+			fprintf(stderr, "Failed to save statistics for output: %s\n", outputs[i].args.output_file);
+			ret = 1;
+		}
+	}
+
+	for (int i = 0; i < opened_sources; i++)
+		close_av_source(&sources[i]);
+
+	if (!close_trace()) {
+		fprintf(stderr, "Failed to save trace file: %s\n", trace_file);
+		ret = 1;
+	}
+
+cleanup_args:
+	for (int i = 0; i < output_count; i++)
+		free(outputs[i].args.input_files);
 
-	fclose(output);
-	close_av_data(&decoder);
-	return 0;
+	return ret;
 }
@@ -23,735 +23,233 @@ freely, subject to the following restrictions:
 */
 
 #include <assert.h>
-#include <math.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
-#include <libavcodec/avdct.h>
 #include "args.h"
+#include "cache.h"
 #include "mdec.h"
+#include "stats.h"
+#include "trace.h"
 
-#define AC_PAIR(zeroes, value) \
-	(((zeroes) << 10) | ((+(value)) & 0x3FF)), \
-	(((zeroes) << 10) | ((-(value)) & 0x3FF))
-
-static const struct {
-	int c_bits;
-	uint32_t c_value;
-	uint16_t u_hword_pos;
-	uint16_t u_hword_neg;
-} ac_huffman_tree[] = {
-	// Fuck this Huffman tree in particular --GM
-	{ 2, 0x3,    AC_PAIR( 0,  1)},
-	{ 3, 0x3,    AC_PAIR( 1,  1)},
-	{ 4, 0x4,    AC_PAIR( 0,  2)},
-	{ 4, 0x5,    AC_PAIR( 2,  1)},
-	{ 5, 0x05,   AC_PAIR( 0,  3)},
-	{ 5, 0x06,   AC_PAIR( 4,  1)},
-	{ 5, 0x07,   AC_PAIR( 3,  1)},
-	{ 6, 0x04,   AC_PAIR( 7,  1)},
-	{ 6, 0x05,   AC_PAIR( 6,  1)},
-	{ 6, 0x06,   AC_PAIR( 1,  2)},
-	{ 6, 0x07,   AC_PAIR( 5,  1)},
-	{ 7, 0x04,   AC_PAIR( 2,  2)},
-	{ 7, 0x05,   AC_PAIR( 9,  1)},
-	{ 7, 0x06,   AC_PAIR( 0,  4)},
-	{ 7, 0x07,   AC_PAIR( 8,  1)},
-	{ 8, 0x20,   AC_PAIR(13,  1)},
-	{ 8, 0x21,   AC_PAIR( 0,  6)},
-	{ 8, 0x22,   AC_PAIR(12,  1)},
-	{ 8, 0x23,   AC_PAIR(11,  1)},
-	{ 8, 0x24,   AC_PAIR( 3,  2)},
-	{ 8, 0x25,   AC_PAIR( 1,  3)},
-	{ 8, 0x26,   AC_PAIR( 0,  5)},
-	{ 8, 0x27,   AC_PAIR(10,  1)},
-	{10, 0x008,  AC_PAIR(16,  1)},
-	{10, 0x009,  AC_PAIR( 5,  2)},
-	{10, 0x00A,  AC_PAIR( 0,  7)},
-	{10, 0x00B,  AC_PAIR( 2,  3)},
-	{10, 0x00C,  AC_PAIR( 1,  4)},
-	{10, 0x00D,  AC_PAIR(15,  1)},
-	{10, 0x00E,  AC_PAIR(14,  1)},
-	{10, 0x00F,  AC_PAIR( 4,  2)},
-	{12, 0x010,  AC_PAIR( 0, 11)},
-	{12, 0x011,  AC_PAIR( 8,  2)},
-	{12, 0x012,  AC_PAIR( 4,  3)},
-	{12, 0x013,  AC_PAIR( 0, 10)},
-	{12, 0x014,  AC_PAIR( 2,  4)},
-	{12, 0x015,  AC_PAIR( 7,  2)},
-	{12, 0x016,  AC_PAIR(21,  1)},
-	{12, 0x017,  AC_PAIR(20,  1)},
-	{12, 0x018,  AC_PAIR( 0,  9)},
-	{12, 0x019,  AC_PAIR(19,  1)},
-	{12, 0x01A,  AC_PAIR(18,  1)},
-	{12, 0x01B,  AC_PAIR( 1,  5)},
-	{12, 0x01C,  AC_PAIR( 3,  3)},
-	{12, 0x01D,  AC_PAIR( 0,  8)},
-	{12, 0x01E,  AC_PAIR( 6,  2)},
-	{12, 0x01F,  AC_PAIR(17,  1)},
-	{13, 0x0010, AC_PAIR(10,  2)},
-	{13, 0x0011, AC_PAIR( 9,  2)},
-	{13, 0x0012, AC_PAIR( 5,  3)},
-	{13, 0x0013, AC_PAIR( 3,  4)},
-	{13, 0x0014, AC_PAIR( 2,  5)},
-	{13, 0x0015, AC_PAIR( 1,  7)},
-	{13, 0x0016, AC_PAIR( 1,  6)},
-	{13, 0x0017, AC_PAIR( 0, 15)},
-	{13, 0x0018, AC_PAIR( 0, 14)},
-	{13, 0x0019, AC_PAIR( 0, 13)},
-	{13, 0x001A, AC_PAIR( 0, 12)},
-	{13, 0x001B, AC_PAIR(26,  1)},
-	{13, 0x001C, AC_PAIR(25,  1)},
-	{13, 0x001D, AC_PAIR(24,  1)},
-	{13, 0x001E, AC_PAIR(23,  1)},
-	{13, 0x001F, AC_PAIR(22,  1)},
-	{14, 0x0010, AC_PAIR( 0, 31)},
-	{14, 0x0011, AC_PAIR( 0, 30)},
-	{14, 0x0012, AC_PAIR( 0, 29)},
-	{14, 0x0013, AC_PAIR( 0, 28)},
-	{14, 0x0014, AC_PAIR( 0, 27)},
-	{14, 0x0015, AC_PAIR( 0, 26)},
-	{14, 0x0016, AC_PAIR( 0, 25)},
-	{14, 0x0017, AC_PAIR( 0, 24)},
-	{14, 0x0018, AC_PAIR( 0, 23)},
-	{14, 0x0019, AC_PAIR( 0, 22)},
-	{14, 0x001A, AC_PAIR( 0, 21)},
-	{14, 0x001B, AC_PAIR( 0, 20)},
-	{14, 0x001C, AC_PAIR( 0, 19)},
-	{14, 0x001D, AC_PAIR( 0, 18)},
-	{14, 0x001E, AC_PAIR( 0, 17)},
-	{14, 0x001F, AC_PAIR( 0, 16)},
-	{15, 0x0010, AC_PAIR( 0, 40)},
-	{15, 0x0011, AC_PAIR( 0, 39)},
-	{15, 0x0012, AC_PAIR( 0, 38)},
-	{15, 0x0013, AC_PAIR( 0, 37)},
-	{15, 0x0014, AC_PAIR( 0, 36)},
-	{15, 0x0015, AC_PAIR( 0, 35)},
-	{15, 0x0016, AC_PAIR( 0, 34)},
-	{15, 0x0017, AC_PAIR( 0, 33)},
-	{15, 0x0018, AC_PAIR( 0, 32)},
-	{15, 0x0019, AC_PAIR( 1, 14)},
-	{15, 0x001A, AC_PAIR( 1, 13)},
-	{15, 0x001B, AC_PAIR( 1, 12)},
-	{15, 0x001C, AC_PAIR( 1, 11)},
-	{15, 0x001D, AC_PAIR( 1, 10)},
-	{15, 0x001E, AC_PAIR( 1,  9)},
-	{15, 0x001F, AC_PAIR( 1,  8)},
-	{16, 0x0010, AC_PAIR( 1, 18)},
-	{16, 0x0011, AC_PAIR( 1, 17)},
-	{16, 0x0012, AC_PAIR( 1, 16)},
-	{16, 0x0013, AC_PAIR( 1, 15)},
-	{16, 0x0014, AC_PAIR( 6,  3)},
-	{16, 0x0015, AC_PAIR(16,  2)},
-	{16, 0x0016, AC_PAIR(15,  2)},
-	{16, 0x0017, AC_PAIR(14,  2)},
-	{16, 0x0018, AC_PAIR(13,  2)},
-	{16, 0x0019, AC_PAIR(12,  2)},
-	{16, 0x001A, AC_PAIR(11,  2)},
-	{16, 0x001B, AC_PAIR(31,  1)},
-	{16, 0x001C, AC_PAIR(30,  1)},
-	{16, 0x001D, AC_PAIR(29,  1)},
-	{16, 0x001E, AC_PAIR(28,  1)},
-	{16, 0x001F, AC_PAIR(27,  1)}
+static const psx_mdec_bs_version_t bs_versions[NUM_BS_CODECS] = {
+	PSX_MDEC_BS_V2,   // BS_CODEC_V2
+	PSX_MDEC_BS_V3,   // BS_CODEC_V3
+	PSX_MDEC_BS_V3DC  // BS_CODEC_V3DC
 };
 
-static const struct {
-	int c_bits;
-	uint32_t c_value;
-	int dc_bits;
-} dc_c_huffman_tree[] = {
-	{2, 0x1,  0},
-	{2, 0x2,  1},
-	{3, 0x6,  2},
-	{4, 0xE,  3},
-	{5, 0x1E, 4},
-	{6, 0x3E, 5},
-	{7, 0x7E, 6},
-	{8, 0xFE, 7}
-};
-
-static const struct {
-	int c_bits;
-	uint32_t c_value;
-	int dc_bits;
-} dc_y_huffman_tree[] = {
-	{2, 0x0,  0},
-	{2, 0x1,  1},
-	{3, 0x5,  2},
-	{3, 0x6,  3},
-	{4, 0xE,  4},
-	{5, 0x1E, 5},
-	{6, 0x3E, 6},
-	{7, 0x7E, 7}
-};
-
-static const uint8_t quant_dec[8*8] = {
-	 2, 16, 19, 22, 26, 27, 29, 34,
-	16, 16, 22, 24, 27, 29, 34, 37,
-	19, 22, 26, 27, 29, 34, 34, 38,
-	22, 22, 26, 27, 29, 34, 37, 40,
-	22, 26, 27, 29, 32, 35, 40, 48,
-	26, 27, 29, 32, 35, 40, 48, 58,
-	26, 27, 29, 34, 38, 46, 56, 69,
-	27, 29, 35, 38, 46, 56, 69, 83
-};
-
-#if 0
-static const uint8_t dct_zigzag_table[8*8] = {
-	 0,  1,  5,  6, 14, 15, 27, 28,
-	 2,  4,  7, 13, 16, 26, 29, 42,
-	 3,  8, 12, 17, 25, 30, 41, 43,
-	 9, 11, 18, 24, 31, 40, 44, 53,
-	10, 19, 23, 32, 39, 45, 52, 54,
-	20, 22, 33, 38, 46, 51, 55, 60,
-	21, 34, 37, 47, 50, 56, 59, 61,
-	35, 36, 48, 49, 57, 58, 62, 63
-};
-#endif
-
-static const uint8_t dct_zagzig_table[8*8] = {
-	 0,  1,  8, 16,  9,  2,  3, 10,
-	17, 24, 32, 25, 18, 11,  4,  5,
-	12, 19, 26, 33, 40, 48, 41, 34,
-	27, 20, 13,  6,  7, 14, 21, 28,
-	35, 42, 49, 56, 57, 50, 43, 36,
-	29, 22, 15, 23, 30, 37, 44, 51,
-	58, 59, 52, 45, 38, 31, 39, 46,
-	53, 60, 61, 54, 47, 55, 62, 63
-};
-
-#if 0
-enum {
-	SF0 = 0x5a82, // cos(0/16 * pi) * sqrt(2)
-	SF1 = 0x7d8a, // cos(1/16 * pi) * 2
-	SF2 = 0x7641, // cos(2/16 * pi) * 2
-	SF3 = 0x6a6d, // cos(3/16 * pi) * 2
-	SF4 = 0x5a82, // cos(4/16 * pi) * 2
-	SF5 = 0x471c, // cos(5/16 * pi) * 2
-	SF6 = 0x30fb, // cos(6/16 * pi) * 2
-	SF7 = 0x18f8  // cos(7/16 * pi) * 2
-};
-
-static const int16_t dct_scale_table[8*8] = {
-	SF0,  SF0,  SF0,  SF0,  SF0,  SF0,  SF0,  SF0,
-	SF1,  SF3,  SF5,  SF7, -SF7, -SF5, -SF3, -SF1,
-	SF2,  SF6, -SF6, -SF2, -SF2, -SF6,  SF6,  SF2,
-	SF3, -SF7, -SF1, -SF5,  SF5,  SF1,  SF7, -SF3,
-	SF4, -SF4, -SF4,  SF4,  SF4, -SF4, -SF4,  SF4,
-	SF5, -SF1,  SF7,  SF3, -SF3, -SF7,  SF1, -SF5,
-	SF6, -SF2,  SF2, -SF6, -SF6,  SF2, -SF2,  SF6,
-	SF7, -SF5,  SF3, -SF1,  SF1, -SF3,  SF5, -SF7
-};
-#endif
-
-enum {
-	INDEX_CR,
-	INDEX_CB,
-	INDEX_Y
-};
-
-#define HUFFMAN_CODE(bits, value) (((bits) << 24) | (value))
-
-static void init_dct_data(mdec_encoder_state_t *state, bs_codec_t codec) {
-	for(int i = 0; i <= 0xFFFF; i++) {
-		state->ac_huffman_map[i] = HUFFMAN_CODE(6 + 16, (0x1 << 16) | i);
-
-		int16_t coeff = (int16_t)i;
-
-		if (coeff < -0x200)
-			coeff = -0x200;
-		else if (coeff > +0x1FE)
-			coeff = +0x1FE; // 0x1FF = v2 end of frame
-
-		state->coeff_clamp_map[i] = coeff;
-	}
-
-	state->dc_huffman_map[(INDEX_CR << 9) | 0] = HUFFMAN_CODE(2, 0x0);
-	state->dc_huffman_map[(INDEX_CB << 9) | 0] = HUFFMAN_CODE(2, 0x0);
-	state->dc_huffman_map[(INDEX_Y  << 9) | 0] = HUFFMAN_CODE(3, 0x4);
-
-	int ac_tree_item_count = sizeof(ac_huffman_tree) / sizeof(ac_huffman_tree[0]);
-	int dc_c_tree_item_count = sizeof(dc_c_huffman_tree) / sizeof(dc_c_huffman_tree[0]);
-	int dc_y_tree_item_count = sizeof(dc_y_huffman_tree) / sizeof(dc_y_huffman_tree[0]);
-
-	for (int i = 0; i < ac_tree_item_count; i++) {
-		int bits = ac_huffman_tree[i].c_bits + 1;
-		uint32_t base_value = ac_huffman_tree[i].c_value;
+bool init_mdec_encoder(mdec_encoder_t *encoder, bs_codec_t video_codec, int video_width, int video_height) {
+	encoder->video_codec = video_codec;
+	encoder->video_width = video_width;
+	encoder->video_height = video_height;
+	encoder->frame_cache = NULL;
+	encoder->frame_pool = NULL;
+	encoder->stats = NULL;
+	encoder->skip_encoding = false;
+	encoder->video_planes = NULL;
+	encoder->video_scaler = NULL;
 
-		state->ac_huffman_map[ac_huffman_tree[i].u_hword_pos] = HUFFMAN_CODE(bits, (base_value << 1) | 0);
-		state->ac_huffman_map[ac_huffman_tree[i].u_hword_neg] = HUFFMAN_CODE(bits, (base_value << 1) | 1);
-	}
-	for (int i = 0; i < dc_c_tree_item_count; i++) {
-		int dc_bits = dc_c_huffman_tree[i].dc_bits;
-		int bits = dc_c_huffman_tree[i].c_bits + 1 + dc_bits;
-		uint32_t base_value = dc_c_huffman_tree[i].c_value;
-
-		int pos_offset = 1 << dc_bits;
-		int neg_offset = pos_offset * 2 - 1;
-
-		for (int j = 0; j < (1 << dc_bits); j++) {
-			int pos = (j + pos_offset) & 0x1FF;
-			int neg = (j - neg_offset) & 0x1FF;
-
-			state->dc_huffman_map[(INDEX_CR << 9) | pos] = HUFFMAN_CODE(bits, (base_value << (dc_bits + 1)) | (1 << dc_bits) | j);
-			state->dc_huffman_map[(INDEX_CR << 9) | neg] = HUFFMAN_CODE(bits, (base_value << (dc_bits + 1)) | (0 << dc_bits) | j);
-			state->dc_huffman_map[(INDEX_CB << 9) | pos] = HUFFMAN_CODE(bits, (base_value << (dc_bits + 1)) | (1 << dc_bits) | j);
-			state->dc_huffman_map[(INDEX_CB << 9) | neg] = HUFFMAN_CODE(bits, (base_value << (dc_bits + 1)) | (0 << dc_bits) | j);
-		}
-	}
-	for (int i = 0; i < dc_y_tree_item_count; i++) {
-		int dc_bits = dc_y_huffman_tree[i].dc_bits;
-		int bits = dc_y_huffman_tree[i].c_bits + 1 + dc_bits;
-		uint32_t base_value = dc_y_huffman_tree[i].c_value;
+	mdec_encoder_state_t *state = &(encoder->state);
+	psx_mdec_settings_t settings;
+	settings.version = bs_versions[video_codec];
+	settings.width = video_width;
+	settings.height = video_height;
 
-		int pos_offset = 1 << dc_bits;
-		int neg_offset = pos_offset * 2 - 1;
+	state->bs_workspace = tracked_malloc(MEMORY_MDEC_TABLES, psx_mdec_get_workspace_size(settings));
 
-		for (int j = 0; j < (1 << dc_bits); j++) {
-			int pos = (j + pos_offset) & 0x1FF;
-			int neg = (j - neg_offset) & 0x1FF;
+	if (state->bs_workspace == NULL)
+		return false;
 
-			state->dc_huffman_map[(INDEX_Y << 9) | pos] = HUFFMAN_CODE(bits, (base_value << (dc_bits + 1)) | (1 << dc_bits) | j);
-			state->dc_huffman_map[(INDEX_Y << 9) | neg] = HUFFMAN_CODE(bits, (base_value << (dc_bits + 1)) | (0 << dc_bits) | j);
-		}
-	}
+	state->bs_encoder = psx_mdec_init_encoder(settings, state->bs_workspace);
+	return state->bs_encoder != NULL;
 }
 
-static bool flush_bits(mdec_encoder_state_t *state) {
-	if(state->bits_left < 16) {
-		state->frame_output[state->bytes_used++] = (uint8_t)state->bits_value;
-		if (state->bytes_used >= state->frame_max_size)
-			return false;
-
-		state->frame_output[state->bytes_used++] = (uint8_t)(state->bits_value>>8);
-	}
+void destroy_mdec_encoder(mdec_encoder_t *encoder) {
+	mdec_encoder_state_t *state = &(encoder->state);
 
-	state->bits_left = 16;
-	state->bits_value = 0;
-	return true;
+	tracked_free(state->bs_workspace);
+	state->bs_encoder = NULL;
+	state->bs_workspace = NULL;
 }
 
-static bool encode_bits(mdec_encoder_state_t *state, int bits, uint32_t val) {
-	assert(val < (1<<bits));
-
-	// FIXME: for some reason the main logic breaks when bits > 16
-	// and I have no idea why, so I have to split this up --GM
-	if (bits > 16) {
-		if (!encode_bits(state, bits-16, val>>16))
-			return false;
-
-		bits = 16;
-		val &= 0xFFFF;
-	}
+static void encode_frame_data(mdec_encoder_t *encoder, const uint8_t *video_frame, const psx_mdec_frame_planes_t *video_planes);
 
-	if (state->bits_left == 0) {
-		if (!flush_bits(state))
-			return false;
-	}
+static void *encode_pooled_frame(void *arg) {
+	mdec_frame_job_t *job = (mdec_frame_job_t *)arg;
 
-	while (bits > state->bits_left) {
-		// Bits need truncating
-		uint32_t outval = val;
-		outval >>= bits - state->bits_left;
-		assert(outval < (1<<16));
-		//uint16_t old_value = state->bits_value;
-		assert((state->bits_value & outval) == 0);
-		state->bits_value |= (uint16_t)outval;
-		//fprintf(stderr, "trunc %2d %2d %08X %04X %04X\n", bits, state->bits_left, val, old_value, state->bits_value);
-		bits -= state->bits_left;
-		uint32_t mask = (1<<bits)-1;
-		val &= mask;
-		assert(mask >= 1);
-		assert(val < (1<<bits));
-		if (!flush_bits(state))
-			return false;
-	}
-
-	if (bits >= 1) {
-		assert(bits <= 16);
-		// Bits may need shifting into place
-		uint32_t outval = val;
-		outval <<= state->bits_left - bits;
-		assert(outval < (1<<16));
-		//uint16_t old_value = state->bits_value;
-		assert((state->bits_value & outval) == 0);
-		state->bits_value |= (uint16_t)outval;
-		//fprintf(stderr, "plop  %2d %2d %08X %04X %04X\n", bits, state->bits_left, val, state->bits_value);
-		state->bits_left -= bits;
-	}
-
-	return true;
+	set_trace_track(job->trace_track);
+	encode_frame_data(&(job->encoder), job->video_frame, NULL);
+	return NULL;
 }
 
-#if 0
-static void transform_dct_block(int16_t *block) {
-	// Apply DCT to block
-	int midblock[8*8];
+static void wait_for_pooled_frame(mdec_frame_job_t *job) {
+	if (!job->started)
+		return;
 
-	for (int i = 0; i < 8; i++) {
-	for (int j = 0; j < 8; j++) {
-		int v = 0;
-		for(int k = 0; k < 8; k++) {
-			v += (int)block[8*j+k] * (int)dct_scale_table[8*i+k] / 8;
-		}
-		midblock[8*i+j] = (v + 0xFFF) >> 13;
-	}
-	}
-	for (int i = 0; i < 8; i++) {
-	for (int j = 0; j < 8; j++) {
-		int v = 0;
-		for(int k = 0; k < 8; k++) {
-			v += (int)midblock[8*j+k] * (int)dct_scale_table[8*i+k];
-		}
-		block[8*i+j] = (int16_t)((v + 0xFFF) >> 13);
-	}
-	}
+	pthread_join(job->thread, NULL);
+	job->started = false;
 }
 
-static int reduce_dct_block(mdec_encoder_state_t *state, int32_t *block, int32_t min_val, int *values_to_shed) {
-	// Reduce so it can all fit
-	int nonzeroes = 0;
-
-	for (int i = 1; i < 64; i++) {
-		//int ri = dct_zigzag_table[i];
-		if (block[i] != 0) {
-			//if (abs(block[i])+(ri>>3) < min_val+(64>>3)) {
-			if ((*values_to_shed) > 0 && abs(block[i]) < min_val*1) {
-				block[i] = 0;
-				(*values_to_shed)--;
-			} else {
-				nonzeroes++;
-			}
-		}
-	}
-
-	// Factor in DC + EOF values
-	return nonzeroes+2;
-}
-#endif
-
-// https://stackoverflow.com/a/60011209
-#if 0
-#define DIVIDE_ROUNDED(n, d) (((n) >= 0) ? (((n) + (d)/2) / (d)) : (((n) - (d)/2) / (d)))
-#else
-#define DIVIDE_ROUNDED(n, d) ((int)round((double)(n) / (double)(d)))
-#endif
-
-static bool encode_dct_block(
-	mdec_encoder_state_t *state,
-	bs_codec_t codec,
-	const int16_t *block,
-	const int16_t *quant_table
-) {
-	int dc = DIVIDE_ROUNDED(block[0], quant_table[0]);
-
-	dc = state->coeff_clamp_map[dc & 0xFFFF];
-
-	if (codec == BS_CODEC_V2) {
-		if (!encode_bits(state, 10, dc & 0x3FF))
-			return false;
-	} else {
-		int index = state->block_type;
-
-		if (index > INDEX_Y)
-			index = INDEX_Y;
-
-		int delta = DIVIDE_ROUNDED(dc - state->last_dc_values[index], 4);
-		state->last_dc_values[index] += delta * 4;
-
-		// Some versions of Sony's BS v3 decoder compute each DC coefficient as
-		// ((last + delta * 4) & 0x3FF) instead of just (last + delta * 4). The
-		// encoder can leverage this behavior to represent large coefficient
-		// differences as smaller deltas that cause the decoder to overflow and
-		// wrap around (e.g. -1 to encode -512 -> 511 as opposed to +1023). This
-		// saves some space as larger DC values take up more bits.
-		if (codec == BS_CODEC_V3DC) {
-			if (delta < -0x80)
-				delta += 0x100;
-			else if (delta > +0x80)
-				delta -= 0x100;
-		}
-
-		uint32_t outword = state->dc_huffman_map[(index << 9) | (delta & 0x1FF)];
-
-		if (!encode_bits(state, outword >> 24, outword & 0xFFFFFF))
-			return false;
-	}
-
-	for (int i = 1, zeroes = 0; i < 64; i++) {
-		int ri = dct_zagzig_table[i];
-		int ac = DIVIDE_ROUNDED(block[ri], quant_table[ri]);
-
-		ac = state->coeff_clamp_map[ac & 0xFFFF];
+// Takes over the frame encoded by a worker, if the frame currently being
+// encoded was submitted to the pool with the same maximum size.
+static bool receive_pooled_frame(mdec_encoder_t *encoder) {
+	mdec_encoder_state_t *state = &(encoder->state);
+	mdec_frame_pool_t *pool = encoder->frame_pool;
+	mdec_frame_job_t *job = &(pool->jobs[state->frame_index % pool->job_count]);
 
-		if (ac == 0) {
-			zeroes++;
-		} else {
-			uint32_t outword = state->ac_huffman_map[(zeroes << 10) | (ac & 0x3FF)];
+	if (!job->started || job->encoder.state.frame_index != state->frame_index)
+		return false;
 
-			if (!encode_bits(state, outword >> 24, outword & 0xFFFFFF))
-				return false;
+	uint64_t t = begin_trace_span();
+	wait_for_pooled_frame(job);
+	end_trace_span("wait_frame", "wait", t, "frame", state->frame_index);
 
-			zeroes = 0;
-			state->uncomp_hwords_used++;
-		}
-	}
+	mdec_encoder_state_t *job_state = &(job->encoder.state);
 
-	// Store end of block
-	if (!encode_bits(state, 2, 0x2))
+	if (job_state->frame_max_size != state->frame_max_size)
 		return false;
 
-	state->block_type++;
-	state->block_type %= 6;
-	state->uncomp_hwords_used += 2;
-	//state->uncomp_hwords_used = (state->uncomp_hwords_used+0xF)&~0xF;
+	// Both buffers have the same size, so they can simply be swapped rather
+	// than copied.
+	uint8_t *frame_output = state->frame_output;
+	state->frame_output = job_state->frame_output;
+	job_state->frame_output = frame_output;
+
+	state->bytes_used = job_state->bytes_used;
+	state->blocks_used = job_state->blocks_used;
+	state->uncomp_hwords_used = job_state->uncomp_hwords_used;
+	state->quant_scale = job_state->quant_scale;
+	state->quant_scale_sum += state->quant_scale;
+	state->quant_attempts = job_state->quant_attempts;
+	state->encode_time = job_state->encode_time;
 	return true;
 }
 
-bool init_mdec_encoder(mdec_encoder_t *encoder, bs_codec_t video_codec, int video_width, int video_height) {
-	encoder->video_codec = video_codec;
-	encoder->video_width = video_width;
-	encoder->video_height = video_height;
-
-	mdec_encoder_state_t *state = &(encoder->state);
-
-#if 0
-	if (state->dct_context != NULL)
-		return true;
-#endif
-
-	state->dct_context = avcodec_dct_alloc();
-	state->ac_huffman_map = malloc(0x10000 * sizeof(uint32_t));
-	state->dc_huffman_map = malloc(0x200 * 3 * sizeof(uint32_t));
-	state->coeff_clamp_map = malloc(0x10000 * sizeof(int16_t));
-
-	if (
-		state->dct_context == NULL ||
-		state->ac_huffman_map == NULL ||
-		state->dc_huffman_map == NULL ||
-		state->coeff_clamp_map == NULL
-	)
-		return false;
-
-	int dct_block_count_x = (video_width + 15) / 16;
-	int dct_block_count_y = (video_height + 15) / 16;
-	int dct_block_size = dct_block_count_x * dct_block_count_y * sizeof(int16_t) * 8*8;
-
-	for (int i = 0; i < 6; i++) {
-		state->dct_block_lists[i] = malloc(dct_block_size);
-
-		if (state->dct_block_lists[i] == NULL)
-			return false;
-	}
-
-	avcodec_dct_init(state->dct_context);
-	init_dct_data(state, video_codec);
-	return true;
+static void log_frame(const mdec_encoder_t *encoder, const char *source) {
+	const mdec_encoder_state_t *state = &(encoder->state);
+	FILE *log = (encoder->stats != NULL) ? encoder->stats->frame_log : NULL;
+
+	if (log == NULL)
+		return;
+
+	fprintf(
+		log,
+		"%d,%d,%d,%d,%d,%d,%.3f,%s\n",
+		state->frame_index,
+		state->quant_scale,
+		state->quant_attempts,
+		state->bytes_used,
+		state->frame_max_size,
+		state->uncomp_hwords_used,
+		(double)state->encode_time / 1e3,
+		source
+	);
 }
 
-void destroy_mdec_encoder(mdec_encoder_t *encoder) {
+static void encode_frame(mdec_encoder_t *encoder, const uint8_t *video_frame, const psx_mdec_frame_planes_t *video_planes) {
 	mdec_encoder_state_t *state = &(encoder->state);
 
-	if (state->dct_context) {
-		av_free(state->dct_context);
-		state->dct_context = NULL;
-	}
-	if (state->ac_huffman_map) {
-		free(state->ac_huffman_map);
-		state->ac_huffman_map = NULL;
-	}
-	if (state->dc_huffman_map) {
-		free(state->dc_huffman_map);
-		state->dc_huffman_map = NULL;
-	}
-	if (state->coeff_clamp_map) {
-		free(state->coeff_clamp_map);
-		state->coeff_clamp_map = NULL;
-	}
-	for (int i = 0; i < 6; i++) {
-		if (state->dct_block_lists[i] != NULL) {
-			free(state->dct_block_lists[i]);
-			state->dct_block_lists[i] = NULL;
+	assert(state->bs_workspace);
+
+	if (encoder->frame_cache != NULL) {
+		uint64_t t = begin_stage(encoder->stats);
+		int bytes_used = fetch_cached_frame(
+			encoder->frame_cache,
+			state->frame_index,
+			state->frame_max_size,
+			video_frame,
+			state->frame_output
+		);
+
+		if (bytes_used > 0) {
+			// Restore the statistics that would have been computed had the
+			// frame been encoded from scratch.
+			state->bytes_used = bytes_used;
+			state->blocks_used = state->frame_output[0x000] | (state->frame_output[0x001] << 8);
+			state->uncomp_hwords_used = state->blocks_used * 2;
+			state->quant_scale = state->frame_output[0x004] | (state->frame_output[0x005] << 8);
+			state->quant_scale_sum += state->quant_scale;
+			state->quant_attempts = 0;
+			state->encode_time = (encoder->stats != NULL) ? (get_monotonic_time() - t) : 0;
+
+			log_frame(encoder, "reused");
+			return;
 		}
 	}
+	if (encoder->frame_pool != NULL && receive_pooled_frame(encoder)) {
+		log_frame(encoder, "pooled");
+		return;
+	}
+
+	encode_frame_data(encoder, video_frame, video_planes);
+	log_frame(encoder, "encoded");
 }
 
 void encode_frame_bs(mdec_encoder_t *encoder, const uint8_t *video_frame) {
-	mdec_encoder_state_t *state = &(encoder->state);
-
-	assert(state->dct_context);
-
-	int pitch = encoder->video_width;
-#if 0
-	int real_index = state->frame_index - 1;
-	if (real_index > (video_frame_count - 1))
-		real_index = video_frame_count - 1;
-
-	const uint8_t *y_plane = video_frames + encoder->video_width * encoder->video_height * 3/2 * real_index;
-#else
-	const uint8_t *y_plane = video_frame;
-	const uint8_t *c_plane = y_plane + (encoder->video_width * encoder->video_height);
-#endif
-
-	int dct_block_count_x = (encoder->video_width + 15) / 16;
-	int dct_block_count_y = (encoder->video_height + 15) / 16;
-
-	// TODO: non-16x16-aligned videos
-	assert((encoder->video_width % 16) == 0);
-	assert((encoder->video_height % 16) == 0);
-
-	// Rearrange the Y/C planes returned by libswscale into macroblocks.
-	for (int fx = 0; fx < dct_block_count_x; fx++) {
-		for (int fy = 0; fy < dct_block_count_y; fy++) {
-			// Order: Cr Cb [Y1|Y2]
-			//              [Y3|Y4]
-			int block_offs = 64 * (fy*dct_block_count_x + fx);
-			int16_t *blocks[6] = {
-				state->dct_block_lists[0] + block_offs,
-				state->dct_block_lists[1] + block_offs,
-				state->dct_block_lists[2] + block_offs,
-				state->dct_block_lists[3] + block_offs,
-				state->dct_block_lists[4] + block_offs,
-				state->dct_block_lists[5] + block_offs
-			};
-
-			for (int y = 0; y < 8; y++) {
-				for (int x = 0; x < 8; x++) {
-					int k = y*8 + x;
-					int cx = fx*8 + x;
-					int cy = fy*8 + y;
-					int lx = fx*16 + x;
-					int ly = fy*16 + y;
-
-					blocks[0][k] = (int16_t)c_plane[pitch*cy + 2*cx + 0] - 128;
-					blocks[1][k] = (int16_t)c_plane[pitch*cy + 2*cx + 1] - 128;
-					blocks[2][k] = (int16_t)y_plane[pitch*(ly+0) + (lx+0)] - 128;
-					blocks[3][k] = (int16_t)y_plane[pitch*(ly+0) + (lx+8)] - 128;
-					blocks[4][k] = (int16_t)y_plane[pitch*(ly+8) + (lx+0)] - 128;
-					blocks[5][k] = (int16_t)y_plane[pitch*(ly+8) + (lx+8)] - 128;
-				}
-			}
-
-			for (int i = 0; i < 6; i++)
-#if 0
-				transform_dct_block(blocks[i]);
-#else
-				state->dct_context->fdct(blocks[i]);
-#endif
-		}
-	}
+	encode_frame(encoder, video_frame, encoder->video_planes);
+}
 
-	uint32_t end_of_block;
+static void encode_frame_data(mdec_encoder_t *encoder, const uint8_t *video_frame, const psx_mdec_frame_planes_t *video_planes) {
+	mdec_encoder_state_t *state = &(encoder->state);
+	uint64_t start_time = begin_stage(encoder->stats);
 
-	if (encoder->video_codec == BS_CODEC_V2) {
-		end_of_block = 0x1FF;
-	} else {
-		end_of_block = 0x3FF;
-		assert(state->dc_huffman_map);
-	}
+	if (video_planes != NULL)
+		psx_mdec_transform_frame_planes(state->bs_encoder, encoder->video_scaler, video_planes);
+	else
+		psx_mdec_transform_frame(state->bs_encoder, video_frame);
 
-	assert(state->ac_huffman_map);
-	assert(state->coeff_clamp_map);
+	end_stage(encoder->stats, STAGE_DCT, start_time);
 
 	// Attempt encoding the frame at the maximum quality. If the result is too
-	// large, increase the quantization scale and try again.
-	// TODO: if a frame encoded at scale N is too large but the same frame
-	// encoded at scale N+1 leaves a significant amount of free space, attempt
-	// compressing at scale N but optimizing coefficients away until it fits
-	// (like the old algorithm did)
+	// large, increase the quantization scale and try again. This is the same
+	// search psx_mdec_encode_frame() performs, split up in order to time each
+	// attempt.
+	psx_mdec_frame_stats_t frame_stats;
+	state->quant_attempts = 0;
+
 	for (
 		state->quant_scale = 1;
 		state->quant_scale < 64;
 		state->quant_scale++
 	) {
-		int16_t quant_table[8*8];
-
-		// The DC coefficient's quantization scale is always 8.
-		quant_table[0] = quant_dec[0] * 8;
-
-		for (int i = 1; i < 64; i++)
-			quant_table[i] = quant_dec[i] * state->quant_scale;
-
-		memset(state->frame_output, 0, state->frame_max_size);
-
-		state->block_type = 0;
-		state->last_dc_values[INDEX_CR] = 0;
-		state->last_dc_values[INDEX_CB] = 0;
-		state->last_dc_values[INDEX_Y] = 0;
-
-		state->bits_value = 0;
-		state->bits_left = 16;
-		state->uncomp_hwords_used = 0;
-		state->bytes_used = 8;
-
-		bool ok = true;
-		for (int fx = 0; ok && (fx < dct_block_count_x); fx++) {
-			for (int fy = 0; ok && (fy < dct_block_count_y); fy++) {
-				// Order: Cr Cb [Y1|Y2]
-				//              [Y3|Y4]
-				int block_offs = 64 * (fy*dct_block_count_x + fx);
-				int16_t *blocks[6] = {
-					state->dct_block_lists[0] + block_offs,
-					state->dct_block_lists[1] + block_offs,
-					state->dct_block_lists[2] + block_offs,
-					state->dct_block_lists[3] + block_offs,
-					state->dct_block_lists[4] + block_offs,
-					state->dct_block_lists[5] + block_offs
-				};
-
-				for(int i = 0; ok && (i < 6); i++)
-					ok = encode_dct_block(state, encoder->video_codec, blocks[i], quant_table);
-			}
-		}
-
-		if (!ok)
-			continue;
-		if (!encode_bits(state, 10, end_of_block))
-			continue;
-#if 0
-		if (!encode_bits(state, 2, 0x2))
-			continue;
-#endif
-		if (!flush_bits(state))
-			continue;
-
-		state->uncomp_hwords_used += 2;
-		state->quant_scale_sum += state->quant_scale;
-		break;
+		uint64_t t = begin_stage(encoder->stats);
+		state->quant_attempts++;
+
+		int bytes_used = psx_mdec_encode_blocks(
+			state->bs_encoder,
+			state->quant_scale,
+			state->frame_output,
+			state->frame_max_size,
+			&frame_stats
+		);
+
+		// libpsxav quantizes and Huffman codes each block in a single pass, so
+		// the two cannot be timed separately. Attempts that resulted in a frame
+		// too large to fit are accounted as part of the search for a suitable
+		// quantization scale, and the successful one separately.
+		end_stage(encoder->stats, (bytes_used >= 0) ? STAGE_FINAL_ATTEMPT : STAGE_QUANT_SEARCH, t);
+
+		if (bytes_used >= 0)
+			break;
 	}
 	assert(state->quant_scale < 64);
 
-	// MDEC DMA is usually configured to transfer data in 32-word chunks.
-	state->uncomp_hwords_used = (state->uncomp_hwords_used+0x3F)&~0x3F;
+	state->bytes_used = frame_stats.bytes_used;
+	state->blocks_used = frame_stats.blocks_used;
+	state->uncomp_hwords_used = frame_stats.uncomp_hwords_used;
+	state->quant_scale_sum += state->quant_scale;
 
-	// This is not the number of 32-byte blocks required for uncompressed data
-	// as jPSXdec docs say, but rather the number of 32-*bit* words required.
-	// The first 4 bytes of the frame header are in fact the MDEC command to
-	// start decoding, which contains the data length in words in the lower 16
-	// bits.
-	state->blocks_used = (state->uncomp_hwords_used+1)>>1;
+	if (encoder->stats != NULL) {
+		uint64_t end_time = get_monotonic_time();
+		state->encode_time = end_time - start_time;
 
-	// We need a multiple of 4
-	state->bytes_used = (state->bytes_used+0x3)&~0x3;
-
-	// MDEC command (size of decompressed MDEC data)
-	state->frame_output[0x000] = (uint8_t)state->blocks_used;
-	state->frame_output[0x001] = (uint8_t)(state->blocks_used>>8);
-	state->frame_output[0x002] = (uint8_t)0x00;
-	state->frame_output[0x003] = (uint8_t)0x38;
-
-	// Quantization scale
-	state->frame_output[0x004] = (uint8_t)state->quant_scale;
-	state->frame_output[0x005] = (uint8_t)(state->quant_scale>>8);
-
-	// BS version
-	if (encoder->video_codec == BS_CODEC_V2)
-		state->frame_output[0x006] = 0x02;
-	else
-		state->frame_output[0x006] = 0x03;
-
-	state->frame_output[0x007] = 0x00;
+		if (trace_enabled)
+			write_trace_span("frame", "frame", start_time, end_time, "frame", state->frame_index);
+	} else {
+		state->encode_time = 0;
+	}
 }
 
 int encode_sector_str(
@@ -762,7 +260,7 @@ int encode_sector_str(
 	uint8_t *output
 ) {
 	mdec_encoder_state_t *state = &(encoder->state);
-	int frame_size = encoder->video_width * encoder->video_height * 2;
+	int frame_size = encoder->video_width * encoder->video_height * 3 / 2;
 	int frames_used = 0;
 
 	while (state->frame_data_offset >= state->frame_max_size) {
@@ -774,8 +272,15 @@ int encode_sector_str(
 		state->frame_block_overflow_num %= state->frame_block_overflow_den;
 		state->frame_data_offset = 0;
 
-		encode_frame_bs(encoder, video_frames);
-		video_frames += frame_size;
+		// Frames that are not going to be output (e.g. as they are outside
+		// of the sector range being encoded) only need to be accounted for.
+		if (!encoder->skip_encoding) {
+			if (encoder->video_planes != NULL)
+				encode_frame(encoder, NULL, encoder->video_planes + frames_used);
+			else
+				encode_frame(encoder, video_frames + (long)frame_size * frames_used, NULL);
+		}
+
 		frames_used++;
 	}
 
@@ -834,3 +339,91 @@ int encode_sector_str(
 	state->frame_data_offset += 2016;
 	return frames_used;
 }
+
+bool init_mdec_frame_pool(mdec_frame_pool_t *pool, const mdec_encoder_t *encoder, int job_count, int max_frame_size) {
+	pool->jobs = calloc(job_count, sizeof(mdec_frame_job_t));
+	pool->job_count = job_count;
+	pool->frame_size = encoder->video_width * encoder->video_height * 3 / 2;
+	pool->next_frame_index = 1;
+
+	if (pool->jobs == NULL)
+		return false;
+
+	for (int i = 0; i < job_count; i++) {
+		mdec_frame_job_t *job = &(pool->jobs[i]);
+
+		if (!init_mdec_encoder(&(job->encoder), encoder->video_codec, encoder->video_width, encoder->video_height))
+			return false;
+
+		job->encoder.stats = encoder->stats;
+		job->trace_track = create_trace_track(
+			"%s: frame worker %d",
+			(encoder->stats != NULL) ? encoder->stats->output_file : "",
+			i
+		);
+		job->encoder.state.frame_index = 0;
+		job->encoder.state.frame_output = tracked_malloc(MEMORY_FRAME_BUFFERS, max_frame_size);
+		job->encoder.state.quant_scale_sum = 0;
+		job->video_frame = tracked_malloc(MEMORY_FRAME_BUFFERS, pool->frame_size);
+
+		if (job->encoder.state.frame_output == NULL || job->video_frame == NULL)
+			return false;
+	}
+
+	return true;
+}
+
+void destroy_mdec_frame_pool(mdec_frame_pool_t *pool) {
+	if (pool->jobs == NULL)
+		return;
+
+	for (int i = 0; i < pool->job_count; i++) {
+		mdec_frame_job_t *job = &(pool->jobs[i]);
+
+		wait_for_pooled_frame(job);
+		tracked_free(job->encoder.state.frame_output);
+		tracked_free(job->video_frame);
+		destroy_mdec_encoder(&(job->encoder));
+	}
+
+	free(pool->jobs);
+	pool->jobs = NULL;
+}
+
+// Returns the position of the next frame to submit relative to the next frame
+// the encoder is going to start, or -1 if all workers are busy with frames the
+// encoder has not reached yet.
+int get_pooled_frame_offset(mdec_encoder_t *encoder) {
+	mdec_frame_pool_t *pool = encoder->frame_pool;
+	int next_frame_index = encoder->state.frame_index + 1;
+
+	if (pool == NULL || encoder->skip_encoding)
+		return -1;
+
+	// Frames that have been skipped or already encoded without going through
+	// the pool are never submitted.
+	if (pool->next_frame_index < next_frame_index)
+		pool->next_frame_index = next_frame_index;
+	if (pool->next_frame_index >= (next_frame_index + pool->job_count))
+		return -1;
+
+	return pool->next_frame_index - next_frame_index;
+}
+
+void submit_pooled_frame(mdec_encoder_t *encoder, int frame_max_size, const uint8_t *video_frame) {
+	mdec_frame_pool_t *pool = encoder->frame_pool;
+	int frame_index = pool->next_frame_index++;
+	mdec_frame_job_t *job = &(pool->jobs[frame_index % pool->job_count]);
+
+	// The slot may still be held by a frame that was never received (e.g.
+	// as it was fetched from the frame cache instead).
+	wait_for_pooled_frame(job);
+
+	job->encoder.state.frame_index = frame_index;
+	job->encoder.state.frame_max_size = frame_max_size;
+	memcpy(job->video_frame, video_frame, pool->frame_size);
+
+	// Frames for which a thread could not be created are going to be encoded
+	// by the encoder itself once it reaches them.
+	job->started = (pthread_create(&(job->thread), NULL, &encode_pooled_frame, job) == 0);
+}
@@ -24,10 +24,13 @@ freely, subject to the following restrictions:
 
 #pragma once
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
-#include <libavcodec/avdct.h>
+#include <libpsxav.h>
 #include "args.h"
+#include "cache.h"
+#include "stats.h"
 
 typedef struct {
 	int frame_index;
@@ -36,35 +39,65 @@ typedef struct {
 	int frame_block_base_overflow;
 	int frame_block_overflow_num;
 	int frame_block_overflow_den;
-	int block_type;
-	int16_t last_dc_values[3];
-	uint16_t bits_value;
-	int bits_left;
 	uint8_t *frame_output;
 	int bytes_used;
 	int blocks_used;
 	int uncomp_hwords_used;
 	int quant_scale;
 	int quant_scale_sum;
+	int quant_attempts;
+	uint64_t encode_time; // in nanoseconds
 
-	AVDCT *dct_context;
-	uint32_t *ac_huffman_map;
-	uint32_t *dc_huffman_map;
-	int16_t *coeff_clamp_map;
-	int16_t *dct_block_lists[6];
+	psx_mdec_encoder_t *bs_encoder;
+	void *bs_workspace;
 } mdec_encoder_state_t;
 
+typedef struct mdec_frame_pool_t mdec_frame_pool_t;
+
 typedef struct {
 	bs_codec_t video_codec;
 	int video_width;
 	int video_height;
+	frame_cache_t *frame_cache;
+	mdec_frame_pool_t *frame_pool;
+	encode_stats_t *stats;
+	bool skip_encoding;
+
+	// If not NULL, frames are read from these planes (one entry per frame, in
+	// the same order as the packed NV21 frames that would otherwise be passed
+	// to encode_frame_bs() and encode_sector_str()) rather than packed frames.
+	const psx_mdec_frame_planes_t *video_planes;
+	psx_mdec_scaler_t *video_scaler; // used for planes that need scaling
 
 	mdec_encoder_state_t state;
 } mdec_encoder_t;
 
+typedef struct {
+	mdec_encoder_t encoder;
+	uint8_t *video_frame;
+	pthread_t thread;
+	bool started;
+	int trace_track;
+} mdec_frame_job_t;
+
+// Once their maximum size is known, frames can be encoded independently of
+// each other. A pool encodes upcoming frames ahead of time on worker threads,
+// one per job slot, and hands them over to the encoder in order as it reaches
+// them.
+struct mdec_frame_pool_t {
+	mdec_frame_job_t *jobs;
+	int job_count;
+	int frame_size;
+	int next_frame_index;
+};
+
 bool init_mdec_encoder(mdec_encoder_t *encoder, bs_codec_t video_codec, int video_width, int video_height);
 void destroy_mdec_encoder(mdec_encoder_t *encoder);
 void encode_frame_bs(mdec_encoder_t *encoder, const uint8_t *video_frame);
+bool init_mdec_frame_pool(mdec_frame_pool_t *pool, const mdec_encoder_t *encoder, int job_count, int max_frame_size);
+void destroy_mdec_frame_pool(mdec_frame_pool_t *pool);
+int get_pooled_frame_offset(mdec_encoder_t *encoder);
+void submit_pooled_frame(mdec_encoder_t *encoder, int frame_max_size, const uint8_t *video_frame);
 int encode_sector_str(
 	mdec_encoder_t *encoder,
 	format_t format,
@@ -0,0 +1,184 @@
+/*
+psxavenc: MDEC video + SPU/XA-ADPCM audio encoder frontend
+
+Copyright (c) 2019, 2020 Adrian "asie" Siekierka
+Copyright (c) 2019 Ben "GreaseMonkey" Russell
+Copyright (c) 2023, 2025 spicyjpeg
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libpsxav.h>
+#include "args.h"
+#include "mux.h"
+
+bool parse_mux_pattern(mux_pattern_t *pattern, const char *str) {
+	pattern->length = 0;
+	pattern->stream_count = 0;
+
+	for (int i = 0; i < MAX_MUX_STREAMS; i++)
+		pattern->stream_slots[i] = 0;
+
+	while (*str) {
+		char *next;
+		long index = strtol(str, &next, 10);
+
+		if (next == str || (*next != ',' && *next != 0) || index < 0 || index >= MAX_MUX_STREAMS) {
+			fprintf(stderr, "Invalid interleaving pattern (expected comma-separated list of indices from 0 to %d)\n", MAX_MUX_STREAMS - 1);
+			return false;
+		}
+		if (pattern->length >= MAX_MUX_PATTERN_LENGTH) {
+			fprintf(stderr, "Interleaving pattern is too long (up to %d sectors)\n", MAX_MUX_PATTERN_LENGTH);
+			return false;
+		}
+
+		pattern->slots[pattern->length++] = (uint8_t)index;
+		pattern->stream_slots[index]++;
+
+		if (pattern->stream_count <= index)
+			pattern->stream_count = index + 1;
+
+		str = (*next == ',') ? (next + 1) : next;
+	}
+
+	if (pattern->stream_count < 2) {
+		fprintf(stderr, "Interleaving pattern must reference at least two streams\n");
+		return false;
+	}
+
+	// Each stream is encoded as if it had the drive to itself at a fraction
+	// of its speed, which only holds if its sectors are evenly spaced.
+	for (int i = 0; i < pattern->stream_count; i++) {
+		int count = pattern->stream_slots[i];
+
+		if (count == 0) {
+			fprintf(stderr, "Stream %d is missing from interleaving pattern\n", i);
+			return false;
+		}
+		if (pattern->length % count) {
+			fprintf(stderr, "Sectors of stream %d are not evenly spaced in interleaving pattern\n", i);
+			return false;
+		}
+
+		int spacing = pattern->length / count;
+		int first = -1;
+
+		for (int j = 0; j < pattern->length; j++) {
+			if (pattern->slots[j] != i)
+				continue;
+
+			if (first < 0)
+				first = j;
+			else if ((j - first) % spacing) {
+				fprintf(stderr, "Sectors of stream %d are not evenly spaced in interleaving pattern\n", i);
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+static int get_mux_sector_size(format_t format) {
+	switch (format) {
+		case FORMAT_STRCD:
+			return PSX_CDROM_SECTOR_SIZE;
+
+		case FORMAT_STR:
+			return 2336;
+
+		default:
+			return 2048;
+	}
+}
+
+// Streams that run out of sectors before the others are padded with empty data
+// sectors, so that the remaining streams keep their position in the pattern.
+static void init_padding_sector(uint8_t *sector, int lba, int sector_size) {
+	psx_cdrom_sector_t *cd_sector = (psx_cdrom_sector_t *)sector;
+
+	memset(sector, 0, PSX_CDROM_SECTOR_SIZE);
+
+	if (sector_size == 2048)
+		return;
+
+	psx_cdrom_init_sector(cd_sector, lba, PSX_CDROM_SECTOR_TYPE_MODE2_FORM1);
+	psx_cdrom_calculate_checksums(cd_sector, PSX_CDROM_SECTOR_TYPE_MODE2_FORM1);
+}
+
+// Sectors are copied from each stream as-is, except for the timecode of raw
+// 2352-byte sectors which is updated to match their new location. The EDC
+// does not cover the header in Mode 2 sectors and thus stays valid.
+bool mux_str_streams(const mux_pattern_t *pattern, const args_t *args, FILE *const *streams, FILE *output) {
+	int sector_size = get_mux_sector_size(args->format);
+	int sector_count[MAX_MUX_STREAMS];
+	int remaining = 0;
+
+	for (int i = 0; i < pattern->stream_count; i++) {
+		if (fseek(streams[i], 0, SEEK_END) != 0) {
+			fprintf(stderr, "Failed to read back encoded stream %d\n", i);
+			return false;
+		}
+
+		sector_count[i] = (int)(ftell(streams[i]) / sector_size);
+		remaining += sector_count[i];
+		rewind(streams[i]);
+	}
+
+	uint8_t buffer[PSX_CDROM_SECTOR_SIZE];
+	uint8_t *sector = buffer + PSX_CDROM_SECTOR_SIZE - sector_size;
+	psx_cdrom_sector_t *cd_sector = (psx_cdrom_sector_t *)buffer;
+	psx_cdrom_sector_xa_subheader_t subheader[2];
+	int padding_count = 0;
+
+	for (int lba = 0; remaining > 0; lba++) {
+		int stream = pattern->slots[lba % pattern->length];
+
+		if (sector_count[stream] > 0) {
+			if (fread(sector, sector_size, 1, streams[stream]) != 1) {
+				fprintf(stderr, "Failed to read back encoded stream %d\n", stream);
+				return false;
+			}
+			if (sector_size == PSX_CDROM_SECTOR_SIZE) {
+				memcpy(subheader, cd_sector->mode2.subheader, sizeof(subheader));
+				psx_cdrom_init_sector(cd_sector, lba, PSX_CDROM_SECTOR_TYPE_MODE2_FORM1);
+				memcpy(cd_sector->mode2.subheader, subheader, sizeof(subheader));
+			}
+
+			sector_count[stream]--;
+			remaining--;
+		} else {
+			init_padding_sector(buffer, lba, sector_size);
+			padding_count++;
+		}
+
+		if (fwrite(sector, sector_size, 1, output) != 1) {
+			fprintf(stderr, "Failed to write output file: %s\n", args->output_file);
+			return false;
+		}
+	}
+
+	if (!(args->flags & FLAG_QUIET) && padding_count > 0)
+		fprintf(stderr, "Padded shorter streams with %d empty sectors\n", padding_count);
+
+	return true;
+}
@@ -0,0 +1,684 @@
+/*
+psxavenc: MDEC video + SPU/XA-ADPCM audio encoder frontend
+
+Copyright (c) 2019, 2020 Adrian "asie" Siekierka
+Copyright (c) 2019 Ben "GreaseMonkey" Russell
+Copyright (c) 2023, 2025 spicyjpeg
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+#include <libpsxav.h>
+#include "args.h"
+#include "demux.h"
+#include "preview.h"
+#include "trace.h"
+#include "transmux.h"
+
+#define MAX_PREVIEW_THREADS 64
+#define FRAMES_PER_THREAD   4
+
+typedef struct {
+	const mapped_file_t *input;
+	const demux_t *demux;
+	psx_mdec_settings_t settings;
+	int frame_size;
+
+	// Frames are decoded in batches, each of which is split among all
+	// threads. Frames that are missing or fail to decode are flagged so that
+	// the previous frame can be repeated in their place.
+	int first_frame;
+	int frame_count;
+	uint8_t *frames;
+	bool *decoded;
+} preview_batch_t;
+
+typedef struct {
+	const preview_batch_t *batch;
+	int index;
+	int stride;
+
+	psx_mdec_decoder_t *decoder;
+	void *decoder_workspace;
+	uint8_t *buffer;
+	int buffer_size;
+	bool out_of_memory;
+} preview_job_t;
+
+static const char *const y4m_header_format = "YUV4MPEG2 W%d H%d F%d:%d Ip A1:1 C420jpeg XCOLORRANGE=FULL\n";
+
+static bool is_stdout_path(const char *path) {
+	return strcmp(path, "-") == 0;
+}
+
+static FILE *open_preview_output(const char *path) {
+	if (!is_stdout_path(path))
+		return fopen(path, "wb");
+
+#ifdef _WIN32
+	_setmode(_fileno(stdout), _O_BINARY);
+#endif
+	return stdout;
+}
+
+static bool close_preview_output(FILE *file) {
+	bool ok = (fflush(file) == 0) && !ferror(file);
+
+	if (file != stdout && fclose(file) != 0)
+		ok = false;
+
+	return ok;
+}
+
+// Returns a pointer to the BS data of a frame. Frames split across multiple
+// .str chunks are reassembled into the job's buffer, while frames stored in a
+// single chunk (including all .sbs frames) are read directly from the mapped
+// input file.
+static const uint8_t *get_frame_data(preview_job_t *job, int frame_index, int *length) {
+	const preview_batch_t *batch = job->batch;
+	const demux_frame_t *frame = get_demux_frame(batch->demux, frame_index);
+
+	if (frame == NULL)
+		return NULL;
+
+	const uint8_t *data = batch->input->data;
+	long size = batch->input->size;
+	int chunk_size = (frame->chunk_count > 1) ? STR_CHUNK_DATA_SIZE : frame->max_size;
+
+	if (frame->chunk_count == 1) {
+		if (frame->chunk_offsets[0] + frame->bytes_used > size)
+			return NULL;
+
+		*length = frame->bytes_used;
+		return data + frame->chunk_offsets[0];
+	}
+
+	if (job->buffer_size < frame->bytes_used) {
+		free(job->buffer);
+		job->buffer = malloc(frame->max_size);
+		job->buffer_size = frame->max_size;
+
+		if (job->buffer == NULL) {
+			job->buffer_size = 0;
+			job->out_of_memory = true;
+			return NULL;
+		}
+	}
+
+	int offset = 0;
+
+	for (int i = 0; i < frame->chunk_count && offset < frame->bytes_used; i++) {
+		int chunk_length = frame->bytes_used - offset;
+
+		if (chunk_length > chunk_size)
+			chunk_length = chunk_size;
+		if (frame->chunk_offsets[i] + chunk_length > size)
+			return NULL;
+
+		memcpy(job->buffer + offset, data + frame->chunk_offsets[i], chunk_length);
+		offset += chunk_length;
+	}
+
+	*length = frame->bytes_used;
+	return job->buffer;
+}
+
+static void *preview_thread(void *arg) {
+	preview_job_t *job = (preview_job_t *)arg;
+	const preview_batch_t *batch = job->batch;
+
+	for (int i = job->index; i < batch->frame_count; i += job->stride) {
+		int length = 0;
+		const uint8_t *data = get_frame_data(job, batch->first_frame + i, &length);
+		uint8_t *frame = batch->frames + (long)i * batch->frame_size;
+
+		batch->decoded[i] = (data != NULL) && (job->decoder != NULL) && psx_mdec_decode_frame(job->decoder, data, length, frame);
+	}
+
+	return NULL;
+}
+
+// Writes a decoded NV21 frame as a .y4m frame, splitting the interleaved
+// chroma plane into separate Cb and Cr planes.
+static bool write_y4m_frame(FILE *output, psx_mdec_settings_t settings, const uint8_t *frame, uint8_t *temp) {
+	int luma_size = settings.width * settings.height;
+	int chroma_size = luma_size / 4;
+	const uint8_t *c_plane = frame + luma_size;
+
+	for (int i = 0; i < chroma_size; i++) {
+		temp[i] = c_plane[i * 2 + 1]; // Cb
+		temp[chroma_size + i] = c_plane[i * 2 + 0]; // Cr
+	}
+
+	return
+		fputs("FRAME\n", output) >= 0 &&
+		fwrite(frame, luma_size, 1, output) == 1 &&
+		fwrite(temp, chroma_size * 2, 1, output) == 1;
+}
+
+static psx_mdec_bs_version_t get_bs_version(const args_t *args, const uint8_t *header) {
+	if (header[0x006] == 0x02)
+		return PSX_MDEC_BS_V2;
+
+	// v3 and v3dc frames are indistinguishable, so DC wrapping is only
+	// emulated if requested.
+	return (args->video_codec == BS_CODEC_V3DC) ? PSX_MDEC_BS_V3DC : PSX_MDEC_BS_V3;
+}
+
+static bool preview_video(const args_t *args, const mapped_file_t *input, const char *path, int *frames_written) {
+	demux_t demux;
+
+	if (args->format == FORMAT_SBS) {
+		if (!open_demux_any(&demux, args->input_file, args->str_video_id, args->alignment))
+			return false;
+	} else {
+		if (!open_demux_str(&demux, args->input_file, args->str_video_id))
+			return false;
+	}
+
+	int first_frame = -1;
+	int last_frame = -1;
+
+	for (int i = 0; i < demux.frame_count; i++) {
+		if (get_demux_frame(&demux, i) == NULL)
+			continue;
+		if (first_frame < 0)
+			first_frame = i;
+
+		last_frame = i;
+	}
+
+	if (first_frame < 0) {
+		fprintf(stderr, "No video frames found in %s\n", args->input_file);
+		close_demux(&demux);
+		return false;
+	}
+
+	// .sbs files do not store the video resolution, so it must be passed
+	// using -s.
+	psx_mdec_settings_t settings;
+	const demux_frame_t *first = get_demux_frame(&demux, first_frame);
+
+	settings.version = get_bs_version(args, input->data + first->chunk_offsets[0]);
+	settings.width = args->video_width;
+	settings.height = args->video_height;
+
+	if (args->format != FORMAT_SBS && demux.video_width > 0 && demux.video_height > 0) {
+		settings.width = (demux.video_width + 15) & ~15;
+		settings.height = (demux.video_height + 15) & ~15;
+	}
+	if (args->format == FORMAT_SBS && !check_demux_resolution(&demux, settings.width, settings.height)) {
+		fprintf(stderr, "Frames in %s do not match the resolution passed to -s (%dx%d)\n", args->input_file, settings.width, settings.height);
+		close_demux(&demux);
+		return false;
+	}
+
+	FILE *output = open_preview_output(path);
+
+	if (output == NULL) {
+		fprintf(stderr, "Failed to open output file: %s\n", path);
+		close_demux(&demux);
+		return false;
+	}
+
+	int thread_count = args->thread_count;
+
+	if (thread_count > MAX_PREVIEW_THREADS)
+		thread_count = MAX_PREVIEW_THREADS;
+
+	int frame_size = settings.width * settings.height * 3 / 2;
+	int batch_size = thread_count * FRAMES_PER_THREAD;
+
+	preview_batch_t batches[2];
+	preview_job_t *jobs = calloc(thread_count, sizeof(preview_job_t));
+	pthread_t threads[MAX_PREVIEW_THREADS];
+	bool started[MAX_PREVIEW_THREADS];
+
+	if (jobs == NULL) {
+		fprintf(stderr, "Failed to allocate preview buffers\n");
+		close_preview_output(output);
+		close_demux(&demux);
+		return false;
+	}
+
+	// Missing frames are replaced with a copy of the last frame decoded (or a
+	// black frame if none has been decoded yet), as a player would do.
+	uint8_t *previous = malloc(frame_size);
+	uint8_t *temp = malloc(frame_size);
+	bool ok = (previous != NULL) && (temp != NULL);
+
+	for (int i = 0; i < 2; i++) {
+		batches[i].input = input;
+		batches[i].demux = &demux;
+		batches[i].settings = settings;
+		batches[i].frame_size = frame_size;
+		batches[i].frames = malloc((long)batch_size * frame_size);
+		batches[i].decoded = malloc(batch_size * sizeof(bool));
+
+		if (batches[i].frames == NULL || batches[i].decoded == NULL)
+			ok = false;
+	}
+	for (int i = 0; i < thread_count; i++) {
+		jobs[i].index = i;
+		jobs[i].stride = thread_count;
+		jobs[i].decoder_workspace = malloc(psx_mdec_get_decoder_workspace_size());
+
+		if (jobs[i].decoder_workspace != NULL)
+			jobs[i].decoder = psx_mdec_init_decoder(settings, jobs[i].decoder_workspace);
+		if (jobs[i].decoder == NULL)
+			ok = false;
+	}
+
+	if (ok) {
+		memset(previous, 0x00, settings.width * settings.height);
+		memset(previous + settings.width * settings.height, 0x80, frame_size - settings.width * settings.height);
+
+		ok = fprintf(
+			output,
+			y4m_header_format,
+			settings.width,
+			settings.height,
+			args->str_fps_num,
+			args->str_fps_den
+		) > 0;
+	} else {
+		fprintf(stderr, "Failed to allocate preview buffers\n");
+	}
+
+	int missing_count = 0;
+	int next_frame = first_frame;
+	int current = 0;
+	bool pending = false;
+
+	// While a batch is being decoded, the main thread writes the previous one
+	// to the output file.
+	while (ok) {
+		preview_batch_t *batch = &batches[current];
+		bool has_batch = (next_frame <= last_frame);
+
+		if (has_batch) {
+			batch->first_frame = next_frame;
+			batch->frame_count = last_frame + 1 - next_frame;
+
+			if (batch->frame_count > batch_size)
+				batch->frame_count = batch_size;
+
+			for (int i = 0; i < thread_count; i++) {
+				jobs[i].batch = batch;
+				started[i] = (pthread_create(&threads[i], NULL, &preview_thread, &jobs[i]) == 0);
+			}
+		}
+
+		if (pending) {
+			const preview_batch_t *written = &batches[current ^ 1];
+			const uint8_t *last_decoded = NULL;
+
+			for (int i = 0; ok && i < written->frame_count; i++) {
+				const uint8_t *frame;
+
+				if (written->decoded[i]) {
+					frame = written->frames + (long)i * frame_size;
+					last_decoded = frame;
+				} else {
+					frame = (last_decoded != NULL) ? last_decoded : previous;
+					missing_count++;
+				}
+
+				ok = write_y4m_frame(output, settings, frame, temp);
+			}
+
+			if (last_decoded != NULL)
+				memcpy(previous, last_decoded, frame_size);
+
+			*frames_written += written->frame_count;
+		}
+
+		if (!has_batch)
+			break;
+
+		for (int i = 0; i < thread_count; i++) {
+			if (started[i])
+				pthread_join(threads[i], NULL);
+			else
+				preview_thread(&jobs[i]);
+
+			if (jobs[i].out_of_memory && ok) {
+				fprintf(stderr, "Failed to allocate preview buffers\n");
+				ok = false;
+			}
+		}
+
+		next_frame += batch->frame_count;
+		current ^= 1;
+		pending = true;
+	}
+
+	if (!close_preview_output(output)) {
+		fprintf(stderr, "Failed to write output file: %s\n", path);
+		ok = false;
+	}
+	if (missing_count > 0 && !(args->flags & FLAG_QUIET))
+		fprintf(stderr, "Warning: %d frames were missing or failed to decode and have been replaced\n", missing_count);
+
+	for (int i = 0; i < 2; i++) {
+		free(batches[i].frames);
+		free(batches[i].decoded);
+	}
+	for (int i = 0; i < thread_count; i++) {
+		free(jobs[i].decoder_workspace);
+		free(jobs[i].buffer);
+	}
+
+	free(jobs);
+	free(previous);
+	free(temp);
+	close_demux(&demux);
+	return ok;
+}
+
+static void write_u16_le(uint8_t *data, uint16_t value) {
+	data[0] = value & 0xFF;
+	data[1] = value >> 8;
+}
+
+static void write_u32_le(uint8_t *data, uint32_t value) {
+	write_u16_le(data, value & 0xFFFF);
+	write_u16_le(data + 2, value >> 16);
+}
+
+static bool write_wav_header(FILE *output, int channels, int sample_rate, uint32_t sample_count) {
+	uint8_t header[44];
+	uint32_t data_size = sample_count * channels * 2;
+
+	memcpy(header + 0x00, "RIFF", 4);
+	write_u32_le(header + 0x04, data_size + 36);
+	memcpy(header + 0x08, "WAVEfmt ", 8);
+	write_u32_le(header + 0x10, 16);
+	write_u16_le(header + 0x14, 0x0001); // PCM
+	write_u16_le(header + 0x16, channels);
+	write_u32_le(header + 0x18, sample_rate);
+	write_u32_le(header + 0x1C, sample_rate * channels * 2);
+	write_u16_le(header + 0x20, channels * 2);
+	write_u16_le(header + 0x22, 16);
+	memcpy(header + 0x24, "data", 4);
+	write_u32_le(header + 0x28, data_size);
+
+	return fwrite(header, sizeof(header), 1, output) == 1;
+}
+
+static bool get_xa_settings(const psx_cdrom_sector_xa_subheader_t *subheader, psx_audio_xa_settings_t *settings) {
+	uint8_t coding = subheader->coding;
+
+	if (
+		(coding & PSX_CDROM_SECTOR_XA_CODING_CHANNEL_MASK) > PSX_CDROM_SECTOR_XA_CODING_STEREO ||
+		(coding & PSX_CDROM_SECTOR_XA_CODING_FREQ_MASK) > PSX_CDROM_SECTOR_XA_CODING_FREQ_SINGLE ||
+		(coding & PSX_CDROM_SECTOR_XA_CODING_BITS_MASK) > PSX_CDROM_SECTOR_XA_CODING_BITS_8
+	)
+		return false;
+
+	settings->format = PSX_AUDIO_XA_FORMAT_XA;
+	settings->stereo = (coding & PSX_CDROM_SECTOR_XA_CODING_CHANNEL_MASK) == PSX_CDROM_SECTOR_XA_CODING_STEREO;
+	settings->frequency = ((coding & PSX_CDROM_SECTOR_XA_CODING_FREQ_MASK) == PSX_CDROM_SECTOR_XA_CODING_FREQ_SINGLE)
+		? PSX_AUDIO_XA_FREQ_SINGLE
+		: PSX_AUDIO_XA_FREQ_DOUBLE;
+	settings->bits_per_sample = ((coding & PSX_CDROM_SECTOR_XA_CODING_BITS_MASK) == PSX_CDROM_SECTOR_XA_CODING_BITS_8) ? 8 : 4;
+	settings->file_number = subheader->file;
+	settings->channel_number = subheader->channel & PSX_CDROM_SECTOR_XA_CHANNEL_MASK;
+	return true;
+}
+
+// Returns the subheader of an XA-ADPCM sector belonging to the selected file
+// and channel, or NULL if the sector is of any other kind.
+static const psx_cdrom_sector_xa_subheader_t *get_audio_subheader(
+	const args_t *args,
+	const uint8_t *sector,
+	int sector_size
+) {
+	const psx_cdrom_sector_xa_subheader_t *subheader = (const psx_cdrom_sector_xa_subheader_t *)(
+		sector + ((sector_size == PSX_CDROM_SECTOR_SIZE) ? 0x010 : 0x000)
+	);
+
+	if (!(subheader->submode & PSX_CDROM_SECTOR_XA_SUBMODE_AUDIO))
+		return NULL;
+	if (subheader->file != args->audio_xa_file)
+		return NULL;
+	if ((subheader->channel & PSX_CDROM_SECTOR_XA_CHANNEL_MASK) != args->audio_xa_channel)
+		return NULL;
+
+	return subheader;
+}
+
+static bool preview_audio(
+	const args_t *args,
+	const mapped_file_t *input,
+	int sector_size,
+	const char *path,
+	double *duration
+) {
+	int sector_count = (int)(input->size / sector_size);
+	psx_audio_xa_settings_t settings;
+	bool found = false;
+	int audio_sectors = 0;
+	int skipped_sectors = 0;
+
+	// The format of the first XA-ADPCM sector is used for the whole file, as
+	// .wav files cannot change format midway. The number of sectors is counted
+	// in advance so that the header can also be written to a pipe.
+	for (int i = 0; i < sector_count; i++) {
+		const psx_cdrom_sector_xa_subheader_t *subheader = get_audio_subheader(args, input->data + (long)i * sector_size, sector_size);
+		psx_audio_xa_settings_t sector_settings;
+
+		if (subheader == NULL)
+			continue;
+
+		if (!get_xa_settings(subheader, &sector_settings)) {
+			skipped_sectors++;
+		} else if (!found) {
+			settings = sector_settings;
+			found = true;
+			audio_sectors++;
+		} else if (
+			sector_settings.stereo == settings.stereo &&
+			sector_settings.frequency == settings.frequency &&
+			sector_settings.bits_per_sample == settings.bits_per_sample
+		) {
+			audio_sectors++;
+		} else {
+			skipped_sectors++;
+		}
+	}
+
+	if (!found) {
+		// .str files may legitimately contain no audio.
+		if (args->format == FORMAT_XA || args->format == FORMAT_XACD) {
+			fprintf(stderr, "No XA-ADPCM sectors found in %s (file %d, channel %d)\n", args->input_file, args->audio_xa_file, args->audio_xa_channel);
+			return false;
+		}
+
+		return true;
+	}
+
+	FILE *output = open_preview_output(path);
+
+	if (output == NULL) {
+		fprintf(stderr, "Failed to open output file: %s\n", path);
+		return false;
+	}
+
+	int channels = settings.stereo ? 2 : 1;
+	int samples_per_sector = psx_audio_xa_get_samples_per_sector(settings);
+	psx_audio_decoder_state_t state;
+	int16_t samples[PSX_AUDIO_XA_MAX_SAMPLES_PER_SECTOR];
+	uint8_t data[PSX_AUDIO_XA_MAX_SAMPLES_PER_SECTOR * 2];
+
+	memset(&state, 0, sizeof(psx_audio_decoder_state_t));
+	bool ok = write_wav_header(output, channels, settings.frequency, (uint32_t)audio_sectors * samples_per_sector);
+
+	for (int i = 0; ok && i < sector_count; i++) {
+		const uint8_t *sector = input->data + (long)i * sector_size;
+		const psx_cdrom_sector_xa_subheader_t *subheader = get_audio_subheader(args, sector, sector_size);
+		psx_audio_xa_settings_t sector_settings;
+
+		if (subheader == NULL || !get_xa_settings(subheader, &sector_settings))
+			continue;
+		if (
+			sector_settings.stereo != settings.stereo ||
+			sector_settings.frequency != settings.frequency ||
+			sector_settings.bits_per_sample != settings.bits_per_sample
+		)
+			continue;
+
+		int count = psx_audio_xa_decode(settings, &state, (const uint8_t *)(subheader + 2), samples) * channels;
+
+		for (int j = 0; j < count; j++)
+			write_u16_le(data + j * 2, (uint16_t)samples[j]);
+
+		ok = (fwrite(data, count * 2, 1, output) == 1);
+	}
+
+	if (!close_preview_output(output)) {
+		fprintf(stderr, "Failed to write output file: %s\n", path);
+		ok = false;
+	}
+	if (skipped_sectors > 0 && !(args->flags & FLAG_QUIET))
+		fprintf(stderr, "Warning: %d XA-ADPCM sectors in a different or invalid format have been skipped\n", skipped_sectors);
+
+	*duration = (double)audio_sectors * samples_per_sector / (double)settings.frequency;
+	return ok;
+}
+
+// Replaces the extension of the given path (if any) with .wav.
+static char *get_wav_path(const char *path) {
+	const char *name = strrchr(path, '/');
+	const char *ext = strrchr((name != NULL) ? name : path, '.');
+	size_t length = (ext != NULL) ? (size_t)(ext - path) : strlen(path);
+	char *wav_path = malloc(length + 5);
+
+	if (wav_path == NULL)
+		return NULL;
+
+	memcpy(wav_path, path, length);
+	memcpy(wav_path + length, ".wav", 5);
+	return wav_path;
+}
+
+bool preview_file(const args_t *args) {
+	bool has_video = (
+		args->format == FORMAT_STR ||
+		args->format == FORMAT_STRCD ||
+		args->format == FORMAT_STRV ||
+		args->format == FORMAT_SBS
+	);
+	bool has_audio = (
+		args->format == FORMAT_XA ||
+		args->format == FORMAT_XACD ||
+		args->format == FORMAT_STR ||
+		args->format == FORMAT_STRCD
+	);
+
+	mapped_file_t input;
+
+	if (!map_input_file(&input, args->input_file)) {
+		fprintf(stderr, "Failed to open input file: %s\n", args->input_file);
+		return false;
+	}
+
+	int sector_size = 0;
+
+	if (args->format != FORMAT_SBS) {
+		if (input.size >= 16)
+			sector_size = detect_sector_size(input.data, input.size);
+		if (sector_size == 0 || (input.size % sector_size) != 0) {
+			fprintf(stderr, "Failed to detect sector size of %s\n", args->input_file);
+			unmap_file(&input);
+			return false;
+		}
+
+		// 2048-byte sectors have no subheader and thus cannot hold audio.
+		if (sector_size == 2048)
+			has_audio = false;
+	}
+
+	// Only a single stream can be written to standard output, in which case
+	// video takes priority. Otherwise audio is saved alongside the video file
+	// with a .wav extension.
+	const char *video_path = NULL;
+	const char *audio_path = NULL;
+	char *wav_path = NULL;
+
+	if (has_video) {
+		video_path = args->output_file;
+
+		if (has_audio && !is_stdout_path(args->output_file)) {
+			wav_path = get_wav_path(args->output_file);
+			audio_path = wav_path;
+
+			if (wav_path == NULL) {
+				fprintf(stderr, "Failed to allocate memory\n");
+				unmap_file(&input);
+				return false;
+			}
+
+			if (strcmp(wav_path, args->output_file) == 0) {
+				fprintf(stderr, "The output file for video must not have a .wav extension\n");
+				free(wav_path);
+				unmap_file(&input);
+				return false;
+			}
+		}
+	} else {
+		audio_path = args->output_file;
+	}
+
+	uint64_t start_time = get_monotonic_time();
+	double audio_duration = 0.0;
+	int frame_count = 0;
+	bool ok = true;
+
+	if (audio_path != NULL)
+		ok = preview_audio(args, &input, sector_size, audio_path, &audio_duration);
+	if (ok && video_path != NULL)
+		ok = preview_video(args, &input, video_path, &frame_count);
+
+	double elapsed = (double)(get_monotonic_time() - start_time) / 1000000000.0;
+	double video_duration = (double)frame_count * args->str_fps_den / args->str_fps_num;
+	double duration = (video_duration > audio_duration) ? video_duration : audio_duration;
+
+	if (ok && !(args->flags & FLAG_QUIET))
+		fprintf(
+			stderr,
+			"Decoded %d frames and %.2f seconds of audio in %.2f seconds (%.1fx real time)\n",
+			frame_count,
+			audio_duration,
+			elapsed,
+			(elapsed > 0.0) ? (duration / elapsed) : 0.0
+		);
+
+	free(wav_path);
+	unmap_file(&input);
+	return ok;
+}
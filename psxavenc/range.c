@@ -0,0 +1,423 @@
+/*
+psxavenc: MDEC video + SPU/XA-ADPCM audio encoder frontend
+
+Copyright (c) 2019, 2020 Adrian "asie" Siekierka
+Copyright (c) 2019 Ben "GreaseMonkey" Russell
+Copyright (c) 2023, 2025 spicyjpeg
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#include "args.h"
+#include "range.h"
+
+#define NUM_BOUNDARY_FIELDS (6 + 3 * MAX_STR_AUDIO_CHANNELS)
+#define NUM_RANGE_FIELDS    (7 + 2 * NUM_BOUNDARY_FIELDS)
+
+// The state file is a plain text list of key=value pairs, one per line. All
+// fields must be present for it to be considered valid, except for the audio
+// state of channels beyond the saved channel count.
+typedef struct {
+	const char *prefix;
+	const char *name;
+	int channel; // -1 for fields not specific to an audio channel
+	int *value;
+} range_field_t;
+
+static const char *const boundary_field_names[6] = {
+	"lba",
+	"frame_index",
+	"frame_data_offset",
+	"frame_max_size",
+	"frame_block_overflow_num",
+	"audio_end"
+};
+
+static const char *const channel_field_names[3] = {
+	"qerr",
+	"prev1",
+	"prev2"
+};
+
+static char *get_state_path(const char *output_file, const char *suffix) {
+	char *path = malloc(strlen(output_file) + strlen(suffix) + 1);
+
+	strcpy(path, output_file);
+	strcat(path, suffix);
+	return path;
+}
+
+static void set_field(range_field_t *field, const char *prefix, const char *name, int channel, int *value) {
+	field->prefix = prefix;
+	field->name = name;
+	field->channel = channel;
+	field->value = value;
+}
+
+static void get_field_key(const range_field_t *field, char *key, size_t length) {
+	if (field->channel >= 0)
+		snprintf(key, length, "%saudio%d_%s", field->prefix, field->channel, field->name);
+	else
+		snprintf(key, length, "%s%s", field->prefix, field->name);
+}
+
+static int bind_boundary_fields(str_boundary_t *boundary, const char *prefix, range_field_t *fields) {
+	int *values[6] = {
+		&(boundary->lba),
+		&(boundary->frame_index),
+		&(boundary->frame_data_offset),
+		&(boundary->frame_max_size),
+		&(boundary->frame_block_overflow_num),
+		&(boundary->audio_end)
+	};
+
+	for (int i = 0; i < 6; i++)
+		set_field(&fields[i], prefix, boundary_field_names[i], -1, values[i]);
+
+	range_field_t *channel_fields = fields + 6;
+
+	for (int ch = 0; ch < MAX_STR_AUDIO_CHANNELS; ch++, channel_fields += 3) {
+		psx_audio_encoder_channel_state_t *state = &(boundary->audio_state[ch]);
+
+		set_field(&channel_fields[0], prefix, channel_field_names[0], ch, &(state->qerr));
+		set_field(&channel_fields[1], prefix, channel_field_names[1], ch, &(state->prev1));
+		set_field(&channel_fields[2], prefix, channel_field_names[2], ch, &(state->prev2));
+	}
+
+	return NUM_BOUNDARY_FIELDS;
+}
+
+static void bind_range_fields(str_range_t *range, range_field_t *fields) {
+	set_field(&fields[0], "", "format", -1, &(range->format));
+	set_field(&fields[1], "", "sector_size", -1, &(range->sector_size));
+	set_field(&fields[2], "", "frame_block_base_overflow", -1, &(range->frame_block_base_overflow));
+	set_field(&fields[3], "", "frame_block_overflow_den", -1, &(range->frame_block_overflow_den));
+	set_field(&fields[4], "", "interleave", -1, &(range->interleave));
+	set_field(&fields[5], "", "audio_channels", -1, &(range->audio_channels));
+	set_field(&fields[6], "", "end_of_input", -1, &(range->end_of_input));
+
+	// Boundary field names are prefixed with "start." or "end." when saved.
+	range_field_t *start_fields = fields + 7;
+	range_field_t *end_fields = start_fields + bind_boundary_fields(&(range->start), "start.", start_fields);
+	bind_boundary_fields(&(range->end), "end.", end_fields);
+}
+
+bool sync_file(FILE *file) {
+	if (fflush(file) != 0)
+		return false;
+
+#ifdef _WIN32
+	return _commit(_fileno(file)) == 0;
+#else
+	return fsync(fileno(file)) == 0;
+#endif
+}
+
+bool save_str_range(const str_range_t *range, const char *output_file) {
+	// The state file is written to a temporary file first and then renamed, in
+	// order to ensure a valid state file is always present even if the process
+	// is killed while saving a checkpoint.
+	char *path = get_state_path(output_file, ".state");
+	char *temp_path = get_state_path(output_file, ".state.tmp");
+	FILE *file = fopen(temp_path, "w");
+
+	if (file == NULL) {
+		free(path);
+		free(temp_path);
+		return false;
+	}
+
+	range_field_t fields[NUM_RANGE_FIELDS];
+	bind_range_fields((str_range_t *)range, fields);
+
+	for (int i = 0; i < NUM_RANGE_FIELDS; i++) {
+		if (fields[i].channel >= range->audio_channels)
+			continue;
+
+		char key[64];
+		get_field_key(&fields[i], key, sizeof(key));
+		fprintf(file, "%s=%d\n", key, *(fields[i].value));
+	}
+
+	bool success = sync_file(file);
+	success = (fclose(file) == 0) && success;
+
+#ifdef _WIN32
+	// rename() cannot replace existing files on Windows.
+	if (success)
+		remove(path);
+#endif
+	if (success)
+		success = (rename(temp_path, path) == 0);
+
+	free(path);
+	free(temp_path);
+	return success;
+}
+
+bool load_str_range(str_range_t *range, const char *output_file) {
+	char *path = get_state_path(output_file, ".state");
+	FILE *file = fopen(path, "r");
+	free(path);
+
+	if (file == NULL)
+		return false;
+
+	range_field_t fields[NUM_RANGE_FIELDS];
+	bool found[NUM_RANGE_FIELDS];
+	memset(range, 0, sizeof(str_range_t));
+	bind_range_fields(range, fields);
+	memset(found, 0, sizeof(found));
+
+	char line[128];
+
+	while (fgets(line, sizeof(line), file) != NULL) {
+		char *separator = strchr(line, '=');
+
+		if (separator == NULL)
+			continue;
+
+		*separator = 0;
+
+		for (int i = 0; i < NUM_RANGE_FIELDS; i++) {
+			char key[64];
+			get_field_key(&fields[i], key, sizeof(key));
+
+			if (strcmp(line, key) == 0) {
+				*(fields[i].value) = strtol(separator + 1, NULL, 10);
+				found[i] = true;
+				break;
+			}
+		}
+	}
+
+	fclose(file);
+
+	if (range->audio_channels < 0 || range->audio_channels > MAX_STR_AUDIO_CHANNELS)
+		return false;
+
+	for (int i = 0; i < NUM_RANGE_FIELDS; i++) {
+		if (!found[i] && fields[i].channel < range->audio_channels)
+			return false;
+	}
+
+	return true;
+}
+
+bool compare_str_boundaries(const str_boundary_t *a, const str_boundary_t *b) {
+	range_field_t a_fields[NUM_BOUNDARY_FIELDS], b_fields[NUM_BOUNDARY_FIELDS];
+	bind_boundary_fields((str_boundary_t *)a, "", a_fields);
+	bind_boundary_fields((str_boundary_t *)b, "", b_fields);
+
+	// Channels that were not saved are zero on both sides.
+	for (int i = 0; i < NUM_BOUNDARY_FIELDS; i++) {
+		if (*(a_fields[i].value) != *(b_fields[i].value))
+			return false;
+	}
+
+	return true;
+}
+
+FILE *resume_str_range(str_range_t *range, const args_t *args) {
+	if (!load_str_range(range, args->output_file)) {
+		fprintf(stderr, "Failed to read state file: %s.state\n", args->output_file);
+		return NULL;
+	}
+	if (range->format != args->format || range->start.lba != args->str_range_start) {
+		fprintf(stderr, "Output file was not encoded using the specified format and sector range\n");
+		return NULL;
+	}
+
+	FILE *output = fopen(args->output_file, "r+b");
+
+	if (output == NULL) {
+		fprintf(stderr, "Failed to open output file: %s\n", args->output_file);
+		return NULL;
+	}
+
+	// Discard any data written after the last checkpoint.
+	long size = (long)(range->end.lba - range->start.lba) * range->sector_size;
+	fseek(output, 0, SEEK_END);
+
+	if (ftell(output) < size) {
+		fprintf(stderr, "Output file is shorter than expected, cannot resume encoding\n");
+		fclose(output);
+		return NULL;
+	}
+
+	fflush(output);
+#ifdef _WIN32
+	int error = _chsize_s(_fileno(output), size);
+#else
+	int error = ftruncate(fileno(output), size);
+#endif
+
+	if (error) {
+		fprintf(stderr, "Failed to truncate output file: %s\n", args->output_file);
+		fclose(output);
+		return NULL;
+	}
+
+	fseek(output, size, SEEK_SET);
+	return output;
+}
+
+static bool copy_range_data(FILE *output, const char *input_file, long size) {
+	FILE *input = fopen(input_file, "rb");
+
+	if (input == NULL) {
+		fprintf(stderr, "Failed to open part: %s\n", input_file);
+		return false;
+	}
+
+	fseek(input, 0, SEEK_END);
+
+	if (ftell(input) != size) {
+		fprintf(stderr, "Part %s is %ld bytes long, expected %ld bytes\n", input_file, ftell(input), size);
+		fclose(input);
+		return false;
+	}
+
+	fseek(input, 0, SEEK_SET);
+
+	uint8_t buffer[0x10000];
+
+	for (long offset = 0; offset < size;) {
+		size_t length = fread(buffer, 1, sizeof(buffer), input);
+
+		if (length == 0 || fwrite(buffer, 1, length, output) != length) {
+			fprintf(stderr, "Failed to copy data from part: %s\n", input_file);
+			fclose(input);
+			return false;
+		}
+
+		offset += length;
+	}
+
+	fclose(input);
+	return true;
+}
+
+bool stitch_str_ranges(const args_t *args) {
+	FILE *output = fopen(args->output_file, "wb");
+
+	if (output == NULL) {
+		fprintf(stderr, "Failed to open output file: %s\n", args->output_file);
+		return false;
+	}
+
+	str_range_t stitched;
+	str_range_t range;
+
+	for (int i = 0; i < args->input_file_count; i++) {
+		const char *input_file = args->input_files[i];
+
+		if (!load_str_range(&range, input_file)) {
+			fprintf(stderr, "Failed to read state file for part: %s.state\n", input_file);
+			goto error;
+		}
+		if (range.format != args->format) {
+			fprintf(stderr, "Part %s was not encoded using the specified format\n", input_file);
+			goto error;
+		}
+
+		if (i == 0) {
+			if (range.start.lba != 0) {
+				fprintf(stderr, "Part %s does not start at LBA 0 (first part missing?)\n", input_file);
+				goto error;
+			}
+
+			stitched = range;
+		} else {
+			// Parts past the end of the input file are empty and can be
+			// safely ignored.
+			if (stitched.end_of_input && range.start.lba == range.end.lba)
+				continue;
+
+			if (
+				range.sector_size != stitched.sector_size ||
+				range.frame_block_base_overflow != stitched.frame_block_base_overflow ||
+				range.frame_block_overflow_den != stitched.frame_block_overflow_den ||
+				range.interleave != stitched.interleave ||
+				range.audio_channels != stitched.audio_channels
+			) {
+				fprintf(stderr, "Part %s was encoded with different settings from previous parts\n", input_file);
+				goto error;
+			}
+			if (stitched.end_of_input) {
+				fprintf(stderr, "Part %s follows a part that already reached the end of the input file\n", input_file);
+				goto error;
+			}
+			if (range.start.lba != stitched.end.lba) {
+				fprintf(
+					stderr,
+					"Part %s starts at LBA %d, expected LBA %d (part missing or out of order?)\n",
+					input_file,
+					range.start.lba,
+					stitched.end.lba
+				);
+				goto error;
+			}
+			if (!compare_str_boundaries(&(range.start), &(stitched.end))) {
+				fprintf(stderr, "Part %s does not continue from the state previous parts ended at\n", input_file);
+				goto error;
+			}
+
+			stitched.end = range.end;
+			stitched.end_of_input = range.end_of_input;
+		}
+
+		long size = (long)(range.end.lba - range.start.lba) * range.sector_size;
+
+		if (!copy_range_data(output, input_file, size))
+			goto error;
+
+		if (!(args->flags & FLAG_QUIET))
+			fprintf(stderr, "Part %s: LBA %d-%d\n", input_file, range.start.lba, range.end.lba - 1);
+	}
+
+	if (fclose(output) != 0) {
+		fprintf(stderr, "Failed to write output file: %s\n", args->output_file);
+		return false;
+	}
+	if (!(args->flags & FLAG_QUIET) && !stitched.end_of_input)
+		fprintf(stderr, "Warning: last part does not reach the end of the input file\n");
+
+	// Save the state of the stitched file as well, so that it can in turn be
+	// stitched with other parts.
+	if (!save_str_range(&stitched, args->output_file)) {
+		fprintf(stderr, "Failed to save state file: %s.state\n", args->output_file);
+		return false;
+	}
+
+	return true;
+
+error:
+	fclose(output);
+	return false;
+}
@@ -0,0 +1,64 @@
+/*
+psxavenc: MDEC video + SPU/XA-ADPCM audio encoder frontend
+
+Copyright (c) 2019, 2020 Adrian "asie" Siekierka
+Copyright (c) 2019 Ben "GreaseMonkey" Russell
+Copyright (c) 2023, 2025 spicyjpeg
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+#include <libpsxav.h>
+#include "args.h"
+
+typedef struct {
+	int lba;
+	int frame_index;
+	int frame_data_offset;
+	int frame_max_size;
+	int frame_block_overflow_num;
+	int audio_end;
+	psx_audio_encoder_channel_state_t audio_state[MAX_STR_AUDIO_CHANNELS];
+} str_boundary_t;
+
+typedef struct {
+	int format;
+	int sector_size;
+	int frame_block_base_overflow;
+	int frame_block_overflow_den;
+	int interleave;
+	int audio_channels;
+	int end_of_input;
+
+	str_boundary_t start;
+	str_boundary_t end;
+
+	// Not saved to the state file. Each output keeps its own checkpoint timer.
+	time_t last_checkpoint;
+} str_range_t;
+
+bool save_str_range(const str_range_t *range, const char *output_file);
+bool load_str_range(str_range_t *range, const char *output_file);
+bool compare_str_boundaries(const str_boundary_t *a, const str_boundary_t *b);
+bool sync_file(FILE *file);
+FILE *resume_str_range(str_range_t *range, const args_t *args);
+bool stitch_str_ranges(const args_t *args);
@@ -0,0 +1,342 @@
+/*
+psxavenc: MDEC video + SPU/XA-ADPCM audio encoder frontend
+
+Copyright (c) 2019, 2020 Adrian "asie" Siekierka
+Copyright (c) 2019 Ben "GreaseMonkey" Russell
+Copyright (c) 2023, 2025 spicyjpeg
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "args.h"
+#include "stats.h"
+
+#ifdef _WIN32
+#define flockfile _lock_file
+#define funlockfile _unlock_file
+#endif
+
+const char *const encode_stage_names[NUM_STAGES] = {
+	"demux",
+	"decode",
+	"resample",
+	"scale",
+	"dct",
+	"quant_search",
+	"final_attempt",
+	"audio",
+	"checksum",
+	"write"
+};
+
+static const char *const memory_category_names[NUM_MEMORY_CATEGORIES] = {
+	"decoder_buffers",
+	"decoder_queue",
+	"mdec_tables",
+	"frame_buffers",
+	"audio_buffers"
+};
+
+typedef struct {
+	atomic_int_fast64_t current;
+	atomic_int_fast64_t peak;
+	atomic_int_fast64_t allocations;
+} memory_counter_t;
+
+// The last counter keeps track of the total across all categories.
+static memory_counter_t memory_counters[NUM_MEMORY_CATEGORIES + 1];
+
+// Each tracked allocation is prefixed with a header holding its size and
+// category, padded to preserve the alignment malloc() guarantees.
+typedef union {
+	struct {
+		size_t size;
+		memory_category_t category;
+	} info;
+	max_align_t align;
+} alloc_header_t;
+
+static void update_memory_counter(memory_counter_t *counter, int64_t size) {
+	int_fast64_t current = atomic_fetch_add(&(counter->current), size) + size;
+	int_fast64_t peak = atomic_load(&(counter->peak));
+
+	while (current > peak) {
+		if (atomic_compare_exchange_weak(&(counter->peak), &peak, current))
+			break;
+	}
+}
+
+void track_memory(memory_category_t category, int64_t size) {
+	update_memory_counter(&memory_counters[category], size);
+	update_memory_counter(&memory_counters[NUM_MEMORY_CATEGORIES], size);
+}
+
+void *tracked_malloc(memory_category_t category, size_t size) {
+	alloc_header_t *header = malloc(sizeof(alloc_header_t) + size);
+
+	if (header == NULL)
+		return NULL;
+
+	header->info.size = size;
+	header->info.category = category;
+
+	atomic_fetch_add(&(memory_counters[category].allocations), 1);
+	atomic_fetch_add(&(memory_counters[NUM_MEMORY_CATEGORIES].allocations), 1);
+	track_memory(category, (int64_t)size);
+	return header + 1;
+}
+
+void *tracked_calloc(memory_category_t category, size_t count, size_t size) {
+	void *ptr = tracked_malloc(category, count * size);
+
+	if (ptr != NULL)
+		memset(ptr, 0, count * size);
+
+	return ptr;
+}
+
+void *tracked_realloc(memory_category_t category, void *ptr, size_t size) {
+	if (ptr == NULL)
+		return tracked_malloc(category, size);
+
+	alloc_header_t *header = (alloc_header_t *)ptr - 1;
+	size_t old_size = header->info.size;
+
+	header = realloc(header, sizeof(alloc_header_t) + size);
+
+	if (header == NULL)
+		return NULL;
+
+	header->info.size = size;
+
+	atomic_fetch_add(&(memory_counters[category].allocations), 1);
+	atomic_fetch_add(&(memory_counters[NUM_MEMORY_CATEGORIES].allocations), 1);
+	track_memory(category, (int64_t)size - (int64_t)old_size);
+	return header + 1;
+}
+
+void tracked_free(void *ptr) {
+	if (ptr == NULL)
+		return;
+
+	alloc_header_t *header = (alloc_header_t *)ptr - 1;
+
+	track_memory(header->info.category, -(int64_t)header->info.size);
+	free(header);
+}
+
+static void write_memory_counter(FILE *file, const char *name, memory_counter_t *counter) {
+	fprintf(
+		file,
+		"\"%s\":{\"current\":%lld,\"peak\":%lld,\"allocations\":%lld}",
+		name,
+		(long long)atomic_load(&(counter->current)),
+		(long long)atomic_load(&(counter->peak)),
+		(long long)atomic_load(&(counter->allocations))
+	);
+}
+
+static void write_json_string(FILE *file, const char *str) {
+	fputc('"', file);
+
+	for (; *str; str++) {
+		unsigned char c = (unsigned char)*str;
+
+		if (c == '"' || c == '\\')
+			fprintf(file, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(file, "\\u%04x", c);
+		else
+			fputc(c, file);
+	}
+
+	fputc('"', file);
+}
+
+// Each report is written as a single line containing a JSON object, so that
+// files with periodic reports can be parsed as JSON Lines while files only
+// containing the final summary are valid JSON. The file is locked while the
+// line is written, as multiple outputs may be reporting to standard output
+// from different threads.
+static void write_stats_report(encode_stats_t *stats, const char *type) {
+	FILE *file = stats->file;
+
+	flockfile(file);
+	fprintf(file, "{\"type\":\"%s\",\"input\":", type);
+	write_json_string(file, stats->input_file);
+	fprintf(file, ",\"output\":");
+	write_json_string(file, stats->output_file);
+	fprintf(
+		file,
+		",\"elapsed\":%.6f,\"position\":%.6f,\"speed\":%.4f,\"frames\":%d,\"bytes_written\":%lld,\"stages\":{",
+		stats->elapsed,
+		stats->position,
+		(stats->elapsed > 0.0) ? (stats->position / stats->elapsed) : 0.0,
+		stats->frames,
+		(long long)stats->bytes_written
+	);
+
+	for (int i = 0; i < NUM_STAGES; i++) {
+		uint64_t time = atomic_load_explicit(&(stats->stage_times[i]), memory_order_relaxed);
+		uint64_t count = atomic_load_explicit(&(stats->stage_counts[i]), memory_order_relaxed);
+
+		fprintf(
+			file,
+			"%s\"%s\":{\"time\":%.6f,\"count\":%llu}",
+			i ? "," : "",
+			encode_stage_names[i],
+			(double)time / 1e9,
+			(unsigned long long)count
+		);
+	}
+
+	fprintf(file, "},\"memory\":{");
+
+	for (int i = 0; i < NUM_MEMORY_CATEGORIES; i++) {
+		write_memory_counter(file, memory_category_names[i], &memory_counters[i]);
+		fputc(',', file);
+	}
+
+	write_memory_counter(file, "total", &memory_counters[NUM_MEMORY_CATEGORIES]);
+	fprintf(file, "}}\n");
+	fflush(file);
+	funlockfile(file);
+}
+
+static FILE *open_stats_file(const char *path) {
+	FILE *file;
+
+	if (!strcmp(path, "-"))
+		file = stdout;
+	else
+		file = fopen(path, "w");
+
+	if (file == NULL)
+		fprintf(stderr, "Failed to open statistics file: %s\n", path);
+
+	return file;
+}
+
+static bool close_stats_file(FILE *file) {
+	if (file == NULL || file == stdout)
+		return true;
+
+	bool ok = !ferror(file);
+
+	if (fclose(file) != 0)
+		ok = false;
+
+	return ok;
+}
+
+bool open_encode_stats(encode_stats_t *stats, const args_t *args) {
+	stats->input_file = args->input_file;
+	stats->output_file = args->output_file;
+	stats->file = NULL;
+	stats->frame_log = NULL;
+	stats->report_interval = args->stats_interval;
+
+	stats->start_time = get_monotonic_time();
+	stats->last_progress_update = stats->start_time;
+	stats->last_report = stats->start_time;
+	stats->elapsed = 0.0;
+	stats->position = 0.0;
+	stats->frames = 0;
+	stats->bytes_written = 0;
+
+	for (int i = 0; i < NUM_STAGES; i++) {
+		atomic_init(&(stats->stage_times[i]), 0);
+		atomic_init(&(stats->stage_counts[i]), 0);
+	}
+
+	if (args->stats_file != NULL) {
+		stats->file = open_stats_file(args->stats_file);
+
+		if (stats->file == NULL)
+			return false;
+	}
+	if (args->video_log_file != NULL) {
+		stats->frame_log = open_stats_file(args->video_log_file);
+
+		if (stats->frame_log == NULL) {
+			close_stats_file(stats->file);
+			stats->file = NULL;
+			return false;
+		}
+
+		fprintf(stats->frame_log, "frame,quant_scale,attempts,bytes_used,frame_max_size,uncomp_hwords_used,time_us,source\n");
+	}
+
+	return true;
+}
+
+void start_encode_stats(encode_stats_t *stats) {
+	stats->start_time = get_monotonic_time();
+	stats->last_progress_update = stats->start_time;
+	stats->last_report = stats->start_time;
+}
+
+// Updates the encoding progress and saves a periodic report if enabled.
+// Returns true if at least one second has passed since the last time the
+// progress indicator was updated.
+bool update_encode_stats(encode_stats_t *stats, int frames, double position) {
+	uint64_t t = get_monotonic_time();
+
+	stats->elapsed = (double)(t - stats->start_time) / 1e9;
+	stats->position = position;
+	stats->frames = frames;
+
+	if (
+		stats->file != NULL &&
+		stats->report_interval > 0 &&
+		(t - stats->last_report) >= (uint64_t)stats->report_interval * 1000000000
+	) {
+		stats->last_report = t;
+		write_stats_report(stats, "progress");
+	}
+
+	if ((t - stats->last_progress_update) < 1000000000)
+		return false;
+
+	stats->last_progress_update = t;
+	return true;
+}
+
+void finish_encode_stats(encode_stats_t *stats) {
+	stats->elapsed = (double)(get_monotonic_time() - stats->start_time) / 1e9;
+
+	if (stats->file != NULL)
+		write_stats_report(stats, "summary");
+}
+
+bool close_encode_stats(encode_stats_t *stats) {
+	bool ok = close_stats_file(stats->file);
+
+	if (!close_stats_file(stats->frame_log))
+		ok = false;
+
+	stats->file = NULL;
+	stats->frame_log = NULL;
+	return ok;
+}
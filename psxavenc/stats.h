@@ -0,0 +1,114 @@
+/*
+psxavenc: MDEC video + SPU/XA-ADPCM audio encoder frontend
+
+Copyright (c) 2019, 2020 Adrian "asie" Siekierka
+Copyright (c) 2019 Ben "GreaseMonkey" Russell
+Copyright (c) 2023, 2025 spicyjpeg
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "args.h"
+#include "trace.h"
+
+typedef enum {
+	STAGE_DEMUX,
+	STAGE_DECODE,
+	STAGE_RESAMPLE,
+	STAGE_SCALE,
+	STAGE_DCT,
+	STAGE_QUANT_SEARCH,
+	STAGE_FINAL_ATTEMPT,
+	STAGE_AUDIO,
+	STAGE_CHECKSUM,
+	STAGE_WRITE,
+	NUM_STAGES
+} encode_stage_t;
+
+typedef enum {
+	MEMORY_DECODER_BUFFERS,
+	MEMORY_DECODER_QUEUE,
+	MEMORY_MDEC_TABLES,
+	MEMORY_FRAME_BUFFERS,
+	MEMORY_AUDIO_BUFFERS,
+	NUM_MEMORY_CATEGORIES
+} memory_category_t;
+
+// Timing statistics for a single output. Stage times are collected using a
+// monotonic clock and may be updated by worker threads (e.g. the ones encoding
+// pooled frames), while the remaining fields are only accessed by the thread
+// encoding the output.
+typedef struct {
+	const char *input_file;
+	const char *output_file;
+	FILE *file; // NULL if no statistics are to be saved
+	FILE *frame_log; // NULL if no per-frame statistics are to be saved
+	int report_interval; // in seconds, 0 = only save a summary at the end
+
+	uint64_t start_time;
+	uint64_t last_progress_update;
+	uint64_t last_report;
+	double elapsed; // in seconds
+	double position; // amount of input encoded so far, in seconds
+	int frames;
+	int64_t bytes_written;
+
+	atomic_uint_fast64_t stage_times[NUM_STAGES]; // in nanoseconds
+	atomic_uint_fast64_t stage_counts[NUM_STAGES];
+} encode_stats_t;
+
+extern const char *const encode_stage_names[NUM_STAGES];
+
+// Memory usage is tracked for the whole process rather than for each output, as
+// some buffers (such as the frames queued by a decoder) are shared between
+// outputs.
+void *tracked_malloc(memory_category_t category, size_t size);
+void *tracked_calloc(memory_category_t category, size_t count, size_t size);
+void *tracked_realloc(memory_category_t category, void *ptr, size_t size);
+void tracked_free(void *ptr);
+void track_memory(memory_category_t category, int64_t size);
+
+bool open_encode_stats(encode_stats_t *stats, const args_t *args);
+void start_encode_stats(encode_stats_t *stats);
+bool update_encode_stats(encode_stats_t *stats, int frames, double position);
+void finish_encode_stats(encode_stats_t *stats);
+bool close_encode_stats(encode_stats_t *stats);
+
+// Returns a timestamp to be passed to end_stage(), or 0 if statistics are not
+// being collected.
+static inline uint64_t begin_stage(const encode_stats_t *stats) {
+	return (stats != NULL) ? get_monotonic_time() : 0;
+}
+
+static inline void end_stage(encode_stats_t *stats, encode_stage_t stage, uint64_t start_time) {
+	if (stats == NULL)
+		return;
+
+	uint64_t end_time = get_monotonic_time();
+	atomic_fetch_add_explicit(&(stats->stage_times[stage]), end_time - start_time, memory_order_relaxed);
+	atomic_fetch_add_explicit(&(stats->stage_counts[stage]), 1, memory_order_relaxed);
+
+	if (trace_enabled)
+		write_trace_span(encode_stage_names[stage], "stage", start_time, end_time, NULL, 0);
+}
@@ -0,0 +1,199 @@
+/*
+psxavenc: MDEC video + SPU/XA-ADPCM audio encoder frontend
+
+Copyright (c) 2019, 2020 Adrian "asie" Siekierka
+Copyright (c) 2019 Ben "GreaseMonkey" Russell
+Copyright (c) 2023, 2025 spicyjpeg
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+#include "trace.h"
+
+// The trace is saved in the JSON array format described in the Chrome trace
+// event format specification, which can be loaded into chrome://tracing or
+// Perfetto. Each event is written with a single fprintf() call, which stdio
+// guarantees to be atomic with respect to other threads.
+
+bool trace_enabled = false;
+
+static FILE *trace_file = NULL;
+static uint64_t trace_start_time = 0;
+static atomic_int next_trace_track = 0;
+static _Thread_local int current_trace_track = 0;
+
+// Returns the current value of a monotonic clock in nanoseconds. Unlike
+// time(), this is unaffected by changes to the system clock and has a much
+// higher resolution.
+uint64_t get_monotonic_time(void) {
+#ifdef _WIN32
+	LARGE_INTEGER counter, frequency;
+	QueryPerformanceCounter(&counter);
+	QueryPerformanceFrequency(&frequency);
+
+	uint64_t seconds = counter.QuadPart / frequency.QuadPart;
+	uint64_t remainder = counter.QuadPart % frequency.QuadPart;
+	return seconds * 1000000000 + (remainder * 1000000000) / frequency.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+// Escapes quotes, backslashes and control characters, truncating the string if
+// it does not fit into the output buffer.
+static void escape_json_string(char *output, int length, const char *str) {
+	int offset = 0;
+
+	for (; *str && offset < (length - 7); str++) {
+		unsigned char c = (unsigned char)*str;
+
+		if (c == '"' || c == '\\')
+			offset += sprintf(output + offset, "\\%c", c);
+		else if (c < 0x20)
+			offset += sprintf(output + offset, "\\u%04x", c);
+		else
+			output[offset++] = c;
+	}
+
+	output[offset] = 0;
+}
+
+bool open_trace(const char *path) {
+	trace_file = fopen(path, "w");
+
+	if (trace_file == NULL) {
+		fprintf(stderr, "Failed to open trace file: %s\n", path);
+		return false;
+	}
+
+	trace_start_time = get_monotonic_time();
+	trace_enabled = true;
+
+	fprintf(trace_file, "[\n");
+	fprintf(trace_file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"psxavenc\"}},\n");
+
+	// Track 0 is always assigned to the main thread.
+	set_trace_track(create_trace_track("main"));
+	return true;
+}
+
+bool close_trace(void) {
+	if (trace_file == NULL)
+		return true;
+
+	trace_enabled = false;
+
+	// The last event must not be followed by a comma.
+	uint64_t t = get_monotonic_time() - trace_start_time;
+	fprintf(
+		trace_file,
+		"{\"name\":\"end\",\"cat\":\"trace\",\"ph\":\"i\",\"s\":\"g\",\"ts\":%.3f,\"pid\":1,\"tid\":0}\n]\n",
+		(double)t / 1e3
+	);
+
+	bool ok = !ferror(trace_file);
+
+	if (fclose(trace_file) != 0)
+		ok = false;
+
+	trace_file = NULL;
+	return ok;
+}
+
+// Allocates a new track (shown as a separate thread in trace viewers), or
+// returns -1 if tracing is disabled. Tracks are used rather than actual thread
+// IDs, as worker threads are short-lived and would otherwise result in one
+// track per frame.
+int create_trace_track(const char *format, ...) {
+	if (!trace_enabled)
+		return -1;
+
+	int track = atomic_fetch_add(&next_trace_track, 1);
+
+	char name[256];
+	va_list ap;
+	va_start(ap, format);
+	vsnprintf(name, sizeof(name), format, ap);
+	va_end(ap);
+
+	char escaped_name[512];
+	escape_json_string(escaped_name, sizeof(escaped_name), name);
+
+	fprintf(
+		trace_file,
+		"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}},\n"
+		"{\"name\":\"thread_sort_index\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"sort_index\":%d}},\n",
+		track,
+		escaped_name,
+		track,
+		track
+	);
+	return track;
+}
+
+void set_trace_track(int track) {
+	if (track >= 0)
+		current_trace_track = track;
+}
+
+void write_trace_span(
+	const char *name,
+	const char *category,
+	uint64_t start_time,
+	uint64_t end_time,
+	const char *arg_name,
+	int arg_value
+) {
+	double ts = (double)(int64_t)(start_time - trace_start_time) / 1e3;
+	double dur = (double)(end_time - start_time) / 1e3;
+
+	if (arg_name != NULL)
+		fprintf(
+			trace_file,
+			"{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d,\"args\":{\"%s\":%d}},\n",
+			name,
+			category,
+			ts,
+			dur,
+			current_trace_track,
+			arg_name,
+			arg_value
+		);
+	else
+		fprintf(
+			trace_file,
+			"{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d},\n",
+			name,
+			category,
+			ts,
+			dur,
+			current_trace_track
+		);
+}
@@ -0,0 +1,61 @@
+/*
+psxavenc: MDEC video + SPU/XA-ADPCM audio encoder frontend
+
+Copyright (c) 2019, 2020 Adrian "asie" Siekierka
+Copyright (c) 2019 Ben "GreaseMonkey" Russell
+Copyright (c) 2023, 2025 spicyjpeg
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+extern bool trace_enabled;
+
+uint64_t get_monotonic_time(void);
+bool open_trace(const char *path);
+bool close_trace(void);
+int create_trace_track(const char *format, ...);
+void set_trace_track(int track);
+void write_trace_span(
+	const char *name,
+	const char *category,
+	uint64_t start_time,
+	uint64_t end_time,
+	const char *arg_name,
+	int arg_value
+);
+
+// Spans are recorded on the calling thread's track. These checks are inlined
+// so that tracing has no overhead other than a branch when disabled.
+static inline uint64_t begin_trace_span(void) {
+	return trace_enabled ? get_monotonic_time() : 0;
+}
+
+static inline void end_trace_span(
+	const char *name,
+	const char *category,
+	uint64_t start_time,
+	const char *arg_name,
+	int arg_value
+) {
+	if (trace_enabled)
+		write_trace_span(name, category, start_time, get_monotonic_time(), arg_name, arg_value);
+}
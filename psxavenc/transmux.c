@@ -0,0 +1,669 @@
+/*
+psxavenc: MDEC video + SPU/XA-ADPCM audio encoder frontend
+
+Copyright (c) 2019, 2020 Adrian "asie" Siekierka
+Copyright (c) 2019 Ben "GreaseMonkey" Russell
+Copyright (c) 2023, 2025 spicyjpeg
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include <libpsxav.h>
+#include "args.h"
+#include "cache.h"
+#include "demux.h"
+#include "filefmt.h"
+#include "mdec.h"
+#include "transmux.h"
+
+#define MAX_TRANSMUX_THREADS 16
+
+typedef struct {
+	const args_t *args;
+	const uint8_t *input;
+	int input_sector_size;
+	uint8_t *output;
+	int output_sector_size;
+	int first_lba;
+	int last_lba;
+	int error_lba;
+} transmux_job_t;
+
+// When converting between .str and .sbs files, frames are copied from the input
+// file as long as they fit within the space the output format reserves for
+// them. Only the frames that do not fit are decoded and re-encoded.
+typedef struct {
+	const args_t *args;
+	frame_cache_t cache;
+	psx_mdec_settings_t settings;
+	void *decoder_workspace;
+	uint8_t *bitstream;
+	int bitstream_size;
+	uint8_t *frame; // last frame decoded
+	int frame_count; // index of the last frame in the input file
+	int frames_encoded;
+} frame_source_t;
+
+// Files are memory-mapped where possible. On Windows they are instead read
+// into (or written from) a buffer in their entirety.
+bool map_input_file(mapped_file_t *file, const char *path) {
+	file->data = NULL;
+	file->size = 0;
+	file->path = path;
+	file->writable = false;
+
+#ifdef _WIN32
+	FILE *input = fopen(path, "rb");
+
+	if (input == NULL)
+		return false;
+
+	if (fseek(input, 0, SEEK_END) == 0) {
+		file->size = ftell(input);
+		fseek(input, 0, SEEK_SET);
+	}
+	if (file->size > 0) {
+		file->data = malloc(file->size);
+
+		if (fread(file->data, file->size, 1, input) != 1) {
+			free(file->data);
+			file->data = NULL;
+		}
+	}
+
+	fclose(input);
+	return file->data != NULL;
+#else
+	struct stat info;
+	file->fd = open(path, O_RDONLY);
+
+	if (file->fd < 0)
+		return false;
+
+	if (fstat(file->fd, &info) == 0 && info.st_size > 0) {
+		file->size = (long)info.st_size;
+		file->data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, file->fd, 0);
+
+		if (file->data == MAP_FAILED)
+			file->data = NULL;
+	}
+	if (file->data == NULL) {
+		close(file->fd);
+		return false;
+	}
+
+	return true;
+#endif
+}
+
+bool map_output_file(mapped_file_t *file, const char *path, long size) {
+	file->data = NULL;
+	file->size = size;
+	file->path = path;
+	file->writable = true;
+
+#ifdef _WIN32
+	file->data = malloc(size);
+	return file->data != NULL;
+#else
+	file->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+
+	if (file->fd < 0)
+		return false;
+
+	if (ftruncate(file->fd, size) == 0) {
+		file->data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, file->fd, 0);
+
+		if (file->data == MAP_FAILED)
+			file->data = NULL;
+	}
+	if (file->data == NULL) {
+		close(file->fd);
+		return false;
+	}
+
+	return true;
+#endif
+}
+
+bool unmap_file(mapped_file_t *file) {
+	bool ok = true;
+
+	if (file->data == NULL)
+		return true;
+
+#ifdef _WIN32
+	if (file->writable) {
+		FILE *output = fopen(file->path, "wb");
+
+		ok = (output != NULL);
+		if (ok)
+			ok = (fwrite(file->data, file->size, 1, output) == 1);
+		if (output != NULL && fclose(output) != 0)
+			ok = false;
+	}
+
+	free(file->data);
+#else
+	if (file->writable)
+		ok = (msync(file->data, file->size, MS_SYNC) == 0);
+
+	munmap(file->data, file->size);
+
+	if (close(file->fd) != 0)
+		ok = false;
+#endif
+
+	file->data = NULL;
+	return ok;
+}
+
+// Converts a single sector by unpacking it into a full 2352-byte sector,
+// regenerating the sync sequence, header and EDC and then copying the part of
+// it that is present in the output format. The CD-XA subheader and payload are
+// left untouched, except for 2048-byte sectors which lack a subheader and are
+// given the same one the .str encoder would generate for a video sector.
+static bool transmux_sector(const transmux_job_t *job, int lba) {
+	const uint8_t *input = job->input + (long)lba * job->input_sector_size;
+	uint8_t *output = job->output + (long)lba * job->output_sector_size;
+
+	psx_cdrom_sector_t sector;
+	uint8_t *data = (uint8_t *)&sector;
+	psx_cdrom_sector_xa_subheader_t subheader[2];
+	psx_cdrom_sector_type_t type = PSX_CDROM_SECTOR_TYPE_MODE2_FORM1;
+
+	memset(&sector, 0, sizeof(psx_cdrom_sector_t));
+
+	if (job->input_sector_size == 2048) {
+		subheader[0].file = job->args->audio_xa_file;
+		subheader[0].channel = job->args->audio_xa_channel & PSX_CDROM_SECTOR_XA_CHANNEL_MASK;
+		subheader[0].submode = PSX_CDROM_SECTOR_XA_SUBMODE_DATA | PSX_CDROM_SECTOR_XA_SUBMODE_RT;
+		subheader[0].coding = 0;
+		subheader[1] = subheader[0];
+
+		memcpy(sector.mode2.data, input, 2048);
+	} else {
+		memcpy(data + PSX_CDROM_SECTOR_SIZE - job->input_sector_size, input, job->input_sector_size);
+		memcpy(subheader, sector.mode2.subheader, sizeof(subheader));
+
+		if (subheader[0].submode & PSX_CDROM_SECTOR_XA_SUBMODE_FORM2)
+			type = PSX_CDROM_SECTOR_TYPE_MODE2_FORM2;
+	}
+
+	if (job->output_sector_size == 2048) {
+		// XA-ADPCM and other Form 2 sectors cannot be stored without their
+		// subheader.
+		if (type != PSX_CDROM_SECTOR_TYPE_MODE2_FORM1)
+			return false;
+
+		memcpy(output, sector.mode2.data, 2048);
+		return true;
+	}
+
+	psx_cdrom_init_sector(&sector, lba, type);
+	memcpy(sector.mode2.subheader, subheader, sizeof(subheader));
+	psx_cdrom_calculate_checksums(&sector, type);
+
+	memcpy(output, data + PSX_CDROM_SECTOR_SIZE - job->output_sector_size, job->output_sector_size);
+	return true;
+}
+
+static void *transmux_thread(void *arg) {
+	transmux_job_t *job = (transmux_job_t *)arg;
+
+	for (int lba = job->first_lba; lba < job->last_lba; lba++) {
+		if (!transmux_sector(job, lba)) {
+			job->error_lba = lba;
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static int get_output_sector_size(format_t format) {
+	switch (format) {
+		case FORMAT_XACD:
+		case FORMAT_STRCD:
+			return PSX_CDROM_SECTOR_SIZE;
+
+		case FORMAT_XA:
+		case FORMAT_STR:
+			return 2336;
+
+		default:
+			return 2048;
+	}
+}
+
+static psx_mdec_bs_version_t get_bs_version(const args_t *args, const uint8_t *header) {
+	if (header[0x006] == 0x02)
+		return PSX_MDEC_BS_V2;
+
+	// v3 and v3dc frames are indistinguishable, so DC wrapping is only
+	// emulated if requested.
+	return (args->video_codec == BS_CODEC_V3DC) ? PSX_MDEC_BS_V3DC : PSX_MDEC_BS_V3;
+}
+
+static bool open_frame_source(frame_source_t *source, const args_t *args, bool input_is_sbs) {
+	demux_t demux;
+
+	// The slot size set by -a is only tried first when reading an .sbs file
+	// if the output is not an .sbs file itself, as it otherwise refers to the
+	// output file.
+	if (!open_demux_any(&demux, args->input_file, args->str_video_id, (args->format == FORMAT_SBS) ? 0 : args->alignment)) {
+		fprintf(stderr, "Failed to open input file: %s\n", args->input_file);
+		return false;
+	}
+
+	int first_frame = -1;
+
+	source->args = args;
+	source->bitstream_size = 0;
+	source->frame_count = 0;
+	source->frames_encoded = 0;
+
+	for (int i = 0; i < demux.frame_count; i++) {
+		const demux_frame_t *frame = get_demux_frame(&demux, i);
+
+		if (frame == NULL)
+			continue;
+		if (first_frame < 0)
+			first_frame = i;
+		if (source->bitstream_size < frame->bytes_used)
+			source->bitstream_size = frame->bytes_used;
+
+		source->frame_count = i;
+	}
+
+	if (first_frame < 0) {
+		fprintf(stderr, "No video frames found in %s\n", args->input_file);
+		close_demux(&demux);
+		return false;
+	}
+
+	// .sbs files do not store the video resolution, so it must be passed
+	// using -s.
+	source->bitstream = malloc(source->bitstream_size);
+
+	if (source->bitstream == NULL || read_demux_frame(&demux, first_frame, source->bitstream, source->bitstream_size) <= 8) {
+		fprintf(stderr, "Failed to read frame %d from %s\n", first_frame, args->input_file);
+		free(source->bitstream);
+		close_demux(&demux);
+		return false;
+	}
+
+	source->settings.version = get_bs_version(args, source->bitstream);
+	source->settings.width = args->video_width;
+	source->settings.height = args->video_height;
+
+	if (!input_is_sbs && demux.video_width > 0 && demux.video_height > 0) {
+		source->settings.width = (demux.video_width + 15) & ~15;
+		source->settings.height = (demux.video_height + 15) & ~15;
+	}
+	if (input_is_sbs && !check_demux_resolution(&demux, source->settings.width, source->settings.height)) {
+		fprintf(
+			stderr,
+			"Frames in %s do not match the resolution passed to -s (%dx%d)\n",
+			args->input_file,
+			source->settings.width,
+			source->settings.height
+		);
+		free(source->bitstream);
+		close_demux(&demux);
+		return false;
+	}
+
+	bs_codec_t video_codec;
+
+	if (source->settings.version == PSX_MDEC_BS_V2)
+		video_codec = BS_CODEC_V2;
+	else if (source->settings.version == PSX_MDEC_BS_V3DC)
+		video_codec = BS_CODEC_V3DC;
+	else
+		video_codec = BS_CODEC_V3;
+
+	init_frame_cache_source(&(source->cache), &demux, video_codec, source->settings.width, source->settings.height);
+
+	source->decoder_workspace = malloc(psx_mdec_get_decoder_workspace_size());
+	source->frame = malloc(source->settings.width * source->settings.height * 3 / 2);
+	return true;
+}
+
+static void close_frame_source(frame_source_t *source) {
+	close_frame_cache(&(source->cache));
+	free(source->decoder_workspace);
+	free(source->bitstream);
+	free(source->frame);
+}
+
+// Decodes the given frame if it will not be copied as-is by the encoder, so
+// that it can be re-encoded.
+static bool prepare_source_frame(frame_source_t *source, int frame_index, int frame_max_size) {
+	demux_t *demux = &(source->cache.source);
+	const demux_frame_t *frame = get_demux_frame(demux, frame_index);
+
+	if (frame == NULL) {
+		fprintf(stderr, "Frame %d is missing from the input file\n", frame_index);
+		return false;
+	}
+
+	int length = read_demux_frame(demux, frame_index, source->bitstream, source->bitstream_size);
+
+	if (length <= 8) {
+		fprintf(stderr, "Failed to read frame %d from the input file\n", frame_index);
+		return false;
+	}
+	if (length <= frame_max_size && get_bs_version(source->args, source->bitstream) == source->settings.version)
+		return true;
+
+	psx_mdec_settings_t settings = source->settings;
+	settings.version = get_bs_version(source->args, source->bitstream);
+	psx_mdec_decoder_t *decoder = psx_mdec_init_decoder(settings, source->decoder_workspace);
+
+	if (decoder == NULL || !psx_mdec_decode_frame(decoder, source->bitstream, length, source->frame)) {
+		fprintf(stderr, "Failed to decode frame %d of the input file\n", frame_index);
+		return false;
+	}
+
+	source->frames_encoded++;
+	return true;
+}
+
+static bool init_source_encoder(mdec_encoder_t *encoder, frame_source_t *source, int frame_max_size) {
+	encoder->state.frame_output = NULL;
+
+	if (!init_mdec_encoder(encoder, source->cache.video_codec, source->settings.width, source->settings.height))
+		return false;
+
+	encoder->frame_cache = &(source->cache);
+
+	encoder->state.frame_output = malloc(frame_max_size);
+	encoder->state.frame_index = 0;
+	encoder->state.frame_data_offset = 0;
+	encoder->state.frame_max_size = 0;
+	encoder->state.frame_block_overflow_num = 0;
+	encoder->state.quant_scale_sum = 0;
+	return encoder->state.frame_output != NULL;
+}
+
+static void destroy_source_encoder(mdec_encoder_t *encoder) {
+	free(encoder->state.frame_output);
+	destroy_mdec_encoder(encoder);
+}
+
+// Each frame is placed in its own slot, padded with zeroes.
+static bool write_sbs_frames(const args_t *args, frame_source_t *source, FILE *output) {
+	mdec_encoder_t encoder;
+
+	if (!init_source_encoder(&encoder, source, args->alignment)) {
+		fprintf(stderr, "Failed to allocate frame buffers\n");
+		destroy_source_encoder(&encoder);
+		return false;
+	}
+
+	bool ok = true;
+
+	for (int i = 1; ok && i <= source->frame_count; i++) {
+		ok = prepare_source_frame(source, i, args->alignment);
+
+		if (ok) {
+			encoder.state.frame_index = i;
+			encoder.state.frame_max_size = args->alignment;
+			encode_frame_bs(&encoder, source->frame);
+
+			ok = (fwrite(encoder.state.frame_output, args->alignment, 1, output) == 1);
+		}
+	}
+
+	destroy_source_encoder(&encoder);
+	return ok;
+}
+
+// Frames are laid out in the same way the .str encoder would lay them out, each
+// one being split into as many chunks as there are sectors reserved for it at
+// the frame rate and CD-ROM speed set by -r and -x. .sbs files have no audio,
+// so all sectors are video sectors.
+static bool write_str_frames(const args_t *args, frame_source_t *source, FILE *output) {
+	str_layout_t layout;
+
+	if (!init_str_layout(&layout, args, false))
+		return false;
+
+	double frame_size = (double)layout.frame_block_base_overflow / (double)layout.frame_block_overflow_den;
+
+	if (frame_size < 1.0) {
+		fprintf(stderr, "Frame rate too high for the specified CD-ROM speed\n");
+		return false;
+	}
+
+	mdec_encoder_t encoder;
+
+	if (!init_source_encoder(&encoder, source, 2016 * (int)ceil(frame_size))) {
+		fprintf(stderr, "Failed to allocate frame buffers\n");
+		destroy_source_encoder(&encoder);
+		return false;
+	}
+
+	encoder.state.frame_block_base_overflow = layout.frame_block_base_overflow;
+	encoder.state.frame_block_overflow_den = layout.frame_block_overflow_den;
+
+	int sector_size = get_output_sector_size(args->format);
+	bool ok = true;
+
+	for (
+		int lba = 0;
+		ok && (encoder.state.frame_index < source->frame_count || encoder.state.frame_data_offset < encoder.state.frame_max_size);
+		lba++
+	) {
+		if (encoder.state.frame_data_offset >= encoder.state.frame_max_size) {
+			int frame_index = encoder.state.frame_index + 1;
+
+			if (!prepare_source_frame(source, frame_index, get_str_frame_max_size(&layout, frame_index))) {
+				ok = false;
+				break;
+			}
+		}
+
+		// 2336-byte sectors are assembled at the end of a full 2352-byte
+		// buffer, so that the EDC can be placed at the right offset. 2048-byte
+		// sectors have no EDC.
+		uint8_t buffer[PSX_CDROM_SECTOR_SIZE];
+		uint8_t *sector = buffer + PSX_CDROM_SECTOR_SIZE - sector_size;
+
+		init_sector_buffer_video(args, sector, lba);
+		encode_sector_str(&encoder, args->format, args->str_video_id, source->frame, sector);
+
+		if (sector_size != 2048)
+			psx_cdrom_calculate_checksums((psx_cdrom_sector_t *)buffer, PSX_CDROM_SECTOR_TYPE_MODE2_FORM1);
+
+		ok = (fwrite(sector, sector_size, 1, output) == 1);
+	}
+
+	destroy_source_encoder(&encoder);
+	return ok;
+}
+
+static bool transmux_frames(const args_t *args, bool input_is_sbs) {
+	frame_source_t source;
+
+	if (!open_frame_source(&source, args, input_is_sbs))
+		return false;
+
+	FILE *output = fopen(args->output_file, "wb");
+
+	if (output == NULL) {
+		fprintf(stderr, "Failed to open output file: %s\n", args->output_file);
+		close_frame_source(&source);
+		return false;
+	}
+
+	bool ok;
+
+	if (source.decoder_workspace == NULL || source.bitstream == NULL || source.frame == NULL) {
+		fprintf(stderr, "Failed to allocate frame buffers\n");
+		ok = false;
+	} else if (args->format == FORMAT_SBS) {
+		ok = write_sbs_frames(args, &source, output);
+	} else {
+		ok = write_str_frames(args, &source, output);
+	}
+
+	if (fclose(output) != 0 && ok) {
+		fprintf(stderr, "Failed to write output file: %s\n", args->output_file);
+		ok = false;
+	}
+
+	if (ok && !(args->flags & FLAG_QUIET))
+		fprintf(
+			stderr,
+			"Converted %d frames (%d copied, %d re-encoded)\n",
+			source.frame_count,
+			source.cache.frames_reused,
+			source.frames_encoded
+		);
+
+	close_frame_source(&source);
+
+	if (!ok)
+		remove(args->output_file);
+
+	return ok;
+}
+
+bool transmux_file(const args_t *args) {
+	mapped_file_t input;
+	mapped_file_t output;
+
+	if (!map_input_file(&input, args->input_file)) {
+		fprintf(stderr, "Failed to open input file: %s\n", args->input_file);
+		return false;
+	}
+
+	// .sbs files are converted frame by frame rather than sector by sector.
+	bool input_is_sbs = (input.size >= 8) && is_bs_frame_header(input.data);
+
+	if (input_is_sbs || args->format == FORMAT_SBS) {
+		unmap_file(&input);
+
+		if (input_is_sbs && (args->format == FORMAT_XA || args->format == FORMAT_XACD)) {
+			fprintf(stderr, ".sbs files can only be converted to .str or .sbs files\n");
+			return false;
+		}
+
+		return transmux_frames(args, input_is_sbs);
+	}
+
+	int input_sector_size = 0;
+
+	if (input.size >= 16)
+		input_sector_size = detect_sector_size(input.data, input.size);
+	if (input_sector_size == 0 || (input.size % input_sector_size) != 0) {
+		fprintf(stderr, "Failed to detect sector size of %s\n", args->input_file);
+		unmap_file(&input);
+		return false;
+	}
+
+	int output_sector_size = get_output_sector_size(args->format);
+	int sector_count = (int)(input.size / input_sector_size);
+
+	if (!map_output_file(&output, args->output_file, (long)sector_count * output_sector_size)) {
+		fprintf(stderr, "Failed to open output file: %s\n", args->output_file);
+		unmap_file(&input);
+		return false;
+	}
+
+	// Each sector only depends on its own contents and LBA, so the file can
+	// be split into contiguous chunks that are converted in parallel.
+	int thread_count = args->thread_count;
+
+	if (thread_count > MAX_TRANSMUX_THREADS)
+		thread_count = MAX_TRANSMUX_THREADS;
+
+	transmux_job_t jobs[MAX_TRANSMUX_THREADS];
+	pthread_t threads[MAX_TRANSMUX_THREADS];
+	bool started[MAX_TRANSMUX_THREADS];
+
+	for (int i = 0; i < thread_count; i++) {
+		jobs[i].args = args;
+		jobs[i].input = input.data;
+		jobs[i].input_sector_size = input_sector_size;
+		jobs[i].output = output.data;
+		jobs[i].output_sector_size = output_sector_size;
+		jobs[i].first_lba = (int)((long)sector_count * i / thread_count);
+		jobs[i].last_lba = (int)((long)sector_count * (i + 1) / thread_count);
+		jobs[i].error_lba = -1;
+
+		// The first chunk is always converted on the main thread, as is any
+		// chunk for which a thread could not be created.
+		started[i] = (i > 0) && (pthread_create(&threads[i], NULL, &transmux_thread, &jobs[i]) == 0);
+	}
+
+	int error_lba = -1;
+
+	for (int i = 0; i < thread_count; i++) {
+		if (started[i])
+			pthread_join(threads[i], NULL);
+		else
+			transmux_thread(&jobs[i]);
+
+		if (error_lba < 0)
+			error_lba = jobs[i].error_lba;
+	}
+
+	bool ok = (error_lba < 0);
+
+	if (!ok)
+		fprintf(stderr, "Sector %d of input file is an XA-ADPCM sector, which cannot be stored in 2048-byte sectors\n", error_lba);
+
+	if (!unmap_file(&output)) {
+		fprintf(stderr, "Failed to write output file: %s\n", args->output_file);
+		ok = false;
+	}
+
+	unmap_file(&input);
+
+	if (!ok) {
+		remove(args->output_file);
+		return false;
+	}
+	if (!(args->flags & FLAG_QUIET))
+		fprintf(
+			stderr,
+			"Converted %d sectors from %d to %d bytes\n",
+			sector_count,
+			input_sector_size,
+			output_sector_size
+		);
+
+	return true;
+}
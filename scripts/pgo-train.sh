@@ -0,0 +1,50 @@
+#!/bin/bash
+# Runs psxavenc on a set of input files in order to collect the profile used by
+# -Db_pgo=use. Each input is encoded to the formats exercising the main hot
+# loops (BS v2/v3 encoding, XA-ADPCM, SPU-ADPCM and CD-ROM sector generation).
+
+if [ $# -lt 2 ]; then
+	echo "Usage: $0 <psxavenc executable> <input file> [input file...]" >&2
+	echo "No training inputs given (set them using -Dpgo_inputs=...)" >&2
+	exit 1
+fi
+
+PSXAVENC="$(realpath "$1")"
+OUTPUT_DIR="$(mktemp -d)" || exit 1
+trap 'rm -rf "$OUTPUT_DIR"' EXIT
+shift
+
+INPUTS=()
+for input in "$@"; do
+	INPUTS+=("$(realpath "$input")")
+done
+
+# Clang writes raw profiles to the current directory.
+if [ -n "$MESON_BUILD_ROOT" ]; then
+	cd "$MESON_BUILD_ROOT"
+fi
+
+## Collect profile
+
+for input in "${INPUTS[@]}"; do
+	echo "Training on $input"
+
+	"$PSXAVENC" -t strcd -q -v v2 "$input" "$OUTPUT_DIR/v2.str" \
+		-t strcd -q -v v3 "$OUTPUT_DIR/v3.str" \
+		-t str -q -v v3dc -s 160x112 -x 1 "$OUTPUT_DIR/v3dc.str" \
+		-t strspu -q "$OUTPUT_DIR/spu.str" \
+		|| exit 1
+	"$PSXAVENC" -t xacd -q -f 37800 -c 2 "$input" "$OUTPUT_DIR/out.xa" \
+		-t xa -q -f 18900 -b 8 -c 1 "$OUTPUT_DIR/out8.xa" \
+		-t vagi -q -c 2 "$OUTPUT_DIR/out.vag" \
+		|| exit 1
+done
+
+## Merge Clang profiles
+
+# GCC writes .gcda files next to the objects, which are picked up as-is, while
+# Clang's raw profiles must be merged into default.profdata.
+if ls *.profraw >/dev/null 2>&1; then
+	llvm-profdata merge -output=default.profdata *.profraw \
+		|| exit 2
+fi
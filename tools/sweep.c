@@ -0,0 +1,709 @@
+/*
+psxav-sweep: quality vs. speed sweep of the libpsxav encoders
+
+Copyright (c) 2019, 2020 Adrian "asie" Siekierka
+Copyright (c) 2019 Ben "GreaseMonkey" Russell
+Copyright (c) 2023, 2025 spicyjpeg
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include <limits.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "libpsxav.h"
+
+#define MAX_QUANT_SCALES 64
+#define MAX_Y4M_SIZE     16384
+#define NOT_MEASURED     -1.0
+
+static const char *const bs_version_names[] = {
+	"v2",
+	"v3",
+	"v3dc"
+};
+
+typedef struct {
+	bool csv;
+	bool rgb;
+	int max_frames;
+	int quant_scales[MAX_QUANT_SCALES];
+	int quant_scale_count;
+} sweep_args_t;
+
+static double get_time(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.0;
+}
+
+static double get_psnr(double squared_error, int64_t count) {
+	if (squared_error <= 0.0)
+		return INFINITY;
+
+	return 10.0 * log10(255.0 * 255.0 * (double)count / squared_error);
+}
+
+static double get_snr(double signal_power, double squared_error) {
+	if (squared_error <= 0.0)
+		return INFINITY;
+
+	return 10.0 * log10(signal_power / squared_error);
+}
+
+static void print_header(const sweep_args_t *args) {
+	if (args->csv)
+		printf("input,codec,setting,cpu,speed,transform_speed,decode_speed,size,quality,quality_chroma\n");
+	else
+		printf("%-24s %-8s %-8s %-8s %12s %12s %12s %12s %10s %10s\n", "Input", "Codec", "Setting", "CPU", "Speed", "Transform", "Decode", "Size", "Quality", "Chroma");
+}
+
+static void print_row(
+	const sweep_args_t *args,
+	const char *path,
+	const char *codec,
+	const char *setting,
+	const char *cpu,
+	double speed,
+	double transform_speed,
+	double decode_speed,
+	double size,
+	double quality,
+	double quality_chroma
+) {
+	const char *name = strrchr(path, '/');
+	name = name ? (name + 1) : path;
+
+	char transform[32], chroma[32];
+
+	// Transform speed and chroma quality are only reported for video. A
+	// negative value is used rather than NaN to mark them as not measured, as
+	// isnan() cannot be relied upon when building with -ffast-math.
+	if (transform_speed < 0.0)
+		snprintf(transform, sizeof(transform), "%s", args->csv ? "" : "-");
+	else
+		snprintf(transform, sizeof(transform), "%.2f", transform_speed);
+
+	if (quality_chroma < 0.0)
+		snprintf(chroma, sizeof(chroma), "%s", args->csv ? "" : "-");
+	else
+		snprintf(chroma, sizeof(chroma), "%.3f", quality_chroma);
+
+	if (args->csv)
+		printf("%s,%s,%s,%s,%.2f,%s,%.2f,%.1f,%.3f,%s\n", name, codec, setting, cpu, speed, transform, decode_speed, size, quality, chroma);
+	else
+		printf("%-24.24s %-8s %-8s %-8s %12.2f %12s %12.2f %12.1f %10.3f %10s\n", name, codec, setting, cpu, speed, transform, decode_speed, size, quality, chroma);
+}
+
+// Video (.y4m)
+
+typedef struct {
+	FILE *file;
+	int width, height;
+	long data_offset;
+} y4m_reader_t;
+
+// Only the 8-bit 4:2:0 tags are accepted; high bit depth variants such as
+// C420p10 share the same prefix and must be rejected.
+static bool is_y4m_420_tag(const char *token) {
+	return
+		!strcmp(token, "C420") ||
+		!strcmp(token, "C420jpeg") ||
+		!strcmp(token, "C420paldv") ||
+		!strcmp(token, "C420mpeg2");
+}
+
+static bool open_y4m(y4m_reader_t *reader, const char *path) {
+	char line[256];
+
+	reader->file = fopen(path, "rb");
+	if (reader->file == NULL) {
+		fprintf(stderr, "Failed to open input file: %s\n", path);
+		return false;
+	}
+	if (fgets(line, sizeof(line), reader->file) == NULL || strncmp(line, "YUV4MPEG2 ", 10)) {
+		fprintf(stderr, "Not a valid .y4m file: %s\n", path);
+		fclose(reader->file);
+		return false;
+	}
+
+	reader->width = 0;
+	reader->height = 0;
+
+	for (char *token = strtok(line + 10, " \n"); token != NULL; token = strtok(NULL, " \n")) {
+		if (token[0] == 'W') {
+			reader->width = strtol(token + 1, NULL, 10);
+		} else if (token[0] == 'H') {
+			reader->height = strtol(token + 1, NULL, 10);
+		} else if (token[0] == 'C' && !is_y4m_420_tag(token)) {
+			fprintf(stderr, "Unsupported .y4m color space (must be 4:2:0 8-bit): %s\n", token + 1);
+			fclose(reader->file);
+			return false;
+		}
+	}
+
+	if (
+		reader->width <= 0 || reader->height <= 0 ||
+		reader->width > MAX_Y4M_SIZE || reader->height > MAX_Y4M_SIZE ||
+		(reader->width % 16) || (reader->height % 16)
+	) {
+		fprintf(stderr, "Invalid .y4m resolution (must be a multiple of 16, up to %dx%d): %dx%d\n", MAX_Y4M_SIZE, MAX_Y4M_SIZE, reader->width, reader->height);
+		fclose(reader->file);
+		return false;
+	}
+
+	reader->data_offset = ftell(reader->file);
+	return true;
+}
+
+// Reads a 4:2:0 planar frame and converts it to the NV21 layout expected by
+// the encoder.
+static bool read_y4m_frame(y4m_reader_t *reader, uint8_t *frame, uint8_t *temp) {
+	char line[256];
+	int luma_size = reader->width * reader->height;
+	int chroma_size = luma_size / 4;
+
+	if (fgets(line, sizeof(line), reader->file) == NULL || strncmp(line, "FRAME", 5))
+		return false;
+	if (fread(frame, 1, luma_size, reader->file) != (size_t)luma_size)
+		return false;
+	if (fread(temp, 1, chroma_size * 2, reader->file) != (size_t)(chroma_size * 2))
+		return false;
+
+	uint8_t *c_plane = frame + luma_size;
+
+	for (int i = 0; i < chroma_size; i++) {
+		c_plane[i * 2 + 0] = temp[chroma_size + i]; // Cr
+		c_plane[i * 2 + 1] = temp[i]; // Cb
+	}
+
+	return true;
+}
+
+static bool sweep_video(const sweep_args_t *args, const char *path) {
+	y4m_reader_t reader;
+
+	if (!open_y4m(&reader, path))
+		return false;
+
+	psx_mdec_settings_t settings;
+	settings.width = reader.width;
+	settings.height = reader.height;
+
+	int frame_size = reader.width * reader.height * 3 / 2;
+	int luma_size = reader.width * reader.height;
+	int max_size = frame_size * 4; // Larger than the worst case at scale 1
+
+	uint8_t *frame = malloc(frame_size);
+	uint8_t *decoded = malloc(frame_size);
+	uint8_t *rgb = malloc(luma_size * 3);
+	uint8_t *temp = malloc(frame_size);
+	uint8_t *output = malloc(max_size);
+	void *workspace = malloc(psx_mdec_get_workspace_size(settings));
+	void *decoder_workspace = malloc(psx_mdec_get_decoder_workspace_size());
+
+	double *encode_times = malloc(sizeof(double) * args->quant_scale_count);
+	double *decode_times = malloc(sizeof(double) * args->quant_scale_count);
+	double *sizes = malloc(sizeof(double) * args->quant_scale_count);
+	double *luma_errors = malloc(sizeof(double) * args->quant_scale_count);
+	double *chroma_errors = malloc(sizeof(double) * args->quant_scale_count);
+
+	psx_cpu_level_t max_level = psx_cpu_get_level();
+	bool ok = (
+		frame != NULL && decoded != NULL && rgb != NULL && temp != NULL &&
+		output != NULL && workspace != NULL && decoder_workspace != NULL &&
+		encode_times != NULL && decode_times != NULL && sizes != NULL &&
+		luma_errors != NULL && chroma_errors != NULL
+	);
+
+	if (!ok)
+		fprintf(stderr, "Failed to allocate frame buffers for %s\n", path);
+
+	for (int level = 0; ok && level <= (int)max_level; level++) {
+		psx_cpu_set_level((psx_cpu_level_t)level);
+
+		for (int version = PSX_MDEC_BS_V2; ok && version <= PSX_MDEC_BS_V3DC; version++) {
+			settings.version = (psx_mdec_bs_version_t)version;
+			psx_mdec_encoder_t *encoder = psx_mdec_init_encoder(settings, workspace);
+			psx_mdec_decoder_t *decoder = psx_mdec_init_decoder(settings, decoder_workspace);
+
+			for (int i = 0; i < args->quant_scale_count; i++) {
+				encode_times[i] = 0.0;
+				decode_times[i] = 0.0;
+				sizes[i] = 0.0;
+				luma_errors[i] = 0.0;
+				chroma_errors[i] = 0.0;
+			}
+
+			double transform_time = 0.0;
+			int frame_count = 0;
+
+			fseek(reader.file, reader.data_offset, SEEK_SET);
+
+			while (
+				(args->max_frames <= 0 || frame_count < args->max_frames) &&
+				read_y4m_frame(&reader, frame, temp)
+			) {
+				double start = get_time();
+				psx_mdec_transform_frame(encoder, frame);
+				transform_time += get_time() - start;
+
+				for (int i = 0; ok && i < args->quant_scale_count; i++) {
+					start = get_time();
+					int length = psx_mdec_encode_blocks(encoder, args->quant_scales[i], output, max_size, NULL);
+					encode_times[i] += get_time() - start;
+
+					start = get_time();
+					bool decoded_ok = (length >= 0) && psx_mdec_decode_frame(decoder, output, length, decoded);
+
+					if (decoded_ok && args->rgb)
+						psx_mdec_convert_frame_rgb(settings, decoded, rgb);
+
+					decode_times[i] += get_time() - start;
+
+					if (!decoded_ok) {
+						fprintf(stderr, "Failed to encode or decode frame %d of %s\n", frame_count, path);
+						ok = false;
+						break;
+					}
+
+					sizes[i] += (double)length;
+
+					for (int j = 0; j < frame_size; j++) {
+						double error = (double)frame[j] - (double)decoded[j];
+
+						if (j < luma_size)
+							luma_errors[i] += error * error;
+						else
+							chroma_errors[i] += error * error;
+					}
+				}
+
+				frame_count++;
+			}
+
+			if (!frame_count) {
+				fprintf(stderr, "No frames found in %s\n", path);
+				ok = false;
+			}
+
+			for (int i = 0; ok && i < args->quant_scale_count; i++) {
+				char setting[16];
+				snprintf(setting, sizeof(setting), "q%d", args->quant_scales[i]);
+
+				print_row(
+					args,
+					path,
+					bs_version_names[version],
+					setting,
+					psx_cpu_get_level_name((psx_cpu_level_t)level),
+					(double)frame_count / (transform_time + encode_times[i]),
+					(double)frame_count / transform_time,
+					(double)frame_count / decode_times[i],
+					sizes[i] / (double)frame_count,
+					get_psnr(luma_errors[i], (int64_t)luma_size * frame_count),
+					get_psnr(chroma_errors[i], (int64_t)(frame_size - luma_size) * frame_count)
+				);
+			}
+		}
+	}
+
+	psx_cpu_set_level(max_level);
+	fclose(reader.file);
+	free(frame);
+	free(decoded);
+	free(rgb);
+	free(temp);
+	free(output);
+	free(workspace);
+	free(decoder_workspace);
+	free(encode_times);
+	free(decode_times);
+	free(sizes);
+	free(luma_errors);
+	free(chroma_errors);
+	return ok;
+}
+
+// Audio (.wav)
+
+static uint32_t read_u32_le(const uint8_t *data) {
+	return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+static uint16_t read_u16_le(const uint8_t *data) {
+	return data[0] | (data[1] << 8);
+}
+
+static int16_t *load_wav(const char *path, int *channels, int *sample_rate, int *sample_count) {
+	FILE *file = fopen(path, "rb");
+	uint8_t header[12];
+	int16_t *samples = NULL;
+
+	*channels = 0;
+	*sample_rate = 0;
+	*sample_count = 0;
+
+	if (file == NULL) {
+		fprintf(stderr, "Failed to open input file: %s\n", path);
+		return NULL;
+	}
+	if (
+		fread(header, 1, 12, file) != 12 ||
+		memcmp(header, "RIFF", 4) ||
+		memcmp(header + 8, "WAVE", 4)
+	) {
+		fprintf(stderr, "Not a valid .wav file: %s\n", path);
+		fclose(file);
+		return NULL;
+	}
+
+	for (;;) {
+		uint8_t chunk[8];
+
+		if (fread(chunk, 1, 8, file) != 8)
+			break;
+
+		uint32_t chunk_size = read_u32_le(chunk + 4);
+
+		if (!memcmp(chunk, "fmt ", 4) && chunk_size >= 16) {
+			uint8_t format[16];
+
+			if (fread(format, 1, 16, file) != 16)
+				break;
+
+			uint16_t tag = read_u16_le(format);
+			int bits = read_u16_le(format + 14);
+
+			if ((tag != 0x0001 && tag != 0xFFFE) || bits != 16) {
+				fprintf(stderr, "Unsupported .wav format (must be 16-bit PCM): %s\n", path);
+				break;
+			}
+
+			*channels = read_u16_le(format + 2);
+			*sample_rate = read_u32_le(format + 4);
+			fseek(file, ((chunk_size + 1) & ~1) - 16, SEEK_CUR);
+		} else if (!memcmp(chunk, "data", 4) && *channels > 0) {
+			uint8_t *data = malloc(chunk_size);
+
+			if (data == NULL) {
+				fprintf(stderr, "Failed to allocate audio buffer (%u bytes) for %s\n", chunk_size, path);
+				fclose(file);
+				return NULL;
+			}
+
+			*sample_count = fread(data, 1, chunk_size, file) / (2 * *channels);
+			samples = malloc(sizeof(int16_t) * *sample_count * *channels);
+
+			if (samples == NULL) {
+				fprintf(stderr, "Failed to allocate audio buffer (%u bytes) for %s\n", chunk_size, path);
+				free(data);
+				fclose(file);
+				return NULL;
+			}
+
+			for (int i = 0; i < *sample_count * *channels; i++)
+				samples[i] = (int16_t)read_u16_le(data + i * 2);
+
+			free(data);
+			break;
+		} else {
+			fseek(file, (chunk_size + 1) & ~1, SEEK_CUR);
+		}
+	}
+
+	fclose(file);
+
+	if (samples == NULL || !*sample_count) {
+		fprintf(stderr, "No audio data found in %s\n", path);
+		free(samples);
+		return NULL;
+	}
+
+	return samples;
+}
+
+static bool sweep_spu(const sweep_args_t *args, const char *path, const int16_t *samples, int channels, int sample_rate, int sample_count) {
+	uint8_t *output = malloc(psx_audio_spu_get_buffer_size(sample_count));
+	int16_t *decoded = malloc(sizeof(int16_t) * (sample_count + PSX_AUDIO_SPU_SAMPLES_PER_BLOCK));
+
+	if (output == NULL || decoded == NULL) {
+		fprintf(stderr, "Failed to allocate SPU-ADPCM buffers for %s\n", path);
+		free(output);
+		free(decoded);
+		return false;
+	}
+
+	double encode_time = 0.0;
+	double decode_time = 0.0;
+	double signal_power = 0.0;
+	double squared_error = 0.0;
+	int length = 0;
+
+	for (int ch = 0; ch < channels; ch++) {
+		psx_audio_encoder_channel_state_t encoder_state;
+		psx_audio_decoder_channel_state_t decoder_state;
+
+		memset(&encoder_state, 0, sizeof(psx_audio_encoder_channel_state_t));
+		memset(&decoder_state, 0, sizeof(psx_audio_decoder_channel_state_t));
+
+		double start = get_time();
+		length = psx_audio_spu_encode(&encoder_state, samples + ch, sample_count, channels, output);
+		encode_time += get_time() - start;
+
+		start = get_time();
+		psx_audio_spu_decode(&decoder_state, output, length, decoded, 1);
+		decode_time += get_time() - start;
+
+		for (int i = 0; i < sample_count; i++) {
+			double sample = (double)samples[i * channels + ch];
+			double error = (double)decoded[i] - sample;
+
+			signal_power += sample * sample;
+			squared_error += error * error;
+		}
+	}
+
+	print_row(
+		args,
+		path,
+		"spu",
+		"4bit",
+		"-",
+		(double)sample_count / (double)sample_rate / encode_time,
+		NOT_MEASURED,
+		(double)sample_count / (double)sample_rate / decode_time,
+		(double)length * channels,
+		get_snr(signal_power, squared_error),
+		NOT_MEASURED
+	);
+
+	free(output);
+	free(decoded);
+	return true;
+}
+
+// The XA encoder does not resample, so the .wav file must already be at one of
+// the two rates supported by the CD-ROM controller.
+static bool sweep_xa(const sweep_args_t *args, const char *path, const int16_t *samples, int channels, int sample_rate, int sample_count, int bits_per_sample) {
+	psx_audio_xa_settings_t settings;
+	settings.format = PSX_AUDIO_XA_FORMAT_XACD;
+	settings.stereo = (channels == 2);
+	settings.frequency = sample_rate;
+	settings.bits_per_sample = bits_per_sample;
+	settings.file_number = 0;
+	settings.channel_number = 0;
+
+	int length = psx_audio_xa_get_buffer_size(settings, sample_count);
+	int samples_per_sector = psx_audio_xa_get_samples_per_sector(settings);
+	uint8_t *output = malloc(length);
+	int16_t *decoded = malloc(sizeof(int16_t) * channels * (length / PSX_CDROM_SECTOR_SIZE) * samples_per_sector);
+
+	if (output == NULL || decoded == NULL) {
+		fprintf(stderr, "Failed to allocate XA-ADPCM buffers for %s\n", path);
+		free(output);
+		free(decoded);
+		return false;
+	}
+
+	double start = get_time();
+	length = psx_audio_xa_encode_simple(settings, samples, sample_count, 0, output);
+	double encode_time = get_time() - start;
+
+	psx_audio_decoder_state_t decoder_state;
+	memset(&decoder_state, 0, sizeof(psx_audio_decoder_state_t));
+
+	int decoded_count = 0;
+	start = get_time();
+
+	for (int offset = 0; offset < length; offset += PSX_CDROM_SECTOR_SIZE) {
+		psx_cdrom_sector_mode2_t *sector = (psx_cdrom_sector_mode2_t *)(output + offset);
+
+		decoded_count += psx_audio_xa_decode(settings, &decoder_state, sector->data, decoded + decoded_count * channels);
+	}
+
+	double decode_time = get_time() - start;
+
+	double signal_power = 0.0;
+	double squared_error = 0.0;
+
+	for (int i = 0; i < sample_count * channels; i++) {
+		double sample = (double)samples[i];
+		double error = (double)decoded[i] - sample;
+
+		signal_power += sample * sample;
+		squared_error += error * error;
+	}
+
+	print_row(
+		args,
+		path,
+		"xa",
+		(bits_per_sample == 8) ? "8bit" : "4bit",
+		"-",
+		(double)sample_count / (double)sample_rate / encode_time,
+		NOT_MEASURED,
+		(double)sample_count / (double)sample_rate / decode_time,
+		(double)length,
+		get_snr(signal_power, squared_error),
+		NOT_MEASURED
+	);
+
+	free(output);
+	free(decoded);
+	return true;
+}
+
+static bool sweep_audio(const sweep_args_t *args, const char *path) {
+	int channels, sample_rate, sample_count;
+	int16_t *samples = load_wav(path, &channels, &sample_rate, &sample_count);
+
+	if (samples == NULL)
+		return false;
+
+	bool ok = sweep_spu(args, path, samples, channels, sample_rate, sample_count);
+
+	if (channels > 2) {
+		fprintf(stderr, "Skipping XA-ADPCM for %s (must be mono or stereo)\n", path);
+	} else if (sample_rate != PSX_AUDIO_XA_FREQ_SINGLE && sample_rate != PSX_AUDIO_XA_FREQ_DOUBLE) {
+		fprintf(stderr, "Skipping XA-ADPCM for %s (sample rate must be %d or %d Hz, not %d Hz)\n", path, PSX_AUDIO_XA_FREQ_SINGLE, PSX_AUDIO_XA_FREQ_DOUBLE, sample_rate);
+	} else {
+		ok &= sweep_xa(args, path, samples, channels, sample_rate, sample_count, 4);
+		ok &= sweep_xa(args, path, samples, channels, sample_rate, sample_count, 8);
+	}
+
+	free(samples);
+	return ok;
+}
+
+// Main
+
+static bool parse_quant_scales(sweep_args_t *args, char *list) {
+	args->quant_scale_count = 0;
+
+	for (char *token = strtok(list, ","); token != NULL; token = strtok(NULL, ",")) {
+		int scale = strtol(token, NULL, 0);
+
+		if (scale < 1 || scale >= 64) {
+			fprintf(stderr, "Invalid quantization scale: %d (must be in 1-63 range)\n", scale);
+			return false;
+		}
+		if (args->quant_scale_count >= MAX_QUANT_SCALES)
+			return false;
+
+		args->quant_scales[args->quant_scale_count++] = scale;
+	}
+
+	return args->quant_scale_count > 0;
+}
+
+static bool parse_frame_count(sweep_args_t *args, const char *arg) {
+	char *end;
+	long count = strtol(arg, &end, 0);
+
+	if (*arg == '\0' || *end != '\0' || count < 1 || count > INT_MAX) {
+		fprintf(stderr, "Invalid frame count: %s (must be in 1-%d range)\n", arg, INT_MAX);
+		return false;
+	}
+
+	args->max_frames = (int)count;
+	return true;
+}
+
+static const char *const help_text =
+	"Usage: psxav-sweep [options] file...\n"
+	"\n"
+	"Encodes each input file (4:2:0 .y4m video or 16-bit .wav audio) with every\n"
+	"supported codec, setting and CPU kernel level, decodes the result and prints\n"
+	"encoding and decoding speed and quality. Speeds are in frames per second for\n"
+	"video and in multiples of real time for audio; size is in bytes per frame for video and\n"
+	"total bytes for audio; quality is PSNR (luma and chroma) for video and SNR for\n"
+	"audio, in dB.\n"
+	"\n"
+	"Options:\n"
+	"    -h                Show this help message and exit\n"
+	"    -c                Output results as CSV\n"
+	"    -n frames         Only encode up to specified number of frames from each video\n"
+	"    -q scales         Comma-separated list of quantization scales to test (default 1,2,4,8,16,32,63)\n"
+	"    -r                Include conversion to RGB24 in video decoding speed\n";
+
+int main(int argc, char **argv) {
+	sweep_args_t args;
+	char default_scales[] = "1,2,4,8,16,32,63";
+	int opt;
+
+	args.csv = false;
+	args.rgb = false;
+	args.max_frames = 0;
+	parse_quant_scales(&args, default_scales);
+
+	while ((opt = getopt(argc, argv, "hcn:q:r")) != -1) {
+		switch (opt) {
+			case 'c':
+				args.csv = true;
+				break;
+
+			case 'n':
+				if (!parse_frame_count(&args, optarg))
+					return 1;
+				break;
+
+			case 'q':
+				if (!parse_quant_scales(&args, optarg))
+					return 1;
+				break;
+
+			case 'r':
+				args.rgb = true;
+				break;
+
+			default:
+				printf("%s", help_text);
+				return (opt == 'h') ? 0 : 1;
+		}
+	}
+
+	if (optind >= argc) {
+		printf("%s", help_text);
+		return 1;
+	}
+
+	print_header(&args);
+	bool ok = true;
+
+	for (int i = optind; i < argc; i++) {
+		const char *ext = strrchr(argv[i], '.');
+
+		if (ext != NULL && !strcmp(ext, ".y4m")) {
+			ok &= sweep_video(&args, argv[i]);
+		} else if (ext != NULL && !strcmp(ext, ".wav")) {
+			ok &= sweep_audio(&args, argv[i]);
+		} else {
+			fprintf(stderr, "Unsupported input file (must be .y4m or .wav): %s\n", argv[i]);
+			ok = false;
+		}
+	}
+
+	return ok ? 0 : 1;
+}